@@ -37,6 +37,11 @@
 #include "../common/session-env.h"
 #include "../common/shareddefs.h"
 
+/* The Argon2 KDF is available since Libgcrypt 1.10.  */
+#if GCRYPT_VERSION_NUMBER >= 0x010a00 /* 1.10.0 */
+# define USE_ARGON2 1
+#endif
+
 /* To convey some special hash algorithms we use algorithm numbers
    reserved for application use. */
 #ifndef GCRY_MODULE_ID_USER
@@ -127,12 +132,20 @@ struct
   /* If set the extended key format is used for new keys.  */
   int enable_extended_key_format;
 
+  /* If set new keys are protected using Argon2id instead of the
+     OpenPGP S2K.  */
+  int protect_argon2;
+
   int running_detached; /* We are running detached from the tty. */
 
   /* If this global option is true, the passphrase cache is ignored
      for signing operations.  */
   int ignore_cache_for_signing;
 
+  /* If this global option is true, the unprotected private keys are
+     cached along with their passphrases.  */
+  int cache_unprotected_keys;
+
   /* If this global option is true, the user is allowed to
      interactively mark certificate in trustlist.txt as trusted. */
   int allow_mark_trusted;
@@ -175,6 +188,10 @@ struct
   /* The value of the option --s2k-count.  If this option is not given
    * or 0 an auto-calibrated value is used.  */
   unsigned long s2k_count;
+
+  /* The maximum number of private key operations run at the same
+   * time or 0 to use the number of CPUs.  */
+  unsigned int crypto_threads;
 } opt;
 
 
@@ -363,6 +380,9 @@ void *get_agent_scd_notify_event (void);
 #endif
 void agent_sighup_action (void);
 int map_pk_openpgp_to_gcry (int openpgp_algo);
+unsigned int agent_crypto_threads (void);
+void agent_crypto_begin (void);
+void agent_crypto_end (void);
 
 /*-- command.c --*/
 gpg_error_t agent_inq_pinentry_launched (ctrl_t ctrl, unsigned long pid,
@@ -385,6 +405,7 @@ int serve_mmapped_ssh_request (ctrl_t ctrl,
 #endif /*HAVE_W32_SYSTEM*/
 
 /*-- command-ssh.c --*/
+void initialize_module_command_ssh (void);
 ssh_control_file_t ssh_open_control_file (void);
 void ssh_close_control_file (ssh_control_file_t cf);
 gpg_error_t ssh_read_control_file (ssh_control_file_t cf,
@@ -419,6 +440,7 @@ gpg_error_t agent_public_key_from_file (ctrl_t ctrl,
 int agent_is_dsa_key (gcry_sexp_t s_key);
 int agent_is_eddsa_key (gcry_sexp_t s_key);
 int agent_key_available (const unsigned char *grip);
+char *agent_key_file_stamp (const unsigned char *grip);
 gpg_error_t agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
                                       int *r_keytype,
                                       unsigned char **r_shadow_info);
@@ -457,6 +479,12 @@ void agent_flush_cache (void);
 int agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
                      const char *data, int ttl);
 char *agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode);
+void agent_put_cache_key (ctrl_t ctrl, const char *key,
+                          cache_mode_t cache_mode,
+                          const unsigned char *skey, const char *stamp);
+unsigned char *agent_get_cache_key (ctrl_t ctrl, const char *key,
+                                    cache_mode_t cache_mode,
+                                    const char *stamp);
 void agent_store_cache_hit (const char *key);
 
 
@@ -470,6 +498,20 @@ gpg_error_t agent_pksign (ctrl_t ctrl, const char *cache_nonce,
                           const char *desc_text,
                           membuf_t *outbuf, cache_mode_t cache_mode);
 
+/* An item for agent_pksign_bulk.  */
+struct pksign_bulk_item_s
+{
+  int algo;                     /* The hash algorithm.  */
+  const unsigned char *digest;  /* The hash value.  */
+  size_t digestlen;
+  gcry_sexp_t s_sig;            /* Result: The signature.  */
+  gpg_error_t err;              /* Result: The error of this item.  */
+};
+gpg_error_t agent_pksign_bulk (ctrl_t ctrl, const char *cache_nonce,
+                               const char *desc_text,
+                               struct pksign_bulk_item_s *items,
+                               unsigned int nitems, cache_mode_t cache_mode);
+
 /*-- pkdecrypt.c --*/
 int agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
                      const unsigned char *ciphertext, size_t ciphertextlen,
@@ -492,6 +534,10 @@ unsigned long get_calibrated_s2k_count (void);
 unsigned long get_standard_s2k_count (void);
 unsigned char get_standard_s2k_count_rfc4880 (void);
 unsigned long get_standard_s2k_time (void);
+void set_s2k_calibration_file (const char *fname);
+#ifdef USE_ARGON2
+void set_kdf_compute_hook (gpg_error_t (*hook) (gcry_kdf_hd_t hd));
+#endif
 int agent_protect (const unsigned char *plainkey, const char *passphrase,
                    unsigned char **result, size_t *resultlen,
 		   unsigned long s2k_count, int use_ocb);
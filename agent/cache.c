@@ -51,24 +51,41 @@ static gcry_cipher_hd_t encryption_handle;
 
 struct secret_data_s {
   int  totallen; /* This includes the padding and space for AESWRAP. */
-  char data[1];  /* A string.  */
+  char data[1];  /* A string or a canonical S-expression.  */
 };
 
 /* The cache object.  */
 typedef struct cache_item_s *ITEM;
 struct cache_item_s {
-  ITEM next;
+  ITEM next;        /* Next item in the same hash bucket.  */
+  unsigned int hash;  /* The hash value of KEY.  */
+  int heapidx;      /* Index into EXPIRY_HEAP or -1.  */
+  time_t expires;   /* Time housekeeping needs to look at this item.  */
   time_t created;
   time_t accessed;  /* Not updated for CACHE_MODE_DATA */
   int ttl;  /* max. lifetime given in seconds, -1 one means infinite */
   struct secret_data_s *pw;
+  struct secret_data_s *skey;  /* The unprotected key or NULL.  */
+  char *skey_stamp;  /* Identifies the key file SKEY was read from.  */
   cache_mode_t cache_mode;
   int restricted;  /* The value of ctrl->restricted is part of the key.  */
   char key[1];
 };
 
-/* The cache himself.  */
-static ITEM thecache;
+/* The cache himself.  This is a hash table with CACHE_TABLE_SIZE
+ * buckets indexed by the hash of the cache key.  Thus all items with
+ * the same key are in the same bucket, most recently inserted first.
+ * The size is a power of two and grows with the number of items.  */
+static ITEM *cache_table;
+static unsigned int cache_table_size;
+static unsigned int cache_nitems;
+
+/* A binary min-heap of all items which need to be expired at some
+ * point, ordered by their EXPIRES time.  The allocated size is kept
+ * at least at the number of items so that inserting can't fail.  */
+static ITEM *expiry_heap;
+static unsigned int expiry_heap_len;
+static unsigned int expiry_heap_size;
 
 /* NULL or the last cache key stored by agent_store_cache_hit.  */
 static char *last_stored_cache_key;
@@ -144,12 +161,33 @@ release_data (struct secret_data_s *data)
    xfree (data);
 }
 
+
+/* Release the cached key of the cache item R.  */
+static void
+release_item_skey (ITEM r)
+{
+  release_data (r->skey);
+  r->skey = NULL;
+  xfree (r->skey_stamp);
+  r->skey_stamp = NULL;
+}
+
+
+/* Release the secrets of the cache item R.  */
+static void
+release_item_data (ITEM r)
+{
+  release_data (r->pw);
+  r->pw = NULL;
+  release_item_skey (r);
+}
+
+
 static gpg_error_t
-new_data (const char *string, struct secret_data_s **r_data)
+new_data (const void *data, size_t length, struct secret_data_s **r_data)
 {
   gpg_error_t err;
   struct secret_data_s *d, *d_enc;
-  size_t length;
   int total;
 
   *r_data = NULL;
@@ -158,8 +196,6 @@ new_data (const char *string, struct secret_data_s **r_data)
   if (err)
     return err;
 
-  length = strlen (string) + 1;
-
   /* We pad the data to 32 bytes so that it get more complicated
      finding something out by watching allocation patterns.  This is
      usually not possible but we better assume nothing about our secure
@@ -170,7 +206,7 @@ new_data (const char *string, struct secret_data_s **r_data)
   d = xtrymalloc_secure (sizeof *d + total - 1);
   if (!d)
     return gpg_error_from_syserror ();
-  memcpy (d->data, string, length);
+  memcpy (d->data, data, length);
 
   d_enc = xtrymalloc (sizeof *d_enc + total - 1);
   if (!d_enc)
@@ -195,75 +231,303 @@ new_data (const char *string, struct secret_data_s **r_data)
 
 
 
-/* Check whether there are items to expire.  */
+/* Return the hash value for the cache key KEY.  This is FNV-1a.  */
+static unsigned int
+hash_key (const char *key)
+{
+  const unsigned char *p;
+  unsigned int h = 2166136261u;
+
+  for (p = (const unsigned char *)key; *p; p++)
+    h = (h ^ *p) * 16777619u;
+  return h;
+}
+
+
+/* Return the first item of the hash bucket for KEY.  */
+static ITEM
+first_item (const char *key)
+{
+  if (!cache_table)
+    return NULL;
+  return cache_table[hash_key (key) & (cache_table_size - 1)];
+}
+
+
+/* Double the size of the hash table.  The order of the items within
+ * a bucket is retained.  */
+static gpg_error_t
+grow_cache_table (void)
+{
+  unsigned int newsize, i;
+  ITEM *newtable, *tail;
+  ITEM r, rnext;
+
+  newsize = cache_table_size? 2 * cache_table_size : 64;
+  newtable = xtrycalloc (newsize, sizeof *newtable);
+  if (!newtable)
+    return gpg_error_from_syserror ();
+
+  for (i=0; i < cache_table_size; i++)
+    for (r = cache_table[i]; r; r = rnext)
+      {
+        rnext = r->next;
+        for (tail = newtable + (r->hash & (newsize - 1)); *tail;
+             tail = &(*tail)->next)
+          ;
+        r->next = NULL;
+        *tail = r;
+      }
+
+  xfree (cache_table);
+  cache_table = newtable;
+  cache_table_size = newsize;
+  return 0;
+}
+
+
+static void
+heap_set (unsigned int idx, ITEM r)
+{
+  expiry_heap[idx] = r;
+  r->heapidx = idx;
+}
+
+
+static void
+heap_sift_up (unsigned int idx)
+{
+  ITEM r = expiry_heap[idx];
+  unsigned int parent;
+
+  while (idx)
+    {
+      parent = (idx - 1) / 2;
+      if (!(r->expires < expiry_heap[parent]->expires))
+        break;
+      heap_set (idx, expiry_heap[parent]);
+      idx = parent;
+    }
+  heap_set (idx, r);
+}
+
+
+static void
+heap_sift_down (unsigned int idx)
+{
+  ITEM r = expiry_heap[idx];
+  unsigned int child;
+
+  while ((child = 2 * idx + 1) < expiry_heap_len)
+    {
+      if (child + 1 < expiry_heap_len
+          && expiry_heap[child+1]->expires < expiry_heap[child]->expires)
+        child++;
+      if (!(expiry_heap[child]->expires < r->expires))
+        break;
+      heap_set (idx, expiry_heap[child]);
+      idx = child;
+    }
+  heap_set (idx, r);
+}
+
+
+/* Remove R from the expiry heap.  */
+static void
+heap_remove (ITEM r)
+{
+  unsigned int idx;
+  ITEM last;
+
+  if (r->heapidx < 0)
+    return;
+  idx = r->heapidx;
+  r->heapidx = -1;
+  last = expiry_heap[--expiry_heap_len];
+  if (last != r)
+    {
+      heap_set (idx, last);
+      heap_sift_up (idx);
+      heap_sift_down (last->heapidx);
+    }
+}
+
+
+/* Return the maximum lifetime since creation for item R or 0 if
+ * there is none.  */
+static unsigned long
+item_max_ttl (ITEM r)
+{
+  switch (r->cache_mode)
+    {
+    case CACHE_MODE_DATA: return 0;  /* No MAX TTL here.  */
+    case CACHE_MODE_SSH: return opt.max_cache_ttl_ssh;
+    default: return opt.max_cache_ttl;
+    }
+}
+
+
+/* Compute the time at which housekeeping needs to look at R again
+ * and move R to its new place in the expiry heap.  This must be
+ * called after changing PW, TTL, CREATED or ACCESSED.  Note that the
+ * max TTL options only change after a flush of the cache, which does
+ * this for all items.  */
+static void
+update_expiry (ITEM r)
+{
+  time_t expires = 0;
+  time_t old;
+  int any = 0;
+
+  if (r->pw)
+    {
+      if (r->ttl >= 0)
+        {
+          expires = r->accessed + r->ttl;
+          any = 1;
+        }
+      if (r->cache_mode != CACHE_MODE_DATA)
+        {
+          time_t t = r->created + (time_t)item_max_ttl (r);
+          if (!any || t < expires)
+            expires = t;
+          any = 1;
+        }
+    }
+  else if (r->ttl >= 0)
+    {
+      expires = r->accessed + 60*30;
+      any = 1;
+    }
+
+  if (!any)
+    heap_remove (r);
+  else if (r->heapidx < 0)
+    {
+      r->expires = expires;
+      heap_set (expiry_heap_len++, r);
+      heap_sift_up (r->heapidx);
+    }
+  else
+    {
+      old = r->expires;
+      r->expires = expires;
+      if (expires < old)
+        heap_sift_up (r->heapidx);
+      else
+        heap_sift_down (r->heapidx);
+    }
+}
+
+
+/* Insert the new item R with its KEY already set into the cache.  */
+static gpg_error_t
+insert_item (ITEM r)
+{
+  gpg_error_t err;
+  ITEM *newheap;
+  ITEM *bucket;
+  unsigned int newsize;
+
+  if (cache_nitems >= cache_table_size)
+    {
+      err = grow_cache_table ();
+      if (err && !cache_table)
+        return err;
+      /* With an existing table we go on with longer buckets.  */
+    }
+  if (cache_nitems >= expiry_heap_size)
+    {
+      newsize = expiry_heap_size? 2 * expiry_heap_size : 64;
+      newheap = xtryrealloc (expiry_heap, newsize * sizeof *newheap);
+      if (!newheap)
+        return gpg_error_from_syserror ();
+      expiry_heap = newheap;
+      expiry_heap_size = newsize;
+    }
+
+  r->hash = hash_key (r->key);
+  r->heapidx = -1;
+  bucket = cache_table + (r->hash & (cache_table_size - 1));
+  r->next = *bucket;
+  *bucket = r;
+  cache_nitems++;
+  update_expiry (r);
+  return 0;
+}
+
+
+/* Unlink the item R from the cache and release it.  */
+static void
+remove_item (ITEM r)
+{
+  ITEM *rp;
+
+  for (rp = cache_table + (r->hash & (cache_table_size - 1)); *rp;
+       rp = &(*rp)->next)
+    if (*rp == r)
+      {
+        *rp = r->next;
+        break;
+      }
+  heap_remove (r);
+  cache_nitems--;
+  release_item_data (r);
+  xfree (r);
+}
+
+
+/* Check whether there are items to expire.  Only the items at the
+ * top of the expiry heap need to be looked at.  */
 static void
 housekeeping (void)
 {
-  ITEM r, rprev;
+  ITEM r;
+  unsigned long maxttl;
   time_t current = gnupg_get_time ();
 
-  /* First expire the actual data */
-  for (r=thecache; r; r = r->next)
+  while (expiry_heap_len && expiry_heap[0]->expires < current)
     {
+      r = expiry_heap[0];
+      maxttl = item_max_ttl (r);
+
+      /* First expire the actual data.  */
       if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
         {
           if (DBG_CACHE)
             log_debug ("  expired '%s'.%d (%ds after last access)\n",
                        r->key, r->restricted, r->ttl);
-          release_data (r->pw);
-          r->pw = NULL;
+          release_item_data (r);
           r->accessed = current;
         }
-    }
-
-  /* Second, make sure that we also remove them based on the created
-   * stamp so that the user has to enter it from time to time.  We
-   * don't do this for data items which are used to storage secrets in
-   * meory and are not user entered passphrases etc.  */
-  for (r=thecache; r; r = r->next)
-    {
-      unsigned long maxttl;
-
-      switch (r->cache_mode)
-        {
-        case CACHE_MODE_DATA:
-          continue;  /* No MAX TTL here.  */
-        case CACHE_MODE_SSH: maxttl = opt.max_cache_ttl_ssh; break;
-        default: maxttl = opt.max_cache_ttl; break;
-        }
-      if (r->pw && r->created + maxttl < current)
+      /* Second, make sure that we also remove them based on the
+       * created stamp so that the user has to enter it from time to
+       * time.  We don't do this for data items which are used to
+       * storage secrets in meory and are not user entered passphrases
+       * etc.  */
+      else if (r->pw && r->cache_mode != CACHE_MODE_DATA
+               && r->created + (time_t)maxttl < current)
         {
           if (DBG_CACHE)
             log_debug ("  expired '%s'.%d (%lus after creation)\n",
-                       r->key, r->restricted, opt.max_cache_ttl);
-          release_data (r->pw);
-          r->pw = NULL;
+                       r->key, r->restricted, maxttl);
+          release_item_data (r);
           r->accessed = current;
         }
-    }
-
-  /* Third, make sure that we don't have too many items in the list.
-   * Expire old and unused entries after 30 minutes.  */
-  for (rprev=NULL, r=thecache; r; )
-    {
-      if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
+      /* Third, make sure that we don't have too many items in the
+       * list.  Expire old and unused entries after 30 minutes.  */
+      else if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
         {
-          ITEM r2 = r->next;
           if (DBG_CACHE)
             log_debug ("  removed '%s'.%d (mode %d) (slot not used for 30m)\n",
                        r->key, r->restricted, r->cache_mode);
-          xfree (r);
-          if (!rprev)
-            thecache = r2;
-          else
-            rprev->next = r2;
-          r = r2;
-        }
-      else
-        {
-          rprev = r;
-          r = r->next;
+          remove_item (r);
+          continue;
         }
+
+      /* None of the above conditions is true anymore; thus the new
+       * expiration time is not in the past.  */
+      update_expiry (r);
     }
 }
 
@@ -292,6 +556,7 @@ void
 agent_flush_cache (void)
 {
   ITEM r;
+  unsigned int i;
   int res;
 
   if (DBG_CACHE)
@@ -301,17 +566,18 @@ agent_flush_cache (void)
   if (res)
     log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
 
-  for (r=thecache; r; r = r->next)
-    {
-      if (r->pw)
-        {
-          if (DBG_CACHE)
-            log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = 0;
-        }
-    }
+  for (i=0; i < cache_table_size; i++)
+    for (r = cache_table[i]; r; r = r->next)
+      {
+        if (r->pw)
+          {
+            if (DBG_CACHE)
+              log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
+            release_item_data (r);
+            r->accessed = 0;
+          }
+        update_expiry (r);
+      }
 
   res = npth_mutex_unlock (&cache_lock);
   if (res)
@@ -368,7 +634,7 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
   if ((!ttl && data) || cache_mode == CACHE_MODE_IGNORE)
     goto out;
 
-  for (r=thecache; r; r = r->next)
+  for (r = first_item (key); r; r = r->next)
     {
       if (((cache_mode != CACHE_MODE_USER
             && cache_mode != CACHE_MODE_NONCE)
@@ -379,20 +645,17 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
     }
   if (r) /* Replace.  */
     {
-      if (r->pw)
-        {
-          release_data (r->pw);
-          r->pw = NULL;
-        }
+      release_item_data (r);
       if (data)
         {
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
-          err = new_data (data, &r->pw);
+          err = new_data (data, strlen (data) + 1, &r->pw);
           if (err)
             log_error ("error replacing cache item: %s\n", gpg_strerror (err));
         }
+      update_expiry (r);
     }
   else if (data) /* Insert.  */
     {
@@ -406,13 +669,13 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
-          err = new_data (data, &r->pw);
+          err = new_data (data, strlen (data) + 1, &r->pw);
+          if (!err)
+            err = insert_item (r);
           if (err)
-            xfree (r);
-          else
             {
-              r->next = thecache;
-              thecache = r;
+              release_item_data (r);
+              xfree (r);
             }
         }
       if (err)
@@ -460,7 +723,7 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
                last_stored? " (stored cache key)":"");
   housekeeping ();
 
-  for (r=thecache; r; r = r->next)
+  for (r = first_item (key); r; r = r->next)
     {
       if (r->pw
           && ((cache_mode != CACHE_MODE_USER
@@ -473,7 +736,10 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
            * below.  Note also that we don't update the accessed time
            * for data items.  */
           if (r->cache_mode != CACHE_MODE_DATA)
-            r->accessed = gnupg_get_time ();
+            {
+              r->accessed = gnupg_get_time ();
+              update_expiry (r);
+            }
           if (DBG_CACHE)
             log_debug ("... hit\n");
           if (r->pw->totallen < 32)
@@ -542,3 +808,146 @@ agent_store_cache_hit (const char *key)
 
   xfree (old);
 }
+
+
+/* Store the unprotected key SKEY, given as canonical S-expression,
+ * with the cached passphrase for KEY, which is the hex encoded
+ * keygrip.  STAMP is a string identifying the key file.  The key is
+ * only stored if the passphrase is in the cache and it is dropped
+ * with the passphrase; thus the TTL of the passphrase also applies to
+ * the key.  If SKEY is NULL the keys stored for KEY are removed
+ * regardless of CTRL and CACHE_MODE.  */
+void
+agent_put_cache_key (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
+                     const unsigned char *skey, const char *stamp)
+{
+  gpg_error_t err;
+  ITEM r;
+  int res;
+  int restricted = ctrl? ctrl->restricted : -1;
+  size_t skeylen;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  if (DBG_CACHE)
+    log_debug ("agent_put_cache_key '%s'.%d (mode %d)%s\n",
+               key, restricted, cache_mode, skey? "":" (remove)");
+
+  for (r = first_item (key); r; r = r->next)
+    {
+      if (strcmp (r->key, key))
+        continue;
+
+      if (!skey)
+        {
+          release_item_skey (r);
+          continue;
+        }
+
+      if (r->pw
+          && ((cache_mode != CACHE_MODE_USER
+               && cache_mode != CACHE_MODE_NONCE)
+              || cache_mode_equal (r->cache_mode, cache_mode))
+          && r->restricted == restricted)
+        {
+          release_item_skey (r);
+          r->skey_stamp = xtrystrdup (stamp);
+          skeylen = gcry_sexp_canon_len (skey, 0, NULL, NULL);
+          if (!r->skey_stamp)
+            err = gpg_error_from_syserror ();
+          else if (!skeylen)
+            err = gpg_error (GPG_ERR_INV_SEXP);
+          else
+            err = new_data (skey, skeylen, &r->skey);
+          if (err)
+            log_error ("error caching key '%s'.%d: %s\n",
+                       key, restricted, gpg_strerror (err));
+          break;
+        }
+    }
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+}
+
+
+/* Return the unprotected key stored for KEY by agent_put_cache_key
+ * as a canonical S-expression in secure memory.  NULL is returned if
+ * the passphrase for KEY has expired, no key has been stored, or the
+ * key has been read from a key file other than that described by
+ * STAMP.  A hit counts as an access to the passphrase.  */
+unsigned char *
+agent_get_cache_key (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
+                     const char *stamp)
+{
+  gpg_error_t err;
+  ITEM r;
+  unsigned char *value = NULL;
+  int res;
+  int restricted = ctrl? ctrl->restricted : -1;
+
+  if (cache_mode == CACHE_MODE_IGNORE)
+    return NULL;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  housekeeping ();
+
+  for (r = first_item (key); r; r = r->next)
+    {
+      if (r->pw && r->skey
+          && ((cache_mode != CACHE_MODE_USER
+               && cache_mode != CACHE_MODE_NONCE)
+              || cache_mode_equal (r->cache_mode, cache_mode))
+          && r->restricted == restricted
+          && !strcmp (r->key, key))
+        {
+          if (strcmp (r->skey_stamp, stamp))
+            {
+              if (DBG_CACHE)
+                log_debug ("agent_get_cache_key '%s'.%d: key file changed\n",
+                           key, restricted);
+              release_item_skey (r);
+              break;
+            }
+
+          if (r->cache_mode != CACHE_MODE_DATA)
+            {
+              r->accessed = gnupg_get_time ();
+              update_expiry (r);
+            }
+          if (r->skey->totallen < 32)
+            err = gpg_error (GPG_ERR_INV_LENGTH);
+          else if ((err = init_encryption ()))
+            ;
+          else if (!(value = xtrymalloc_secure (r->skey->totallen - 8)))
+            err = gpg_error_from_syserror ();
+          else
+            err = gcry_cipher_decrypt (encryption_handle,
+                                       value, r->skey->totallen - 8,
+                                       r->skey->data, r->skey->totallen);
+          if (err)
+            {
+              xfree (value);
+              value = NULL;
+              log_error ("retrieving cached key '%s'.%d failed: %s\n",
+                         key, restricted, gpg_strerror (err));
+            }
+          break;
+        }
+    }
+  if (DBG_CACHE)
+    log_debug ("agent_get_cache_key '%s'.%d (mode %d) ... %s\n",
+               key, restricted, cache_mode, value? "hit":"miss");
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+
+  return value;
+}
@@ -52,6 +52,7 @@
 #ifdef HAVE_UCRED_H
 #include <ucred.h>
 #endif
+#include <npth.h>
 
 #include "agent.h"
 
@@ -207,11 +208,46 @@ struct ssh_key_type_spec
 };
 
 
+/* An entry of the parsed sshcontrol file.  */
+typedef struct control_entry_s *control_entry_t;
+struct control_entry_s
+{
+  control_entry_t hashnext;  /* Next entry in the same hash bucket.  */
+  int lnr;                   /* The line number of the entry.  */
+  int disabled;              /* The item is disabled.  */
+  int ttl;                   /* The TTL of the item.   */
+  int confirm;               /* The confirm flag is set.  */
+  char hexgrip[40+1];        /* The hexgrip of the item (uppercase).  */
+  char *keystamp;            /* The stamp of the key file used for BLOB.  */
+  void *blob;                /* NULL or the key as sent in an identities
+                                answer.  Protected by CONTROL_TABLE_LOCK. */
+  size_t bloblen;
+};
+
+
+/* The sshcontrol file parsed into memory.  A table is shared by all
+   connections and replaced by a new one when the file changes.  */
+typedef struct control_table_s *control_table_t;
+struct control_table_s
+{
+  unsigned int refcount;     /* Protected by CONTROL_TABLE_LOCK.  */
+  char *fname;               /* Name of the file.  */
+  time_t mtime;              /* The stat info of the file at the time */
+  time_t ctime;              /* it was read.                          */
+  unsigned long size;
+  unsigned long ino;
+  unsigned int nentries;
+  control_entry_t entries;   /* Array with the entries in file order.  */
+  control_entry_t buckets[256];  /* Indexed by the first byte of the
+                                    keygrip.  */
+};
+
+
 /* Definition of an object to access the sshcontrol file.  */
 struct ssh_control_file_s
 {
   char *fname;  /* Name of the file.  */
-  FILE *fp;     /* This is never NULL. */
+  FILE *fp;     /* The file if opened for parsing or appending.  */
   int lnr;      /* The current line number.  */
   struct {
     int valid;           /* True if the data of this structure is valid.  */
@@ -220,9 +256,22 @@ struct ssh_control_file_s
     int confirm;         /* The confirm flag is set.  */
     char hexgrip[40+1];  /* The hexgrip of the item (uppercase).  */
   } item;
+  control_table_t table; /* The parsed file if opened for reading.  */
+  unsigned int nextidx;  /* The next entry of TABLE to be read.  */
 };
 
 
+/* A mutex used to serialize access to the control table.  */
+static npth_mutex_t control_table_lock;
+
+/* The current parsed sshcontrol file or NULL.  */
+static control_table_t control_table;
+
+/* True if the file has been modified by us; i.e. CONTROL_TABLE needs
+   to be reloaded even if the stat info didn't change.  */
+static int control_table_stale;
+
+
 /* Prototypes.  */
 static gpg_error_t ssh_handler_request_identities (ctrl_t ctrl,
 						   estream_t request,
@@ -812,11 +861,50 @@ stream_copy (estream_t dst, estream_t src)
   return err;
 }
 
+void
+initialize_module_command_ssh (void)
+{
+  static int initialized;
+  int err;
+
+  if (!initialized)
+    {
+      err = npth_mutex_init (&control_table_lock, NULL);
+      if (err)
+        log_fatal ("failed to init mutex in %s: %s\n", __FILE__,strerror (err));
+      initialized = 1;
+    }
+}
+
+
+static void
+lock_control_table (void)
+{
+  int err;
+
+  err = npth_mutex_lock (&control_table_lock);
+  if (err)
+    log_fatal ("failed to acquire mutex in %s: %s\n", __FILE__, strerror (err));
+}
+
+
+static void
+unlock_control_table (void)
+{
+  int err;
+
+  err = npth_mutex_unlock (&control_table_lock);
+  if (err)
+    log_fatal ("failed to release mutex in %s: %s\n", __FILE__, strerror (err));
+}
+
+
 /* Open the ssh control file and create it if not available.  With
    APPEND passed as true the file will be opened in append mode,
    otherwise in read only mode.  On success 0 is returned and a new
    control file object stored at R_CF.  On error an error code is
-   returned and NULL is stored at R_CF.  */
+   returned and NULL is stored at R_CF.  To search or list the items
+   of the file open_control_table shall be used instead.  */
 static gpg_error_t
 open_control_file (ssh_control_file_t *r_cf, int append)
 {
@@ -882,21 +970,21 @@ open_control_file (ssh_control_file_t *r_cf, int append)
 }
 
 
-static void
-rewind_control_file (ssh_control_file_t cf)
-{
-  fseek (cf->fp, 0, SEEK_SET);
-  cf->lnr = 0;
-  clearerr (cf->fp);
-}
-
+static void release_control_table (control_table_t table);
 
 static void
 close_control_file (ssh_control_file_t cf)
 {
   if (!cf)
     return;
-  fclose (cf->fp);
+  if (cf->fp)
+    fclose (cf->fp);
+  if (cf->table)
+    {
+      lock_control_table ();
+      release_control_table (cf->table);
+      unlock_control_table ();
+    }
   xfree (cf->fname);
   xfree (cf);
 }
@@ -1003,16 +1091,253 @@ read_control_file_item (ssh_control_file_t cf)
 
 
 
-/* Search the control file CF from the beginning until a matching
-   HEXGRIP is found; return success in this case and store true at
+/* Release a reference to TABLE.  The caller must hold
+   CONTROL_TABLE_LOCK.  */
+static void
+release_control_table (control_table_t table)
+{
+  unsigned int idx;
+
+  if (!table || --table->refcount)
+    return;
+
+  for (idx=0; idx < table->nentries; idx++)
+    {
+      xfree (table->entries[idx].keystamp);
+      xfree (table->entries[idx].blob);
+    }
+  xfree (table->entries);
+  xfree (table->fname);
+  xfree (table);
+}
+
+
+/* Return true if the stat info ST describes the file read into
+   TABLE.  */
+static int
+control_table_current_p (control_table_t table, struct stat *st)
+{
+  return (table->mtime == st->st_mtime
+          && table->ctime == st->st_ctime
+          && table->size == (unsigned long)st->st_size
+          && table->ino == (unsigned long)st->st_ino);
+}
+
+
+/* Return the entry for HEXGRIP, which must be 40 uppercase hex
+   digits, from TABLE or NULL if there is none.  If a key is listed
+   more than once the first entry is returned.  */
+static control_entry_t
+find_control_entry (control_table_t table, const char *hexgrip)
+{
+  control_entry_t entry;
+
+  for (entry = table->buckets[xtoi_2 (hexgrip)]; entry;
+       entry = entry->hashnext)
+    if (!strcmp (entry->hexgrip, hexgrip))
+      break;
+  return entry;
+}
+
+
+/* Read the sshcontrol file into a new table and store it at R_TABLE.
+   As with reading the file item by item, the items after a bad line
+   are ignored.  This is called with CONTROL_TABLE_LOCK held.  */
+static gpg_error_t
+load_control_table (control_table_t *r_table)
+{
+  gpg_error_t err;
+  ssh_control_file_t cf;
+  control_table_t table;
+  control_entry_t entry, tmp;
+  unsigned int allocated = 0;
+  unsigned int idx;
+  struct stat st;
+
+  *r_table = NULL;
+
+  err = open_control_file (&cf, 0);
+  if (err)
+    return err;
+
+  table = xtrycalloc (1, sizeof *table);
+  if (!table)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  table->refcount = 1;
+  if (fstat (fileno (cf->fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  table->mtime = st.st_mtime;
+  table->ctime = st.st_ctime;
+  table->size = st.st_size;
+  table->ino = st.st_ino;
+
+  while (!read_control_file_item (cf))
+    {
+      if (!cf->item.valid)
+        continue; /* Should not happen.  */
+      if (table->nentries == allocated)
+        {
+          allocated = allocated? 2 * allocated : 32;
+          tmp = xtryrealloc (table->entries, allocated * sizeof *tmp);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+          table->entries = tmp;
+        }
+      entry = table->entries + table->nentries++;
+      memset (entry, 0, sizeof *entry);
+      entry->lnr = cf->lnr;
+      entry->disabled = cf->item.disabled;
+      entry->ttl = cf->item.ttl;
+      entry->confirm = cf->item.confirm;
+      strcpy (entry->hexgrip, cf->item.hexgrip);
+    }
+
+  /* Build the hash table so that duplicates are found in file order.
+     Now that the array won't be reallocated anymore we may point into
+     it.  */
+  for (idx = table->nentries; idx--; )
+    {
+      entry = table->entries + idx;
+      entry->hashnext = table->buckets[xtoi_2 (entry->hexgrip)];
+      table->buckets[xtoi_2 (entry->hexgrip)] = entry;
+    }
+
+  table->fname = cf->fname;
+  cf->fname = NULL;
+  *r_table = table;
+  table = NULL;
+
+ leave:
+  release_control_table (table);  /* Not yet shared; thus no lock.  */
+  close_control_file (cf);
+  return err;
+}
+
+
+/* Make sure that CONTROL_TABLE reflects the current sshcontrol file.
+   The file is only read again if it has changed.  This is called
+   with CONTROL_TABLE_LOCK held.  */
+static gpg_error_t
+update_control_table (void)
+{
+  gpg_error_t err = 0;
+  control_table_t table;
+  control_entry_t entry, oldentry;
+  char *fname;
+  struct stat st;
+  unsigned int idx;
+
+  fname = make_filename_try (gnupg_homedir (), SSH_CONTROL_FILE_NAME, NULL);
+  if (!fname)
+    return gpg_error_from_syserror ();
+
+  if (!control_table || control_table_stale
+      || stat (fname, &st) || !control_table_current_p (control_table, &st))
+    {
+      err = load_control_table (&table);
+      if (err)
+        goto leave;
+
+      /* Keep the public keys already computed for the old table.  */
+      if (control_table)
+        {
+          for (idx=0; idx < table->nentries; idx++)
+            {
+              entry = table->entries + idx;
+              oldentry = find_control_entry (control_table, entry->hexgrip);
+              if (oldentry && oldentry->blob)
+                {
+                  entry->keystamp = oldentry->keystamp;
+                  oldentry->keystamp = NULL;
+                  entry->blob = oldentry->blob;
+                  entry->bloblen = oldentry->bloblen;
+                  oldentry->blob = NULL;
+                }
+            }
+        }
+
+      release_control_table (control_table);
+      control_table = table;
+      control_table_stale = 0;
+      if (DBG_CACHE)
+        log_debug ("ssh control file '%s' loaded (%u entries)\n",
+                   table->fname, table->nentries);
+    }
+
+ leave:
+  xfree (fname);
+  return err;
+}
+
+
+/* Return a reference to the current parsed sshcontrol file at
+   R_TABLE.  */
+static gpg_error_t
+get_control_table (control_table_t *r_table)
+{
+  gpg_error_t err;
+
+  *r_table = NULL;
+
+  lock_control_table ();
+  err = update_control_table ();
+  if (!err)
+    {
+      control_table->refcount++;
+      *r_table = control_table;
+    }
+  unlock_control_table ();
+  return err;
+}
+
+
+/* Open the parsed ssh control file for searching and listing the
+   items.  On success 0 is returned and a new control file object
+   stored at R_CF.  On error an error code is returned and NULL is
+   stored at R_CF.  */
+static gpg_error_t
+open_control_table (ssh_control_file_t *r_cf)
+{
+  gpg_error_t err;
+  ssh_control_file_t cf;
+
+  *r_cf = NULL;
+
+  cf = xtrycalloc (1, sizeof *cf);
+  if (!cf)
+    return gpg_error_from_syserror ();
+
+  err = get_control_table (&cf->table);
+  if (err)
+    {
+      xfree (cf);
+      return err;
+    }
+  *r_cf = cf;
+  return 0;
+}
+
+
+/* Search the control file CF, opened by open_control_table, for a
+   matching HEXGRIP; return success in this case and store true at
    DISABLED if the found key has been disabled.  If R_TTL is not NULL
    a specified TTL for that key is stored there.  If R_CONFIRM is not
-   NULL it is set to 1 if the key has the confirm flag set. */
+   NULL it is set to 1 if the key has the confirm flag set.  If the
+   key is not found GPG_ERR_EOF is returned.  */
 static gpg_error_t
 search_control_file (ssh_control_file_t cf, const char *hexgrip,
                      int *r_disabled, int *r_ttl, int *r_confirm)
 {
-  gpg_error_t err;
+  control_entry_t entry;
 
   assert (strlen (hexgrip) == 40 );
 
@@ -1023,24 +1348,17 @@ search_control_file (ssh_control_file_t cf, const char *hexgrip,
   if (r_confirm)
     *r_confirm = 0;
 
-  rewind_control_file (cf);
-  while (!(err=read_control_file_item (cf)))
-    {
-      if (!cf->item.valid)
-        continue; /* Should not happen.  */
-      if (!strcmp (hexgrip, cf->item.hexgrip))
-        break;
-    }
-  if (!err)
-    {
-      if (r_disabled)
-        *r_disabled = cf->item.disabled;
-      if (r_ttl)
-        *r_ttl = cf->item.ttl;
-      if (r_confirm)
-        *r_confirm = cf->item.confirm;
-    }
-  return err;
+  entry = find_control_entry (cf->table, hexgrip);
+  if (!entry)
+    return gpg_error (GPG_ERR_EOF);
+
+  if (r_disabled)
+    *r_disabled = entry->disabled;
+  if (r_ttl)
+    *r_ttl = entry->ttl;
+  if (r_confirm)
+    *r_confirm = entry->confirm;
+  return 0;
 }
 
 
@@ -1049,56 +1367,67 @@ search_control_file (ssh_control_file_t cf, const char *hexgrip,
    HEXGRIP as usable for SSH; i.e. it will be returned when ssh asks
    for it.  FMTFPR is the fingerprint string.  This function is in
    general used to add a key received through the ssh-add function.
-   We can assume that the user wants to allow ssh using this key. */
+   We can assume that the user wants to allow ssh using this key.  The
+   control table lock is held while searching and appending so that
+   concurrent requests do not both add the key.  */
 static gpg_error_t
 add_control_entry (ctrl_t ctrl, ssh_key_type_spec_t *spec,
                    const char *hexgrip, gcry_sexp_t key,
                    int ttl, int confirm)
 {
   gpg_error_t err;
-  ssh_control_file_t cf;
-  int disabled;
+  ssh_control_file_t cf = NULL;
   char *fpr_md5 = NULL;
   char *fpr_sha256 = NULL;
+  struct tm *tp;
+  time_t atime;
 
   (void)ctrl;
 
-  err = open_control_file (&cf, 1);
-  if (err)
-    return err;
+  assert (strlen (hexgrip) == 40 );
 
-  err = search_control_file (cf, hexgrip, &disabled, NULL, NULL);
-  if (err && gpg_err_code(err) == GPG_ERR_EOF)
-    {
-      struct tm *tp;
-      time_t atime = time (NULL);
+  lock_control_table ();
+  err = update_control_table ();
+  if (err || find_control_entry (control_table, hexgrip))
+    goto out;
 
-      err = ssh_get_fingerprint_string (key, GCRY_MD_MD5, &fpr_md5);
-      if (err)
-        goto out;
+  err = ssh_get_fingerprint_string (key, GCRY_MD_MD5, &fpr_md5);
+  if (err)
+    goto out;
 
-      err = ssh_get_fingerprint_string (key, GCRY_MD_SHA256, &fpr_sha256);
-      if (err)
-        goto out;
+  err = ssh_get_fingerprint_string (key, GCRY_MD_SHA256, &fpr_sha256);
+  if (err)
+    goto out;
 
-      /* Not yet in the file - add it. Because the file has been
-         opened in append mode, we simply need to write to it.  */
-      tp = localtime (&atime);
-      fprintf (cf->fp,
-               ("# %s key added on: %04d-%02d-%02d %02d:%02d:%02d\n"
-                "# Fingerprints:  %s\n"
-                "#                %s\n"
-                "%s %d%s\n"),
-               spec->name,
-               1900+tp->tm_year, tp->tm_mon+1, tp->tm_mday,
-               tp->tm_hour, tp->tm_min, tp->tm_sec,
-               fpr_md5, fpr_sha256, hexgrip, ttl, confirm? " confirm":"");
+  err = open_control_file (&cf, 1);
+  if (err)
+    goto out;
+
+  /* Not yet in the file - add it. Because the file has been opened
+     in append mode, we simply need to write to it.  */
+  atime = time (NULL);
+  tp = localtime (&atime);
+  fprintf (cf->fp,
+           ("# %s key added on: %04d-%02d-%02d %02d:%02d:%02d\n"
+            "# Fingerprints:  %s\n"
+            "#                %s\n"
+            "%s %d%s\n"),
+           spec->name,
+           1900+tp->tm_year, tp->tm_mon+1, tp->tm_mday,
+           tp->tm_hour, tp->tm_min, tp->tm_sec,
+           fpr_md5, fpr_sha256, hexgrip, ttl, confirm? " confirm":"");
+
+  /* The stat info may not change within the same second.  */
+  control_table_stale = 1;
 
-    }
  out:
+  /* Close the file before releasing the lock so that the next load
+     sees the new entry.  CF has no table and thus does not take the
+     lock.  */
+  close_control_file (cf);
+  unlock_control_table ();
   xfree (fpr_md5);
   xfree (fpr_sha256);
-  close_control_file (cf);
   return 0;
 }
 
@@ -1113,7 +1442,7 @@ ttl_from_sshcontrol (const char *hexgrip)
   if (!hexgrip || strlen (hexgrip) != 40)
     return 0;  /* Wrong input: Use global default.  */
 
-  if (open_control_file (&cf, 0))
+  if (open_control_table (&cf))
     return 0; /* Error: Use the global default TTL.  */
 
   if (search_control_file (cf, hexgrip, &disabled, &ttl, NULL)
@@ -1136,7 +1465,7 @@ confirm_flag_from_sshcontrol (const char *hexgrip)
   if (!hexgrip || strlen (hexgrip) != 40)
     return 1;  /* Wrong input: Better ask for confirmation.  */
 
-  if (open_control_file (&cf, 0))
+  if (open_control_table (&cf))
     return 1; /* Error: Better ask for confirmation.  */
 
   if (search_control_file (cf, hexgrip, &disabled, NULL, &confirm)
@@ -1153,15 +1482,14 @@ confirm_flag_from_sshcontrol (const char *hexgrip)
 
 
 /* Open the ssh control file for reading.  This is a public version of
-   open_control_file.  The caller must use ssh_close_control_file to
+   open_control_table.  The caller must use ssh_close_control_file to
    release the returned handle.  */
 ssh_control_file_t
 ssh_open_control_file (void)
 {
   ssh_control_file_t cf;
 
-  /* Then look at all the registered and non-disabled keys. */
-  if (open_control_file (&cf, 0))
+  if (open_control_table (&cf))
     return NULL;
   return cf;
 }
@@ -1184,23 +1512,21 @@ ssh_read_control_file (ssh_control_file_t cf,
                        char *r_hexgrip,
                        int *r_disabled, int *r_ttl, int *r_confirm)
 {
-  gpg_error_t err;
+  control_entry_t entry;
 
-  do
-    err = read_control_file_item (cf);
-  while (!err && !cf->item.valid);
-  if (!err)
-    {
-      if (r_hexgrip)
-        strcpy (r_hexgrip, cf->item.hexgrip);
-      if (r_disabled)
-        *r_disabled = cf->item.disabled;
-      if (r_ttl)
-        *r_ttl = cf->item.ttl;
-      if (r_confirm)
-        *r_confirm = cf->item.confirm;
-    }
-  return err;
+  if (cf->nextidx >= cf->table->nentries)
+    return gpg_error (GPG_ERR_EOF);
+  entry = cf->table->entries + cf->nextidx++;
+
+  if (r_hexgrip)
+    strcpy (r_hexgrip, entry->hexgrip);
+  if (r_disabled)
+    *r_disabled = entry->disabled;
+  if (r_ttl)
+    *r_ttl = entry->ttl;
+  if (r_confirm)
+    *r_confirm = entry->confirm;
+  return 0;
 }
 
 
@@ -2583,6 +2909,46 @@ card_key_available (ctrl_t ctrl, gcry_sexp_t *r_pk, char **cardsn)
 */
 
 
+/* Store KEY in the format used by ssh_send_key_public in a new
+   buffer at (R_BLOB, R_BLOBLEN).  */
+static gpg_error_t
+make_identity_blob (gcry_sexp_t key, void **r_blob, size_t *r_bloblen)
+{
+  gpg_error_t err;
+  estream_t stream;
+  void *buffer;
+  size_t length;
+
+  *r_blob = NULL;
+  *r_bloblen = 0;
+
+  stream = es_fopenmem (0, "w+b");
+  if (!stream)
+    return gpg_error_from_syserror ();
+
+  err = ssh_send_key_public (stream, key, NULL);
+  if (err)
+    {
+      es_fclose (stream);
+      return err;
+    }
+  if (es_fclose_snatch (stream, &buffer, &length))
+    return gpg_error_from_syserror ();
+
+  /* Copy it so that it can be released with xfree.  */
+  *r_blob = xtrymalloc (length? length : 1);
+  if (!*r_blob)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      memcpy (*r_blob, buffer, length);
+      *r_bloblen = length;
+    }
+  es_free (buffer);
+  return err;
+}
+
+
 /* Handler for the "request_identities" command.  */
 static gpg_error_t
 ssh_handler_request_identities (ctrl_t ctrl,
@@ -2595,6 +2961,10 @@ ssh_handler_request_identities (ctrl_t ctrl,
   int ret;
   ssh_control_file_t cf = NULL;
   gpg_error_t ret_err;
+  unsigned int idx;
+  char *keystamp = NULL;
+  void *blob = NULL;
+  size_t bloblen;
 
   (void)request;
 
@@ -2666,35 +3036,75 @@ ssh_handler_request_identities (ctrl_t ctrl,
 
  scd_out:
   /* Then look at all the registered and non-disabled keys. */
-  err = open_control_file (&cf, 0);
+  err = open_control_table (&cf);
   if (err)
     goto out;
 
-  while (!read_control_file_item (cf))
+  for (idx=0; idx < cf->table->nentries; idx++)
     {
+      control_entry_t entry = cf->table->entries + idx;
       unsigned char grip[20];
 
-      if (!cf->item.valid)
-        continue; /* Should not happen.  */
-      if (cf->item.disabled)
+      if (entry->disabled)
         continue;
-      assert (strlen (cf->item.hexgrip) == 40);
-      hex2bin (cf->item.hexgrip, grip, sizeof (grip));
+      hex2bin (entry->hexgrip, grip, sizeof (grip));
+
+      /* Use the cached public key if the key file has not changed
+         since it was computed.  */
+      keystamp = agent_key_file_stamp (grip);
+      lock_control_table ();
+      if (keystamp && entry->blob && !strcmp (entry->keystamp, keystamp))
+        err = es_write (key_blobs, entry->blob, entry->bloblen, NULL)?
+          gpg_error_from_syserror () : 0;
+      else
+        err = gpg_error (GPG_ERR_NOT_FOUND);
+      unlock_control_table ();
+      if (!err)
+        {
+          xfree (keystamp);
+          key_counter++;
+          continue;
+        }
+      if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        goto out;
 
       err = agent_public_key_from_file (ctrl, grip, &key_public);
       if (err)
         {
           log_error ("%s:%d: key '%s' skipped: %s\n",
-                     cf->fname, cf->lnr, cf->item.hexgrip,
+                     cf->table->fname, entry->lnr, entry->hexgrip,
                      gpg_strerror (err));
+          xfree (keystamp);
           continue;
         }
 
-      err = ssh_send_key_public (key_blobs, key_public, NULL);
+      err = make_identity_blob (key_public, &blob, &bloblen);
       if (err)
         goto out;
       gcry_sexp_release (key_public);
       key_public = NULL;
+      if (es_write (key_blobs, blob, bloblen, NULL))
+        {
+          err = gpg_error_from_syserror ();
+          goto out;
+        }
+
+      if (keystamp)
+        {
+          lock_control_table ();
+          xfree (entry->keystamp);
+          entry->keystamp = keystamp;
+          keystamp = NULL;
+          xfree (entry->blob);
+          entry->blob = blob;
+          entry->bloblen = bloblen;
+          blob = NULL;
+          unlock_control_table ();
+        }
+      xfree (keystamp);
+      keystamp = NULL;
+      xfree (blob);
+      blob = NULL;
 
       key_counter++;
     }
@@ -2711,6 +3121,8 @@ ssh_handler_request_identities (ctrl_t ctrl,
   /* Send response.  */
 
   gcry_sexp_release (key_public);
+  xfree (keystamp);
+  xfree (blob);
 
   if (!err)
     {
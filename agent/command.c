@@ -42,10 +42,16 @@
 #include "../common/ssh-utils.h"
 #include "../common/asshelp.h"
 #include "../common/server-help.h"
+#include "../common/sexp-parse.h"
 
 
 /* Maximum allowed size of the inquired ciphertext.  */
 #define MAXLEN_CIPHERTEXT 4096
+/* Maximum allowed size of the inquired ciphertexts for a bulk
+   decryption.  */
+#define MAXLEN_BULK_CIPHERTEXT (1024*1024)
+/* Maximum allowed size of the inquired hashes for a bulk signing.  */
+#define MAXLEN_BULK_HASHES (1024*1024)
 /* Maximum allowed size of the key parameters.  */
 #define MAXLEN_KEYPARAM 1024
 /* Maximum allowed size of key data as used in inquiries (bytes). */
@@ -636,6 +642,28 @@ cmd_sigkey (assuan_context_t ctx, char *line)
 }
 
 
+/* Return a malloced description for the pinentry made from the
+   escaped string DESC as given to SETKEYDESC.  DESC is modified.
+   Returns NULL on error.  */
+static char *
+make_keydesc (ctrl_t ctrl, char *desc)
+{
+  /* Note, that we only need to replace the + characters and should
+     leave the other escaping in place because the escaped string is
+     send verbatim to the pinentry which does the unescaping (but not
+     the + replacing) */
+  plus_to_blank (desc);
+
+  if (ctrl->restricted)
+    return strconcat ((ctrl->restricted == 2
+                       ? _("Note: Request from the web browser.")
+                       : _("Note: Request from a remote site.")  ),
+                      "%0A%0A", desc, NULL);
+  else
+    return xtrystrdup (desc);
+}
+
+
 static const char hlp_setkeydesc[] =
   "SETKEYDESC plus_percent_escaped_string\n"
   "\n"
@@ -666,23 +694,8 @@ cmd_setkeydesc (assuan_context_t ctx, char *line)
   if (!*desc)
     return set_error (GPG_ERR_ASS_PARAMETER, "no description given");
 
-  /* Note, that we only need to replace the + characters and should
-     leave the other escaping in place because the escaped string is
-     send verbatim to the pinentry which does the unescaping (but not
-     the + replacing) */
-  plus_to_blank (desc);
-
   xfree (ctrl->server_local->keydesc);
-
-  if (ctrl->restricted)
-    {
-      ctrl->server_local->keydesc = strconcat
-        ((ctrl->restricted == 2
-         ? _("Note: Request from the web browser.")
-         : _("Note: Request from a remote site.")  ), "%0A%0A", desc, NULL);
-    }
-  else
-    ctrl->server_local->keydesc = xtrystrdup (desc);
+  ctrl->server_local->keydesc = make_keydesc (ctrl, desc);
   if (!ctrl->server_local->keydesc)
     return out_of_core ();
   return 0;
@@ -770,11 +783,144 @@ cmd_sethash (assuan_context_t ctx, char *line)
 }
 
 
+/* Parse the bulk request for PKSIGN in the canonical S-expression
+   VALUE of length VALUELEN.  On success the array of items is stored
+   at R_ITEMS and their number at R_NITEMS.  The items point into
+   VALUE.  */
+static gpg_error_t
+parse_pksign_bulk (const unsigned char *value, size_t valuelen,
+                   struct pksign_bulk_item_s **r_items,
+                   unsigned int *r_nitems)
+{
+  const unsigned char *s;
+  struct pksign_bulk_item_s *items;
+  unsigned int nitems, idx;
+  char name[32];
+  size_t n;
+  int algo;
+
+  *r_items = NULL;
+  *r_nitems = 0;
+
+  if (!gcry_sexp_canon_len (value, valuelen, NULL, NULL))
+    return gpg_error (GPG_ERR_INV_SEXP);
+  s = value;
+  if (*s != '(')
+    return gpg_error (GPG_ERR_INV_SEXP);
+  s++;
+  n = snext (&s);
+  if (!smatch (&s, n, "bulk"))
+    return gpg_error (GPG_ERR_UNKNOWN_SEXP);
+
+  /* Each item has at least 16 bytes; thus this is an upper limit.  */
+  nitems = valuelen / 16 + 1;
+  items = xtrycalloc (nitems, sizeof *items);
+  if (!items)
+    return gpg_error_from_syserror ();
+
+  for (idx=0; *s == '(' && idx < nitems; idx++)
+    {
+      s++;
+      n = snext (&s);
+      if (!smatch (&s, n, "hash"))
+        goto bad;
+      n = snext (&s);
+      if (!n || n >= sizeof name)
+        goto bad;
+      memcpy (name, s, n);
+      name[n] = 0;
+      s += n;
+      if (!strcmp (name, "tls-md5sha1"))
+        algo = MD_USER_TLS_MD5SHA1;
+      else
+        algo = gcry_md_map_name (name);
+      if (!algo || (algo != MD_USER_TLS_MD5SHA1 && gcry_md_test_algo (algo)))
+        {
+          xfree (items);
+          return gpg_error (GPG_ERR_UNSUPPORTED_ALGORITHM);
+        }
+      n = snext (&s);
+      if (algo == MD_USER_TLS_MD5SHA1 && n == 36)
+        ;
+      else if (n != 16 && n != 20 && n != 24
+               && n != 28 && n != 32 && n != 48 && n != 64)
+        goto bad;
+      items[idx].algo = algo;
+      items[idx].digest = s;
+      items[idx].digestlen = n;
+      s += n;
+      if (*s != ')')
+        goto bad;
+      s++;
+    }
+  if (*s != ')')
+    goto bad;
+
+  *r_items = items;
+  *r_nitems = idx;
+  return 0;
+
+ bad:
+  xfree (items);
+  return gpg_error (GPG_ERR_INV_SEXP);
+}
+
+
+/* Write the results of a bulk PKSIGN for the NITEMS ITEMS to
+   OUTBUF.  */
+static gpg_error_t
+write_pksign_bulk (struct pksign_bulk_item_s *items, unsigned int nitems,
+                   membuf_t *outbuf)
+{
+  unsigned int idx;
+  char numbuf[35];
+  char *buf;
+  size_t len;
+
+  put_membuf_str (outbuf, "(7:results");
+  for (idx=0; idx < nitems; idx++)
+    {
+      snprintf (numbuf, sizeof numbuf, "%u", items[idx].err);
+      put_membuf_printf (outbuf, "(6:result(5:error%u:%s)",
+                         (unsigned int)strlen (numbuf), numbuf);
+      if (!items[idx].err && items[idx].s_sig)
+        {
+          len = gcry_sexp_sprint (items[idx].s_sig, GCRYSEXP_FMT_CANON,
+                                  NULL, 0);
+          buf = xtrymalloc (len);
+          if (!buf)
+            return gpg_error_from_syserror ();
+          len = gcry_sexp_sprint (items[idx].s_sig, GCRYSEXP_FMT_CANON,
+                                  buf, len);
+          put_membuf (outbuf, buf, len);
+          xfree (buf);
+        }
+      put_membuf (outbuf, ")", 1);
+    }
+  put_membuf (outbuf, ")", 1);
+  return 0;
+}
+
+
 static const char hlp_pksign[] =
   "PKSIGN [<options>] [<cache_nonce>]\n"
   "\n"
   "Perform the actual sign operation.  Neither input nor output are\n"
-  "sensitive to eavesdropping.";
+  "sensitive to eavesdropping.\n"
+  "\n"
+  "With --bulk many hashes are signed with the key set by SETKEY in\n"
+  "one go and SETHASH is not used.  The hashes are inquired with the\n"
+  "keyword HASHES as a canonical S-expression\n"
+  "\n"
+  "  (bulk (hash ALGONAME VALUE) ...)\n"
+  "\n"
+  "with ALGONAME being for example \"sha256\" and VALUE the binary\n"
+  "hash.  The result lists the outcome for each hash in the same\n"
+  "order:\n"
+  "\n"
+  "  (results (result (error ERR) [(sig-val ...)]) ...)\n"
+  "\n"
+  "ERR is the decimal error code of the item and 0 on success.";
 static gpg_error_t
 cmd_pksign (assuan_context_t ctx, char *line)
 {
@@ -784,7 +930,14 @@ cmd_pksign (assuan_context_t ctx, char *line)
   membuf_t outbuf;
   char *cache_nonce = NULL;
   char *p;
+  int opt_bulk;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  struct pksign_bulk_item_s *items = NULL;
+  unsigned int nitems = 0;
+  unsigned int idx;
 
+  opt_bulk = has_option (line, "--bulk");
   line = skip_options (line);
 
   for (p=line; *p && *p != ' ' && *p != '\t'; p++)
@@ -800,8 +953,29 @@ cmd_pksign (assuan_context_t ctx, char *line)
 
   init_membuf (&outbuf, 512);
 
-  err = agent_pksign (ctrl, cache_nonce, ctrl->server_local->keydesc,
-                      &outbuf, cache_mode);
+  if (opt_bulk)
+    {
+      err = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u",
+                                 MAXLEN_BULK_HASHES);
+      if (!err)
+        err = assuan_inquire (ctx, "HASHES",
+                              &value, &valuelen, MAXLEN_BULK_HASHES);
+      if (!err)
+        err = parse_pksign_bulk (value, valuelen, &items, &nitems);
+      if (!err)
+        err = agent_pksign_bulk (ctrl, cache_nonce,
+                                 ctrl->server_local->keydesc,
+                                 items, nitems, cache_mode);
+      if (!err)
+        err = write_pksign_bulk (items, nitems, &outbuf);
+      for (idx=0; idx < nitems; idx++)
+        gcry_sexp_release (items[idx].s_sig);
+      xfree (items);
+      xfree (value);
+    }
+  else
+    err = agent_pksign (ctrl, cache_nonce, ctrl->server_local->keydesc,
+                        &outbuf, cache_mode);
   if (err)
     clear_outbuf (&outbuf);
   else
@@ -814,33 +988,258 @@ cmd_pksign (assuan_context_t ctx, char *line)
 }
 
 
+/* Decrypt all items of the bulk request in the canonical
+   S-expression VALUE of length VALUELEN and append the results to
+   OUTBUF.  See hlp_pkdecrypt for the format.  Errors of a single
+   item are returned in its result; only a syntax error or a cancel
+   by the user terminates the entire request.  */
+static gpg_error_t
+pkdecrypt_bulk (ctrl_t ctrl, const unsigned char *value, size_t valuelen,
+                membuf_t *outbuf)
+{
+  gpg_error_t err = 0;
+  gpg_error_t itemerr;
+  const unsigned char *s, *t, *ciphertext;
+  size_t n, ciphertextlen, len;
+  int depth, padding, i;
+  unsigned char grip[20];
+  char *desc = NULL;
+  char *buf;
+  char numbuf[35];
+  membuf_t itembuf;
+  int saved_have_keygrip = ctrl->have_keygrip;
+  unsigned char saved_keygrip[20];
+
+  memcpy (saved_keygrip, ctrl->keygrip, 20);
+
+  if (!gcry_sexp_canon_len (value, valuelen, NULL, NULL))
+    return gpg_error (GPG_ERR_INV_SEXP);
+
+  s = value;
+  if (*s != '(')
+    return gpg_error (GPG_ERR_INV_SEXP);
+  s++;
+  n = snext (&s);
+  if (!n)
+    return gpg_error (GPG_ERR_INV_SEXP);
+  if (!smatch (&s, n, "bulk"))
+    return gpg_error (GPG_ERR_UNKNOWN_SEXP);
+
+  put_membuf_str (outbuf, "(7:results");
+  while (*s == '(')
+    {
+      s++;
+      n = snext (&s);
+      if (!smatch (&s, n, "item"))
+        {
+          err = gpg_error (GPG_ERR_UNKNOWN_SEXP);
+          goto leave;
+        }
+
+      /* The keygrip.  */
+      if (*s != '(')
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      s++;
+      n = snext (&s);
+      if (!smatch (&s, n, "keygrip"))
+        {
+          err = gpg_error (GPG_ERR_UNKNOWN_SEXP);
+          goto leave;
+        }
+      n = snext (&s);
+      if (n != 40)
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      for (i=0; i < 20; i++, s += 2)
+        {
+          if (!hexdigitp (s) || !hexdigitp (s+1))
+            {
+              err = gpg_error (GPG_ERR_INV_SEXP);
+              goto leave;
+            }
+          grip[i] = xtoi_2 (s);
+        }
+      if (*s != ')')
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      s++;
+
+      /* The optional description.  */
+      t = s;
+      if (*t == '(')
+        {
+          t++;
+          n = snext (&t);
+          if (smatch (&t, n, "desc"))
+            {
+              n = snext (&t);
+              if (!n)
+                {
+                  err = gpg_error (GPG_ERR_INV_SEXP);
+                  goto leave;
+                }
+              buf = xtrymalloc (n + 1);
+              if (!buf)
+                {
+                  err = gpg_error_from_syserror ();
+                  goto leave;
+                }
+              memcpy (buf, t, n);
+              buf[n] = 0;
+              desc = make_keydesc (ctrl, buf);
+              xfree (buf);
+              if (!desc)
+                {
+                  err = gpg_error_from_syserror ();
+                  goto leave;
+                }
+              t += n;
+              if (*t != ')')
+                {
+                  err = gpg_error (GPG_ERR_INV_SEXP);
+                  goto leave;
+                }
+              s = t + 1;
+            }
+        }
+
+      /* The ciphertext.  */
+      if (*s != '(')
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      ciphertext = s;
+      s++;
+      depth = 1;
+      err = sskip (&s, &depth);
+      if (err)
+        goto leave;
+      if (*s != ')')
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      ciphertextlen = s - ciphertext;
+      s++;
+
+      memcpy (ctrl->keygrip, grip, 20);
+      ctrl->have_keygrip = 1;
+      init_membuf (&itembuf, 512);
+      itemerr = agent_pkdecrypt (ctrl,
+                                 desc? desc : ctrl->server_local->keydesc,
+                                 ciphertext, ciphertextlen,
+                                 &itembuf, &padding);
+      xfree (desc);
+      desc = NULL;
+      if (gpg_err_code (itemerr) == GPG_ERR_CANCELED
+          || gpg_err_code (itemerr) == GPG_ERR_FULLY_CANCELED)
+        {
+          clear_outbuf (&itembuf);
+          err = itemerr;
+          break;
+        }
+
+      snprintf (numbuf, sizeof numbuf, "%u", itemerr);
+      put_membuf_printf (outbuf, "(6:result(5:error%u:%s)",
+                         (unsigned int)strlen (numbuf), numbuf);
+      if (itemerr)
+        clear_outbuf (&itembuf);
+      else
+        {
+          if (padding != -1)
+            {
+              snprintf (numbuf, sizeof numbuf, "%d", padding);
+              put_membuf_printf (outbuf, "(7:padding%u:%s)",
+                                 (unsigned int)strlen (numbuf), numbuf);
+            }
+          buf = get_membuf (&itembuf, &len);
+          if (!buf)
+            {
+              err = gpg_error_from_syserror ();
+              break;
+            }
+          /* The smartcard case appends a Nul.  */
+          put_membuf (outbuf, buf, (len && !buf[len-1])? len - 1 : len);
+          wipememory (buf, len);
+          xfree (buf);
+        }
+      put_membuf (outbuf, ")", 1);
+    }
+  if (!err && *s != ')')
+    err = gpg_error (GPG_ERR_INV_SEXP);
+  put_membuf (outbuf, ")", 1);
+
+ leave:
+  xfree (desc);
+  memcpy (ctrl->keygrip, saved_keygrip, 20);
+  ctrl->have_keygrip = saved_have_keygrip;
+  return err;
+}
+
+
 static const char hlp_pkdecrypt[] =
   "PKDECRYPT [<options>]\n"
   "\n"
   "Perform the actual decrypt operation.  Input is not\n"
-  "sensitive to eavesdropping.";
+  "sensitive to eavesdropping.\n"
+  "\n"
+  "With --bulk many ciphertexts are decrypted in one go.  The\n"
+  "inquired CIPHERTEXT is then a canonical S-expression\n"
+  "\n"
+  "  (bulk (item (keygrip HEXGRIP) [(desc DESC)] (enc-val ...)) ...)\n"
+  "\n"
+  "where DESC is an optional description as used by SETKEYDESC;\n"
+  "the one set by SETKEYDESC is used for items without it.  The\n"
+  "result lists the outcome for each item in the same order:\n"
+  "\n"
+  "  (results (result (error ERR) [(padding N)] [(value ...)]) ...)\n"
+  "\n"
+  "ERR is the decimal error code of the item and 0 on success.  A\n"
+  "cancel of the pinentry terminates the command.";
 static gpg_error_t
 cmd_pkdecrypt (assuan_context_t ctx, char *line)
 {
   int rc;
   ctrl_t ctrl = assuan_get_pointer (ctx);
   unsigned char *value;
-  size_t valuelen;
+  size_t valuelen, maxlen;
   membuf_t outbuf;
   int padding;
+  int opt_bulk;
 
-  (void)line;
+  opt_bulk = has_option (line, "--bulk");
+  maxlen = opt_bulk? MAXLEN_BULK_CIPHERTEXT : MAXLEN_CIPHERTEXT;
 
   /* First inquire the data to decrypt */
-  rc = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", MAXLEN_CIPHERTEXT);
+  rc = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", (unsigned int)maxlen);
   if (!rc)
-    rc = assuan_inquire (ctx, "CIPHERTEXT",
-			&value, &valuelen, MAXLEN_CIPHERTEXT);
+    rc = assuan_inquire (ctx, "CIPHERTEXT", &value, &valuelen, maxlen);
   if (rc)
     return rc;
 
   init_membuf (&outbuf, 512);
 
+  if (opt_bulk)
+    {
+      rc = pkdecrypt_bulk (ctrl, value, valuelen, &outbuf);
+      xfree (value);
+      if (rc)
+        clear_outbuf (&outbuf);
+      else
+        rc = write_and_clear_outbuf (ctx, &outbuf);
+      xfree (ctrl->server_local->keydesc);
+      ctrl->server_local->keydesc = NULL;
+      return leave_cmd (ctx, rc);
+    }
+
   rc = agent_pkdecrypt (ctrl, ctrl->server_local->keydesc,
                         value, valuelen, &outbuf, &padding);
   xfree (value);
@@ -3425,6 +3824,11 @@ command_has_option (const char *cmd, const char *cmdopt)
       if (!strcmp (cmdopt, "repeat"))
           return 1;
     }
+  else if (!strcmp (cmd, "PKDECRYPT") || !strcmp (cmd, "PKSIGN"))
+    {
+      if (!strcmp (cmdopt, "bulk"))
+          return 1;
+    }
 
   return 0;
 }
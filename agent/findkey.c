@@ -147,6 +147,7 @@ agent_write_private_key (const unsigned char *grip,
   char hexgrip[40+4+1];
 
   bin2hex (grip, 20, hexgrip);
+  agent_put_cache_key (NULL, hexgrip, CACHE_MODE_ANY, NULL, NULL);
   strcpy (hexgrip+40, ".key");
 
   fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
@@ -811,6 +812,32 @@ read_key_file (const unsigned char *grip, gcry_sexp_t *result)
 }
 
 
+/* Return a malloced string identifying the current version of the
+   key file for GRIP or NULL if the file can't be stat-ed.  */
+char *
+agent_key_file_stamp (const unsigned char *grip)
+{
+  char *fname, *stamp;
+  char hexgrip[40+4+1];
+  struct stat st;
+
+  bin2hex (grip, 20, hexgrip);
+  strcpy (hexgrip+40, ".key");
+  fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
+                         hexgrip, NULL);
+  if (stat (fname, &st))
+    stamp = NULL;
+  else
+    stamp = xtryasprintf ("%lu.%lu.%lu.%lu",
+                          (unsigned long)st.st_mtime,
+                          (unsigned long)st.st_ctime,
+                          (unsigned long)st.st_size,
+                          (unsigned long)st.st_ino);
+  xfree (fname);
+  return stamp;
+}
+
+
 /* Remove the key identified by GRIP from the private key directory.  */
 static gpg_error_t
 remove_key_file (const unsigned char *grip)
@@ -820,6 +847,7 @@ remove_key_file (const unsigned char *grip)
   char hexgrip[40+4+1];
 
   bin2hex (grip, 20, hexgrip);
+  agent_put_cache_key (NULL, hexgrip, CACHE_MODE_ANY, NULL, NULL);
   strcpy (hexgrip+40, ".key");
   fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
                          hexgrip, NULL);
@@ -856,6 +884,8 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   unsigned char *buf;
   size_t len, buflen, erroff;
   gcry_sexp_t s_skey;
+  char hexgrip[40+1];
+  char *stamp = NULL;
 
   *result = NULL;
   if (shadow_info)
@@ -863,9 +893,29 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   if (r_passphrase)
     *r_passphrase = NULL;
 
+  /* If enabled, first look for the already unprotected key.  This
+     saves reading and parsing the file and, more important, the
+     passphrase KDF.  The key file is checked for changes.  */
+  if (opt.cache_unprotected_keys && !r_passphrase
+      && cache_mode != CACHE_MODE_IGNORE)
+    {
+      bin2hex (grip, 20, hexgrip);
+      stamp = agent_key_file_stamp (grip);
+      if (stamp)
+        {
+          buf = agent_get_cache_key (ctrl, hexgrip, cache_mode, stamp);
+          if (buf)
+            {
+              xfree (stamp);
+              goto have_key;
+            }
+        }
+    }
+
   err = read_key_file (grip, &s_skey);
   if (err)
     {
+      xfree (stamp);
       if (gpg_err_code (err) == GPG_ERR_ENOENT)
         err = gpg_error (GPG_ERR_NO_SECKEY);
       return err;
@@ -876,7 +926,10 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
      now.  */
   err = make_canon_sexp (s_skey, &buf, &len);
   if (err)
-    return err;
+    {
+      xfree (stamp);
+      return err;
+    }
 
   switch (agent_private_key_type (buf))
     {
@@ -928,6 +981,8 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
 	    if (err)
 	      log_error ("failed to unprotect the secret key: %s\n",
 			 gpg_strerror (err));
+            else if (stamp)
+              agent_put_cache_key (ctrl, hexgrip, cache_mode, buf, stamp);
 	  }
 
 	xfree (desc_text_final);
@@ -966,6 +1021,7 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
     }
   gcry_sexp_release (s_skey);
   s_skey = NULL;
+  xfree (stamp);
   if (err)
     {
       xfree (buf);
@@ -977,6 +1033,7 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
       return err;
     }
 
+ have_key:
   buflen = gcry_sexp_canon_len (buf, 0, NULL, NULL);
   err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
   wipememory (buf, buflen);
@@ -120,6 +120,7 @@ enum cmd_and_opt_values
   oFakedSystemTime,
 
   oIgnoreCacheForSigning,
+  oCacheUnprotectedKeys,
   oAllowMarkTrusted,
   oNoAllowMarkTrusted,
   oAllowPresetPassphrase,
@@ -135,6 +136,8 @@ enum cmd_and_opt_values
   oDisableScdaemon,
   oDisableCheckOwnSocket,
   oS2KCount,
+  oProtectionKDF,
+  oCryptoThreads,
   oAutoExpandSecmem,
   oListenBacklog,
 
@@ -227,6 +230,7 @@ static ARGPARSE_OPTS opts[] = {
 
   ARGPARSE_s_n (oIgnoreCacheForSigning, "ignore-cache-for-signing",
                 /* */    N_("do not use the PIN cache when signing")),
+  ARGPARSE_s_n (oCacheUnprotectedKeys, "cache-unprotected-keys", "@"),
   ARGPARSE_s_n (oNoAllowExternalCache,  "no-allow-external-cache",
                 /* */    N_("disallow the use of an external password cache")),
   ARGPARSE_s_n (oNoAllowMarkTrusted, "no-allow-mark-trusted",
@@ -253,6 +257,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_n (oEnableExtendedKeyFormat, "enable-extended-key-format", "@"),
 
   ARGPARSE_s_u (oS2KCount, "s2k-count", "@"),
+  ARGPARSE_s_s (oProtectionKDF, "protection-kdf", "@"),
+  ARGPARSE_s_u (oCryptoThreads, "crypto-threads", "@"),
 
   ARGPARSE_op_u (oAutoExpandSecmem, "auto-expand-secmem", "@"),
 
@@ -290,6 +296,12 @@ static struct debug_flags_s debug_flags [] =
 #define MIN_PASSPHRASE_NONALPHA (1)
 #define MAX_PASSPHRASE_DAYS   (0)
 
+/* The name of the file to keep the S2K calibration.  */
+#define S2K_CALIBRATION_FILE_NAME "s2k-calibration"
+
+/* The maximum number of threads used for one KDF computation.  */
+#define KDF_MAX_JOBS          (64)
+
 /* The timer tick used for housekeeping stuff.  Note that on Windows
  * we use a SetWaitableTimer seems to signal earlier than about 2
  * seconds.  Thus we use 4 seconds on all platforms except for
@@ -415,6 +427,16 @@ static int reliable_homedir_inotify;
 /* Number of active connections.  */
 static int active_connections;
 
+/* The number of threads currently running a private key operation
+ * without holding the nPth lock, the mutex and condition variable
+ * protecting it, and a thread specific flag set while a thread does
+ * so.  See agent_crypto_begin.  */
+static unsigned int crypto_busy;
+static npth_mutex_t crypto_lock;
+static npth_cond_t crypto_cond;
+static npth_key_t crypto_tlskey;
+static int crypto_available;
+
 /* This object is used to dispatch progress messages from Libgcrypt to
  * the right thread.  Given that we will have at max only a few dozen
  * connections at a time, using a linked list is the easiest way to
@@ -824,7 +846,9 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.max_passphrase_days = MAX_PASSPHRASE_DAYS;
       opt.enable_passphrase_history = 0;
       opt.enable_extended_key_format = 0;
+      opt.protect_argon2 = 0;
       opt.ignore_cache_for_signing = 0;
+      opt.cache_unprotected_keys = 0;
       opt.allow_mark_trusted = 1;
       opt.allow_external_cache = 1;
       opt.allow_loopback_pinentry = 1;
@@ -834,6 +858,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       /* Note: When changing the next line, change also gpgconf_list.  */
       opt.ssh_fingerprint_digest = GCRY_MD_MD5;
       opt.s2k_count = 0;
+      opt.crypto_threads = 0;
       return 1;
     }
 
@@ -902,6 +927,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       break;
 
     case oIgnoreCacheForSigning: opt.ignore_cache_for_signing = 1; break;
+    case oCacheUnprotectedKeys: opt.cache_unprotected_keys = 1; break;
 
     case oAllowMarkTrusted: opt.allow_mark_trusted = 1; break;
     case oNoAllowMarkTrusted: opt.allow_mark_trusted = 0; break;
@@ -929,6 +955,21 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.s2k_count = pargs->r.ret_ulong;
       break;
 
+    case oProtectionKDF:
+      if (!strcmp (pargs->r.ret_str, "s2k"))
+        opt.protect_argon2 = 0;
+#ifdef USE_ARGON2
+      else if (!strcmp (pargs->r.ret_str, "argon2id"))
+        opt.protect_argon2 = 1;
+#endif
+      else
+        log_error ("unsupported protection KDF '%s'\n", pargs->r.ret_str);
+      break;
+
+    case oCryptoThreads:
+      opt.crypto_threads = pargs->r.ret_ulong;
+      break;
+
     default:
       return 0; /* not handled */
     }
@@ -947,6 +988,195 @@ finalize_rereadable_options (void)
 }
 
 
+/* The system call clamp for Libgcrypt and libgpg-error.  A thread
+ * running a private key operation has already left the protected
+ * state; nPth may not be told again.  */
+static void
+agent_pre_syscall (void)
+{
+  if (!npth_getspecific (crypto_tlskey))
+    npth_unprotect ();
+}
+
+static void
+agent_post_syscall (void)
+{
+  if (!npth_getspecific (crypto_tlskey))
+    npth_protect ();
+}
+
+
+/* Return the number of private key operations which may run at the
+ * same time.  */
+unsigned int
+agent_crypto_threads (void)
+{
+  static unsigned int ncpus;
+
+  if (!crypto_available)
+    return 1;
+
+  if (!ncpus)
+    ncpus = gnupg_get_ncpus ();
+  return opt.crypto_threads? opt.crypto_threads : ncpus;
+}
+
+
+/* Wait until fewer than --crypto-threads threads run without the nPth
+ * lock and count the caller as one of them.  */
+static void
+crypto_slot_acquire (void)
+{
+  unsigned int limit = agent_crypto_threads ();
+
+  npth_mutex_lock (&crypto_lock);
+  while (crypto_busy >= limit)
+    npth_cond_wait (&crypto_cond, &crypto_lock);
+  crypto_busy++;
+  npth_mutex_unlock (&crypto_lock);
+}
+
+
+/* Give back a slot taken by crypto_slot_acquire.  */
+static void
+crypto_slot_release (void)
+{
+  npth_mutex_lock (&crypto_lock);
+  crypto_busy--;
+  npth_cond_signal (&crypto_cond);
+  npth_mutex_unlock (&crypto_lock);
+}
+
+
+/* Private key operations are CPU bound and may take a long time; for
+ * example a 4096 bit RSA signature.  nPth allows only one thread at a
+ * time to run in its protected state; thus such an operation blocks
+ * all other connections.  A caller may call this function before a
+ * Libgcrypt private key operation to run it in parallel to the other
+ * threads.  The code between this function and agent_crypto_end may
+ * only call Libgcrypt and must not touch any state of the agent.  The
+ * number of such threads is limited by --crypto-threads.  */
+void
+agent_crypto_begin (void)
+{
+  if (!crypto_available)
+    return;
+
+  crypto_slot_acquire ();
+  npth_setspecific (crypto_tlskey, &crypto_busy);
+  npth_unprotect ();
+}
+
+
+/* Return to the protected state after agent_crypto_begin.  */
+void
+agent_crypto_end (void)
+{
+  if (!crypto_available || !npth_getspecific (crypto_tlskey))
+    return;
+
+  npth_protect ();
+  npth_setspecific (crypto_tlskey, NULL);
+  crypto_slot_release ();
+}
+
+
+#ifdef USE_ARGON2
+/* A job of a KDF computation and the jobs of one computation.  */
+struct kdf_job_s
+{
+  gcry_kdf_job_fn_t fn;
+  void *priv;
+};
+
+struct kdf_jobs_s
+{
+  unsigned int njobs;
+  npth_t threads[KDF_MAX_JOBS];
+  struct kdf_job_s jobs[KDF_MAX_JOBS];
+};
+
+
+/* The thread running one job of a KDF computation.  Like a private
+ * key operation this does not need the nPth lock and it counts
+ * against the --crypto-threads limit.  */
+static void *
+kdf_job_thread (void *arg)
+{
+  struct kdf_job_s *job = arg;
+
+  crypto_slot_acquire ();
+  npth_setspecific (crypto_tlskey, &crypto_busy);
+  npth_unprotect ();
+  job->fn (job->priv);
+  npth_protect ();
+  npth_setspecific (crypto_tlskey, NULL);
+  crypto_slot_release ();
+  return NULL;
+}
+
+
+static int
+kdf_dispatch_job (void *jobs_context, gcry_kdf_job_fn_t job_fn,
+                  void *job_priv)
+{
+  struct kdf_jobs_s *kdfjobs = jobs_context;
+  npth_attr_t tattr;
+  unsigned int idx = kdfjobs->njobs;
+
+  if (idx >= KDF_MAX_JOBS || npth_attr_init (&tattr))
+    {
+      job_fn (job_priv);
+      return 0;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  kdfjobs->jobs[idx].fn = job_fn;
+  kdfjobs->jobs[idx].priv = job_priv;
+  if (npth_create (&kdfjobs->threads[idx], &tattr,
+                   kdf_job_thread, &kdfjobs->jobs[idx]))
+    job_fn (job_priv);
+  else
+    kdfjobs->njobs++;
+  npth_attr_destroy (&tattr);
+  return 0;
+}
+
+
+static int
+kdf_wait_all_jobs (void *jobs_context)
+{
+  struct kdf_jobs_s *kdfjobs = jobs_context;
+  unsigned int idx;
+
+  for (idx=0; idx < kdfjobs->njobs; idx++)
+    npth_join (kdfjobs->threads[idx], NULL);
+  kdfjobs->njobs = 0;
+  return 0;
+}
+
+
+/* Compute the KDF HD running its jobs, for example the lanes of
+ * Argon2, in parallel threads.  */
+static gpg_error_t
+agent_kdf_compute (gcry_kdf_hd_t hd)
+{
+  struct kdf_jobs_s *kdfjobs;
+  gcry_kdf_thread_ops_t ops;
+  gpg_error_t err;
+
+  kdfjobs = xtrycalloc (1, sizeof *kdfjobs);
+  if (!kdfjobs)
+    return gpg_error_from_syserror ();
+  ops.jobs_context = kdfjobs;
+  ops.dispatch_job = kdf_dispatch_job;
+  ops.wait_all_jobs = kdf_wait_all_jobs;
+  err = gcry_kdf_compute (hd, &ops);
+  xfree (kdfjobs);
+  return err;
+}
+#endif /*USE_ARGON2*/
+
+
 static void
 thread_init_once (void)
 {
@@ -956,8 +1186,20 @@ thread_init_once (void)
     {
       npth_initialized++;
       npth_init ();
+      if (!npth_key_create (&crypto_tlskey, NULL)
+          && !npth_mutex_init (&crypto_lock, NULL)
+          && !npth_cond_init (&crypto_cond, NULL))
+        crypto_available = 1;
     }
-  gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+  if (crypto_available)
+    {
+      gpgrt_set_syscall_clamp (agent_pre_syscall, agent_post_syscall);
+#ifdef USE_ARGON2
+      set_kdf_compute_hook (agent_kdf_compute);
+#endif
+    }
+  else
+    gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
   /* Now that we have set the syscall clamp we need to tell Libgcrypt
    * that it should get them from libgpg-error.  Note that Libgcrypt
    * has already been initialized but at that point nPth was not
@@ -978,6 +1220,7 @@ initialize_modules (void)
   initialize_module_call_pinentry ();
   initialize_module_call_scd ();
   initialize_module_trustlist ();
+  initialize_module_command_ssh ();
 }
 
 
@@ -1321,6 +1564,15 @@ main (int argc, char **argv )
       agent_exit (0);
     }
 
+  /* Measure the S2K count only once per host.  */
+  {
+    char *fname;
+
+    fname = make_filename (gnupg_homedir (), S2K_CALIBRATION_FILE_NAME, NULL);
+    set_s2k_calibration_file (fname);
+    xfree (fname);
+  }
+
   if (is_supervised)
     ;
   else if (!opt.extra_socket)
@@ -1835,10 +2087,16 @@ agent_libgcrypt_progress_cb (void *data, const char *what, int printchar,
                              int current, int total)
 {
   struct progress_dispatch_s *dispatch;
-  npth_t mytid = npth_self ();
+  npth_t mytid;
 
   (void)data;
 
+  /* A thread running a private key operation does not hold the nPth
+   * lock and must not walk the dispatch list, nor may it yield.  */
+  if (crypto_available && npth_getspecific (crypto_tlskey))
+    return;
+
+  mytid = npth_self ();
   for (dispatch = progress_dispatch_list; dispatch; dispatch = dispatch->next)
     if (dispatch->ctrl && dispatch->tid == mytid)
       break;
@@ -106,7 +106,9 @@ agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
 /*           gcry_sexp_dump (s_skey); */
 /*         } */
 
+      agent_crypto_begin ();
       rc = gcry_pk_decrypt (&s_plain, s_cipher, s_skey);
+      agent_crypto_end ();
       if (rc)
         {
           log_error ("decryption failed: %s\n", gpg_strerror (rc));
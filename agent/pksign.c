@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
+#include <npth.h>
+
 #include "agent.h"
 #include "../common/i18n.h"
 
@@ -270,6 +272,39 @@ do_encode_raw_pkcs1 (const byte *md, size_t mdlen, unsigned int nbits,
 
 
 
+/* Put the DATA of length DATALEN to be signed with the key S_SKEY
+ * into an S-expression and store it at R_HASH.  ALGO is the hash
+ * algorithm and RAW_VALUE the flag from the digest of CTRL.  If the
+ * key is a DSA key its algorithm is stored at R_DSAALGO, else 0.  */
+static gpg_error_t
+encode_sign_data (gcry_sexp_t s_skey, int algo, int raw_value,
+                  const unsigned char *data, size_t datalen,
+                  gcry_sexp_t *r_hash, int *r_dsaalgo)
+{
+  int dsaalgo = 0;
+  gpg_error_t err;
+
+  if (agent_is_eddsa_key (s_skey))
+    err = do_encode_eddsa (data, datalen,
+                           r_hash);
+  else if (algo == MD_USER_TLS_MD5SHA1)
+    err = do_encode_raw_pkcs1 (data, datalen,
+                               gcry_pk_get_nbits (s_skey),
+                               r_hash);
+  else if ( (dsaalgo = agent_is_dsa_key (s_skey)) )
+    err = do_encode_dsa (data, datalen,
+                         dsaalgo, s_skey,
+                         r_hash);
+  else
+    err = do_encode_md (data, datalen,
+                        algo,
+                        r_hash,
+                        raw_value);
+  *r_dsaalgo = dsaalgo;
+  return err;
+}
+
+
 /* SIGN whatever information we have accumulated in CTRL and return
  * the signature S-expression.  LOOKUP is an optional function to
  * provide a way for lower layers to ask for the caching TTL.  If a
@@ -454,22 +489,9 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
       int dsaalgo = 0;
 
       /* Put the hash into a sexp */
-      if (agent_is_eddsa_key (s_skey))
-        err = do_encode_eddsa (data, datalen,
-                               &s_hash);
-      else if (ctrl->digest.algo == MD_USER_TLS_MD5SHA1)
-        err = do_encode_raw_pkcs1 (data, datalen,
-                                   gcry_pk_get_nbits (s_skey),
-                                   &s_hash);
-      else if ( (dsaalgo = agent_is_dsa_key (s_skey)) )
-        err = do_encode_dsa (data, datalen,
-                             dsaalgo, s_skey,
-                             &s_hash);
-      else
-        err = do_encode_md (data, datalen,
-                            ctrl->digest.algo,
-                            &s_hash,
-                            ctrl->digest.raw_value);
+      err = encode_sign_data (s_skey, ctrl->digest.algo,
+                              ctrl->digest.raw_value, data, datalen,
+                              &s_hash, &dsaalgo);
       if (err)
         goto leave;
 
@@ -486,7 +508,9 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
         }
 
       /* sign */
+      agent_crypto_begin ();
       err = gcry_pk_sign (&s_sig, s_hash, s_skey);
+      agent_crypto_end ();
       if (err)
         {
           log_error ("signing failed: %s\n", gpg_strerror (err));
@@ -516,7 +540,11 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
         }
 
       if (!err)
-        err = gcry_pk_verify (s_sig, s_hash, sexp_key);
+        {
+          agent_crypto_begin ();
+          err = gcry_pk_verify (s_sig, s_hash, sexp_key);
+          agent_crypto_end ();
+        }
 
       if (err)
         {
@@ -575,3 +603,207 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
 
   return err;
 }
+
+
+/* The state shared by the threads of agent_pksign_bulk.  */
+struct sign_jobs_s
+{
+  npth_mutex_t lock;
+  gcry_sexp_t s_skey;
+  gcry_sexp_t *s_hashes;
+  struct pksign_bulk_item_s *items;
+  unsigned int nitems;
+  unsigned int next;   /* The index of the next item to sign.  */
+  int check_signature;
+};
+
+
+/* Sign the items of JOBS until none are left.  This is run by
+ * several threads at the same time.  */
+static void
+sign_jobs (struct sign_jobs_s *jobs)
+{
+  struct pksign_bulk_item_s *item;
+  unsigned int idx;
+
+  for (;;)
+    {
+      npth_mutex_lock (&jobs->lock);
+      idx = jobs->next++;
+      npth_mutex_unlock (&jobs->lock);
+      if (idx >= jobs->nitems)
+        break;
+      item = jobs->items + idx;
+      if (item->err)
+        continue;
+
+      agent_crypto_begin ();
+      item->err = gcry_pk_sign (&item->s_sig, jobs->s_hashes[idx],
+                                jobs->s_skey);
+      if (!item->err && jobs->check_signature)
+        item->err = gcry_pk_verify (item->s_sig, jobs->s_hashes[idx],
+                                    jobs->s_skey);
+      agent_crypto_end ();
+
+      if (item->err)
+        {
+          log_error ("signing failed: %s\n", gpg_strerror (item->err));
+          gcry_sexp_release (item->s_sig);
+          item->s_sig = NULL;
+        }
+    }
+}
+
+
+static void *
+sign_jobs_thread (void *arg)
+{
+  sign_jobs (arg);
+  return NULL;
+}
+
+
+/* Sign the NITEMS hashes in ITEMS with the key set in CTRL.  Unlike
+ * calling agent_pksign for each hash, the key is read and unprotected
+ * only once and the signatures are created by several threads.  The
+ * signature or error of each item is stored in the item.  An error is
+ * only returned if the key can't be used at all.  */
+gpg_error_t
+agent_pksign_bulk (ctrl_t ctrl, const char *cache_nonce,
+                   const char *desc_text,
+                   struct pksign_bulk_item_s *items, unsigned int nitems,
+                   cache_mode_t cache_mode)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_skey = NULL;
+  unsigned char *shadow_info = NULL;
+  struct sign_jobs_s jobs;
+  npth_t *threads = NULL;
+  npth_attr_t tattr;
+  unsigned int idx, nthreads;
+  int dsaalgo = 0;
+
+  memset (&jobs, 0, sizeof jobs);
+  for (idx=0; idx < nitems; idx++)
+    {
+      items[idx].s_sig = NULL;
+      items[idx].err = 0;
+    }
+
+  if (!ctrl->have_keygrip)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+
+  err = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
+                             &shadow_info, cache_mode, NULL, &s_skey, NULL);
+  if (err)
+    {
+      if (gpg_err_code (err) != GPG_ERR_NO_SECKEY)
+        log_error ("failed to read the secret key\n");
+      goto leave;
+    }
+
+  if (shadow_info)
+    {
+      /* A smartcard can only do one operation at a time; thus use the
+       * standard code for each item.  The PIN is cached by the
+       * card.  */
+      int saved_algo = ctrl->digest.algo;
+      int saved_valuelen = ctrl->digest.valuelen;
+      int saved_raw_value = ctrl->digest.raw_value;
+      unsigned char saved_value[MAX_DIGEST_LEN];
+
+      memcpy (saved_value, ctrl->digest.value, sizeof saved_value);
+      for (idx=0; idx < nitems; idx++)
+        {
+          if (items[idx].digestlen > MAX_DIGEST_LEN)
+            {
+              items[idx].err = gpg_error (GPG_ERR_INV_LENGTH);
+              continue;
+            }
+          ctrl->digest.algo = items[idx].algo;
+          ctrl->digest.raw_value = 0;
+          ctrl->digest.valuelen = items[idx].digestlen;
+          memcpy (ctrl->digest.value, items[idx].digest,
+                  items[idx].digestlen);
+          items[idx].err = agent_pksign_do (ctrl, cache_nonce, desc_text,
+                                            &items[idx].s_sig, cache_mode,
+                                            NULL, NULL, 0);
+          if (gpg_err_code (items[idx].err) == GPG_ERR_CANCELED
+              || gpg_err_code (items[idx].err) == GPG_ERR_FULLY_CANCELED)
+            {
+              err = items[idx].err;
+              break;
+            }
+        }
+      ctrl->digest.algo = saved_algo;
+      ctrl->digest.valuelen = saved_valuelen;
+      ctrl->digest.raw_value = saved_raw_value;
+      memcpy (ctrl->digest.value, saved_value, sizeof saved_value);
+      goto leave;
+    }
+
+  jobs.s_hashes = xtrycalloc (nitems? nitems : 1, sizeof *jobs.s_hashes);
+  if (!jobs.s_hashes)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (idx=0; idx < nitems; idx++)
+    items[idx].err = encode_sign_data (s_skey, items[idx].algo, 0,
+                                       items[idx].digest,
+                                       items[idx].digestlen,
+                                       &jobs.s_hashes[idx], &dsaalgo);
+
+  /* It's RSA and Libgcrypt < 1.7 */
+  if (dsaalgo == 0 && GCRYPT_VERSION_NUMBER < 0x010700)
+    jobs.check_signature = 1;
+
+  if (DBG_CRYPTO)
+    gcry_log_debugsxp ("skey", s_skey);
+
+  err = npth_mutex_init (&jobs.lock, NULL);
+  if (err)
+    {
+      err = gpg_error_from_errno (err);
+      goto leave;
+    }
+  jobs.s_skey = s_skey;
+  jobs.items = items;
+  jobs.nitems = nitems;
+
+  /* The calling thread does its share of the work; thus start one
+   * thread less than allowed.  */
+  nthreads = agent_crypto_threads ();
+  if (nthreads > nitems)
+    nthreads = nitems;
+  if (nthreads > 1)
+    threads = xtrycalloc (nthreads - 1, sizeof *threads);
+  if (threads && !npth_attr_init (&tattr))
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+      for (idx=0; idx < nthreads - 1; idx++)
+        if (npth_create (&threads[idx], &tattr, sign_jobs_thread, &jobs))
+          break;
+      nthreads = idx + 1;
+      npth_attr_destroy (&tattr);
+    }
+  else
+    nthreads = 1;
+
+  sign_jobs (&jobs);
+  for (idx=0; idx < nthreads - 1; idx++)
+    npth_join (threads[idx], NULL);
+  npth_mutex_destroy (&jobs.lock);
+
+ leave:
+  if (jobs.s_hashes)
+    {
+      for (idx=0; idx < nitems; idx++)
+        gcry_sexp_release (jobs.s_hashes[idx]);
+      xfree (jobs.s_hashes);
+    }
+  xfree (threads);
+  gcry_sexp_release (s_skey);
+  xfree (shadow_info);
+  return err;
+}
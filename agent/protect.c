@@ -52,6 +52,27 @@
 /* Decode an rfc4880 encoded S2K count.  */
 #define S2K_DECODE_COUNT(_val) ((16ul + ((_val) & 15)) << (((_val) >> 4) + 6))
 
+/* The parameters for new keys protected with Argon2id.  These are the
+   second recommended option from RFC-9106: 3 passes over 64 MiB.  The
+   4 lanes may be computed in parallel.  */
+#define ARGON2_PASSES   3
+#define ARGON2_MEMCOST  65536  /* In KiB.  */
+#define ARGON2_LANES    4
+#define ARGON2_SALTLEN  16
+
+/* The limits we accept when unprotecting a key.  */
+#define ARGON2_MAX_PASSES   64
+#define ARGON2_MAX_MEMCOST  (2*1024*1024)  /* 2 GiB.  */
+#define ARGON2_MAX_LANES    64
+
+/* The name of the file to keep the S2K calibration or NULL.  */
+static char *calibration_fname;
+
+#ifdef USE_ARGON2
+/* A function to compute a KDF with parallel threads or NULL.  */
+static gpg_error_t (*kdf_compute_hook) (gcry_kdf_hd_t hd);
+#endif
+
 
 /* A table containing the information needed to create a protected
    private key.  */
@@ -71,6 +92,20 @@ static const struct {
 };
 
 
+/* The parameters to derive the protection key from a passphrase.  */
+struct kdf_params_s
+{
+  int algo;                   /* GCRY_KDF_ITERSALTED_S2K or
+                                 GCRY_KDF_ARGON2.  */
+  const unsigned char *salt;
+  size_t saltlen;
+  unsigned long s2kcount;     /* The iteration count for S2K.  */
+  unsigned long passes;       /* The parameters for Argon2.  */
+  unsigned long memcost;
+  unsigned long lanes;
+};
+
+
 /* A helper object for time measurement.  */
 struct calibrate_time_s
 {
@@ -195,13 +230,138 @@ calibrate_s2k_count (void)
 }
 
 
+/* Keep the S2K calibration in the file FNAME so that it does not
+ * need to be measured again by the next process.  Because a home
+ * directory may be used on several machines, the file has a line
+ *
+ *   HOST LIBGCRYPT_VERSION COUNT
+ *
+ * for each host.  */
+void
+set_s2k_calibration_file (const char *fname)
+{
+  xfree (calibration_fname);
+  calibration_fname = fname? xtrystrdup (fname) : NULL;
+}
+
+
+/* Store a name for this host at BUFFER of size BUFLEN.  */
+static void
+get_host_name (char *buffer, size_t buflen)
+{
+  char *p;
+
+#ifdef HAVE_W32_SYSTEM
+  DWORD n = buflen;
+
+  if (!GetComputerNameA (buffer, &n))
+    *buffer = 0;
+#else
+  if (gethostname (buffer, buflen - 1))
+    *buffer = 0;
+  buffer[buflen-1] = 0;
+#endif
+  for (p = buffer; *p; p++)
+    if (spacep (p))
+      *p = '_';
+  if (!*buffer)
+    mem2str (buffer, "-", buflen);
+}
+
+
+/* Read the S2K count for this host from the calibration file.
+ * Returns 0 if there is none.  */
+static unsigned long
+read_s2k_calibration (const char *host)
+{
+  estream_t fp;
+  char line[256];
+  char *fields[3];
+  unsigned long count = 0;
+
+  fp = es_fopen (calibration_fname, "r");
+  if (!fp)
+    return 0;
+  while (es_fgets (line, sizeof line, fp))
+    {
+      trim_spaces (line);
+      if (split_fields (line, fields, DIM (fields)) == 3
+          && !strcmp (fields[0], host)
+          && !strcmp (fields[1], gcry_check_version (NULL)))
+        count = strtoul (fields[2], NULL, 10);
+    }
+  es_fclose (fp);
+  return count < 65536? 0 : count;
+}
+
+
+/* Store COUNT as the S2K count for this host in the calibration
+ * file.  The lines of other hosts are kept.  */
+static void
+write_s2k_calibration (const char *host, unsigned long count)
+{
+  gpg_error_t err;
+  estream_t fp, outfp;
+  char *tmpfname;
+  char line[256];
+  size_t n;
+
+  tmpfname = xtryasprintf ("%s.tmp", calibration_fname);
+  if (!tmpfname)
+    return;
+  outfp = es_fopen (tmpfname, "w,mode=-rw");
+  if (!outfp)
+    {
+      xfree (tmpfname);
+      return;
+    }
+
+  fp = es_fopen (calibration_fname, "r");
+  if (fp)
+    {
+      n = strlen (host);
+      while (es_fgets (line, sizeof line, fp))
+        if (strncmp (line, host, n) || !spacep (line + n))
+          es_fputs (line, outfp);
+      es_fclose (fp);
+    }
+  es_fprintf (outfp, "%s %s %lu\n", host, gcry_check_version (NULL), count);
+
+  if (es_fclose (outfp))
+    err = gpg_error_from_syserror ();
+  else
+    err = gnupg_rename_file (tmpfname, calibration_fname, NULL);
+  if (err)
+    {
+      log_info ("error writing '%s': %s\n",
+                calibration_fname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+  xfree (tmpfname);
+}
+
+
 /* Return the calibrated S2K count.  This is only public for the use
  * of the Assuan getinfo s2k_count_cal command.  */
 unsigned long
 get_calibrated_s2k_count (void)
 {
   static unsigned long count;
+  char host[64];
 
+  if (!count && calibration_fname)
+    {
+      get_host_name (host, sizeof host);
+      count = read_s2k_calibration (host);
+      if (!count)
+        {
+          count = calibrate_s2k_count ();
+          write_s2k_calibration (host, count);
+        }
+      else if (opt.verbose)
+        log_info ("S2K calibration: %lu (from '%s')\n",
+                  count, calibration_fname);
+    }
   if (!count)
     count = calibrate_s2k_count ();
 
@@ -258,6 +418,65 @@ get_standard_s2k_count_rfc4880 (void)
 }
 
 
+#ifdef USE_ARGON2
+/* Let the Argon2 KDF be computed by HOOK, which may run the jobs of
+   the KDF in parallel threads.  */
+void
+set_kdf_compute_hook (gpg_error_t (*hook) (gcry_kdf_hd_t hd))
+{
+  kdf_compute_hook = hook;
+}
+
+
+static gpg_error_t
+argon2_hash_passphrase (const char *passphrase,
+                        const struct kdf_params_s *kdf,
+                        unsigned char *key, size_t keylen)
+{
+  gpg_error_t err;
+  gcry_kdf_hd_t hd;
+  unsigned long param[4];
+
+  if (!passphrase || !*passphrase)
+    return gpg_error (GPG_ERR_NO_PASSPHRASE);
+
+  param[0] = keylen;
+  param[1] = kdf->passes;
+  param[2] = kdf->memcost;
+  param[3] = kdf->lanes;
+  err = gcry_kdf_open (&hd, GCRY_KDF_ARGON2, GCRY_KDF_ARGON2ID,
+                       param, DIM (param),
+                       passphrase, strlen (passphrase),
+                       kdf->salt, kdf->saltlen, NULL, 0, NULL, 0);
+  if (err)
+    return err;
+  if (kdf_compute_hook)
+    err = kdf_compute_hook (hd);
+  else
+    err = gcry_kdf_compute (hd, NULL);
+  if (!err)
+    err = gcry_kdf_final (hd, keylen, key);
+  gcry_kdf_close (hd);
+  return err;
+}
+#endif /*USE_ARGON2*/
+
+
+/* Derive the protection key from PASSPHRASE as described by KDF and
+   store it in the buffer KEY of length KEYLEN.  */
+static gpg_error_t
+derive_key (const char *passphrase, const struct kdf_params_s *kdf,
+            unsigned char *key, size_t keylen)
+{
+#ifdef USE_ARGON2
+  if (kdf->algo == GCRY_KDF_ARGON2)
+    return argon2_hash_passphrase (passphrase, kdf, key, keylen);
+#endif
+  return hash_passphrase (passphrase, GCRY_MD_SHA1, 3,
+                          kdf->salt, kdf->s2kcount, key, keylen);
+}
+
+
 
 /* Calculate the MIC for a private key or shared secret S-expression.
    SHA1HASH should point to a 20 byte buffer.  This function is
@@ -347,10 +566,12 @@ do_encryption (const unsigned char *hashbegin, size_t hashlen,
                const char *passphrase,
                const char *timestamp_exp, size_t timestamp_exp_len,
                unsigned char **result, size_t *resultlen,
-	       unsigned long s2k_count, int use_ocb)
+	       unsigned long s2k_count, int use_ocb, int use_argon2)
 {
   gcry_cipher_hd_t hd;
   const char *modestr;
+  struct kdf_params_s kdf;
+  size_t saltlen;
   unsigned char hashvalue[20];
   int blklen, enclen, outlen;
   unsigned char *iv = NULL;
@@ -366,8 +587,10 @@ do_encryption (const unsigned char *hashbegin, size_t hashlen,
   *resultlen = 0;
   *result = NULL;
 
-  modestr = (use_ocb? "openpgp-s2k3-ocb-aes"
-             /*   */: "openpgp-s2k3-sha1-" PROT_CIPHER_STRING "-cbc");
+  modestr = (use_argon2? "argon2id-ocb-aes" :
+             use_ocb?    "openpgp-s2k3-ocb-aes"
+             /*   */:    "openpgp-s2k3-sha1-" PROT_CIPHER_STRING "-cbc");
+  saltlen = use_argon2? ARGON2_SALTLEN : 8;
 
   rc = gcry_cipher_open (&hd, PROT_CIPHER,
                          use_ocb? GCRY_CIPHER_MODE_OCB :
@@ -416,14 +639,14 @@ do_encryption (const unsigned char *hashbegin, size_t hashlen,
       /* Allocate random bytes to be used as IV, padding and s2k salt
        * or in OCB mode for a nonce and the s2k salt.  The IV/nonce is
        * set later because for OCB we need to set the key first.  */
-      ivsize = (use_ocb? 12 : (blklen*2)) + 8;
+      ivsize = (use_ocb? 12 : (blklen*2)) + saltlen;
       iv = xtrymalloc (ivsize);
       if (!iv)
         rc = gpg_error_from_syserror ();
       else
         {
           gcry_create_nonce (iv, ivsize);
-          s2ksalt = iv + ivsize - 8;
+          s2ksalt = iv + ivsize - saltlen;
         }
     }
 
@@ -438,10 +661,24 @@ do_encryption (const unsigned char *hashbegin, size_t hashlen,
         rc = out_of_core ();
       else
         {
-          rc = hash_passphrase (passphrase, GCRY_MD_SHA1,
-                                3, s2ksalt,
-				s2k_count? s2k_count:get_standard_s2k_count(),
-				key, keylen);
+          memset (&kdf, 0, sizeof kdf);
+          kdf.salt = s2ksalt;
+          kdf.saltlen = saltlen;
+          if (use_argon2)
+            {
+#ifdef USE_ARGON2
+              kdf.algo = GCRY_KDF_ARGON2;
+#endif
+              kdf.passes = ARGON2_PASSES;
+              kdf.memcost = ARGON2_MEMCOST;
+              kdf.lanes = ARGON2_LANES;
+            }
+          else
+            {
+              kdf.algo = GCRY_KDF_ITERSALTED_S2K;
+              kdf.s2kcount = s2k_count? s2k_count:get_standard_s2k_count();
+            }
+          rc = derive_key (passphrase, &kdf, key, keylen);
           if (!rc)
             rc = gcry_cipher_setkey (hd, key, keylen);
           xfree (key);
@@ -540,20 +777,45 @@ do_encryption (const unsigned char *hashbegin, size_t hashlen,
        ((sha1 salt no_of_iterations) 16byte_iv)
        encrypted_octet_string)
 
+     or for Argon2
+
+     (protected argon2id-ocb-aes
+       ((argon2id salt passes memcost lanes) 12byte_nonce)
+       encrypted_octet_string)
+
      in canoncical format of course.  We use asprintf and %n modifier
      and dummy values as placeholders.  */
   {
     char countbuf[35];
+    char passbuf[35], membuf[35], lanebuf[35];
 
-    snprintf (countbuf, sizeof countbuf, "%lu",
-	    s2k_count ? s2k_count : get_standard_s2k_count ());
-    p = xtryasprintf
-      ("(9:protected%d:%s((4:sha18:%n_8bytes_%u:%s)%d:%n%*s)%d:%n%*s)",
-       (int)strlen (modestr), modestr,
-       &saltpos,
-       (unsigned int)strlen (countbuf), countbuf,
-       use_ocb? 12 : blklen, &ivpos, use_ocb? 12 : blklen, "",
-       enclen, &encpos, enclen, "");
+    if (use_argon2)
+      {
+        snprintf (passbuf, sizeof passbuf, "%lu", kdf.passes);
+        snprintf (membuf, sizeof membuf, "%lu", kdf.memcost);
+        snprintf (lanebuf, sizeof lanebuf, "%lu", kdf.lanes);
+        p = xtryasprintf
+          ("(9:protected%d:%s((8:argon2id%d:%n%*s%u:%s%u:%s%u:%s)%d:%n%*s)"
+           "%d:%n%*s)",
+           (int)strlen (modestr), modestr,
+           (int)saltlen, &saltpos, (int)saltlen, "",
+           (unsigned int)strlen (passbuf), passbuf,
+           (unsigned int)strlen (membuf), membuf,
+           (unsigned int)strlen (lanebuf), lanebuf,
+           12, &ivpos, 12, "",
+           enclen, &encpos, enclen, "");
+      }
+    else
+      {
+        snprintf (countbuf, sizeof countbuf, "%lu", kdf.s2kcount);
+        p = xtryasprintf
+          ("(9:protected%d:%s((4:sha18:%n_8bytes_%u:%s)%d:%n%*s)%d:%n%*s)",
+           (int)strlen (modestr), modestr,
+           &saltpos,
+           (unsigned int)strlen (countbuf), countbuf,
+           use_ocb? 12 : blklen, &ivpos, use_ocb? 12 : blklen, "",
+           enclen, &encpos, enclen, "");
+      }
     if (!p)
       {
         gpg_error_t tmperr = out_of_core ();
@@ -565,7 +827,7 @@ do_encryption (const unsigned char *hashbegin, size_t hashlen,
   }
   *resultlen = strlen (p);
   *result = (unsigned char*)p;
-  memcpy (p+saltpos, s2ksalt, 8);
+  memcpy (p+saltpos, s2ksalt, saltlen);
   memcpy (p+ivpos, iv, use_ocb? 12 : blklen);
   memcpy (p+encpos, outbuf, enclen);
   xfree (iv);
@@ -584,7 +846,9 @@ do_encryption (const unsigned char *hashbegin, size_t hashlen,
 /* Protect the key encoded in canonical format in PLAINKEY.  We assume
    a valid S-Exp here.  With USE_UCB set to -1 the default scheme is
    used (ie. either CBC or OCB), set to 0 the old CBC mode is used,
-   and set to 1 OCB is used. */
+   and set to 1 OCB is used.  If Argon2 has been configured and
+   neither CBC nor an S2K_COUNT are requested, OCB with Argon2 is
+   used.  */
 int
 agent_protect (const unsigned char *plainkey, const char *passphrase,
                unsigned char **result, size_t *resultlen,
@@ -604,9 +868,13 @@ agent_protect (const unsigned char *plainkey, const char *passphrase,
   int depth = 0;
   unsigned char *p;
   int have_curve = 0;
+  int use_argon2 = 0;
 
+#ifdef USE_ARGON2
+  use_argon2 = (opt.protect_argon2 && use_ocb && !s2k_count);
+#endif
   if (use_ocb == -1)
-    use_ocb = opt.enable_extended_key_format;
+    use_ocb = use_argon2 || opt.enable_extended_key_format;
 
   /* Create an S-expression with the protected-at timestamp.  */
   memcpy (timestamp_exp, "(12:protected-at15:", 19);
@@ -711,7 +979,8 @@ agent_protect (const unsigned char *plainkey, const char *passphrase,
   rc = do_encryption (hash_begin, hash_end - hash_begin + 1,
                       prot_begin, prot_end - prot_begin + 1,
                       passphrase, timestamp_exp, sizeof (timestamp_exp),
-                      &protected, &protectedlen, s2k_count, use_ocb);
+                      &protected, &protectedlen, s2k_count, use_ocb,
+                      use_argon2);
   if (rc)
     return rc;
 
@@ -756,8 +1025,7 @@ static gpg_error_t
 do_decryption (const unsigned char *aad_begin, size_t aad_len,
                const unsigned char *aadhole_begin, size_t aadhole_len,
                const unsigned char *protected, size_t protectedlen,
-               const char *passphrase,
-               const unsigned char *s2ksalt, unsigned long s2kcount,
+               const char *passphrase, const struct kdf_params_s *kdf,
                const unsigned char *iv, size_t ivlen,
                int prot_cipher, int prot_cipher_keylen, int is_ocb,
                unsigned char **result)
@@ -804,8 +1072,7 @@ do_decryption (const unsigned char *aad_begin, size_t aad_len,
         rc = out_of_core ();
       else
         {
-          rc = hash_passphrase (passphrase, GCRY_MD_SHA1,
-                                3, s2ksalt, s2kcount, key, prot_cipher_keylen);
+          rc = derive_key (passphrase, kdf, key, prot_cipher_keylen);
           if (!rc)
             rc = gcry_cipher_setkey (hd, key, prot_cipher_keylen);
           xfree (key);
@@ -1037,6 +1304,121 @@ merge_lists (const unsigned char *protectedkey,
 
 
 
+/* Parse the S2K parameters of the protected list at *BUFPTR, which
+   points behind the opening parentheses of "((sha1 salt count) iv)",
+   into KDF.  On success *BUFPTR is updated to the closing parenthesis
+   of the inner list.  */
+static gpg_error_t
+parse_s2k_params (const unsigned char **bufptr, struct kdf_params_s *kdf)
+{
+  const unsigned char *s = *bufptr;
+  size_t n;
+
+  n = snext (&s);
+  if (!n)
+    return gpg_error (GPG_ERR_INV_SEXP);
+  if (!smatch (&s, n, "sha1"))
+    return gpg_error (GPG_ERR_UNSUPPORTED_PROTECTION);
+  n = snext (&s);
+  if (n != 8)
+    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
+  kdf->algo = GCRY_KDF_ITERSALTED_S2K;
+  kdf->salt = s;
+  kdf->saltlen = n;
+  s += n;
+  n = snext (&s);
+  if (!n)
+    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
+  /* We expect a list close as next, so we can simply use strtoul()
+     here.  We might want to check that we only have digits - but this
+     is nothing we should worry about */
+  if (s[n] != ')' )
+    return gpg_error (GPG_ERR_INV_SEXP);
+
+  /* Old versions of gpg-agent used the funny floating point number in
+     a byte encoding as specified by OpenPGP.  However this is not
+     needed and thus we now store it as a plain unsigned integer.  We
+     can easily distinguish the old format by looking at its value:
+     Less than 256 is an old-style encoded number; other values are
+     plain integers.  In any case we check that they are at least
+     65536 because we never used a lower value in the past and we
+     should have a lower limit.  */
+  kdf->s2kcount = strtoul ((const char*)s, NULL, 10);
+  if (!kdf->s2kcount)
+    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
+  if (kdf->s2kcount < 256)
+    kdf->s2kcount = S2K_DECODE_COUNT (kdf->s2kcount);
+  if (kdf->s2kcount < 65536)
+    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
+
+  s += n;
+  *bufptr = s;
+  return 0;
+}
+
+
+/* Parse the Argon2 parameters of the protected list at *BUFPTR, which
+   points behind the opening parentheses of
+   "((argon2id salt passes memcost lanes) nonce)", into KDF.  On
+   success *BUFPTR is updated to the closing parenthesis of the inner
+   list.  */
+static gpg_error_t
+parse_argon2_params (const unsigned char **bufptr, struct kdf_params_s *kdf)
+{
+#ifdef USE_ARGON2
+  const unsigned char *s = *bufptr;
+  unsigned long values[3];
+  size_t n;
+  int i;
+
+  n = snext (&s);
+  if (!n)
+    return gpg_error (GPG_ERR_INV_SEXP);
+  if (!smatch (&s, n, "argon2id"))
+    return gpg_error (GPG_ERR_UNSUPPORTED_PROTECTION);
+  n = snext (&s);
+  if (n < 8 || n > 64)
+    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
+  kdf->algo = GCRY_KDF_ARGON2;
+  kdf->salt = s;
+  kdf->saltlen = n;
+  s += n;
+  for (i=0; i < DIM (values); i++)
+    {
+      n = snext (&s);
+      if (!n || n > 9)
+        return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
+      values[i] = 0;
+      for (; n; n--, s++)
+        {
+          if (!digitp (s))
+            return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
+          values[i] = values[i] * 10 + atoi_1 (s);
+        }
+    }
+  if (*s != ')')
+    return gpg_error (GPG_ERR_INV_SEXP);
+
+  /* Check the limits so that a crafted key can't make us use too much
+     time or memory.  */
+  kdf->passes = values[0];
+  kdf->memcost = values[1];
+  kdf->lanes = values[2];
+  if (!kdf->passes || kdf->passes > ARGON2_MAX_PASSES
+      || !kdf->lanes || kdf->lanes > ARGON2_MAX_LANES
+      || kdf->memcost < 8 * kdf->lanes || kdf->memcost > ARGON2_MAX_MEMCOST)
+    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
+
+  *bufptr = s;
+  return 0;
+#else
+  (void)bufptr;
+  (void)kdf;
+  return gpg_error (GPG_ERR_UNSUPPORTED_PROTECTION);
+#endif
+}
+
+
 /* Unprotect the key encoded in canonical format.  We assume a valid
    S-Exp here.  If a protected-at item is available, its value will
    be stored at protected_at unless this is NULL.  */
@@ -1051,10 +1433,14 @@ agent_unprotect (ctrl_t ctrl,
     int algo;         /* (A zero indicates the "openpgp-native" hack.)  */
     int keylen;       /* Used key length in bytes.  */
     unsigned int is_ocb:1;
+    unsigned int is_argon2:1;
   } algotable[] = {
     { "openpgp-s2k3-sha1-aes-cbc",    GCRY_CIPHER_AES128, (128/8)},
     { "openpgp-s2k3-sha1-aes256-cbc", GCRY_CIPHER_AES256, (256/8)},
     { "openpgp-s2k3-ocb-aes",         GCRY_CIPHER_AES128, (128/8), 1},
+#ifdef USE_ARGON2
+    { "argon2id-ocb-aes",             GCRY_CIPHER_AES128, (128/8), 1, 1},
+#endif
     { "openpgp-native", 0, 0 }
   };
   int rc;
@@ -1063,11 +1449,10 @@ agent_unprotect (ctrl_t ctrl,
   size_t n;
   int infidx, i;
   unsigned char sha1hash[20], sha1hash2[20];
-  const unsigned char *s2ksalt;
-  unsigned long s2kcount;
+  struct kdf_params_s kdf;
   const unsigned char *iv;
   int prot_cipher, prot_cipher_keylen;
-  int is_ocb;
+  int is_ocb, is_argon2;
   const unsigned char *aad_begin, *aad_end, *aadhole_begin, *aadhole_end;
   const unsigned char *prot_begin;
   unsigned char *cleartext;
@@ -1179,13 +1564,14 @@ agent_unprotect (ctrl_t ctrl,
   /* Lookup the protection algo.  */
   prot_cipher = 0;        /* (avoid gcc warning) */
   prot_cipher_keylen = 0; /* (avoid gcc warning) */
-  is_ocb = 0;
+  is_ocb = is_argon2 = 0;
   for (i=0; i < DIM (algotable); i++)
     if (smatch (&s, n, algotable[i].name))
       {
         prot_cipher = algotable[i].algo;
         prot_cipher_keylen = algotable[i].keylen;
         is_ocb = algotable[i].is_ocb;
+        is_argon2 = algotable[i].is_argon2;
         break;
       }
   if (i == DIM (algotable))
@@ -1214,42 +1600,19 @@ agent_unprotect (ctrl_t ctrl,
   if (*s != '(' || s[1] != '(')
     return gpg_error (GPG_ERR_INV_SEXP);
   s += 2;
-  n = snext (&s);
-  if (!n)
-    return gpg_error (GPG_ERR_INV_SEXP);
-  if (!smatch (&s, n, "sha1"))
-    return gpg_error (GPG_ERR_UNSUPPORTED_PROTECTION);
-  n = snext (&s);
-  if (n != 8)
-    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
-  s2ksalt = s;
-  s += n;
-  n = snext (&s);
-  if (!n)
-    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
-  /* We expect a list close as next, so we can simply use strtoul()
-     here.  We might want to check that we only have digits - but this
-     is nothing we should worry about */
-  if (s[n] != ')' )
-    return gpg_error (GPG_ERR_INV_SEXP);
-
-  /* Old versions of gpg-agent used the funny floating point number in
-     a byte encoding as specified by OpenPGP.  However this is not
-     needed and thus we now store it as a plain unsigned integer.  We
-     can easily distinguish the old format by looking at its value:
-     Less than 256 is an old-style encoded number; other values are
-     plain integers.  In any case we check that they are at least
-     65536 because we never used a lower value in the past and we
-     should have a lower limit.  */
-  s2kcount = strtoul ((const char*)s, NULL, 10);
-  if (!s2kcount)
-    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
-  if (s2kcount < 256)
-    s2kcount = (16ul + (s2kcount & 15)) << ((s2kcount >> 4) + 6);
-  if (s2kcount < 65536)
-    return gpg_error (GPG_ERR_CORRUPTED_PROTECTION);
-
-  s += n;
+  memset (&kdf, 0, sizeof kdf);
+  if (is_argon2)
+    {
+      rc = parse_argon2_params (&s, &kdf);
+      if (rc)
+        return rc;
+    }
+  else
+    {
+      rc = parse_s2k_params (&s, &kdf);
+      if (rc)
+        return rc;
+    }
   s++; /* skip list end */
 
   n = snext (&s);
@@ -1276,7 +1639,7 @@ agent_unprotect (ctrl_t ctrl,
   rc = do_decryption (aad_begin, aad_end - aad_begin,
                       aadhole_begin, aadhole_end - aadhole_begin,
                       s, n,
-                      passphrase, s2ksalt, s2kcount,
+                      passphrase, &kdf,
                       iv, is_ocb? 12:16,
                       prot_cipher, prot_cipher_keylen, is_ocb,
                       &cleartext);
@@ -0,0 +1,318 @@
+/* t-pksign-bench.c - Signing throughput benchmark for gpg-agent
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+
+   As of now this is only a program for manual tests.  It connects
+   to a running gpg-agent N times in parallel, lets each connection
+   sign hashes with the key KEYGRIP for some seconds and prints the
+   number of signatures per second.  This is done for N from 1 up to
+   the given maximum.  The key must either not be protected or its
+   passphrase must be cached.  Example:
+
+     ./t-pksign-bench --max-clients 8 --seconds 5 KEYGRIP
+
+   Running the agent with --crypto-threads 1 shows the throughput
+   without parallel private key operations.  With --bulk N each
+   connection signs N hashes with one PKSIGN --bulk command.
+
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/wait.h>
+#endif
+#include <assuan.h>
+
+#include "../common/util.h"
+#include "../common/sysutils.h"
+
+#define PGM "t-pksign-bench"
+
+static int verbose;
+static int bulk;
+
+
+/* The hashes for one PKSIGN --bulk command.  */
+struct hashes_parm_s
+{
+  assuan_context_t ctx;
+  unsigned char *buffer;
+  size_t length;
+};
+
+
+static gpg_error_t
+discard_data_cb (void *opaque, const void *buffer, size_t length)
+{
+  (void)opaque;
+  (void)buffer;
+  (void)length;
+  return 0;
+}
+
+
+static gpg_error_t
+inq_hashes_cb (void *opaque, const char *line)
+{
+  struct hashes_parm_s *parm = opaque;
+
+  if (!strncmp (line, "HASHES", 6) && (!line[6] || line[6] == ' '))
+    return assuan_send_data (parm->ctx, parm->buffer, parm->length);
+  return 0;
+}
+
+
+/* Build a request for PKSIGN --bulk with N hashes starting at
+ * COUNT.  */
+static void
+make_hashes (struct hashes_parm_s *parm, unsigned long count, int n)
+{
+  unsigned char *p;
+  int i;
+
+  p = parm->buffer;
+  memcpy (p, "(4:bulk", 7);
+  p += 7;
+  for (i=0; i < n; i++)
+    {
+      memcpy (p, "(4:hash6:sha25632:", 18);
+      p += 18;
+      memset (p, 0, 32);
+      memcpy (p, &count, sizeof count);
+      count++;
+      p += 32;
+      *p++ = ')';
+    }
+  *p++ = ')';
+  parm->length = p - parm->buffer;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Connect to the agent at SOCKNAME and sign with KEYGRIP until
+ * SECONDS have passed.  Returns the number of signatures made.  */
+static unsigned long
+run_client (const char *sockname, const char *keygrip, int seconds)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  char line[ASSUAN_LINELENGTH];
+  unsigned long count = 0;
+  time_t stop;
+  struct hashes_parm_s parm;
+
+  err = assuan_new (&ctx);
+  if (!err)
+    err = assuan_socket_connect (ctx, sockname, ASSUAN_INVALID_PID, 0);
+  if (err)
+    {
+      fprintf (stderr, PGM ": can't connect to '%s': %s\n",
+               sockname, gpg_strerror (err));
+      exit (1);
+    }
+
+  snprintf (line, sizeof line, "SIGKEY %s", keygrip);
+  err = assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    {
+      fprintf (stderr, PGM ": SIGKEY failed: %s\n", gpg_strerror (err));
+      exit (1);
+    }
+
+  parm.ctx = ctx;
+  parm.buffer = NULL;
+  if (bulk)
+    parm.buffer = xmalloc (8 + bulk * 51);
+
+  stop = time (NULL) + seconds;
+  while (bulk && time (NULL) < stop)
+    {
+      make_hashes (&parm, count, bulk);
+      err = assuan_transact (ctx, "PKSIGN --bulk", discard_data_cb, NULL,
+                             inq_hashes_cb, &parm, NULL, NULL);
+      if (err)
+        {
+          fprintf (stderr, PGM ": PKSIGN failed: %s\n", gpg_strerror (err));
+          exit (1);
+        }
+      count += bulk;
+    }
+  while (!bulk && time (NULL) < stop)
+    {
+      snprintf (line, sizeof line, "SETHASH --hash=sha256 %064lX", count);
+      err = assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+      if (!err)
+        err = assuan_transact (ctx, "PKSIGN", discard_data_cb, NULL,
+                               NULL, NULL, NULL, NULL);
+      if (err)
+        {
+          fprintf (stderr, PGM ": PKSIGN failed: %s\n", gpg_strerror (err));
+          exit (1);
+        }
+      count++;
+    }
+
+  xfree (parm.buffer);
+  assuan_release (ctx);
+  return count;
+}
+
+
+/* Run NCLIENTS clients in parallel and return the total number of
+ * signatures.  */
+static unsigned long
+run_clients (const char *sockname, const char *keygrip, int seconds,
+             int nclients)
+{
+  unsigned long total = 0;
+  unsigned long count;
+  int fds[2];
+  int i, status;
+  pid_t pid;
+
+  if (pipe (fds))
+    {
+      fprintf (stderr, PGM ": pipe failed: %s\n", strerror (errno));
+      exit (1);
+    }
+
+  for (i=0; i < nclients; i++)
+    {
+      pid = fork ();
+      if (pid == (pid_t)(-1))
+        {
+          fprintf (stderr, PGM ": fork failed: %s\n", strerror (errno));
+          exit (1);
+        }
+      if (!pid)
+        {
+          close (fds[0]);
+          count = run_client (sockname, keygrip, seconds);
+          if (write (fds[1], &count, sizeof count) != sizeof count)
+            exit (1);
+          exit (0);
+        }
+    }
+  close (fds[1]);
+
+  while (read (fds[0], &count, sizeof count) == sizeof count)
+    total += count;
+  close (fds[0]);
+
+  for (i=0; i < nclients; i++)
+    {
+      if (wait (&status) == (pid_t)(-1)
+          || !WIFEXITED (status) || WEXITSTATUS (status))
+        {
+          fprintf (stderr, PGM ": a client failed\n");
+          exit (1);
+        }
+    }
+
+  return total;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+int
+main (int argc, char **argv)
+{
+  const char *sockname = NULL;
+  int maxclients = 0;
+  int seconds = 5;
+#ifndef HAVE_W32_SYSTEM
+  unsigned long total;
+  int n;
+#endif
+
+  if (argc)
+    { argc--; argv++; }
+  while (argc && **argv == '-')
+    {
+      if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--socket") && argc > 1)
+        {
+          sockname = argv[1];
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--max-clients") && argc > 1)
+        {
+          maxclients = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--seconds") && argc > 1)
+        {
+          seconds = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--bulk") && argc > 1)
+        {
+          bulk = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else
+        break;
+    }
+  if (argc != 1 || strlen (*argv) != 40)
+    {
+      fprintf (stderr, "usage: " PGM " [--verbose] [--socket NAME]"
+               " [--max-clients N] [--seconds N] [--bulk N] KEYGRIP\n");
+      return 1;
+    }
+
+  assuan_set_gpg_err_source (GPG_ERR_SOURCE_DEFAULT);
+
+  if (!sockname)
+    sockname = make_filename (gnupg_socketdir (), GPG_AGENT_SOCK_NAME, NULL);
+  if (maxclients < 1)
+    maxclients = gnupg_get_ncpus ();
+  if (seconds < 1)
+    seconds = 1;
+  if (bulk < 0)
+    bulk = 0;
+
+  if (verbose)
+    printf ("socket=%s key=%s seconds=%d cpus=%u\n",
+            sockname, *argv, seconds, gnupg_get_ncpus ());
+
+#ifdef HAVE_W32_SYSTEM
+  fprintf (stderr, PGM ": not supported on this platform\n");
+  return 1;
+#else
+  for (n=1; n <= maxclients; n++)
+    {
+      total = run_clients (sockname, *argv, seconds, n);
+      printf ("clients=%-3d %8lu signatures %10.1f/s\n",
+              n, total, (double)total / seconds);
+      fflush (stdout);
+    }
+  return 0;
+#endif
+}
@@ -226,14 +226,98 @@ test_agent_protect (void)
 }
 
 
+/* Return true if the string STR is in BUFFER of length LENGTH.  */
+static int
+contains (const unsigned char *buffer, size_t length, const char *str)
+{
+  size_t n = strlen (str);
+
+  for (; length >= n; buffer++, length--)
+    if (!memcmp (buffer, str, n))
+      return 1;
+  return 0;
+}
+
+
 static void
 test_agent_unprotect (void)
 {
-  /* Unprotect the key encoded in canonical format.  We assume a valid
-     S-Exp here. */
-/*   int  */
-/*     agent_unprotect (const unsigned char *protectedkey, const char *passphrase, */
-/*                      unsigned char **result, size_t *resultlen) */
+  struct {
+    int use_ocb;
+    int argon2;
+    const char *mode;
+  } specs[] =
+    {
+      { 0, 0, "openpgp-s2k3-sha1-aes-cbc" },
+      { 1, 0, "openpgp-s2k3-ocb-aes" },
+#ifdef USE_ARGON2
+      { 1, 1, "argon2id-ocb-aes" },
+      { 0, 1, "openpgp-s2k3-sha1-aes-cbc" },
+#endif
+    };
+  gcry_sexp_t s_parms, s_key, s_skey;
+  unsigned char *key;
+  size_t keylen;
+  unsigned char *protected, *result;
+  size_t protectedlen, resultlen;
+  gpg_error_t err;
+  int i;
+
+  err = gcry_sexp_new (&s_parms, "(genkey(ecc(curve Ed25519)(flags eddsa)))",
+                       0, 1);
+  if (!err)
+    err = gcry_pk_genkey (&s_key, s_parms);
+  if (err)
+    {
+      printf ("creating a test key failed: %s\n", gpg_strerror (err));
+      abort ();
+    }
+  gcry_sexp_release (s_parms);
+  s_skey = gcry_sexp_find_token (s_key, "private-key", 0);
+  assert (s_skey);
+  err = make_canon_sexp (s_skey, &key, &keylen);
+  assert (!err);
+  gcry_sexp_release (s_skey);
+  gcry_sexp_release (s_key);
+
+  for (i = 0; i < DIM (specs); i++)
+    {
+      opt.protect_argon2 = specs[i].argon2;
+      err = agent_protect (key, "passphrase", &protected, &protectedlen,
+                           0, specs[i].use_ocb);
+      if (err)
+        {
+          printf ("agent_protect(%d) failed: %s\n", i, gpg_strerror (err));
+          abort ();
+        }
+      if (!contains (protected, protectedlen, specs[i].mode))
+        {
+          printf ("agent_protect(%d) did not use '%s'\n", i, specs[i].mode);
+          abort ();
+        }
+
+      err = agent_unprotect (NULL, protected, "passphrase", NULL,
+                             &result, &resultlen);
+      if (err)
+        {
+          printf ("agent_unprotect(%d) failed: %s\n", i, gpg_strerror (err));
+          abort ();
+        }
+      assert (resultlen == keylen && !memcmp (result, key, keylen));
+      xfree (result);
+
+      err = agent_unprotect (NULL, protected, "wrong", NULL,
+                             &result, &resultlen);
+      if (gpg_err_code (err) != GPG_ERR_BAD_PASSPHRASE)
+        {
+          printf ("agent_unprotect(%d) with a wrong passphrase returned '%s'\n",
+                  i, gpg_strerror (err));
+          abort ();
+        }
+      xfree (protected);
+    }
+  opt.protect_argon2 = 0;
+  xfree (key);
 }
 
 
@@ -106,6 +106,33 @@ b64dec_proc (struct b64state *state, void *buffer, size_t length,
 
   for (s=d=buffer; length && !state->stop_seen; length--, s++)
     {
+      if (ds == s_b64_0)
+        {
+          /* Fast path: decode runs of 4 valid characters without going
+             through the state machine.  Everything else, including
+             line endings and padding, is handled below.  */
+          unsigned char *u = (unsigned char *)s;
+          unsigned char c0, c1, c2, c3;
+
+          while (length >= 4 && !((u[0] | u[1] | u[2] | u[3]) & 0x80))
+            {
+              c0 = asctobin[u[0]];
+              c1 = asctobin[u[1]];
+              c2 = asctobin[u[2]];
+              c3 = asctobin[u[3]];
+              if ((c0 | c1 | c2 | c3) & 0x80)
+                break;
+              *d++ = (c0 << 2) | (c1 >> 4);
+              *d++ = (c1 << 4) | (c2 >> 2);
+              *d++ = (c2 << 6) | c3;
+              u += 4;
+              length -= 4;
+            }
+          s = (char *)u;
+          if (!length)
+            break;
+        }
+
     again:
       switch (ds)
         {
@@ -1874,19 +1874,35 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
     /* We have a filter function and the last time we tried to read we
        didn't get an EOF or an error.  Try to fill the buffer.  */
     {
+      byte *p;
+      int direct = 0;
+
       /* Be careful to account for any buffered data.  */
       len = a->d.size - a->d.len;
+      p = &a->d.buf[a->d.len];
+      if (a->e_d.buf && !a->d.len && a->e_d.size >= len)
+	/* The buffer is empty and iobuf_read wants at least a buffer
+	   full of data.  Let the filter store it directly in the
+	   caller's buffer.  */
+	{
+	  len = a->e_d.size;
+	  p = a->e_d.buf;
+	  direct = 1;
+	}
       if (DBG_IOBUF)
-	log_debug ("iobuf-%d.%d: underflow: A->FILTER (%lu bytes)\n",
-		   a->no, a->subno, (ulong) len);
+	log_debug ("iobuf-%d.%d: underflow: A->FILTER (%lu bytes%s)\n",
+		   a->no, a->subno, (ulong) len, direct? ", direct":"");
       if (len == 0)
 	/* There is no space for more data.  Don't bother calling
 	   A->FILTER.  */
 	rc = 0;
       else
 	rc = a->filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain,
-			&a->d.buf[a->d.len], &len);
-      a->d.len += len;
+			p, &len);
+      if (direct)
+	a->e_d.used = len;
+      else
+	a->d.len += len;
 
       if (DBG_IOBUF)
 	log_debug ("iobuf-%d.%d: A->FILTER() returned rc=%d (%s), read %lu bytes\n",
@@ -1913,7 +1929,8 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	  a->filter = NULL;
 	  a->filter_eof = 1;
 
-	  if (clear_pending_eof && a->d.len == 0 && a->chain)
+	  if (clear_pending_eof && a->d.len == 0 && !a->e_d.used
+	      && a->chain)
 	    /* We don't need to keep this filter around at all:
 
 	         - we got an EOF
@@ -1935,7 +1952,7 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 
 	      return -1;
 	    }
-	  else if (a->d.len == 0)
+	  else if (a->d.len == 0 && !a->e_d.used)
 	    /* We can't unlink this filter (it is the only one in the
 	       pipeline), but we can immediately return EOF.  */
 	    return -1;
@@ -1945,12 +1962,17 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	{
 	  a->error = rc;
 
-	  if (a->d.len == 0)
+	  if (a->d.len == 0 && !a->e_d.used)
 	    /* There is no buffered data.  Immediately return EOF.  */
 	    return -1;
 	}
     }
 
+  if (a->e_d.used)
+    /* The data is in the caller's buffer; the return value is not
+       used in this case.  */
+    return 0;
+
   assert (a->d.start <= a->d.len);
   if (a->d.start < a->d.len)
     return a->d.buf[a->d.start++];
@@ -2082,18 +2104,41 @@ iobuf_read (iobuf_t a, void *buffer, unsigned int buflen)
       if (n < buflen)
 	/* Draining the internal buffer didn't fill BUFFER.  Call
 	   underflow to read more data into the filter's internal
-	   buffer.  */
+	   buffer.  If BUFFER has room for at least a full internal
+	   buffer, underflow reads directly into BUFFER instead.  */
 	{
-	  if ((c = underflow (a, 1)) == -1)
+	  size_t used;
+
+	  if (buf && buflen - n >= a->d.size)
+	    {
+	      a->e_d.buf = buf;
+	      a->e_d.size = buflen - n;
+	      a->e_d.used = 0;
+	    }
+	  c = underflow (a, 1);
+	  used = a->e_d.used;
+	  a->e_d.buf = NULL;
+	  a->e_d.size = 0;
+	  a->e_d.used = 0;
+
+	  if (c == -1)
 	    /* EOF.  If we managed to read something, don't return EOF
 	       now.  */
 	    {
 	      a->nbytes += n;
 	      return n ? n : -1 /*EOF*/;
 	    }
-	  if (buf)
-	    *buf++ = c;
-	  n++;
+	  if (used)
+	    {
+	      buf += used;
+	      n += used;
+	    }
+	  else
+	    {
+	      if (buf)
+		*buf++ = c;
+	      n++;
+	    }
 	}
     }
   while (n < buflen);
@@ -2166,6 +2211,22 @@ iobuf_writebyte (iobuf_t a, unsigned int c)
 }
 
 
+/* Return true if the filter of the output pipeline A neither
+   modifies nor keeps the data passed to it for flushing.  Such
+   filters are given the caller's buffer by iobuf_write.  */
+static int
+filter_is_passthrough (iobuf_t a)
+{
+  return (a->use == IOBUF_OUTPUT
+	  && (a->filter == file_filter
+	      || a->filter == file_es_filter
+#ifdef HAVE_W32_SYSTEM
+	      || a->filter == sock_filter
+#endif
+	      || a->filter == block_filter));
+}
+
+
 int
 iobuf_write (iobuf_t a, const void *buffer, unsigned int buflen)
 {
@@ -2178,6 +2239,28 @@ iobuf_write (iobuf_t a, const void *buffer, unsigned int buflen)
       return -1;
     }
 
+  if (!a->d.len && buflen >= a->d.size && filter_is_passthrough (a))
+    /* The buffer is empty and we have at least a buffer full of data.
+       Instead of copying it to the buffer pass it directly to the
+       filter.  */
+    {
+      size_t len = buflen;
+
+      if (DBG_IOBUF)
+	log_debug ("iobuf-%d.%d: direct flush of %u bytes\n",
+		   a->no, a->subno, buflen);
+      rc = a->filter (a->filter_ov, IOBUFCTRL_FLUSH, a->chain,
+		      (byte *)buf, &len);
+      if (!rc && len != buflen)
+	{
+	  log_info ("filter_flush did not write all!\n");
+	  rc = GPG_ERR_INTERNAL;
+	}
+      else if (rc)
+	a->error = rc;
+      return rc;
+    }
+
   do
     {
       if (buflen && a->d.len < a->d.size)
@@ -2257,8 +2340,10 @@ size_t
 iobuf_copy (iobuf_t dest, iobuf_t source)
 {
   char *temp;
-  /* Use a 32 KB buffer.  */
-  const size_t temp_size = 32 * 1024;
+  /* Use a buffer of the size of the iobuf buffers so that the data
+     is read and written without copying it to the internal
+     buffers.  */
+  const size_t temp_size = iobuf_buffer_size;
 
   size_t nread;
   size_t nwrote = 0;
@@ -202,6 +202,19 @@ struct iobuf_struct
     byte *buf;
   } d;
 
+  /* An external buffer for reading data without copying it through
+     D.BUF.  If iobuf_read is asked for at least as many bytes as fit
+     into D.BUF and D.BUF is empty, it sets BUF and SIZE to the
+     caller's buffer and FILTER then reads directly into that buffer.
+     USED is set to the number of bytes stored there.  Outside of
+     iobuf_read this is always zero.  */
+  struct
+  {
+    byte *buf;
+    size_t size;
+    size_t used;
+  } e_d;
+
   /* When FILTER is called to read some data, it may read some data
      and then return EOF.  We can't return the EOF immediately.
      Instead, we note that we observed the EOF and when the buffer is
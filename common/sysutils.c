@@ -361,6 +361,26 @@ gnupg_usleep (unsigned int usecs)
 }
 
 
+/* Return the number of online processors.  Returns 1 if the number
+ * can't be determined.  */
+unsigned int
+gnupg_get_ncpus (void)
+{
+#ifdef HAVE_W32_SYSTEM
+  SYSTEM_INFO si;
+
+  GetSystemInfo (&si);
+  return si.dwNumberOfProcessors? si.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+  return n > 0? (unsigned int)n : 1;
+#else
+  return 1;
+#endif
+}
+
+
 /* This function is a NOP for POSIX systems but required under Windows
    as the file handles as returned by OS calls (like CreateFile) are
    different from the libc file descriptors (like open). This function
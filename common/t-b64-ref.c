@@ -0,0 +1,293 @@
+/* t-b64-ref.c - Compare the base64 codec with reference implementations
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* b64enc.c computes the OpenPGP CRC with slice-by-8 tables and
+ * encodes whole groups directly from the input; b64dec.c decodes runs
+ * of four characters without its state machine.  This test checks
+ * them against straightforward byte-at-a-time implementations for
+ * random lengths, alignments and chunkings of the input.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "membuf.h"
+
+#define PGM "t-b64-ref"
+
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                      errcount++;                                \
+                      exit (1);                                  \
+                   } while(0)
+
+static int verbose;
+static int errcount;
+
+/* The state of our pseudo random number generator.  We don't use a
+ * real RNG so that a failure can be reproduced.  */
+static unsigned int rndstate = 42;
+
+static unsigned int
+rnd (unsigned int n)
+{
+  rndstate = rndstate * 1103515245 + 12345;
+  return ((rndstate >> 16) & 0x7fff) % n;
+}
+
+
+/* The OpenPGP CRC-24 as given in RFC-4880.  */
+static unsigned int
+ref_crc (const unsigned char *buf, size_t len)
+{
+  unsigned int crc = 0xB704CE;
+  int i;
+
+  while (len--)
+    {
+      crc ^= (*buf++) << 16;
+      for (i = 0; i < 8; i++)
+        {
+          crc <<= 1;
+          if (crc & 0x1000000)
+            crc ^= 0x1864CFB;
+        }
+    }
+  return crc & 0xFFFFFF;
+}
+
+
+/* Append the base64 encoding of the LEN bytes at BUF to MB.  If
+ * LINES is set a linefeed is inserted after each 64 characters and
+ * after the last line.  */
+static void
+ref_encode (membuf_t *mb, const unsigned char *buf, size_t len, int lines)
+{
+  static const char bintoasc[] = ("ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                  "abcdefghijklmnopqrstuvwxyz"
+                                  "0123456789+/");
+  unsigned int val;
+  size_t i, n;
+  int col = 0;
+  char quad[4];
+
+  for (i = 0; i < len; i += 3)
+    {
+      n = len - i < 3? len - i : 3;
+      val = buf[i] << 16;
+      if (n > 1)
+        val |= buf[i+1] << 8;
+      if (n > 2)
+        val |= buf[i+2];
+      quad[0] = bintoasc[(val >> 18) & 63];
+      quad[1] = bintoasc[(val >> 12) & 63];
+      quad[2] = n > 1? bintoasc[(val >> 6) & 63] : '=';
+      quad[3] = n > 2? bintoasc[val & 63] : '=';
+      put_membuf (mb, quad, 4);
+      col += 4;
+      if (lines && col == 64)
+        {
+          put_membuf_str (mb, "\n");
+          col = 0;
+        }
+    }
+  if (lines && col)
+    put_membuf_str (mb, "\n");
+}
+
+
+/* Return the expected output of the encoder for the LEN bytes at BUF
+ * with TITLE.  */
+static char *
+ref_armor (const unsigned char *buf, size_t len, const char *title,
+           size_t *r_len)
+{
+  membuf_t mb;
+  unsigned char crc[3];
+  unsigned int val;
+
+  init_membuf (&mb, 1024);
+  if (len)
+    {
+      put_membuf_str (&mb, "-----BEGIN ");
+      put_membuf_str (&mb, title);
+      put_membuf_str (&mb, "-----\n\n");
+      ref_encode (&mb, buf, len, 1);
+      val = ref_crc (buf, len);
+      crc[0] = val >> 16;
+      crc[1] = val >> 8;
+      crc[2] = val;
+      put_membuf_str (&mb, "=");
+      ref_encode (&mb, crc, 3, 1);
+      put_membuf_str (&mb, "-----END ");
+      put_membuf_str (&mb, title);
+      put_membuf_str (&mb, "-----\n");
+    }
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, r_len);
+}
+
+
+/* Encode the LEN bytes at BUF in random chunks and compare the
+ * result including the CRC with the reference implementation.  */
+static void
+check_encode (const unsigned char *buf, size_t len)
+{
+  struct b64state state;
+  estream_t fp;
+  void *result;
+  size_t resultlen, n, off;
+  char *expected;
+  size_t expectedlen;
+
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    fail (0);
+  if (b64enc_start_es (&state, fp, "PGP MESSAGE"))
+    fail (0);
+  for (off = 0; off < len; off += n)
+    {
+      n = 1 + rnd (len - off < 200? len - off : 200);
+      if (b64enc_write (&state, buf + off, n))
+        fail (0);
+    }
+  if (b64enc_finish (&state))
+    fail (0);
+  if (es_fclose_snatch (fp, &result, &resultlen))
+    fail (0);
+
+  expected = ref_armor (buf, len, "PGP MESSAGE", &expectedlen);
+  if (!expected)
+    fail (0);
+  expectedlen--;  /* Remove the nul.  */
+  if (resultlen != expectedlen || memcmp (result, expected, resultlen))
+    {
+      if (verbose)
+        fprintf (stderr, PGM ": length %u: got\n%.*s\nexpected\n%s\n",
+                 (unsigned int)len, (int)resultlen, (char *)result,
+                 expected);
+      fail ((int)len);
+    }
+  xfree (expected);
+  es_free (result);
+}
+
+
+/* Encode the LEN bytes at BUF with the reference encoder, sprinkle
+ * in white space and decode it in random chunks starting at random
+ * alignments.  The result must be the original data.  */
+static void
+check_decode (const unsigned char *buf, size_t len)
+{
+  static const char spaces[] = " \t\r\n";
+  struct b64state state;
+  membuf_t mb;
+  char *plain, *text;
+  size_t plainlen, textlen, i, n, nbytes, off;
+  unsigned char *work, *out;
+  size_t outlen = 0;
+  gpg_error_t err;
+
+  init_membuf (&mb, 1024);
+  ref_encode (&mb, buf, len, 0);
+  plain = get_membuf (&mb, &plainlen);
+  if (!plain && plainlen)
+    fail (0);
+
+  init_membuf (&mb, 1024);
+  for (i = 0; i < plainlen; i++)
+    {
+      if (!rnd (16))
+        put_membuf (&mb, spaces + rnd (4), 1);
+      put_membuf (&mb, plain + i, 1);
+    }
+  put_membuf (&mb, "\n", 1);
+  text = get_membuf (&mb, &textlen);
+  if (!text)
+    fail (0);
+
+  work = xmalloc (textlen + 8);
+  out = xmalloc (textlen + 1);
+  if (b64dec_start (&state, NULL))
+    fail (0);
+  for (off = 0; off < textlen; off += n)
+    {
+      n = 1 + rnd (textlen - off < 100? textlen - off : 100);
+      i = rnd (8);
+      memcpy (work + i, text + off, n);
+      err = b64dec_proc (&state, work + i, n, &nbytes);
+      if (gpg_err_code (err) == GPG_ERR_EOF)
+        break;
+      if (err)
+        fail ((int)len);
+      memcpy (out + outlen, work + i, nbytes);
+      outlen += nbytes;
+    }
+  if (b64dec_finish (&state))
+    fail ((int)len);
+  if (outlen != len || memcmp (out, buf, len))
+    fail ((int)len);
+
+  xfree (work);
+  xfree (out);
+  xfree (text);
+  xfree (plain);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned char *data;
+  size_t len, i;
+  int round;
+
+  if (argc)
+    { argc--; argv++; }
+  if (argc && !strcmp (argv[0], "--verbose"))
+    {
+      verbose = 1;
+      argc--; argv++;
+    }
+
+  /* Some extra bytes to start at all alignments.  */
+  data = xmalloc (4096 + 8);
+  for (i = 0; i < 4096 + 8; i++)
+    data[i] = rnd (256);
+
+  for (len = 0; len < 70; len++)
+    {
+      check_encode (data + (len & 7), len);
+      check_decode (data + (len & 7), len);
+    }
+  for (round = 0; round < 500; round++)
+    {
+      len = rnd (4096);
+      i = rnd (8);
+      check_encode (data + i, len);
+      check_decode (data + i, len);
+    }
+  if (verbose)
+    fprintf (stderr, PGM ": all tests passed\n");
+
+  xfree (data);
+  return !!errcount;
+}
@@ -0,0 +1,213 @@
+/* t-iobuf-bench.c - Throughput benchmark for iobuf.c
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+
+   As of now this is only a program for manual tests.  It writes a
+   file through a chain of pass-through filters and reads it back the
+   same way.  The filters behave like the armor, compress and cipher
+   filters in that they use iobuf_read and iobuf_write on the next
+   filter in the chain.  Example:
+
+     ./t-iobuf-bench --size 1024 --filters 4 /tmp/bench.tmp
+
+   Running this with a --blocksize below the iobuf buffer size of 64
+   KiB shows the cost of copying the data through the iobuf buffers.
+
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "iobuf.h"
+
+#define PGM "t-iobuf-bench"
+
+static int verbose;
+
+
+/* A filter which passes all data unchanged to or from the next
+ * filter in the chain.  */
+static int
+copy_filter (void *opaque, int control,
+             iobuf_t chain, byte *buf, size_t *ret_len)
+{
+  int n;
+
+  (void)opaque;
+
+  if (control == IOBUFCTRL_UNDERFLOW)
+    {
+      n = iobuf_read (chain, buf, *ret_len);
+      if (n == -1)
+        {
+          *ret_len = 0;
+          return -1;
+        }
+      *ret_len = n;
+    }
+  else if (control == IOBUFCTRL_FLUSH)
+    {
+      if (iobuf_write (chain, buf, *ret_len))
+        return iobuf_error (chain);
+    }
+  else if (control == IOBUFCTRL_DESC)
+    mem2str (buf, "copy_filter", *ret_len);
+
+  return 0;
+}
+
+
+/* Return the current time in seconds.  */
+static double
+timer (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+static void
+report (const char *what, unsigned long mib, double elapsed)
+{
+  printf ("%-6s %6lu MiB in %7.3f s = %8.1f MiB/s\n",
+          what, mib, elapsed, elapsed > 0? mib / elapsed : 0.0);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned long mib = 256;
+  unsigned int blocksize = 64 * 1024;
+  int nfilters = 4;
+  const char *fname = PGM ".tmp";
+  unsigned long long total, n;
+  iobuf_t a;
+  char *block;
+  double start;
+  int i, nread;
+
+  if (argc)
+    { argc--; argv++; }
+  while (argc && **argv == '-')
+    {
+      if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--size") && argc > 1)
+        {
+          mib = strtoul (argv[1], NULL, 10);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--blocksize") && argc > 1)
+        {
+          blocksize = strtoul (argv[1], NULL, 10);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--filters") && argc > 1)
+        {
+          nfilters = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else
+        {
+          fprintf (stderr, "usage: " PGM " [--verbose] [--size MIB]"
+                   " [--blocksize N] [--filters N] [FILE]\n");
+          return 1;
+        }
+    }
+  if (argc)
+    fname = *argv;
+  if (!blocksize)
+    blocksize = 1;
+
+  block = xmalloc (blocksize);
+  for (i=0; i < blocksize; i++)
+    block[i] = i;
+  total = (unsigned long long)mib * 1024 * 1024;
+
+  if (verbose)
+    printf ("file=%s size=%lu MiB blocksize=%u filters=%d\n",
+            fname, mib, blocksize, nfilters);
+
+  /* Write the file.  */
+  a = iobuf_create (fname, 0);
+  if (!a)
+    {
+      fprintf (stderr, PGM ": can't create '%s': %s\n",
+               fname, strerror (errno));
+      return 1;
+    }
+  iobuf_ioctl (a, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+  for (i=0; i < nfilters; i++)
+    iobuf_push_filter (a, copy_filter, NULL);
+  start = timer ();
+  for (n=0; n < total; n += blocksize)
+    if (iobuf_write (a, block,
+                     total - n < blocksize? total - n : blocksize))
+      {
+        fprintf (stderr, PGM ": error writing '%s': %s\n",
+                 fname, gpg_strerror (iobuf_error (a)));
+        return 1;
+      }
+  if (iobuf_close (a))
+    {
+      fprintf (stderr, PGM ": error closing '%s'\n", fname);
+      return 1;
+    }
+  report ("write", mib, timer () - start);
+
+  /* Read it back.  */
+  a = iobuf_open (fname);
+  if (!a)
+    {
+      fprintf (stderr, PGM ": can't open '%s': %s\n",
+               fname, strerror (errno));
+      return 1;
+    }
+  iobuf_ioctl (a, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+  for (i=0; i < nfilters; i++)
+    iobuf_push_filter (a, copy_filter, NULL);
+  start = timer ();
+  n = 0;
+  while ((nread = iobuf_read (a, block, blocksize)) != -1)
+    n += nread;
+  report ("read", mib, timer () - start);
+  iobuf_close (a);
+  gnupg_remove (fname);
+
+  if (n != total)
+    {
+      fprintf (stderr, PGM ": read %llu bytes but expected %llu\n",
+               n, total);
+      return 1;
+    }
+
+  xfree (block);
+  return 0;
+}
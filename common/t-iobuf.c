@@ -320,6 +320,61 @@ main (int argc, char *argv[])
     free (state);
   }
 
+  {
+    /* Large reads are stored directly in the caller's buffer.  Check
+       that this gives the same data and EOF semantics as reading
+       through the iobuf's own buffer:
+       - 200000 characters, EOF
+       - 17 characters, EOF
+     */
+    char *content = "abcdefghijklmnopq";
+    char *content2;
+    char *buffer;
+    const int bigsize = 200000;
+    iobuf_t iobuf;
+    int rc;
+    int i;
+    int n;
+    struct content_filter_state *state;
+
+    content2 = malloc (bigsize + 1);
+    assert (content2);
+    for (i = 0; i < bigsize; i ++)
+      content2[i] = 'A' + i % 26;
+    content2[bigsize] = 0;
+    buffer = malloc (bigsize);
+    assert (buffer);
+
+    iobuf = iobuf_temp_with_content (content, strlen(content));
+    rc = iobuf_push_filter (iobuf,
+			    content_filter,
+                            state=content_filter_new (content2));
+    assert (rc == 0);
+
+    /* A small read fills the iobuf's buffer.  The large read drains
+       it and reads the rest directly.  */
+    n = iobuf_read (iobuf, buffer, 100);
+    assert (n == 100);
+    n = iobuf_read (iobuf, buffer + 100, bigsize - 100);
+    assert (n == bigsize - 100);
+    assert (memcmp (buffer, content2, bigsize) == 0);
+
+    n = iobuf_read (iobuf, buffer, bigsize);
+    assert (n == -1);
+
+    n = iobuf_read (iobuf, buffer, bigsize);
+    assert (n == strlen (content));
+    assert (memcmp (buffer, content, n) == 0);
+
+    n = iobuf_read (iobuf, buffer, bigsize);
+    assert (n == -1);
+
+    iobuf_close (iobuf);
+    free (state);
+    free (buffer);
+    free (content2);
+  }
+
   /* Write some data to a temporary filter.  Push a new filter.  The
      already written data should not be processed by the new
      filter.  */
@@ -106,6 +106,8 @@
 #define mkdir(a,b) mkdir(a)
 #endif
 
+#include <npth.h>
+
 #include "dirmngr.h"
 #include "validate.h"
 #include "certcache.h"
@@ -125,6 +127,11 @@
    idea anyway to limit the number of opened cache files. */
 #define MAX_OPEN_DB_FILES 5
 
+/* The number of CRLs we may refresh at one time in the background
+   and the minimum time between two refreshes of the same CRL.  */
+#define MAX_CRL_REFRESH_THREADS 4
+#define CRL_REFRESH_INTERVAL (30*60)
+
 #ifndef O_BINARY
 # define O_BINARY 0
 #endif
@@ -152,6 +159,8 @@ struct crl_cache_entry_s
   ksba_isotime_t this_update;
   ksba_isotime_t next_update;
   ksba_isotime_t last_refresh; /* Use for the force_crl_refresh feature. */
+  ksba_isotime_t last_refresh_attempt; /* Time a background refresh has
+                                          last been scheduled.  */
   char *crl_number;
   char *authority_issuer;
   char *authority_serialno;
@@ -184,6 +193,11 @@ static crl_cache_entry_t find_entry (crl_cache_entry_t first,
    right at startup.  */
 static crl_cache_t current_cache;
 
+/* The issuer hashes of the CRLs which are scheduled for a refresh
+   or are being refreshed in the background.  An empty string marks
+   an unused slot.  */
+static char crl_refresh_slots[MAX_CRL_REFRESH_THREADS][41];
+
 
 
 
@@ -1976,7 +1990,7 @@ get_auth_key_id (ksba_crl_t crl, char **serialno)
 gpg_error_t
 crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
 {
-  crl_cache_t cache = get_current_cache ();
+  crl_cache_t cache;
   gpg_error_t err, err2;
   ksba_crl_t crl;
   char *fname = NULL;
@@ -2147,6 +2161,11 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
     }
 
 
+  /* Reading the CRL may have taken a long time during which the
+     cache might have been flushed; thus we get the cache object only
+     now.  */
+  cache = get_current_cache ();
+
   /* Create an hex encoded SHA-1 hash of the issuer DN to be
      used as the key for the cache. */
   issuer_hash = hashify_data (issuer, strlen (issuer));
@@ -2589,3 +2608,203 @@ crl_cache_reload_crl (ctrl_t ctrl, ksba_cert_t cert)
   ksba_free (issuer);
   return err;
 }
+
+
+/* The parameter for crl_refresh_thread.  */
+struct crl_refresh_parm_s
+{
+  int slot;           /* Our index into CRL_REFRESH_SLOTS.  */
+  char url[1];        /* The URL of the CRL.  */
+};
+
+
+/* Thread to fetch a new CRL and to put it into the cache.  The old
+   CRL is used for lookups until the new one has been stored.  */
+static void *
+crl_refresh_thread (void *arg)
+{
+  struct crl_refresh_parm_s *parm = arg;
+  struct server_control_s ctrlbuf;
+  ksba_reader_t reader;
+  gpg_error_t err;
+
+  memset (&ctrlbuf, 0, sizeof ctrlbuf);
+  dirmngr_init_default_ctrl (&ctrlbuf);
+
+  if (opt.verbose)
+    log_info ("refreshing CRL from '%s'\n", parm->url);
+  err = crl_fetch (&ctrlbuf, parm->url, &reader);
+  if (!err)
+    {
+      err = crl_cache_insert (&ctrlbuf, parm->url, reader);
+      crl_close_reader (reader);
+    }
+  if (err)
+    log_error (_("error refreshing CRL from '%s': %s\n"),
+               parm->url, gpg_strerror (err));
+  else if (opt.verbose)
+    log_info ("CRL from '%s' refreshed\n", parm->url);
+
+  *crl_refresh_slots[parm->slot] = 0;
+  dirmngr_deinit_default_ctrl (&ctrlbuf);
+  xfree (parm);
+  return NULL;
+}
+
+
+/* Workqueue task to refresh the CRL of the issuer ISSUER_HASH.  The
+   actual work is done by a new thread so that several CRLs can be
+   fetched at the same time.  */
+static const char *
+task_refresh_crl (ctrl_t ctrl, const char *issuer_hash)
+{
+  crl_cache_entry_t entry;
+  struct crl_refresh_parm_s *parm;
+  npth_t thread;
+  npth_attr_t tattr;
+  int slot, rc;
+
+  if (!ctrl || !issuer_hash)
+    return "refresh_crl";
+
+  for (slot=0; slot < MAX_CRL_REFRESH_THREADS; slot++)
+    if (!strcmp (crl_refresh_slots[slot], issuer_hash))
+      break;
+  if (slot == MAX_CRL_REFRESH_THREADS)
+    return NULL;  /* Oops - not scheduled by us.  */
+
+  /* The cache may have been flushed in the meantime.  */
+  entry = current_cache? find_entry (current_cache->entries, issuer_hash)
+    /**/               : NULL;
+  parm = entry? xtrymalloc (sizeof *parm + strlen (entry->url)) : NULL;
+  if (!parm)
+    {
+      *crl_refresh_slots[slot] = 0;
+      return NULL;
+    }
+  parm->slot = slot;
+  strcpy (parm->url, entry->url);
+
+  rc = npth_attr_init (&tattr);
+  if (!rc)
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+      rc = npth_create (&thread, &tattr, crl_refresh_thread, parm);
+      npth_attr_destroy (&tattr);
+    }
+  if (rc)
+    {
+      log_error ("error spawning CRL refresh thread: %s\n", strerror (rc));
+      *crl_refresh_slots[slot] = 0;
+      xfree (parm);
+    }
+  return NULL;
+}
+
+
+/* Return true if the background refresh of entry E at CURRENT_TIME
+   is too early after the last one.  */
+static int
+refreshed_recently (crl_cache_entry_t e, const ksba_isotime_t current_time)
+{
+  gnupg_isotime_t tmptime;
+
+  if (*e->last_refresh)
+    {
+      gnupg_copy_time (tmptime, e->last_refresh);
+      add_seconds_to_isotime (tmptime, CRL_REFRESH_INTERVAL);
+      if (strcmp (tmptime, current_time) > 0)
+        return 1;
+    }
+  if (*e->last_refresh_attempt)
+    {
+      gnupg_copy_time (tmptime, e->last_refresh_attempt);
+      add_seconds_to_isotime (tmptime, CRL_REFRESH_INTERVAL);
+      if (strcmp (tmptime, current_time) > 0)
+        return 1;
+    }
+  return 0;
+}
+
+
+/* Schedule a refresh of all cached CRLs which expire within the next
+   opt.crl_prefetch_period seconds.  This is called by the
+   housekeeping thread.  */
+void
+crl_cache_schedule_refresh (void)
+{
+  crl_cache_entry_t e;
+  gnupg_isotime_t current_time, limit;
+  struct {
+    int slot;
+    char issuer_hash[41];
+    ksba_isotime_t next_update;
+  } todo[MAX_CRL_REFRESH_THREADS];
+  int ntodo, slot, i;
+
+  if (!current_cache || !opt.crl_prefetch_period)
+    return;
+
+  gnupg_get_isotime (current_time);
+  gnupg_copy_time (limit, current_time);
+  add_seconds_to_isotime (limit, opt.crl_prefetch_period);
+
+  /* First collect the CRLs to refresh and reserve their slots.  This
+     loop must not yield because another thread may change the cache
+     in the meantime.  */
+  ntodo = 0;
+  for (e = current_cache->entries; e; e = e->next)
+    {
+      if (e->deleted || e->invalid
+          || strlen (e->issuer_hash) >= sizeof *crl_refresh_slots)
+        continue;
+      /* Only CRLs from a distribution point can be fetched again.  */
+      if (!strncmp (e->url, "http:", 5) || !strncmp (e->url, "https:", 6))
+        {
+          if (opt.ignore_http_dp)
+            continue;
+        }
+      else if (!strncmp (e->url, "ldap:", 5) || !strncmp (e->url, "ldaps:", 6))
+        {
+          if (opt.ignore_ldap_dp)
+            continue;
+        }
+      else
+        continue;
+      /* Expired CRLs are fetched on demand.  */
+      if (strcmp (e->next_update, current_time) <= 0
+          || strcmp (e->next_update, limit) > 0)
+        continue;
+      /* Do not retry a failed refresh at each run.  */
+      if (refreshed_recently (e, current_time))
+        continue;
+
+      /* Skip if already scheduled and look for a free slot.  */
+      for (slot=0; slot < MAX_CRL_REFRESH_THREADS; slot++)
+        if (!strcmp (crl_refresh_slots[slot], e->issuer_hash))
+          break;
+      if (slot < MAX_CRL_REFRESH_THREADS)
+        continue;
+      for (slot=0; slot < MAX_CRL_REFRESH_THREADS; slot++)
+        if (!*crl_refresh_slots[slot])
+          break;
+      if (slot == MAX_CRL_REFRESH_THREADS)
+        break;  /* All busy; the others are done at the next run.  */
+
+      strcpy (crl_refresh_slots[slot], e->issuer_hash);
+      gnupg_copy_time (e->last_refresh_attempt, current_time);
+      todo[ntodo].slot = slot;
+      strcpy (todo[ntodo].issuer_hash, e->issuer_hash);
+      gnupg_copy_time (todo[ntodo].next_update, e->next_update);
+      ntodo++;
+    }
+
+  for (i=0; i < ntodo; i++)
+    {
+      if (opt.verbose)
+        log_info ("CRL for issuer id %s expires at %s - scheduling refresh\n",
+                  todo[i].issuer_hash, todo[i].next_update);
+      if (workqueue_add_task (task_refresh_crl, todo[i].issuer_hash, 0, 0))
+        *crl_refresh_slots[todo[i].slot] = 0;
+    }
+}
@@ -131,6 +131,7 @@ enum cmd_and_opt_values {
   oOCSPMaxClockSkew,
   oOCSPMaxPeriod,
   oOCSPCurrentPeriod,
+  oCRLPrefetchPeriod,
   oMaxReplies,
   oHkpCaCert,
   oFakedSystemTime,
@@ -151,6 +152,8 @@ enum cmd_and_opt_values {
   oResolverTimeout,
   oConnectTimeout,
   oConnectQuickTimeout,
+  oKeepAliveTimeout,
+  oDnsCacheSize,
   oListenBacklog,
   aTest
 };
@@ -222,6 +225,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_i (oOCSPMaxClockSkew, "ocsp-max-clock-skew", "@"),
   ARGPARSE_s_i (oOCSPMaxPeriod,    "ocsp-max-period", "@"),
   ARGPARSE_s_i (oOCSPCurrentPeriod, "ocsp-current-period", "@"),
+  ARGPARSE_s_i (oCRLPrefetchPeriod, "crl-prefetch-period", "@"),
 
   ARGPARSE_s_i (oMaxReplies, "max-replies",
                 N_("|N|do not return more than N items in one query")),
@@ -257,6 +261,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_i (oResolverTimeout, "resolver-timeout", "@"),
   ARGPARSE_s_i (oConnectTimeout, "connect-timeout", "@"),
   ARGPARSE_s_i (oConnectQuickTimeout, "connect-quick-timeout", "@"),
+  ARGPARSE_s_i (oKeepAliveTimeout, "keep-alive-timeout", "@"),
+  ARGPARSE_s_i (oDnsCacheSize, "dns-cache-size", "@"),
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
 
   ARGPARSE_group (302,N_("@\n(See the \"info\" manual for a complete listing "
@@ -284,9 +290,12 @@ static struct debug_flags_s debug_flags [] =
 
 #define DEFAULT_MAX_REPLIES 10
 #define DEFAULT_LDAP_TIMEOUT 15  /* seconds */
+#define DEFAULT_CRL_PREFETCH_PERIOD (60*60)  /* 1 hour */
 
 #define DEFAULT_CONNECT_TIMEOUT       (15*1000)  /* 15 seconds */
 #define DEFAULT_CONNECT_QUICK_TIMEOUT ( 2*1000)  /*  2 seconds */
+#define DEFAULT_KEEP_ALIVE_TIMEOUT    30         /* 30 seconds */
+#define DEFAULT_DNS_CACHE_SIZE        1000       /* entries */
 
 /* For the cleanup handler we need to keep track of the socket's name.  */
 static const char *socket_name;
@@ -611,6 +620,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.ocsp_max_clock_skew = 10 * 60;      /* 10 minutes.  */
       opt.ocsp_max_period = 90 * 86400;       /* 90 days.  */
       opt.ocsp_current_period = 3 * 60 * 60;  /* 3 hours. */
+      opt.crl_prefetch_period = DEFAULT_CRL_PREFETCH_PERIOD;
       opt.max_replies = DEFAULT_MAX_REPLIES;
       while (opt.ocsp_signer)
         {
@@ -630,6 +640,8 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       set_dns_timeout (0);
       opt.connect_timeout = 0;
       opt.connect_quick_timeout = 0;
+      opt.keep_alive_timeout = DEFAULT_KEEP_ALIVE_TIMEOUT;
+      opt.dns_cache_size = DEFAULT_DNS_CACHE_SIZE;
       return 1;
     }
 
@@ -686,6 +698,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
     case oOCSPMaxClockSkew: opt.ocsp_max_clock_skew = pargs->r.ret_int; break;
     case oOCSPMaxPeriod: opt.ocsp_max_period = pargs->r.ret_int; break;
     case oOCSPCurrentPeriod: opt.ocsp_current_period = pargs->r.ret_int; break;
+    case oCRLPrefetchPeriod: opt.crl_prefetch_period = pargs->r.ret_int; break;
 
     case oMaxReplies: opt.max_replies = pargs->r.ret_int; break;
 
@@ -739,6 +752,14 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.connect_quick_timeout = pargs->r.ret_ulong * 1000;
       break;
 
+    case oKeepAliveTimeout:
+      opt.keep_alive_timeout = pargs->r.ret_ulong;
+      break;
+
+    case oDnsCacheSize:
+      opt.dns_cache_size = pargs->r.ret_ulong;
+      break;
+
     default:
       return 0; /* Not handled. */
     }
@@ -762,6 +783,8 @@ post_option_parsing (void)
   if (opt.connect_quick_timeout > opt.connect_timeout)
     opt.connect_quick_timeout = opt.connect_timeout;
 
+  http_set_keep_alive_timeout (opt.keep_alive_timeout);
+  set_dns_cache_size (opt.dns_cache_size);
   set_debug ();
   set_tor_mode ();
 }
@@ -1958,6 +1981,8 @@ housekeeping_thread (void *arg)
   dirmngr_init_default_ctrl (&ctrlbuf);
 
   ks_hkp_housekeeping (curtime);
+  http_expire_idle_connections ();
+  crl_cache_schedule_refresh ();
   if (network_activity_seen)
     {
       network_activity_seen = 0;
@@ -101,6 +101,10 @@ struct
 
   unsigned int connect_timeout;       /* Timeout for connect.  */
   unsigned int connect_quick_timeout; /* Shorter timeout for connect.  */
+  unsigned int keep_alive_timeout;    /* Seconds to keep idle
+                                         connections.  */
+  unsigned int dns_cache_size;        /* Max. number of cached DNS
+                                         answers.  */
 
   int disable_http;       /* Do not use HTTP at all.  */
   int disable_ldap;       /* Do not use LDAP at all.  */
@@ -138,6 +142,10 @@ struct
   unsigned int ocsp_current_period; /* Seconds a response is considered
                                        current after nextUpdate. */
 
+  unsigned int crl_prefetch_period; /* Seconds before nextUpdate at which
+                                       a CRL is refreshed in the
+                                       background.  */
+
   strlist_t keyserver;              /* List of default keyservers.  */
 } opt;
 
@@ -117,6 +117,22 @@
 
 #define RESOLV_CONF_NAME "/etc/resolv.conf"
 
+/* The default maximum number of entries in the DNS cache.  */
+#define DEFAULT_DNS_CACHE_SIZE 1000
+
+/* The number of buckets of the DNS cache's hash table.  */
+#define DNS_CACHE_BUCKETS 256
+
+/* The maximum time in seconds an answer is cached.  */
+#define DNS_CACHE_MAX_TTL 3600
+
+/* The time in seconds an address lookup is cached.  The resolver
+ * interfaces used for them do not tell us the TTL.  */
+#define DNS_CACHE_ADDR_TTL 300
+
+/* The time in seconds negative answers are cached.  */
+#define DNS_CACHE_NEG_TTL 60
+
 /* Two flags to enable verbose and debug mode.  */
 static int opt_verbose;
 static int opt_debug;
@@ -149,6 +165,62 @@ static char tor_nameserver[40+20];
 static char tor_socks_user[30];
 static char tor_socks_password[20];
 
+/* The name of the resolver configuration file or NULL for the
+ * default.  */
+static char *resolv_conf_name;
+
+
+/* The types of the DNS cache entries.  */
+enum dns_cache_types
+  {
+    DNS_CACHE_ADDR,   /* Result of resolve_dns_name.  */
+    DNS_CACHE_SRV,    /* SRV records for get_dns_srv.  */
+    DNS_CACHE_CERT    /* Result of get_dns_cert.  */
+  };
+
+/* An entry of the DNS cache.  */
+struct dns_cache_item_s
+{
+  struct dns_cache_item_s *next;
+  enum dns_cache_types type;
+  unsigned int subtype;    /* Further parameters of the query.  */
+  time_t expires;          /* The entry is not used after this time.  */
+  gpg_error_t err;         /* Error code of a negative entry.  */
+
+  dns_addrinfo_t dai;      /* DNS_CACHE_ADDR: The addresses and the */
+  char *canonname;         /* canonical name or NULL.               */
+
+  struct srventry *srvs;   /* DNS_CACHE_SRV: The records as returned */
+  unsigned int nsrvs;      /* by the resolver.                       */
+
+  void *key;               /* DNS_CACHE_CERT: The values as returned */
+  size_t keylen;           /* by get_dns_cert.                       */
+  unsigned char *fpr;
+  size_t fprlen;
+  char *url;
+
+  char name[1];            /* The queried name.  */
+};
+typedef struct dns_cache_item_s *dns_cache_item_t;
+
+/* The DNS cache is shared by all connections.  Access to it is not
+ * protected by a lock: nPth switches threads only in calls which may
+ * block, for example when writing a log line.  Thus no such call may
+ * be made while the cache is modified or an entry is used.  An entry
+ * returned by dns_cache_get must be copied before anything is
+ * logged.  */
+static dns_cache_item_t dns_cache[DNS_CACHE_BUCKETS];
+
+/* The maximum number of entries in the cache; 0 disables it.  */
+static unsigned int dns_cache_size = DEFAULT_DNS_CACHE_SIZE;
+
+/* The statistics of the cache.  The ENTRIES and SIZE fields are not
+ * used here.  */
+static struct dns_cache_stats_s dns_cache_stats;
+
+/* The current number of entries in the cache.  */
+static unsigned int dns_cache_count;
+
 
 #ifdef USE_LIBDNS
 /* Libdns global data.  */
@@ -227,6 +299,8 @@ enable_dns_tormode (int new_circuit)
                       "p%u", counter);
       counter++;
     }
+  if (!tor_mode)
+    flush_dns_cache ();
   tor_mode = 1;
 }
 
@@ -235,6 +309,8 @@ enable_dns_tormode (int new_circuit)
 void
 disable_dns_tormode (void)
 {
+  if (tor_mode)
+    flush_dns_cache ();
   tor_mode = 0;
 }
 
@@ -253,6 +329,8 @@ set_dns_verbose (int verbose, int debug)
 void
 set_dns_disable_ipv4 (int yes)
 {
+  if (opt_disable_ipv4 != !!yes)
+    flush_dns_cache ();
   opt_disable_ipv4 = !!yes;
 }
 
@@ -262,6 +340,8 @@ set_dns_disable_ipv4 (int yes)
 void
 set_dns_disable_ipv6 (int yes)
 {
+  if (opt_disable_ipv6 != !!yes)
+    flush_dns_cache ();
   opt_disable_ipv6 = !!yes;
 }
 
@@ -298,6 +378,21 @@ set_dns_nameserver (const char *ipaddr)
 }
 
 
+/* Use the resolver configuration file FNAME instead of the standard
+ * one.  This is only used by the regression tests; NULL reverts to
+ * the standard file.  */
+void
+set_dns_resolv_conf (const char *fname)
+{
+  xfree (resolv_conf_name);
+  resolv_conf_name = fname? xstrdup (fname) : NULL;
+  flush_dns_cache ();
+#ifdef USE_LIBDNS
+  libdns_reinit_pending = 1;
+#endif
+}
+
+
 /* Free an addressinfo linked list as returned by resolve_dns_name.  */
 void
 free_dns_addrinfo (dns_addrinfo_t ai)
@@ -311,6 +406,254 @@ free_dns_addrinfo (dns_addrinfo_t ai)
 }
 
 
+/* Return a copy of the addressinfo list AI or NULL with ERRNO set.  */
+static dns_addrinfo_t
+copy_dns_addrinfo (dns_addrinfo_t ai)
+{
+  dns_addrinfo_t head = NULL;
+  dns_addrinfo_t *tail = &head;
+
+  for (; ai; ai = ai->next)
+    {
+      *tail = xtrymalloc (sizeof **tail);
+      if (!*tail)
+        {
+          free_dns_addrinfo (head);
+          return NULL;
+        }
+      memcpy (*tail, ai, sizeof **tail);
+      (*tail)->next = NULL;
+      tail = &(*tail)->next;
+    }
+  return head;
+}
+
+
+/* Set the maximum number of entries in the DNS cache to N.  A value
+ * of 0 disables the cache.  */
+void
+set_dns_cache_size (unsigned int n)
+{
+  if (n < dns_cache_count)
+    flush_dns_cache ();
+  dns_cache_size = n;
+}
+
+
+/* Release the cache entry ITEM.  */
+static void
+release_dns_cache_item (dns_cache_item_t item)
+{
+  if (!item)
+    return;
+  free_dns_addrinfo (item->dai);
+  xfree (item->canonname);
+  xfree (item->srvs);
+  xfree (item->key);
+  xfree (item->fpr);
+  xfree (item->url);
+  xfree (item);
+}
+
+
+/* Remove all entries from the DNS cache.  */
+void
+flush_dns_cache (void)
+{
+  dns_cache_item_t item, next;
+  int i;
+
+  for (i=0; i < DNS_CACHE_BUCKETS; i++)
+    {
+      for (item = dns_cache[i]; item; item = next)
+        {
+          next = item->next;
+          release_dns_cache_item (item);
+        }
+      dns_cache[i] = NULL;
+    }
+  dns_cache_count = 0;
+  if (opt_debug)
+    log_debug ("dns: cache flushed\n");
+}
+
+
+/* Store the statistics of the DNS cache at STATS.  */
+void
+get_dns_cache_stats (struct dns_cache_stats_s *stats)
+{
+  *stats = dns_cache_stats;
+  stats->entries = dns_cache_count;
+  stats->size = dns_cache_size;
+}
+
+
+/* Return the hash bucket for the query (TYPE,SUBTYPE,NAME).  */
+static unsigned int
+dns_cache_bucket (enum dns_cache_types type, unsigned int subtype,
+                  const char *name)
+{
+  unsigned int hash = type * 31 + subtype;
+  const unsigned char *s;
+
+  for (s = (const unsigned char *)name; *s; s++)
+    hash = hash * 33 + ascii_tolower (*s);
+  return hash % DNS_CACHE_BUCKETS;
+}
+
+
+/* Return true if ERR is a definite answer that NAME does not exist or
+ * has no records of the requested type.  Only such errors are cached
+ * and not for example timeouts.  */
+static int
+dns_cache_negative_p (gpg_error_t err)
+{
+  switch (gpg_err_code (err))
+    {
+    case GPG_ERR_NO_NAME:
+    case GPG_ERR_NOT_FOUND:
+    case GPG_ERR_NO_DATA:
+    case GPG_ERR_ENOENT:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+
+/* Look up the query (TYPE,SUBTYPE,NAME) in the DNS cache and return
+ * the entry or NULL if it is not cached.  Expired entries of the
+ * bucket are removed on the way.  The entry is only valid until the
+ * thread yields; see above.  */
+static dns_cache_item_t
+dns_cache_get (enum dns_cache_types type, unsigned int subtype,
+               const char *name)
+{
+  dns_cache_item_t item, *itemp;
+  unsigned int bucket;
+  time_t now;
+
+  if (!dns_cache_size)
+    return NULL;
+
+  now = gnupg_get_time ();
+  bucket = dns_cache_bucket (type, subtype, name);
+  for (itemp = &dns_cache[bucket]; (item = *itemp); )
+    {
+      if (item->expires <= now)
+        {
+          *itemp = item->next;
+          release_dns_cache_item (item);
+          dns_cache_count--;
+          dns_cache_stats.expired++;
+          continue;
+        }
+      if (item->type == type && item->subtype == subtype
+          && !ascii_strcasecmp (item->name, name))
+        {
+          if (item->err)
+            dns_cache_stats.neghits++;
+          else
+            dns_cache_stats.hits++;
+          return item;
+        }
+      itemp = &item->next;
+    }
+
+  dns_cache_stats.misses++;
+  return NULL;
+}
+
+
+/* Create a new cache entry for the query (TYPE,SUBTYPE,NAME) with
+ * the error code ERR.  Returns NULL if the cache is disabled or on
+ * memory shortage.  */
+static dns_cache_item_t
+dns_cache_new_item (enum dns_cache_types type, unsigned int subtype,
+                    const char *name, gpg_error_t err)
+{
+  dns_cache_item_t item;
+
+  if (!dns_cache_size)
+    return NULL;
+  item = xtrycalloc (1, sizeof *item + strlen (name));
+  if (!item)
+    return NULL;
+  item->type = type;
+  item->subtype = subtype;
+  item->err = err;
+  strcpy (item->name, name);
+  return item;
+}
+
+
+/* Remove the entry which expires first from the cache.  */
+static void
+dns_cache_evict (void)
+{
+  dns_cache_item_t item, *itemp, *oldest = NULL;
+  int i;
+
+  for (i=0; i < DNS_CACHE_BUCKETS; i++)
+    for (itemp = &dns_cache[i]; (item = *itemp); itemp = &item->next)
+      if (!oldest || item->expires < (*oldest)->expires)
+        oldest = itemp;
+
+  if (oldest)
+    {
+      item = *oldest;
+      *oldest = item->next;
+      release_dns_cache_item (item);
+      dns_cache_count--;
+      dns_cache_stats.evicted++;
+    }
+}
+
+
+/* Insert ITEM into the DNS cache; it is valid for TTL seconds.  ITEM
+ * is released if it can't be cached.  An existing entry for the same
+ * query is replaced.  */
+static void
+dns_cache_put (dns_cache_item_t item, unsigned int ttl)
+{
+  dns_cache_item_t old, *itemp;
+  unsigned int bucket;
+
+  if (!item)
+    return;
+  if (!dns_cache_size || !ttl)
+    {
+      release_dns_cache_item (item);
+      return;
+    }
+  if (ttl > DNS_CACHE_MAX_TTL)
+    ttl = DNS_CACHE_MAX_TTL;
+  item->expires = gnupg_get_time () + ttl;
+  /* Log now, while ITEM is not yet shared.  */
+  if (opt_debug)
+    log_debug ("dns: caching %s for '%s' (%us)\n",
+               item->err? "negative answer":"answer", item->name, ttl);
+
+  bucket = dns_cache_bucket (item->type, item->subtype, item->name);
+  for (itemp = &dns_cache[bucket]; (old = *itemp); itemp = &old->next)
+    if (old->type == item->type && old->subtype == item->subtype
+        && !ascii_strcasecmp (old->name, item->name))
+      {
+        *itemp = old->next;
+        release_dns_cache_item (old);
+        dns_cache_count--;
+        break;
+      }
+
+  while (dns_cache_count >= dns_cache_size)
+    dns_cache_evict ();
+
+  item->next = dns_cache[bucket];
+  dns_cache[bucket] = item;
+  dns_cache_count++;
+}
+
+
 #ifndef HAVE_W32_SYSTEM
 /* Return H_ERRNO mapped to a gpg-error code.  Will never return 0. */
 static gpg_error_t
@@ -406,7 +749,7 @@ resolv_conf_changed_p (void)
   return 0;
 #else
   static time_t last_mtime;
-  const char *fname = RESOLV_CONF_NAME;
+  const char *fname = resolv_conf_name? resolv_conf_name : RESOLV_CONF_NAME;
   struct stat statbuf;
   int changed = 0;
 
@@ -535,7 +878,7 @@ libdns_init (ctrl_t ctrl)
 
 #else /* Unix */
 
-      fname = RESOLV_CONF_NAME;
+      fname = resolv_conf_name? resolv_conf_name : RESOLV_CONF_NAME;
       resolv_conf_changed_p (); /* Reset timestamp.  */
       err = libdns_error_to_gpg_error
         (dns_resconf_loadpath (ld.resolv_conf, fname));
@@ -672,6 +1015,8 @@ libdns_deinit (void)
 void
 reload_dns_stuff (int force)
 {
+  flush_dns_cache ();
+
 #ifdef USE_LIBDNS
   if (force)
     {
@@ -710,6 +1055,7 @@ libdns_res_open (ctrl_t ctrl, struct dns_resolver **r_res)
       if (opt_debug)
         log_debug ("dns: resolv.conf changed - forcing reload\n");
       libdns_reinit_pending = 1;
+      flush_dns_cache ();
     }
 
   if (libdns_reinit_pending)
@@ -1073,6 +1419,36 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
                   dns_addrinfo_t *r_ai, char **r_canonname)
 {
   gpg_error_t err;
+  dns_cache_item_t item = NULL;
+  unsigned int subtype;
+
+  /* The cache key covers all parameters of the query.  */
+  subtype = ((port << 16) | ((want_family & 0xff) << 8)
+             | ((want_socktype & 0x7f) << 1) | !!r_canonname);
+  if (!is_ip_address (name)
+      && (item = dns_cache_get (DNS_CACHE_ADDR, subtype, name)))
+    {
+      *r_ai = NULL;
+      if (r_canonname)
+        *r_canonname = NULL;
+      err = item->err;
+      if (!err)
+        {
+          *r_ai = copy_dns_addrinfo (item->dai);
+          if (!*r_ai)
+            err = gpg_error_from_syserror ();
+          else if (r_canonname && item->canonname
+                   && !(*r_canonname = xtrystrdup (item->canonname)))
+            {
+              err = gpg_error_from_syserror ();
+              free_dns_addrinfo (*r_ai);
+              *r_ai = NULL;
+            }
+        }
+      if (opt_debug)
+        log_debug ("dns: cache hit for '%s'\n", name);
+      goto leave;
+    }
 
 #ifdef USE_LIBDNS
   if (!standard_resolver)
@@ -1087,6 +1463,26 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
 #endif /*USE_LIBDNS*/
     err = resolve_name_standard (ctrl, name, port, want_family, want_socktype,
                                  r_ai, r_canonname);
+
+  if (!is_ip_address (name)
+      && (!err || dns_cache_negative_p (err))
+      && (item = dns_cache_new_item (DNS_CACHE_ADDR, subtype, name, err)))
+    {
+      if (!err)
+        {
+          item->dai = copy_dns_addrinfo (*r_ai);
+          if (r_canonname && *r_canonname)
+            item->canonname = xtrystrdup (*r_canonname);
+          if (!item->dai || (r_canonname && *r_canonname && !item->canonname))
+            {
+              release_dns_cache_item (item);
+              item = NULL;
+            }
+        }
+      dns_cache_put (item, err? DNS_CACHE_NEG_TTL : DNS_CACHE_ADDR_TTL);
+    }
+
+ leave:
   if (opt_debug)
     log_debug ("dns: resolve_dns_name(%s): %s\n", name, gpg_strerror (err));
   return err;
@@ -1405,7 +1801,8 @@ is_onion_address (const char *name)
 static gpg_error_t
 get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
                      void **r_key, size_t *r_keylen,
-                     unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
+                     unsigned char **r_fpr, size_t *r_fprlen, char **r_url,
+                     unsigned int *r_ttl)
 {
   gpg_error_t err;
   struct dns_resolver *res = NULL;
@@ -1471,6 +1868,9 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
       unsigned short len = rr.rd.len;
       u16 subtype;
 
+      if (rr.ttl < *r_ttl)
+        *r_ttl = rr.ttl;
+
        if (!len)
         {
           /* Definitely too short - skip.  */
@@ -1579,7 +1979,8 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
 static gpg_error_t
 get_dns_cert_standard (const char *name, int want_certtype,
                        void **r_key, size_t *r_keylen,
-                       unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
+                       unsigned char **r_fpr, size_t *r_fprlen, char **r_url,
+                       unsigned int *r_ttl)
 {
 #ifdef HAVE_SYSTEM_RESOLVER
   gpg_error_t err;
@@ -1654,6 +2055,8 @@ get_dns_cert_standard (const char *name, int want_certtype,
             break;
 
           /* ttl */
+          if (buf32_to_uint (pt) < *r_ttl)
+            *r_ttl = buf32_to_uint (pt);
           pt += 4;
 
           /* data length */
@@ -1772,12 +2175,59 @@ get_dns_cert_standard (const char *name, int want_certtype,
   (void)r_fpr;
   (void)r_fprlen;
   (void)r_url;
+  (void)r_ttl;
   return gpg_error (GPG_ERR_NOT_SUPPORTED);
 
 #endif /*!HAVE_SYSTEM_RESOLVER*/
 }
 
 
+/* Helper for get_dns_cert to copy the values (KEY,KEYLEN),
+ * (FPR,FPRLEN) and URL, which may all be NULL, to the respective
+ * R_ arguments.  On error nothing is returned.  */
+static gpg_error_t
+copy_cert_values (void **r_key, size_t *r_keylen,
+                  unsigned char **r_fpr, size_t *r_fprlen, char **r_url,
+                  const void *key, size_t keylen,
+                  const unsigned char *fpr, size_t fprlen, const char *url)
+{
+  gpg_error_t err;
+
+  *r_key = NULL;
+  *r_keylen = 0;
+  *r_fpr = NULL;
+  *r_fprlen = 0;
+  *r_url = NULL;
+
+  if (key && !(*r_key = xtrymalloc (keylen)))
+    goto leave;
+  if (fpr && !(*r_fpr = xtrymalloc (fprlen)))
+    goto leave;
+  if (url && !(*r_url = xtrystrdup (url)))
+    goto leave;
+
+  if (key)
+    {
+      memcpy (*r_key, key, keylen);
+      *r_keylen = keylen;
+    }
+  if (fpr)
+    {
+      memcpy (*r_fpr, fpr, fprlen);
+      *r_fprlen = fprlen;
+    }
+  return 0;
+
+ leave:
+  err = gpg_error_from_syserror ();
+  xfree (*r_key);
+  *r_key = NULL;
+  xfree (*r_fpr);
+  *r_fpr = NULL;
+  return err;
+}
+
+
 /* Returns 0 on success or an error code.  If a PGP CERT record was
    found, the malloced data is returned at (R_KEY, R_KEYLEN) and
    the other return parameters are set to NULL/0.  If an IPGP CERT
@@ -1794,6 +2244,9 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
               unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
 {
   gpg_error_t err;
+  dns_cache_item_t item;
+  unsigned int subtype;
+  unsigned int ttl = DNS_CACHE_MAX_TTL;
 
   if (r_key)
     *r_key = NULL;
@@ -1803,20 +2256,61 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
   *r_fprlen = 0;
   *r_url = NULL;
 
+  subtype = (want_certtype << 1) | !!(r_key && r_keylen);
+  if ((item = dns_cache_get (DNS_CACHE_CERT, subtype, name)))
+    {
+      err = item->err;
+      if (!err)
+        {
+          void *key = NULL;
+          size_t keylen = 0;
+
+          err = copy_cert_values (&key, &keylen, r_fpr, r_fprlen, r_url,
+                                  item->key, item->keylen,
+                                  item->fpr, item->fprlen, item->url);
+          if (r_key)
+            {
+              *r_key = key;
+              *r_keylen = keylen;
+            }
+          else
+            xfree (key);
+        }
+      if (opt_debug)
+        log_debug ("dns: cache hit for '%s'\n", name);
+      goto leave;
+    }
+
 #ifdef USE_LIBDNS
   if (!standard_resolver)
     {
       err = get_dns_cert_libdns (ctrl, name, want_certtype, r_key, r_keylen,
-                                 r_fpr, r_fprlen, r_url);
+                                 r_fpr, r_fprlen, r_url, &ttl);
       if (err && libdns_switch_port_p (err))
         err = get_dns_cert_libdns (ctrl, name, want_certtype, r_key, r_keylen,
-                                   r_fpr, r_fprlen, r_url);
+                                   r_fpr, r_fprlen, r_url, &ttl);
     }
   else
 #endif /*USE_LIBDNS*/
     err = get_dns_cert_standard (name, want_certtype, r_key, r_keylen,
-                                 r_fpr, r_fprlen, r_url);
+                                 r_fpr, r_fprlen, r_url, &ttl);
 
+  if ((!err || dns_cache_negative_p (err))
+      && (item = dns_cache_new_item (DNS_CACHE_CERT, subtype, name, err)))
+    {
+      if (!err
+          && (copy_cert_values (&item->key, &item->keylen,
+                                &item->fpr, &item->fprlen, &item->url,
+                                r_key? *r_key : NULL, r_keylen? *r_keylen : 0,
+                                *r_fpr, *r_fprlen, *r_url)))
+        {
+          release_dns_cache_item (item);
+          item = NULL;
+        }
+      dns_cache_put (item, err? DNS_CACHE_NEG_TTL : ttl);
+    }
+
+ leave:
   if (opt_debug)
     log_debug ("dns: get_dns_cert(%s): %s\n", name, gpg_strerror (err));
   return err;
@@ -1841,8 +2335,9 @@ priosort(const void *a,const void *b)
  * R_COUNT.  */
 #ifdef USE_LIBDNS
 static gpg_error_t
-getsrv_libdns (ctrl_t ctrl,
-               const char *name, struct srventry **list, unsigned int *r_count)
+getsrv_libdns (ctrl_t ctrl, const char *name,
+               struct srventry **list, unsigned int *r_count,
+               unsigned int *r_ttl)
 {
   gpg_error_t err;
   struct dns_resolver *res = NULL;
@@ -1903,6 +2398,8 @@ getsrv_libdns (ctrl_t ctrl,
       err = libdns_error_to_gpg_error (dns_srv_parse(&dsrv, &rr, ans));
       if (err)
         goto leave;
+      if (rr.ttl < *r_ttl)
+        *r_ttl = rr.ttl;
 
       newlist = xtryrealloc (*list, (srvcount+1)*sizeof(struct srventry));
       if (!newlist)
@@ -1944,7 +2441,8 @@ getsrv_libdns (ctrl_t ctrl,
  * at the address of R_COUNT.  */
 static gpg_error_t
 getsrv_standard (const char *name,
-                 struct srventry **list, unsigned int *r_count)
+                 struct srventry **list, unsigned int *r_count,
+                 unsigned int *r_ttl)
 {
 #ifdef HAVE_SYSTEM_RESOLVER
   union {
@@ -2020,6 +2518,8 @@ getsrv_standard (const char *name,
       if (class != C_IN)
         goto fail;
 
+      if (buf32_to_uint (pt) < *r_ttl)
+        *r_ttl = buf32_to_uint (pt);
       pt += 4; /* ttl */
       dlen = buf16_to_u16 (pt);
       pt += 2;
@@ -2061,6 +2561,7 @@ getsrv_standard (const char *name,
   (void)name;
   (void)list;
   (void)r_count;
+  (void)r_ttl;
   return gpg_error (GPG_ERR_NOT_SUPPORTED);
 
 #endif /*!HAVE_SYSTEM_RESOLVER*/
@@ -2079,6 +2580,8 @@ get_dns_srv (ctrl_t ctrl,
   gpg_error_t err;
   char *namebuffer = NULL;
   unsigned int srvcount;
+  unsigned int ttl = DNS_CACHE_MAX_TTL;
+  dns_cache_item_t item;
   int i;
 
   *list = NULL;
@@ -2099,16 +2602,58 @@ get_dns_srv (ctrl_t ctrl,
     }
 
 
-#ifdef USE_LIBDNS
-  if (!standard_resolver)
+  if ((item = dns_cache_get (DNS_CACHE_SRV, 0, name)))
     {
-      err = getsrv_libdns (ctrl, name, list, &srvcount);
-      if (err && libdns_switch_port_p (err))
-        err = getsrv_libdns (ctrl, name, list, &srvcount);
+      err = item->err;
+      if (!err && item->nsrvs)
+        {
+          *list = xtrymalloc (item->nsrvs * sizeof **list);
+          if (!*list)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memcpy (*list, item->srvs, item->nsrvs * sizeof **list);
+              srvcount = item->nsrvs;
+            }
+        }
+      if (opt_debug)
+        log_debug ("dns: cache hit for '%s'\n", name);
     }
   else
+    {
+#ifdef USE_LIBDNS
+      if (!standard_resolver)
+        {
+          err = getsrv_libdns (ctrl, name, list, &srvcount, &ttl);
+          if (err && libdns_switch_port_p (err))
+            err = getsrv_libdns (ctrl, name, list, &srvcount, &ttl);
+        }
+      else
 #endif /*USE_LIBDNS*/
-    err = getsrv_standard (name, list, &srvcount);
+        err = getsrv_standard (name, list, &srvcount, &ttl);
+
+      /* Cache the records before they are shuffled.  An answer
+       * without records is cached like a negative one.  */
+      if ((!err || dns_cache_negative_p (err))
+          && (item = dns_cache_new_item (DNS_CACHE_SRV, 0, name, err)))
+        {
+          if (!err && srvcount)
+            {
+              item->srvs = xtrymalloc (srvcount * sizeof *item->srvs);
+              if (!item->srvs)
+                {
+                  release_dns_cache_item (item);
+                  item = NULL;
+                }
+              else
+                {
+                  memcpy (item->srvs, *list, srvcount * sizeof *item->srvs);
+                  item->nsrvs = srvcount;
+                }
+            }
+          dns_cache_put (item, (err || !srvcount)? DNS_CACHE_NEG_TTL : ttl);
+        }
+    }
 
   if (err)
     {
@@ -92,6 +92,19 @@ struct srventry
 };
 
 
+/* Statistics of the DNS cache.  */
+struct dns_cache_stats_s
+{
+  unsigned int entries;  /* Current number of entries.  */
+  unsigned int size;     /* Maximum number of entries.  */
+  unsigned int hits;     /* Positive answers taken from the cache.  */
+  unsigned int neghits;  /* Negative answers taken from the cache.  */
+  unsigned int misses;   /* Queries not found in the cache.  */
+  unsigned int expired;  /* Entries removed because their TTL expired.  */
+  unsigned int evicted;  /* Entries removed to make room.  */
+};
+
+
 /* Set verbosity and debug mode for this module. */
 void set_dns_verbose (int verbose, int debug);
 
@@ -131,6 +144,20 @@ void disable_dns_tormode (void);
    next DNS query.  Note that this is only used in Tor mode.  */
 void set_dns_nameserver (const char *ipaddr);
 
+/* Use the resolver configuration file FNAME instead of the standard
+ * one.  This is only used by the regression tests.  */
+void set_dns_resolv_conf (const char *fname);
+
+/* Set the maximum number of entries in the DNS cache.  0 disables
+ * the cache.  */
+void set_dns_cache_size (unsigned int n);
+
+/* Remove all entries from the DNS cache.  */
+void flush_dns_cache (void);
+
+/* Return the statistics of the DNS cache.  */
+void get_dns_cache_stats (struct dns_cache_stats_s *stats);
+
 /* SIGHUP action handler for this module.  */
 void reload_dns_stuff (int force);
 
@@ -211,9 +211,34 @@ struct cookie_s
      the content length.  */
   uint64_t content_length;
   unsigned int content_length_valid:1;
+
+  unsigned int in_header:1;   /* Reading the response header.  */
+  unsigned int hdr_eol:1;     /* The last header line has been read.  */
+  unsigned int chunked:1;     /* The body uses the chunked encoding.  */
+  unsigned int chunk_crlf:1;  /* Expect the CRLF after the chunk data.  */
+  unsigned int body_done:1;   /* The last chunk has been read.  */
+  unsigned int keep_alive:1;  /* The server allows to reuse the socket.  */
+  unsigned int failed:1;      /* A read error occurred.  */
+
+  /* The remaining length of the current chunk.  */
+  uint64_t chunk_left;
+
+  /* A buffer with data read ahead from the network.  This is used
+     while reading the response header and the chunk sizes so that
+     we never read beyond the end of a response.  */
+  char *lookahead;
+  size_t la_off;
+  size_t la_len;
+
+  /* The key into the connection pool or NULL if the connection shall
+     not be kept alive.  */
+  char *pool_key;
 };
 typedef struct cookie_s *cookie_t;
 
+/* The size of the look-ahead buffer of a cookie.  */
+#define LOOKAHEAD_SIZE 4096
+
 
 /* Simple cookie functions.  Here the cookie is an int with the
  * socket. */
@@ -304,9 +329,45 @@ struct http_context_s
   size_t buffer_size;
   unsigned int flags;
   header_t headers;      /* Received headers. */
+  char *pool_key;        /* Key into the connection pool or NULL.  */
 };
 
 
+/* An idle connection kept for reuse.  */
+struct idle_conn_s
+{
+  struct idle_conn_s *next;
+  my_socket_t sock;
+  tls_session_t tls_session;  /* The TLS session or NULL for plain HTTP.  */
+#ifdef HTTP_USE_GNUTLS
+  gnutls_certificate_credentials_t certcred;
+#endif
+  time_t idle_since;          /* The time the connection was put back.  */
+};
+typedef struct idle_conn_s *idle_conn_t;
+
+/* The connection pool has one item for each combination of host,
+   port and connection parameters.  */
+struct pool_item_s
+{
+  struct pool_item_s *next;
+  idle_conn_t conns;          /* The idle connections, newest first.  */
+  unsigned int nconns;        /* The number of idle connections.  */
+  unsigned int hits;          /* The number of reused connections.  */
+  unsigned int misses;        /* The number of new connections.  */
+  unsigned int resumed;       /* The number of resumed TLS sessions.  */
+#ifdef HTTP_USE_GNUTLS
+  gnutls_datum_t resume_data; /* The data to resume a TLS session.  */
+#endif
+  char *host;                 /* The host part of KEY.  */
+  char key[1];
+};
+typedef struct pool_item_s *pool_item_t;
+
+/* The maximum number of idle connections per pool item.  */
+#define MAX_IDLE_CONNS 4
+
+
 /* Two flags to enable verbose and debug mode.  Although currently not
  * set-able a value > 1 for OPT_DEBUG enables debugging of the session
  * reference counting.  */
@@ -325,6 +386,11 @@ static strlist_t cfg_ca_certlist;
 /* The global callback for net activity.  */
 static void (*netactivity_cb)(void);
 
+/* The pool of idle connections and the number of seconds an idle
+ * connection is kept.  A timeout of 0 disables the pool.  */
+static pool_item_t conn_pool;
+static unsigned int keep_alive_timeout;
+
 
 
 #if defined(HAVE_W32_SYSTEM) && !defined(HTTP_NO_WSASTARTUP)
@@ -648,6 +714,348 @@ notify_netactivity (void)
 
 
 
+/* Set the time in seconds an idle connection is kept in the pool for
+ * reuse.  Using 0 disables the pool and closes all idle connections.  */
+void
+http_set_keep_alive_timeout (unsigned int seconds)
+{
+  keep_alive_timeout = seconds;
+  if (!seconds)
+    http_expire_idle_connections ();
+}
+
+
+/* Close the idle connection CONN and release it.  */
+static void
+release_idle_conn (idle_conn_t conn)
+{
+  if (!conn)
+    return;
+
+#ifdef HTTP_USE_GNUTLS
+  if (conn->tls_session)
+    {
+      my_socket_unref (gnutls_transport_get_ptr (conn->tls_session),
+                       NULL, NULL);
+      gnutls_deinit (conn->tls_session);
+      gnutls_certificate_free_credentials (conn->certcred);
+    }
+#endif /*HTTP_USE_GNUTLS*/
+  my_socket_unref (conn->sock, NULL, NULL);
+  xfree (conn);
+}
+
+
+/* Close all idle connections which are older than the keep alive
+ * timeout.  */
+void
+http_expire_idle_connections (void)
+{
+  pool_item_t item;
+  idle_conn_t conn, *connp, expired = NULL;
+  time_t now = gnupg_get_time ();
+
+  /* First unlink the connections and then close them so that we do
+   * not need to care about other threads.  */
+  for (item = conn_pool; item; item = item->next)
+    for (connp = &item->conns; (conn = *connp); )
+      {
+        if (keep_alive_timeout
+            && conn->idle_since + keep_alive_timeout > now)
+          connp = &conn->next;
+        else
+          {
+            *connp = conn->next;
+            item->nconns--;
+            conn->next = expired;
+            expired = conn;
+          }
+      }
+
+  while ((conn = expired))
+    {
+      expired = conn->next;
+      if (opt_debug)
+        log_debug ("http.c:pool: closing idle connection fd %d\n",
+                   (int)conn->sock->fd);
+      release_idle_conn (conn);
+    }
+}
+
+
+/* Return the pool item for KEY.  If CREATE is set a new item is
+ * created for HOST if none exists.  Returns NULL if not found or on
+ * memory failure.  */
+static pool_item_t
+get_pool_item (const char *key, const char *host, int create)
+{
+  pool_item_t item;
+
+  for (item = conn_pool; item; item = item->next)
+    if (!strcmp (item->key, key))
+      return item;
+  if (!create)
+    return NULL;
+
+  item = xtrycalloc (1, sizeof *item + strlen (key) + strlen (host) + 1);
+  if (!item)
+    return NULL;
+  strcpy (item->key, key);
+  item->host = item->key + strlen (key) + 1;
+  strcpy (item->host, host);
+  item->next = conn_pool;
+  conn_pool = item;
+  return item;
+}
+
+
+/* Return the key into the connection pool for a request of HD to
+ * SERVER and PORT or NULL if the request may not use the pool.  */
+static char *
+make_pool_key (http_t hd, const char *server, unsigned short port,
+               const char *httphost, const char *srvtag)
+{
+  unsigned int flags;
+
+  if (!keep_alive_timeout
+      || !(hd->flags & HTTP_FLAG_KEEP_ALIVE)
+      || (hd->flags & HTTP_FLAG_SHUTDOWN)
+      || (hd->flags & HTTP_FLAG_IGNORE_CL))
+    return NULL;
+#ifndef HTTP_USE_GNUTLS
+  if (hd->uri->use_tls)
+    return NULL;  /* Not supported.  */
+#endif
+
+  /* The TLS connection has been verified with the flags of the
+   * session and thus they are part of the key.  */
+  flags = (hd->flags & (HTTP_FLAG_FORCE_TOR
+                        | HTTP_FLAG_IGNORE_IPv4 | HTTP_FLAG_IGNORE_IPv6));
+  if (hd->uri->use_tls && hd->session)
+    flags |= hd->session->flags;
+
+  return xtryasprintf ("%s://%s:%hu %s %s %x",
+                       hd->uri->use_tls? "https" : "http", server, port,
+                       hd->uri->use_tls && httphost? httphost : "-",
+                       srvtag? srvtag : "-", flags);
+}
+
+
+/* Return true if the idle connection CONN can be used for a new
+ * request.  A connection which has been closed by the server or has
+ * unexpected data pending is not usable.  */
+static int
+idle_conn_usable (idle_conn_t conn)
+{
+  fd_set rfds;
+  struct timeval tv;
+
+#ifdef HTTP_USE_GNUTLS
+  if (conn->tls_session && gnutls_record_check_pending (conn->tls_session))
+    return 0;
+#endif /*HTTP_USE_GNUTLS*/
+
+  FD_ZERO (&rfds);
+  FD_SET (FD2INT (conn->sock->fd), &rfds);
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  /* Note that we don't use my_select here because we do not want to
+   * release the CPU while working on the pool.  */
+  return !select (FD2INT (conn->sock->fd)+1, &rfds, NULL, NULL, &tv);
+}
+
+
+/* Take a usable idle connection for the request of HD from the pool
+ * and return its socket.  The TLS session of the connection replaces
+ * the one of the HD's session object.  Returns NULL if no connection
+ * is available.  */
+static my_socket_t
+pool_take (http_t hd, const char *host)
+{
+  pool_item_t item;
+  idle_conn_t conn;
+  my_socket_t sock;
+
+  http_expire_idle_connections ();
+  item = get_pool_item (hd->pool_key, host, 1);
+  if (!item)
+    return NULL;
+
+  while ((conn = item->conns))
+    {
+      item->conns = conn->next;
+      item->nconns--;
+      if (idle_conn_usable (conn))
+        break;
+      if (opt_debug)
+        log_debug ("http.c:pool: idle connection fd %d is not usable\n",
+                   (int)conn->sock->fd);
+      release_idle_conn (conn);
+    }
+  if (!conn)
+    {
+      item->misses++;
+      return NULL;
+    }
+
+#ifdef HTTP_USE_GNUTLS
+  if (conn->tls_session)
+    {
+      http_session_t sess = hd->session;
+
+      if (sess->tls_session)
+        {
+          my_socket_unref (gnutls_transport_get_ptr (sess->tls_session),
+                           NULL, NULL);
+          gnutls_deinit (sess->tls_session);
+        }
+      if (sess->certcred)
+        gnutls_certificate_free_credentials (sess->certcred);
+      sess->tls_session = conn->tls_session;
+      sess->certcred = conn->certcred;
+    }
+#endif /*HTTP_USE_GNUTLS*/
+
+  if (opt_debug)
+    log_debug ("http.c:pool: reusing connection fd %d for '%s'\n",
+               (int)conn->sock->fd, hd->pool_key);
+  item->hits++;
+  sock = conn->sock;
+  xfree (conn);
+  return sock;
+}
+
+
+/* Put the connection of the read cookie C into the pool.  This
+ * requires that the response has been read completely.  */
+static void
+pool_put (cookie_t c)
+{
+  pool_item_t item;
+  idle_conn_t conn;
+
+  if (!keep_alive_timeout)
+    return;
+
+#ifdef HTTP_USE_GNUTLS
+  /* The TLS session is owned by the session object; we can only take
+   * it if nobody else uses that object anymore.  */
+  if (c->use_tls
+      && (!c->session || !c->session->tls_session
+          || c->session->refcount != 1))
+    return;
+#else
+  if (c->use_tls)
+    return;
+#endif
+
+  item = get_pool_item (c->pool_key, NULL, 0);
+  if (!item)
+    return;
+  conn = xtrycalloc (1, sizeof *conn);
+  if (!conn)
+    return;
+  conn->sock = my_socket_ref (c->sock);
+#ifdef HTTP_USE_GNUTLS
+  if (c->use_tls)
+    {
+      conn->tls_session = c->session->tls_session;
+      conn->certcred = c->session->certcred;
+      c->session->tls_session = NULL;
+      c->session->certcred = NULL;
+      xfree (c->session->servername);
+      c->session->servername = NULL;
+    }
+#endif /*HTTP_USE_GNUTLS*/
+  conn->idle_since = gnupg_get_time ();
+  conn->next = item->conns;
+  item->conns = conn;
+  item->nconns++;
+  if (opt_debug)
+    log_debug ("http.c:pool: keeping connection fd %d for '%s'\n",
+               (int)conn->sock->fd, c->pool_key);
+
+  /* Close the oldest connection if there are too many.  */
+  if (item->nconns > MAX_IDLE_CONNS)
+    {
+      idle_conn_t *connp;
+
+      for (connp = &item->conns; (*connp)->next; connp = &(*connp)->next)
+        ;
+      conn = *connp;
+      *connp = NULL;
+      item->nconns--;
+      release_idle_conn (conn);
+    }
+}
+
+
+#ifdef HTTP_USE_GNUTLS
+/* Prepare the new TLS session of HD for resuming an earlier session
+ * with the same server.  */
+static void
+pool_set_resume_data (http_t hd)
+{
+  pool_item_t item;
+  int rc;
+
+  if (!hd->pool_key
+      || !(item = get_pool_item (hd->pool_key, NULL, 0))
+      || !item->resume_data.data)
+    return;
+
+  rc = gnutls_session_set_data (hd->session->tls_session,
+                                item->resume_data.data,
+                                item->resume_data.size);
+  if (rc < 0 && opt_debug)
+    log_debug ("http.c:pool: gnutls_session_set_data failed: %s\n",
+               gnutls_strerror (rc));
+}
+
+
+/* Remember the data to resume the TLS session of the read cookie C.
+ * This is done after the response has been read because with TLS 1.3
+ * the server sends the session ticket only after the handshake.  */
+static void
+pool_save_resume_data (cookie_t c)
+{
+  pool_item_t item;
+  gnutls_datum_t data;
+
+  if (!c->session || !c->session->tls_session
+      || !(item = get_pool_item (c->pool_key, NULL, 0)))
+    return;
+
+  if (!gnutls_session_get_data2 (c->session->tls_session, &data))
+    {
+      gnutls_free (item->resume_data.data);
+      item->resume_data = data;
+    }
+}
+#endif /*HTTP_USE_GNUTLS*/
+
+
+/* Return statistics about the connection pool for HOST.  */
+void
+http_get_pool_stats (const char *host, unsigned int *r_idle,
+                     unsigned int *r_hits, unsigned int *r_misses,
+                     unsigned int *r_resumed)
+{
+  pool_item_t item;
+
+  *r_idle = *r_hits = *r_misses = *r_resumed = 0;
+  for (item = conn_pool; item; item = item->next)
+    if (!ascii_strcasecmp (item->host, host))
+      {
+        *r_idle += item->nconns;
+        *r_hits += item->hits;
+        *r_misses += item->misses;
+        *r_resumed += item->resumed;
+      }
+}
+
+
+
 #ifdef USE_TLS
 /* Free the TLS session associated with SESS, if any.  */
 static void
@@ -974,6 +1382,7 @@ http_open (ctrl_t ctrl, http_t *r_hd, http_req_t reqtype, const char *url,
       if (hd->fp_write)
         es_fclose (hd->fp_write);
       http_session_unref (hd->session);
+      xfree (hd->pool_key);
       xfree (hd);
     }
   else
@@ -1150,6 +1559,15 @@ http_wait_response (http_t hd)
   cookie->sock = my_socket_ref (hd->sock);
   cookie->session = http_session_ref (hd->session);
   cookie->use_tls = use_tls;
+  cookie->in_header = 1;
+  if (hd->pool_key && !(cookie->pool_key = xtrystrdup (hd->pool_key)))
+    {
+      err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+      my_socket_unref (cookie->sock, NULL, NULL);
+      http_session_unref (cookie->session);
+      xfree (cookie);
+      return err;
+    }
 
   hd->read_cookie = cookie;
   hd->fp_read = es_fopencookie (cookie, "r", cookie_functions);
@@ -1158,6 +1576,7 @@ http_wait_response (http_t hd)
       err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
       my_socket_unref (cookie->sock, NULL, NULL);
       http_session_unref (cookie->session);
+      xfree (cookie->pool_key);
       xfree (cookie);
       hd->read_cookie = NULL;
       return err;
@@ -1228,6 +1647,7 @@ http_close (http_t hd, int keep_read_stream)
       hd->headers = tmp;
     }
   xfree (hd->buffer);
+  xfree (hd->pool_key);
   xfree (hd);
 }
 
@@ -1749,6 +2169,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
   char *proxy_authstr = NULL;
   char *authstr = NULL;
   assuan_fd_t sock;
+  int reused = 0;
 #ifdef USE_TLS
   int have_http_proxy = 0;
 #endif
@@ -1892,8 +2313,15 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
     }
   else
     {
-      err = connect_server (ctrl,
-                            server, port, hd->flags, srvtag, timeout, &sock);
+      hd->pool_key = make_pool_key (hd, server, port, httphost, srvtag);
+      if (hd->pool_key && (hd->sock = pool_take (hd, server)))
+        {
+          reused = 1;
+          err = 0;
+        }
+      else
+        err = connect_server (ctrl,
+                              server, port, hd->flags, srvtag, timeout, &sock);
     }
 
   if (err)
@@ -1901,7 +2329,8 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
       xfree (proxy_authstr);
       return err;
     }
-  hd->sock = my_socket_new (sock);
+  if (!reused)
+    hd->sock = my_socket_new (sock);
   if (!hd->sock)
     {
       xfree (proxy_authstr);
@@ -1998,7 +2427,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
 #endif	/* USE_TLS */
 
 #if HTTP_USE_NTBTLS
-  if (hd->uri->use_tls)
+  if (hd->uri->use_tls && !reused)
     {
       estream_t in, out;
 
@@ -2107,7 +2536,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
 
     }
 #elif HTTP_USE_GNUTLS
-  if (hd->uri->use_tls)
+  if (hd->uri->use_tls && !reused)
     {
       int rc;
 
@@ -2117,6 +2546,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
                                           my_gnutls_read);
       gnutls_transport_set_push_function (hd->session->tls_session,
                                           my_gnutls_write);
+      pool_set_resume_data (hd);
 
     handshake_again:
       do
@@ -2150,6 +2580,13 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
           return gpg_err_make (default_errsource, GPG_ERR_NETWORK);
         }
 
+      if (hd->pool_key && gnutls_session_is_resumed (hd->session->tls_session))
+        {
+          pool_item_t item = get_pool_item (hd->pool_key, NULL, 0);
+          if (item)
+            item->resumed++;
+        }
+
       hd->session->verify.done = 0;
       if (tls_callback)
         err = tls_callback (hd, hd->session, 0);
@@ -2224,12 +2661,14 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
       else
         snprintf (portstr, sizeof portstr, ":%u", port);
 
+      /* A connection from the pool is kept alive using HTTP/1.1.  */
       request = es_bsprintf
-        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s",
+        ("%s %s%s HTTP/1.%d\r\nHost: %s%s\r\n%s",
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" : "OOPS",
          *p == '/' ? "" : "/", p,
+         hd->pool_key? 1 : 0,
          httphost? httphost : server,
          portstr,
          authstr? authstr:"");
@@ -2507,6 +2946,7 @@ parse_response (http_t hd)
   size_t maxlen, len;
   cookie_t cookie = hd->read_cookie;
   const char *s;
+  int is_http11;
 
   /* Delete old header lines.  */
   while (hd->headers)
@@ -2547,6 +2987,7 @@ parse_response (http_t hd)
     }
   if (!p2)
     return 0; /* Also assume http 0.9. */
+  is_http11 = !strcmp (p, "1.1");
   p = p2;
   /* TODO: Add HTTP version number check. */
   if ((p2 = strpbrk (p, " \t")))
@@ -2588,7 +3029,18 @@ parse_response (http_t hd)
   while (len && *line);
 
   cookie->content_length_valid = 0;
-  if (!(hd->flags & HTTP_FLAG_IGNORE_CL))
+  cookie->chunked = 0;
+  if (hd->req_type == HTTP_REQ_HEAD || hd->status_code / 100 == 1
+      || hd->status_code == 204 || hd->status_code == 304)
+    {
+      /* These responses never have a body.  */
+      cookie->content_length_valid = 1;
+      cookie->content_length = 0;
+    }
+  else if ((s = http_get_header (hd, "Transfer-Encoding"))
+           && ascii_memistr (s, strlen (s), "chunked"))
+    cookie->chunked = 1;
+  else if (!(hd->flags & HTTP_FLAG_IGNORE_CL))
     {
       s = http_get_header (hd, "Content-Length");
       if (s)
@@ -2598,6 +3050,18 @@ parse_response (http_t hd)
         }
     }
 
+  /* The connection can be reused if the server agrees and we are
+   * able to detect the end of the body.  */
+  cookie->keep_alive = 0;
+  if (cookie->pool_key && (cookie->chunked || cookie->content_length_valid))
+    {
+      s = http_get_header (hd, "Connection");
+      if (s && ascii_memistr (s, strlen (s), "close"))
+        ;
+      else if (is_http11 || (s && ascii_memistr (s, strlen (s), "keep-alive")))
+        cookie->keep_alive = 1;
+    }
+
   return 0;
 }
 
@@ -3149,21 +3613,13 @@ write_server (assuan_fd_t sock, const char *data, size_t length)
 
 
 
-/* Read handler for estream.  */
+/* Read up to SIZE bytes from the network connection of cookie C
+ * into BUFFER.  */
 static gpgrt_ssize_t
-cookie_read (void *cookie, void *buffer, size_t size)
+cookie_net_read (cookie_t c, void *buffer, size_t size)
 {
-  cookie_t c = cookie;
   int nread;
 
-  if (c->content_length_valid)
-    {
-      if (!c->content_length)
-        return 0; /* EOF */
-      if (c->content_length < size)
-        size = c->content_length;
-    }
-
 #if HTTP_USE_NTBTLS
   if (c->use_tls && c->session && c->session->tls_session)
     {
@@ -3213,7 +3669,221 @@ cookie_read (void *cookie, void *buffer, size_t size)
       nread = read_server (c->sock->fd, buffer, size);
     }
 
-  if (c->content_length_valid && nread > 0)
+  return (gpgrt_ssize_t)nread;
+}
+
+
+/* Make sure that the look-ahead buffer of cookie C is not empty.
+ * Returns 1 on success, 0 on EOF, and -1 on error.  */
+static int
+cookie_fill (cookie_t c)
+{
+  gpgrt_ssize_t nread;
+
+  if (c->la_off < c->la_len)
+    return 1;
+
+  if (!c->lookahead)
+    {
+      c->lookahead = xtrymalloc (LOOKAHEAD_SIZE);
+      if (!c->lookahead)
+        return -1;
+    }
+  nread = cookie_net_read (c, c->lookahead, LOOKAHEAD_SIZE);
+  if (nread <= 0)
+    return nread;
+  c->la_off = 0;
+  c->la_len = nread;
+  return 1;
+}
+
+
+/* Read up to SIZE bytes from the look-ahead buffer or, if that is
+ * empty, from the network.  */
+static gpgrt_ssize_t
+cookie_raw_read (cookie_t c, void *buffer, size_t size)
+{
+  size_t n;
+
+  if (c->la_off < c->la_len)
+    {
+      n = c->la_len - c->la_off;
+      if (n > size)
+        n = size;
+      memcpy (buffer, c->lookahead + c->la_off, n);
+      c->la_off += n;
+      return n;
+    }
+  return cookie_net_read (c, buffer, size);
+}
+
+
+/* Read the line with a chunk size or a trailer of a chunked body
+ * into LINE and return its length.  Overlong lines are truncated.
+ * Returns -1 on error or a premature EOF.  */
+static int
+cookie_read_chunk_line (cookie_t c, char *line, size_t linesize)
+{
+  size_t n = 0;
+  int rc, ch;
+
+  for (;;)
+    {
+      rc = cookie_fill (c);
+      if (!rc)
+        gpg_err_set_errno (EIO);
+      if (rc <= 0)
+        return -1;
+      ch = c->lookahead[c->la_off++];
+      if (ch == '\n')
+        break;
+      if (ch != '\r' && n+1 < linesize)
+        line[n++] = ch;
+    }
+  line[n] = 0;
+  return n;
+}
+
+
+/* Start reading the next chunk of a chunked body.  Returns 0 on
+ * success and -1 on error.  At the end of the body BODY_DONE is
+ * set.  */
+static int
+cookie_next_chunk (cookie_t c)
+{
+  char line[80];
+  const char *s;
+  uint64_t len;
+  int n;
+
+  if (c->chunk_crlf)
+    {
+      /* Skip the CRLF after the data of the last chunk.  */
+      n = cookie_read_chunk_line (c, line, sizeof line);
+      if (n)
+        goto invalid;
+      c->chunk_crlf = 0;
+    }
+
+  n = cookie_read_chunk_line (c, line, sizeof line);
+  if (n < 0)
+    return -1;
+  if (!hexdigitp (line))
+    goto invalid;
+  for (len = 0, s = line; hexdigitp (s); s++)
+    {
+      if (len >> 60)
+        goto invalid;  /* Too large.  */
+      len = (len << 4) | xtoi_1 (s);
+    }
+  if (*s && *s != ';' && *s != ' ' && *s != '\t')
+    goto invalid;
+
+  if (len)
+    {
+      c->chunk_left = len;
+      return 0;
+    }
+
+  /* The last chunk: Skip the trailer.  */
+  do
+    n = cookie_read_chunk_line (c, line, sizeof line);
+  while (n > 0);
+  if (n < 0)
+    return -1;
+  c->body_done = 1;
+  return 0;
+
+ invalid:
+  if (n >= 0)
+    {
+      log_info ("invalid chunk encoding in HTTP response\n");
+      gpg_err_set_errno (EIO);
+    }
+  return -1;
+}
+
+
+/* Read handler for estream.  */
+static gpgrt_ssize_t
+cookie_read (void *cookie, void *buffer, size_t size)
+{
+  cookie_t c = cookie;
+  gpgrt_ssize_t nread;
+  const char *s;
+  size_t n;
+  int rc;
+
+  if (c->failed && c->chunked)
+    {
+      /* We lost track of the chunks.  */
+      gpg_err_set_errno (EIO);
+      return -1;
+    }
+
+  if (c->in_header)
+    {
+      /* Do not return more than the header so that the body can be
+       * read with the framing set up by parse_response.  */
+      rc = cookie_fill (c);
+      if (rc <= 0)
+        {
+          c->failed = (rc < 0);
+          return rc;
+        }
+      s = c->lookahead + c->la_off;
+      for (n = 0; n < size && c->la_off + n < c->la_len; )
+        {
+          if (s[n++] == '\n')
+            {
+              if (c->hdr_eol)
+                {
+                  c->in_header = 0;
+                  break;
+                }
+              c->hdr_eol = 1;
+            }
+          else if (s[n-1] != '\r')
+            c->hdr_eol = 0;
+        }
+      memcpy (buffer, s, n);
+      c->la_off += n;
+      return n;
+    }
+
+  if (c->chunked)
+    {
+      while (!c->chunk_left && !c->body_done)
+        if (cookie_next_chunk (c))
+          {
+            c->failed = 1;
+            return -1;
+          }
+      if (c->body_done)
+        return 0; /* EOF */
+      if (c->chunk_left < size)
+        size = c->chunk_left;
+    }
+  else if (c->content_length_valid)
+    {
+      if (!c->content_length)
+        return 0; /* EOF */
+      if (c->content_length < size)
+        size = c->content_length;
+    }
+
+  nread = cookie_raw_read (c, buffer, size);
+  if (nread < 0)
+    c->failed = 1;
+  else if (!nread && (c->chunked || c->content_length_valid))
+    c->failed = 1;  /* Premature EOF - the connection can't be reused.  */
+  else if (c->chunked)
+    {
+      c->chunk_left -= nread;
+      if (!c->chunk_left)
+        c->chunk_crlf = 1;
+    }
+  else if (c->content_length_valid)
     {
       if (nread < c->content_length)
         c->content_length -= nread;
@@ -3221,9 +3891,10 @@ cookie_read (void *cookie, void *buffer, size_t size)
         c->content_length = 0;
     }
 
-  return (gpgrt_ssize_t)nread;
+  return nread;
 }
 
+
 /* Write handler for estream.  */
 static gpgrt_ssize_t
 cookie_write (void *cookie, const void *buffer_arg, size_t size)
@@ -3353,6 +4024,21 @@ cookie_close (void *cookie)
   if (!c)
     return 0;
 
+  /* If the response has been read completely the connection may be
+   * kept for another request.  */
+  if (c->pool_key && !c->failed
+      && (c->chunked? c->body_done
+          : (c->content_length_valid && !c->content_length))
+      && c->la_off == c->la_len)
+    {
+#ifdef HTTP_USE_GNUTLS
+      if (c->use_tls)
+        pool_save_resume_data (c);
+#endif
+      if (c->keep_alive)
+        pool_put (c);
+    }
+
 #if HTTP_USE_NTBTLS
   if (c->use_tls && c->session && c->session->tls_session)
     {
@@ -3371,6 +4057,8 @@ cookie_close (void *cookie)
 
   if (c->session)
     http_session_unref (c->session);
+  xfree (c->lookahead);
+  xfree (c->pool_key);
   xfree (c);
   return 0;
 }
@@ -92,7 +92,8 @@ enum
     HTTP_FLAG_TRUST_DEF   = 256, /* Use the CAs configured for HKP.  */
     HTTP_FLAG_TRUST_SYS   = 512, /* Also use the system defined CAs. */
     HTTP_FLAG_TRUST_CFG  = 1024, /* Also use configured CAs.         */
-    HTTP_FLAG_NO_CRL     = 2048  /* Do not consult CRLs for https.   */
+    HTTP_FLAG_NO_CRL     = 2048, /* Do not consult CRLs for https.   */
+    HTTP_FLAG_KEEP_ALIVE = 4096  /* Use the pool of idle connections. */
   };
 
 
@@ -130,6 +131,11 @@ void http_register_tls_callback (gpg_error_t (*cb)(http_t,http_session_t,int));
 void http_register_tls_ca (const char *fname);
 void http_register_cfg_ca (const char *fname);
 void http_register_netactivity_cb (void (*cb)(void));
+void http_set_keep_alive_timeout (unsigned int seconds);
+void http_expire_idle_connections (void);
+void http_get_pool_stats (const char *host, unsigned int *r_idle,
+                          unsigned int *r_hits, unsigned int *r_misses,
+                          unsigned int *r_resumed);
 
 
 gpg_error_t http_session_new (http_session_t *r_session,
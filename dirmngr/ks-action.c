@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 #include "misc.h"
@@ -297,6 +298,223 @@ ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
 }
 
 
+/* The maximum number of keys ks_action_get_bulk fetches at the same
+   time.  */
+#define MAX_BULK_GET_WORKERS 4
+
+/* A key fetched by a worker of ks_action_get_bulk.  */
+struct bulk_get_result_s
+{
+  struct bulk_get_result_s *next;
+  estream_t fp;   /* Memory stream with the key data.  */
+};
+
+/* The state shared by ks_action_get_bulk and its workers.  */
+struct bulk_get_parm_s
+{
+  ctrl_t ctrl;              /* The control object of the caller.  */
+  parsed_uri_t uri;         /* The keyserver to use.  */
+  npth_mutex_t lock;        /* Protects all fields below.  */
+  npth_cond_t cond;         /* Signaled for a new result or an exiting
+                               worker.  */
+  strlist_t next_pattern;   /* The next pattern to fetch.  */
+  struct bulk_get_result_s *results;  /* Results not yet written.  */
+  struct bulk_get_result_s **results_tail;
+  int nworkers;             /* Number of running workers.  */
+  int stop;                 /* Request to stop the workers.  */
+  gpg_error_t first_err;    /* The first error of a fetch.  */
+};
+
+
+/* Thread function for ks_action_get_bulk.  Fetch the keys for the
+   patterns from the shared list one after the other and queue them
+   for the caller.  A worker uses its own control object so that it
+   does not interact with the Assuan connection of the caller.  The
+   session options affecting the fetches are copied from the caller's
+   object; the connection and per-operation fields are not.  */
+static void *
+bulk_get_worker (void *opaque)
+{
+  struct bulk_get_parm_s *parm = opaque;
+  struct server_control_s ctrlbuf;
+  struct bulk_get_result_s *res;
+  strlist_t sl;
+  estream_t infp, fp;
+  gpg_error_t err;
+
+  memset (&ctrlbuf, 0, sizeof ctrlbuf);
+  dirmngr_init_default_ctrl (&ctrlbuf);
+  xfree (ctrlbuf.http_proxy);
+  ctrlbuf.http_proxy = (parm->ctrl->http_proxy
+                        ? xstrdup (parm->ctrl->http_proxy) : NULL);
+  ctrlbuf.timeout = parm->ctrl->timeout;
+  ctrlbuf.http_no_crl = parm->ctrl->http_no_crl;
+  ctrlbuf.force_crl_refresh = parm->ctrl->force_crl_refresh;
+
+  npth_mutex_lock (&parm->lock);
+  while (!parm->stop && (sl = parm->next_pattern))
+    {
+      parm->next_pattern = sl->next;
+      npth_mutex_unlock (&parm->lock);
+
+      res = NULL;
+      err = ks_hkp_get (&ctrlbuf, parm->uri, sl->d, &infp);
+      if (!err)
+        {
+          fp = es_fopenmem (0, "w+b");
+          if (!fp)
+            err = gpg_error_from_syserror ();
+          else
+            err = copy_stream (infp, fp);
+          es_fclose (infp);
+          if (!err)
+            {
+              res = xtrycalloc (1, sizeof *res);
+              if (!res)
+                err = gpg_error_from_syserror ();
+            }
+          if (err)
+            es_fclose (fp);
+          else
+            {
+              es_rewind (fp);
+              res->fp = fp;
+            }
+        }
+      if (err && opt.verbose)
+        log_info ("error fetching '%s': %s\n", sl->d, gpg_strerror (err));
+
+      npth_mutex_lock (&parm->lock);
+      if (res)
+        {
+          *parm->results_tail = res;
+          parm->results_tail = &res->next;
+          npth_cond_signal (&parm->cond);
+        }
+      else if (!parm->first_err)
+        parm->first_err = err;
+    }
+  parm->nworkers--;
+  npth_cond_signal (&parm->cond);
+  npth_mutex_unlock (&parm->lock);
+
+  dirmngr_deinit_default_ctrl (&ctrlbuf);
+  return NULL;
+}
+
+
+/* Get the keys matching PATTERNS like ks_action_get but fetch up to
+   MAX_BULK_GET_WORKERS keys concurrently.  The keys are written to
+   OUTFP in the order they arrive.  This is only done for the first
+   keyserver and only if it is a HKP server; in all other cases this
+   falls back to ks_action_get.  */
+gpg_error_t
+ks_action_get_bulk (ctrl_t ctrl, uri_item_t keyservers,
+                    strlist_t patterns, estream_t outfp)
+{
+  gpg_error_t err = 0;
+  struct bulk_get_parm_s parm;
+  struct bulk_get_result_s *res, *resnext;
+  npth_t threads[MAX_BULK_GET_WORKERS];
+  npth_attr_t tattr;
+  int nthreads = 0;
+  int any_data = 0;
+  int npatterns, ret, i;
+
+  if (!patterns)
+    return gpg_error (GPG_ERR_NO_USER_ID);
+  if (!keyservers
+      || (strcmp (keyservers->parsed_uri->scheme, "hkp")
+          && strcmp (keyservers->parsed_uri->scheme, "hkps")))
+    return ks_action_get (ctrl, keyservers, patterns, outfp);
+
+  npatterns = strlist_length (patterns);
+
+  memset (&parm, 0, sizeof parm);
+  parm.ctrl = ctrl;
+  parm.uri = keyservers->parsed_uri;
+  parm.next_pattern = patterns;
+  parm.results_tail = &parm.results;
+  ret = npth_mutex_init (&parm.lock, NULL);
+  if (ret)
+    return gpg_error_from_errno (ret);
+  ret = npth_cond_init (&parm.cond, NULL);
+  if (ret)
+    {
+      npth_mutex_destroy (&parm.lock);
+      return gpg_error_from_errno (ret);
+    }
+
+  /* Start the workers.  We hold the lock so that they do not start
+     before NWORKERS is set.  */
+  npth_mutex_lock (&parm.lock);
+  ret = npth_attr_init (&tattr);
+  if (!ret)
+    {
+      while (nthreads < MAX_BULK_GET_WORKERS && nthreads < npatterns)
+        {
+          ret = npth_create (&threads[nthreads], &tattr,
+                             bulk_get_worker, &parm);
+          if (ret)
+            break;
+          nthreads++;
+        }
+      npth_attr_destroy (&tattr);
+    }
+  parm.nworkers = nthreads;
+  if (!nthreads)
+    {
+      err = gpg_error_from_errno (ret);
+      log_error ("error spawning key fetch thread: %s\n", gpg_strerror (err));
+    }
+
+  /* Write out the results as they arrive.  */
+  for (;;)
+    {
+      while (!parm.results && parm.nworkers)
+        npth_cond_wait (&parm.cond, &parm.lock);
+      res = parm.results;
+      if (!res)
+        break;  /* All workers are done.  */
+      parm.results = NULL;
+      parm.results_tail = &parm.results;
+      npth_mutex_unlock (&parm.lock);
+
+      for (; res; res = resnext)
+        {
+          resnext = res->next;
+          if (!err)
+            {
+              err = copy_stream (res->fp, outfp);
+              if (!err)
+                any_data = 1;
+            }
+          es_fclose (res->fp);
+          xfree (res);
+        }
+
+      npth_mutex_lock (&parm.lock);
+      if (err)
+        parm.stop = 1;
+    }
+  npth_mutex_unlock (&parm.lock);
+
+  for (i=0; i < nthreads; i++)
+    npth_join (threads[i], NULL);
+  npth_cond_destroy (&parm.cond);
+  npth_mutex_destroy (&parm.lock);
+
+  /* The workers can't emit status lines, thus we tell the caller
+     about the source here.  */
+  if (!err && (any_data || gpg_err_code (parm.first_err) == GPG_ERR_NO_DATA))
+    err = dirmngr_status (ctrl, "SOURCE", parm.uri->original, NULL);
+
+  if (!err && parm.first_err && !any_data)
+    err = parm.first_err;
+  return err;
+}
+
+
 /* Retrieve keys from URL and write the result to the provided output
  * stream OUTFP.  If OUTFP is NULL the data is written to the bit
  * bucket. */
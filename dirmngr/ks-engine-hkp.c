@@ -845,6 +845,7 @@ ks_hkp_print_hosttable (ctrl_t ctrl)
   time_t curtime;
   char *p, *died;
   const char *diedstr;
+  unsigned int idle, hits, misses, resumed;
 
   err = ks_print_help (ctrl, "hosttable (idx, ipv6, ipv4, dead, name, time):");
   if (err)
@@ -952,6 +953,14 @@ ks_hkp_print_hosttable (ctrl_t ctrl)
         if (err)
 	  goto leave;
 
+        http_get_pool_stats (hi->name, &idle, &hits, &misses, &resumed);
+        if (hits || misses)
+          err = ks_printf_help (ctrl, "  .       connections: %u new,"
+                                " %u reused, %u resumed, %u idle",
+                                misses, hits, resumed, idle);
+        if (err)
+	  goto leave;
+
         if (hi->pool)
           {
             init_membuf (&mb, 256);
@@ -1233,6 +1242,7 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
                    httphost,
                    /* fixme: AUTH */ NULL,
                    (httpflags
+                    |HTTP_FLAG_KEEP_ALIVE
                     |(opt.honor_http_proxy? HTTP_FLAG_TRY_PROXY:0)
                     |(dirmngr_use_tor ()? HTTP_FLAG_FORCE_TOR:0)
                     |(opt.disable_ipv4? HTTP_FLAG_IGNORE_IPv4 : 0)
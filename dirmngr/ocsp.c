@@ -30,6 +30,7 @@
 #include "validate.h"
 #include "certcache.h"
 #include "ocsp.h"
+#include "ocspcache.h"
 
 /* The maximum size we allow as a response from an OCSP reponder. */
 #define MAX_RESPONSE_SIZE 65536
@@ -309,10 +310,12 @@ do_ocsp_request (ctrl_t ctrl, ksba_ocsp_t ocsp, gcry_md_hd_t md,
 
 /* Validate that CERT is indeed valid to sign an OCSP response. If
    SIGNER_FPR_LIST is not NULL we simply check that CERT matches one
-   of the fingerprints in this list. */
+   of the fingerprints in this list.  If the validity of CERT is left
+   to the client, its fingerprint is stored at R_SIGNER_FPR. */
 static gpg_error_t
 validate_responder_cert (ctrl_t ctrl, ksba_cert_t cert,
-                         fingerprint_list_t signer_fpr_list)
+                         fingerprint_list_t signer_fpr_list,
+                         char **r_signer_fpr)
 {
   gpg_error_t err;
   char *fpr;
@@ -352,7 +355,8 @@ validate_responder_cert (ctrl_t ctrl, ksba_cert_t cert,
          all. */
       fpr = get_fingerprint_hexstring (cert);
       dirmngr_status (ctrl, "ONLY_VALID_IF_CERT_VALID", fpr, NULL);
-      xfree (fpr);
+      xfree (*r_signer_fpr);
+      *r_signer_fpr = fpr;
       err = 0;
     }
 
@@ -363,7 +367,8 @@ validate_responder_cert (ctrl_t ctrl, ksba_cert_t cert,
 /* Helper for check_signature. */
 static int
 check_signature_core (ctrl_t ctrl, ksba_cert_t cert, gcry_sexp_t s_sig,
-                      gcry_sexp_t s_hash, fingerprint_list_t signer_fpr_list)
+                      gcry_sexp_t s_hash, fingerprint_list_t signer_fpr_list,
+                      char **r_signer_fpr)
 {
   gpg_error_t err;
   ksba_sexp_t pubkey;
@@ -378,7 +383,8 @@ check_signature_core (ctrl_t ctrl, ksba_cert_t cert, gcry_sexp_t s_sig,
   if (!err)
     err = gcry_pk_verify (s_sig, s_hash, s_pkey);
   if (!err)
-    err = validate_responder_cert (ctrl, cert, signer_fpr_list);
+    err = validate_responder_cert (ctrl, cert, signer_fpr_list,
+                                   r_signer_fpr);
   if (!err)
     {
       gcry_sexp_release (s_pkey);
@@ -396,11 +402,12 @@ check_signature_core (ctrl_t ctrl, ksba_cert_t cert, gcry_sexp_t s_sig,
    the response.  This function automagically finds the correct public
    key.  If SIGNER_FPR_LIST is not NULL, the default OCSP reponder has been
    used and thus the certificate is one of those identified by
-   the fingerprints. */
+   the fingerprints.  R_SIGNER_FPR receives the fingerprint of the
+   responder's certificate if the client needs to validate it. */
 static gpg_error_t
 check_signature (ctrl_t ctrl,
                  ksba_ocsp_t ocsp, gcry_sexp_t s_sig, gcry_md_hd_t md,
-                 fingerprint_list_t signer_fpr_list)
+                 fingerprint_list_t signer_fpr_list, char **r_signer_fpr)
 {
   gpg_error_t err;
   int algo, cert_idx;
@@ -438,7 +445,7 @@ check_signature (ctrl_t ctrl,
       if (cert)
         {
           err = check_signature_core (ctrl, cert, s_sig, s_hash,
-                                      signer_fpr_list);
+                                      signer_fpr_list, r_signer_fpr);
           ksba_cert_release (cert);
           cert = NULL;
           if (!err)
@@ -502,7 +509,7 @@ check_signature (ctrl_t ctrl,
       if (cert)
         {
           err = check_signature_core (ctrl, cert, s_sig, s_hash,
-                                      signer_fpr_list);
+                                      signer_fpr_list, r_signer_fpr);
           ksba_cert_release (cert);
           if (!err)
             {
@@ -521,7 +528,8 @@ check_signature (ctrl_t ctrl,
 /* Check whether the certificate either given by fingerprint CERT_FPR
    or directly through the CERT object is valid by running an OCSP
    transaction.  With FORCE_DEFAULT_RESPONDER set only the configured
-   default responder is used. */
+   default responder is used.  A verified response is cached until
+   its NEXT_UPDATE time. */
 gpg_error_t
 ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
               int force_default_responder)
@@ -543,6 +551,11 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   char *oid;
   ksba_name_t name;
   fingerprint_list_t default_signer = NULL;
+  struct ocsp_cache_status_s cached;
+  char *signer_fpr = NULL;
+  int time_okay = 1;
+
+  memset (&cached, 0, sizeof cached);
 
   /* Get the certificate.  */
   if (cert)
@@ -575,6 +588,29 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
         }
     }
 
+  /* Check whether we have a still valid response for this
+     certificate.  */
+  if (ocsp_cache_get (cert, issuer_cert,
+                      force_default_responder || opt.ignore_ocsp_service_url,
+                      &cached))
+    {
+      if (opt.verbose)
+        log_info (_("using cached OCSP status (next update %s)\n"),
+                  cached.next_update);
+      if (cached.signer_fpr)
+        dirmngr_status (ctrl, "ONLY_VALID_IF_CERT_VALID",
+                        cached.signer_fpr, NULL);
+      status = cached.status;
+      gnupg_copy_time (this_update, cached.this_update);
+      gnupg_copy_time (next_update, cached.next_update);
+      if (*cached.revocation_time)
+        gnupg_copy_time (revocation_time, cached.revocation_time);
+      else
+        *revocation_time = 0;
+      reason = cached.reason;
+      goto status_known;
+    }
+
   /* Create an OCSP instance.  */
   err = ksba_ocsp_new (&ocsp);
   if (err)
@@ -691,7 +727,8 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
     goto leave;
   xfree (sigval);
   sigval = NULL;
-  err = check_signature (ctrl, ocsp, s_sig, md, default_signer);
+  err = check_signature (ctrl, ocsp, s_sig, md, default_signer,
+                         &signer_fpr);
   if (err)
     goto leave;
 
@@ -707,6 +744,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
       goto leave;
     }
 
+ status_known:
   /* In case the certificate has been revoked, we better invalidate
      our cached validation status. */
   if (status == KSBA_STATUS_REVOKED)
@@ -771,6 +809,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
     {
       log_error (_("OCSP responder returned a status in the future\n"));
       log_info ("used now: %s  this_update: %s\n", current_time, this_update);
+      time_okay = 0;
       if (!err)
         err = gpg_error (GPG_ERR_TIME_CONFLICT);
     }
@@ -784,6 +823,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
       log_error (_("OCSP responder returned a non-current status\n"));
       log_info ("used now: %s  this_update: %s\n",
                 current_time, this_update);
+      time_okay = 0;
       if (!err)
         err = gpg_error (GPG_ERR_TIME_CONFLICT);
     }
@@ -799,13 +839,33 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
           log_error (_("OCSP responder returned an too old status\n"));
           log_info ("used now: %s  next_update: %s\n",
                     current_time, next_update);
+          time_okay = 0;
           if (!err)
             err = gpg_error (GPG_ERR_TIME_CONFLICT);
         }
     }
 
+  /* Remember a fresh and verified response.  */
+  if (ocsp && time_okay
+      && (status == KSBA_STATUS_GOOD || status == KSBA_STATUS_REVOKED))
+    {
+      memset (&cached, 0, sizeof cached);
+      cached.status = status;
+      gnupg_copy_time (cached.this_update, this_update);
+      if (*next_update)
+        gnupg_copy_time (cached.next_update, next_update);
+      if (status == KSBA_STATUS_REVOKED && *revocation_time)
+        gnupg_copy_time (cached.revocation_time, revocation_time);
+      cached.reason = reason;
+      cached.signer_fpr = signer_fpr;
+      ocsp_cache_put (cert, issuer_cert, !!default_signer, &cached);
+      cached.signer_fpr = NULL;
+    }
+
 
  leave:
+  xfree (cached.signer_fpr);
+  xfree (signer_fpr);
   gcry_md_close (md);
   gcry_sexp_release (s_sig);
   xfree (sigval);
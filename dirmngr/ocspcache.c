@@ -0,0 +1,648 @@
+/* ocspcache.c - Cache for OCSP responses
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+
+   The cache keeps the verified status of a certificate as returned
+   by an OCSP responder until the NEXT_UPDATE time of the response.
+   Responses without a NEXT_UPDATE are not cached.  An entry is
+   identified by the fingerprint of the issuer certificate and the
+   serial number of the certificate.
+
+   The entries are stored in the file "ocsp.txt" in the directory of
+   the CRL cache so that they survive a restart and FLUSHCRLS removes
+   them along with the CRLs.  New entries are appended to the file;
+   the file is rewritten without the expired and replaced entries
+   when it is read at the first use of the cache.  Fields are colon
+   separated:
+
+   1. Version record
+
+        Field 1: Constant "v"
+        Field 2: Version number of this file.  Must be 1.
+
+   2. Status record
+
+        Field 1: Constant "g" for a good or "r" for a revoked
+                 certificate.
+        Field 2: Hex fingerprint of the issuer certificate.
+        Field 3: Hex serial number of the certificate.
+        Field 4: Constant "d" if the default responder was used,
+                 otherwise empty.
+        Field 5: 15 character ISO timestamp with THIS_UPDATE.
+        Field 6: 15 character ISO timestamp with NEXT_UPDATE.
+        Field 7: 15 character ISO timestamp with the revocation time
+                 or empty.
+        Field 8: The KSBA reason flags as decimal number.
+        Field 9: Hex fingerprint of the responder certificate if
+                 ONLY_VALID_IF_CERT_VALID needs to be emitted or
+                 empty.
+
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dirmngr.h"
+#include "misc.h"
+#include "ocspcache.h"
+
+/* The directory of the CRL cache and the name of our file.  */
+#define OCSP_CACHE_DIR "crls.d"
+#define OCSP_CACHE_FILE "ocsp.txt"
+#define OCSP_CACHE_VERSION 1
+
+/* The number of buckets of the hash table and the maximum number of
+ * entries.  */
+#define OCSP_CACHE_BUCKETS 256
+#define OCSP_CACHE_MAX_ENTRIES 10000
+
+/* The size of the buffer for a line of the file.  */
+#define OCSP_CACHE_LINELEN 512
+
+
+/* An entry of the cache.  */
+struct ocsp_cache_item_s
+{
+  struct ocsp_cache_item_s *next;
+  char *signer_fpr;         /* Malloced or NULL.  */
+  int default_responder;    /* Created by the default responder.  */
+  ksba_status_t status;
+  ksba_isotime_t this_update;
+  ksba_isotime_t next_update;
+  ksba_isotime_t revocation_time;
+  ksba_crl_reason_t reason;
+  char key[1];              /* "ISSUERFPR:SERIALNO" */
+};
+typedef struct ocsp_cache_item_s *ocsp_cache_item_t;
+
+
+/* The hash table and the number of entries.  The table is not
+ * protected by a lock because nPth switches threads only in calls
+ * which may block, like estream I/O or logging.  Thus no such call
+ * may be made while an item of the table is in use.  */
+static ocsp_cache_item_t ocsp_cache[OCSP_CACHE_BUCKETS];
+static unsigned int ocsp_cache_count;
+
+/* Set once we tried to read the file.  */
+static int loaded;
+
+
+
+/* Return the name of the cache file.  The caller must free it.  */
+static char *
+cache_fname (void)
+{
+  return make_filename (opt.homedir_cache, OCSP_CACHE_DIR, OCSP_CACHE_FILE,
+                        NULL);
+}
+
+
+static unsigned int
+bucket_of (const char *key)
+{
+  unsigned int hash = 0;
+
+  for (; *key; key++)
+    hash = hash * 31 + *(const unsigned char *)key;
+  return hash % OCSP_CACHE_BUCKETS;
+}
+
+
+static void
+release_item (ocsp_cache_item_t item)
+{
+  if (item)
+    {
+      xfree (item->signer_fpr);
+      xfree (item);
+    }
+}
+
+
+/* Return true if ITEM shall not be used anymore at time NOW.  */
+static int
+item_expired_p (ocsp_cache_item_t item, const ksba_isotime_t now)
+{
+  ksba_isotime_t tmp_time;
+
+  if (strcmp (item->next_update, now) <= 0)
+    return 1;
+
+  /* The same limit as used for a fresh response.  */
+  gnupg_copy_time (tmp_time, item->this_update);
+  add_seconds_to_isotime (tmp_time,
+                          opt.ocsp_max_period+opt.ocsp_max_clock_skew);
+  if (!*tmp_time || strcmp (tmp_time, now) < 0)
+    return 1;
+
+  return 0;
+}
+
+
+/* Build the key for CERT issued by ISSUER_CERT.  The caller must
+ * free the returned string.  Returns NULL on error.  */
+static char *
+make_key (ksba_cert_t cert, ksba_cert_t issuer_cert)
+{
+  char *issuer_fpr, *serialno, *key;
+  ksba_sexp_t serial;
+
+  serial = ksba_cert_get_serial (cert);
+  serialno = serial_hex (serial);
+  ksba_free (serial);
+  if (!serialno)
+    return NULL;
+  issuer_fpr = get_fingerprint_hexstring (issuer_cert);
+  key = strconcat (issuer_fpr, ":", serialno, NULL);
+  xfree (issuer_fpr);
+  xfree (serialno);
+  return key;
+}
+
+
+/* Find the entry with KEY and unlink it from the table if UNLINK is
+ * set.  */
+static ocsp_cache_item_t
+find_item (const char *key, int unlink)
+{
+  ocsp_cache_item_t item, *prevp;
+
+  for (prevp = &ocsp_cache[bucket_of (key)]; (item = *prevp);
+       prevp = &item->next)
+    if (!strcmp (item->key, key))
+      {
+        if (unlink)
+          {
+            *prevp = item->next;
+            item->next = NULL;
+            ocsp_cache_count--;
+          }
+        return item;
+      }
+  return NULL;
+}
+
+
+/* Remove all expired entries and, if the table is still full, the
+ * entry which expires first.  */
+static void
+make_room (void)
+{
+  ocsp_cache_item_t item, *prevp, *oldest;
+  ksba_isotime_t now;
+  unsigned int i;
+
+  gnupg_get_isotime (now);
+  oldest = NULL;
+  for (i=0; i < OCSP_CACHE_BUCKETS; i++)
+    for (prevp = &ocsp_cache[i]; (item = *prevp); )
+      {
+        if (item_expired_p (item, now))
+          {
+            *prevp = item->next;
+            release_item (item);
+            ocsp_cache_count--;
+          }
+        else
+          {
+            if (!oldest || strcmp (item->next_update,
+                                   (*oldest)->next_update) < 0)
+              oldest = prevp;
+            prevp = &item->next;
+          }
+      }
+
+  if (ocsp_cache_count >= OCSP_CACHE_MAX_ENTRIES && oldest)
+    {
+      item = *oldest;
+      *oldest = item->next;
+      release_item (item);
+      ocsp_cache_count--;
+    }
+}
+
+
+/* Insert ITEM into the table replacing an existing entry with the
+ * same key.  Returns true if an entry has been replaced.  */
+static int
+insert_item (ocsp_cache_item_t item)
+{
+  ocsp_cache_item_t old;
+  unsigned int bucket;
+
+  old = find_item (item->key, 1);
+  release_item (old);
+  if (ocsp_cache_count >= OCSP_CACHE_MAX_ENTRIES)
+    make_room ();
+
+  bucket = bucket_of (item->key);
+  item->next = ocsp_cache[bucket];
+  ocsp_cache[bucket] = item;
+  ocsp_cache_count++;
+  return !!old;
+}
+
+
+/* Format ITEM as a status record into BUFFER of SIZE.  Returns false
+ * if the record does not fit; it could not be read back anyway.  */
+static int
+format_item (char *buffer, size_t size, ocsp_cache_item_t item)
+{
+  int n;
+
+  n = snprintf (buffer, size, "%c:%s:%s:%s:%s:%s:%d:%s:\n",
+                item->status == KSBA_STATUS_REVOKED? 'r' : 'g',
+                item->key,
+                item->default_responder? "d":"",
+                item->this_update,
+                item->next_update,
+                item->revocation_time,
+                (int)item->reason,
+                item->signer_fpr? item->signer_fpr : "");
+  return n > 0 && n < size;
+}
+
+
+/* Parse the status record LINE and return a new item.  Returns NULL
+ * if the line is not a valid status record.  */
+static ocsp_cache_item_t
+parse_item (char *line)
+{
+  char *fields[10];
+  ocsp_cache_item_t item;
+  int n;
+
+  n = split_fields_colon (line, fields, DIM (fields));
+  if (n < 9
+      || (strcmp (fields[0], "g") && strcmp (fields[0], "r"))
+      || strlen (fields[1]) != 40 || !*fields[2]
+      || strlen (fields[4]) != 15 || strlen (fields[5]) != 15
+      || (*fields[6] && strlen (fields[6]) != 15))
+    return NULL;
+
+  item = xtrycalloc (1, sizeof *item + strlen (fields[1]) + 1
+                     + strlen (fields[2]));
+  if (!item)
+    return NULL;
+  strcpy (stpcpy (stpcpy (item->key, fields[1]), ":"), fields[2]);
+  item->status = (*fields[0] == 'r'? KSBA_STATUS_REVOKED
+                  /**/             : KSBA_STATUS_GOOD);
+  item->default_responder = (*fields[3] == 'd');
+  gnupg_copy_time (item->this_update, fields[4]);
+  gnupg_copy_time (item->next_update, fields[5]);
+  if (*fields[6])
+    gnupg_copy_time (item->revocation_time, fields[6]);
+  item->reason = atoi (fields[7]);
+  if (*fields[8])
+    {
+      item->signer_fpr = xtrystrdup (fields[8]);
+      if (!item->signer_fpr)
+        {
+          xfree (item);
+          return NULL;
+        }
+    }
+  return item;
+}
+
+
+/* Write all entries of the table to the cache file.  */
+static void
+rewrite_cache_file (const char *fname)
+{
+  char *tmpfname;
+  estream_t fp;
+  ocsp_cache_item_t item;
+  unsigned int i;
+  membuf_t mb;
+  char line[OCSP_CACHE_LINELEN];
+  char *buffer;
+  size_t length;
+  int rc;
+
+  /* Take a snapshot of the table first; the table may change as soon
+   * as we write to the file.  */
+  init_membuf (&mb, 4096);
+  put_membuf_printf (&mb, "v:%d:\n", OCSP_CACHE_VERSION);
+  for (i=0; i < OCSP_CACHE_BUCKETS; i++)
+    for (item = ocsp_cache[i]; item; item = item->next)
+      if (format_item (line, sizeof line, item))
+        put_membuf_str (&mb, line);
+  buffer = get_membuf (&mb, &length);
+  if (!buffer)
+    {
+      log_error ("error building '%s': %s\n", fname, strerror (errno));
+      return;
+    }
+
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  fp = es_fopen (tmpfname, "w,mode=-rw");
+  if (!fp)
+    {
+      log_error (_("error creating '%s': %s\n"), tmpfname, strerror (errno));
+      xfree (tmpfname);
+      xfree (buffer);
+      return;
+    }
+  rc = es_write (fp, buffer, length, NULL);
+  xfree (buffer);
+  if (es_fclose (fp) || rc)
+    {
+      log_error (_("error writing '%s': %s\n"), tmpfname, strerror (errno));
+      gnupg_remove (tmpfname);
+      xfree (tmpfname);
+      return;
+    }
+
+#ifdef HAVE_W32_SYSTEM
+  /* No atomic mv on W32 systems.  */
+  gnupg_remove (fname);
+#endif
+  if (rename (tmpfname, fname))
+    {
+      log_error (_("error renaming '%s' to '%s': %s\n"),
+                 tmpfname, fname, strerror (errno));
+      gnupg_remove (tmpfname);
+    }
+  xfree (tmpfname);
+}
+
+
+/* Read the cache file into the table.  */
+static void
+load_cache (void)
+{
+  char *fname;
+  estream_t fp;
+  char line[OCSP_CACHE_LINELEN];
+  ksba_isotime_t now;
+  ocsp_cache_item_t item;
+  unsigned int stale = 0;
+  int version_okay = 0;
+
+  loaded = 1;
+  fname = cache_fname ();
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_error (_("can't open '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+
+  gnupg_get_isotime (now);
+  while (es_fgets (line, sizeof line, fp))
+    {
+      if (!*line || line[strlen (line)-1] != '\n')
+        {
+          /* Line too long or last line truncated.  */
+          stale++;
+          while (*line && line[strlen (line)-1] != '\n'
+                 && es_fgets (line, sizeof line, fp))
+            ;
+          continue;
+        }
+      trim_trailing_spaces (line);
+      if (*line == '#')
+        continue;
+      if (!version_okay)
+        {
+          if (*line == 'v' && line[1] == ':'
+              && atoi (line+2) == OCSP_CACHE_VERSION)
+            {
+              version_okay = 1;
+              continue;
+            }
+          break;
+        }
+
+      item = parse_item (line);
+      if (!item || item_expired_p (item, now))
+        {
+          release_item (item);
+          stale++;
+        }
+      else if (insert_item (item))
+        stale++;
+    }
+  if (es_ferror (fp))
+    log_error (_("error reading '%s': %s\n"), fname, strerror (errno));
+  es_fclose (fp);
+
+  if (!version_okay)
+    {
+      log_info ("'%s' is not an OCSP cache - starting anew\n", fname);
+      ocsp_cache_flush ();
+    }
+  else
+    {
+      if (DBG_CACHE)
+        log_debug ("ocspcache: %u entries read from '%s' (%u stale)\n",
+                   ocsp_cache_count, fname, stale);
+      if (stale)
+        rewrite_cache_file (fname);
+    }
+  xfree (fname);
+}
+
+
+/* Append the status record RECORD to the cache file.  */
+static void
+append_to_cache_file (const char *record)
+{
+  char *fname;
+  estream_t fp;
+
+  fname = cache_fname ();
+  fp = es_fopen (fname, "a,mode=-rw");
+  if (!fp)
+    {
+      if (opt.verbose)
+        log_info (_("can't open '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+  /* The position of a stream in append mode is not defined before
+     the first write.  */
+  if (!es_fseek (fp, 0, SEEK_END) && !es_ftell (fp))
+    es_fprintf (fp, "v:%d:\n", OCSP_CACHE_VERSION);
+  es_fputs (record, fp);
+  if (es_fclose (fp))
+    log_error (_("error writing '%s': %s\n"), fname, strerror (errno));
+  xfree (fname);
+}
+
+
+
+/* Look up the cached OCSP status of CERT which has been issued by
+ * ISSUER_CERT.  With DEFAULT_RESPONDER_ONLY set only responses from
+ * the default OCSP responder are considered.  On success true is
+ * returned and the status is stored at R_STATUS; the caller must
+ * then release R_STATUS->SIGNER_FPR.  */
+int
+ocsp_cache_get (ksba_cert_t cert, ksba_cert_t issuer_cert,
+                int default_responder_only,
+                struct ocsp_cache_status_s *r_status)
+{
+  ocsp_cache_item_t item;
+  ksba_isotime_t now;
+  char *key;
+  int hit = 0;
+
+  memset (r_status, 0, sizeof *r_status);
+  if (!loaded)
+    load_cache ();
+
+  key = make_key (cert, issuer_cert);
+  if (!key)
+    return 0;
+  item = find_item (key, 0);
+  if (item)
+    {
+      gnupg_get_isotime (now);
+      if (item_expired_p (item, now))
+        {
+          find_item (key, 1);
+          release_item (item);
+          item = NULL;
+        }
+      else if (default_responder_only && !item->default_responder)
+        item = NULL;
+    }
+
+  /* Copy the status before logging.  */
+  if (item && (!item->signer_fpr
+               || (r_status->signer_fpr = xtrystrdup (item->signer_fpr))))
+    {
+      r_status->status = item->status;
+      gnupg_copy_time (r_status->this_update, item->this_update);
+      gnupg_copy_time (r_status->next_update, item->next_update);
+      if (*item->revocation_time)
+        gnupg_copy_time (r_status->revocation_time, item->revocation_time);
+      r_status->reason = item->reason;
+      hit = 1;
+    }
+
+  if (DBG_CACHE)
+    log_debug ("ocspcache: %s: %s\n", key, hit? "hit" : "miss");
+  xfree (key);
+  return hit;
+}
+
+
+/* Store the OCSP STATUS of CERT which has been issued by ISSUER_CERT.
+ * DEFAULT_RESPONDER tells whether the default OCSP responder has
+ * been used.  Only good and revoked states with a NEXT_UPDATE are
+ * stored.  */
+void
+ocsp_cache_put (ksba_cert_t cert, ksba_cert_t issuer_cert,
+                int default_responder,
+                const struct ocsp_cache_status_s *status)
+{
+  ocsp_cache_item_t item;
+  ksba_isotime_t now;
+  char *key;
+  char record[OCSP_CACHE_LINELEN];
+
+  if ((status->status != KSBA_STATUS_GOOD
+       && status->status != KSBA_STATUS_REVOKED)
+      || !*status->next_update || !*status->this_update)
+    return;
+
+  if (!loaded)
+    load_cache ();
+
+  key = make_key (cert, issuer_cert);
+  if (!key)
+    return;
+  item = xtrycalloc (1, sizeof *item + strlen (key));
+  if (!item)
+    {
+      xfree (key);
+      return;
+    }
+  strcpy (item->key, key);
+  xfree (key);
+  if (status->signer_fpr)
+    {
+      item->signer_fpr = xtrystrdup (status->signer_fpr);
+      if (!item->signer_fpr)
+        {
+          xfree (item);
+          return;
+        }
+    }
+  item->default_responder = !!default_responder;
+  item->status = status->status;
+  gnupg_copy_time (item->this_update, status->this_update);
+  gnupg_copy_time (item->next_update, status->next_update);
+  if (status->status == KSBA_STATUS_REVOKED && *status->revocation_time)
+    gnupg_copy_time (item->revocation_time, status->revocation_time);
+  item->reason = status->reason;
+
+  gnupg_get_isotime (now);
+  if (item_expired_p (item, now))
+    {
+      release_item (item);
+      return;
+    }
+
+  /* Format and log while ITEM is not yet in the table; once it is,
+   * another thread may replace it while we write the file.  */
+  if (!format_item (record, sizeof record, item))
+    *record = 0;
+  if (DBG_CACHE)
+    log_debug ("ocspcache: %s: storing until %s\n",
+               item->key, item->next_update);
+  insert_item (item);
+  if (*record)
+    append_to_cache_file (record);
+}
+
+
+/* Remove all entries from the cache and delete the cache file.  */
+void
+ocsp_cache_flush (void)
+{
+  ocsp_cache_item_t item, next;
+  char *fname;
+  unsigned int i;
+
+  for (i=0; i < OCSP_CACHE_BUCKETS; i++)
+    {
+      for (item = ocsp_cache[i]; item; item = next)
+        {
+          next = item->next;
+          release_item (item);
+        }
+      ocsp_cache[i] = NULL;
+    }
+  ocsp_cache_count = 0;
+
+  fname = cache_fname ();
+  if (gnupg_remove (fname) && errno != ENOENT)
+    log_error ("failed to remove '%s': %s\n", fname, strerror (errno));
+  xfree (fname);
+  loaded = 1;
+}
@@ -0,0 +1,52 @@
+/* ocspcache.h - Cache for OCSP responses
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OCSPCACHE_H
+#define OCSPCACHE_H
+
+/* The status of a certificate as stored in the cache.  */
+struct ocsp_cache_status_s
+{
+  ksba_status_t status;             /* KSBA_STATUS_GOOD or _REVOKED.  */
+  ksba_isotime_t this_update;
+  ksba_isotime_t next_update;
+  ksba_isotime_t revocation_time;
+  ksba_crl_reason_t reason;
+  char *signer_fpr;                 /* Malloced fingerprint of the
+                                       responder's certificate if it
+                                       has not been verified or NULL.  */
+};
+typedef struct ocsp_cache_status_s *ocsp_cache_status_t;
+
+
+/* Look up the status of CERT issued by ISSUER_CERT.  */
+int ocsp_cache_get (ksba_cert_t cert, ksba_cert_t issuer_cert,
+                    int default_responder_only,
+                    struct ocsp_cache_status_s *r_status);
+
+/* Store the status of CERT issued by ISSUER_CERT.  */
+void ocsp_cache_put (ksba_cert_t cert, ksba_cert_t issuer_cert,
+                     int default_responder,
+                     const struct ocsp_cache_status_s *status);
+
+/* Remove all entries from the cache.  */
+void ocsp_cache_flush (void);
+
+
+#endif /*OCSPCACHE_H*/
@@ -42,6 +42,7 @@
 # include "ldapserver.h"
 #endif
 #include "ocsp.h"
+#include "ocspcache.h"
 #include "certcache.h"
 #include "validate.h"
 #include "misc.h"
@@ -77,6 +78,10 @@
    them such large blobs.  */
 #define MAX_KEYBLOCK_LENGTH (20*1024*1024)
 
+/* The limit for the PATTERNS inquiry of KS_GET --bulk.  This allows
+ * for about 100000 fingerprints.  */
+#define MAX_PATTERNS_LENGTH (4*1024*1024)
+
 
 #define PARM_ERROR(t) assuan_set_error (ctx, \
                                         gpg_error (GPG_ERR_ASS_PARAMETER), (t))
@@ -2402,11 +2407,19 @@ cmd_ks_search (assuan_context_t ctx, char *line)
 
 
 static const char hlp_ks_get[] =
-  "KS_GET {<pattern>}\n"
+  "KS_GET [--quick] [--bulk] {<pattern>}\n"
   "\n"
   "Get the keys matching PATTERN from the configured OpenPGP keyservers\n"
   "(see command KEYSERVER).  Each pattern should be a keyid, a fingerprint,\n"
-  "or an exact name indicated by the '=' prefix.";
+  "or an exact name indicated by the '=' prefix.\n"
+  "\n"
+  "With --bulk the patterns are not given on the command line but\n"
+  "requested by the inquiry\n"
+  "\n"
+  "  INQUIRE PATTERNS\n"
+  "\n"
+  "The client shall respond with the patterns delimited by LFs.  The\n"
+  "keys are then fetched concurrently and returned as they arrive.";
 static gpg_error_t
 cmd_ks_get (assuan_context_t ctx, char *line)
 {
@@ -2415,19 +2428,49 @@ cmd_ks_get (assuan_context_t ctx, char *line)
   strlist_t list, sl;
   char *p;
   estream_t outfp;
+  int bulk;
+  unsigned char *value = NULL;
+  size_t valuelen;
 
   if (has_option (line, "--quick"))
     ctrl->timeout = opt.connect_quick_timeout;
+  bulk = has_option (line, "--bulk");
   line = skip_options (line);
 
+  list = NULL;
+  if (bulk)
+    {
+      if (*line)
+        {
+          err = PARM_ERROR ("no patterns expected with --bulk");
+          goto leave;
+        }
+      err = assuan_inquire (ctx, "PATTERNS",
+                            &value, &valuelen, MAX_PATTERNS_LENGTH);
+      if (err)
+        {
+          log_error (_("assuan_inquire failed: %s\n"), gpg_strerror (err));
+          goto leave;
+        }
+      /* Make sure that the value is a string.  */
+      p = xtryrealloc (value, valuelen + 1);
+      if (!p)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      value = (unsigned char *)p;
+      value[valuelen] = 0;
+      line = (char *)value;
+    }
+
   /* Break the line into a strlist.  Each pattern is by
      definition percent-plus escaped.  However we only support keyids
      and fingerprints and thus the client has no need to apply the
      escaping.  */
-  list = NULL;
   for (p=line; *p; line = p)
     {
-      while (*p && *p != ' ')
+      while (*p && *p != ' ' && *p != '\n')
         p++;
       if (*p)
         *p++ = 0;
@@ -2459,13 +2502,19 @@ cmd_ks_get (assuan_context_t ctx, char *line)
       ctrl->server_local->inhibit_data_logging = 1;
       ctrl->server_local->inhibit_data_logging_now = 0;
       ctrl->server_local->inhibit_data_logging_count = 0;
-      err = ks_action_get (ctrl, ctrl->server_local->keyservers, list, outfp);
+      if (bulk)
+        err = ks_action_get_bulk (ctrl, ctrl->server_local->keyservers,
+                                  list, outfp);
+      else
+        err = ks_action_get (ctrl, ctrl->server_local->keyservers,
+                             list, outfp);
       es_fclose (outfp);
       ctrl->server_local->inhibit_data_logging = 0;
     }
 
  leave:
   free_strlist (list);
+  xfree (value);
   return leave_cmd (ctx, err);
 }
 
@@ -2597,6 +2646,20 @@ cmd_loadswdb (assuan_context_t ctx, char *line)
 
 
 
+/* Return true if the command CMD implements the option CMDOPT.  */
+static int
+command_has_option (const char *cmd, const char *cmdopt)
+{
+  if (!strcmp (cmd, "KS_GET"))
+    {
+      if (!strcmp (cmdopt, "bulk"))
+        return 1;
+    }
+
+  return 0;
+}
+
+
 static const char hlp_getinfo[] =
   "GETINFO <what>\n"
   "\n"
@@ -2607,10 +2670,13 @@ static const char hlp_getinfo[] =
   "pid         - Return the process id of the server.\n"
   "tor         - Return OK if running in Tor mode\n"
   "dnsinfo     - Return info about the DNS resolver\n"
+  "dnscache    - Return statistics of the DNS cache\n"
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
   "workqueue   - Inspect the work queue\n"
-  "getenv NAME - Return value of envvar NAME\n";
+  "getenv NAME - Return value of envvar NAME\n"
+  "cmd_has_option CMD OPT\n"
+  "            - Returns OK if command CMD has option OPT.\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
@@ -2673,11 +2739,52 @@ cmd_getinfo (assuan_context_t ctx, char *line)
         }
       err = 0;
     }
+  else if (!strcmp (line, "dnscache"))
+    {
+      struct dns_cache_stats_s stats;
+      char *buf;
+
+      get_dns_cache_stats (&stats);
+      buf = xtryasprintf ("entries=%u size=%u hits=%u neghits=%u misses=%u"
+                          " expired=%u evicted=%u",
+                          stats.entries, stats.size, stats.hits,
+                          stats.neghits, stats.misses,
+                          stats.expired, stats.evicted);
+      if (!buf)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
   else if (!strcmp (line, "workqueue"))
     {
       workqueue_dump_queue (ctrl);
       err = 0;
     }
+  else if (!strncmp (line, "cmd_has_option", 14)
+           && (line[14] == ' ' || line[14] == '\t' || !line[14]))
+    {
+      char *cmd;
+
+      line += 14;
+      while (*line == ' ' || *line == '\t')
+        line++;
+      cmd = line;
+      while (*line && *line != ' ' && *line != '\t')
+        line++;
+      if (*line)
+        *line++ = 0;
+      while (*line == ' ' || *line == '\t')
+        line++;
+      if (!*cmd || !*line)
+        err = gpg_error (GPG_ERR_MISSING_VALUE);
+      else if (!command_has_option (cmd, line))
+        err = gpg_error (GPG_ERR_FALSE);
+      else
+        err = 0;
+    }
   else if (!strncmp (line, "getenv", 6)
            && (line[6] == ' ' || line[6] == '\t' || !line[6]))
     {
@@ -2740,17 +2847,32 @@ cmd_reloaddirmngr (assuan_context_t ctx, char *line)
 static const char hlp_flushcrls[] =
   "FLUSHCRLS\n"
   "\n"
-  "Remove all cached CRLs from memory and\n"
+  "Remove all cached CRLs and OCSP responses from memory and\n"
   "the file system.";
 static gpg_error_t
 cmd_flushcrls (assuan_context_t ctx, char *line)
 {
   (void)line;
 
+  ocsp_cache_flush ();
   return leave_cmd (ctx, crl_cache_flush () ? GPG_ERR_GENERAL : 0);
 }
 
 
+static const char hlp_flushdns[] =
+  "FLUSHDNS\n"
+  "\n"
+  "Remove all cached DNS answers from memory.";
+static gpg_error_t
+cmd_flushdns (assuan_context_t ctx, char *line)
+{
+  (void)line;
+
+  flush_dns_cache ();
+  return leave_cmd (ctx, 0);
+}
+
+
 
 /* Tell the assuan library about our commands. */
 static int
@@ -2782,6 +2904,7 @@ register_commands (assuan_context_t ctx)
     { "KILLDIRMNGR",cmd_killdirmngr,hlp_killdirmngr },
     { "RELOADDIRMNGR",cmd_reloaddirmngr,hlp_reloaddirmngr },
     { "FLUSHCRLS",  cmd_flushcrls,  hlp_flushcrls },
+    { "FLUSHDNS",   cmd_flushdns,   hlp_flushdns },
     { NULL, NULL }
   };
   int i, j, rc;
@@ -0,0 +1,385 @@
+/* t-dns-cache.c - Tests for the DNS cache of dns-stuff.c
+ * Copyright (C) 2020  g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The tests run a minimal nameserver on the loopback interface in a
+ * child process and direct libdns to it.  The nameserver counts the
+ * queries it receives in a shared memory page so that we can tell
+ * whether an answer has been taken from the cache.  The nameserver
+ * knows these names:
+ *
+ *   a.test                       - A 10.0.0.1, no AAAA records
+ *   _pgpkey-https._tcp.srv.test  - SRV with a TTL of 1 second
+ *
+ * All other names do not exist.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef HAVE_W32_SYSTEM
+# include <signal.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/mman.h>
+# include <sys/wait.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+
+#include "../common/util.h"
+#include "t-support.h"
+#include "dns-stuff.h"
+
+#define PGM "t-dns-cache"
+
+static int verbose;
+
+/* The number of queries received by the nameserver.  */
+static volatile unsigned int *query_count;
+
+
+#ifndef HAVE_W32_SYSTEM
+
+/* Append a resource record for the question at offset 12 with TYPE,
+ * TTL and the RDATA of length RDLEN to the answer at P.  Returns the
+ * new end of the answer.  */
+static unsigned char *
+put_rr (unsigned char *p, int type, unsigned int ttl,
+        const unsigned char *rdata, int rdlen)
+{
+  *p++ = 0xc0;  /* Pointer to the name of the question.  */
+  *p++ = 12;
+  *p++ = type >> 8;
+  *p++ = type;
+  *p++ = 0;     /* Class IN.  */
+  *p++ = 1;
+  *p++ = ttl >> 24;
+  *p++ = ttl >> 16;
+  *p++ = ttl >> 8;
+  *p++ = ttl;
+  *p++ = rdlen >> 8;
+  *p++ = rdlen;
+  memcpy (p, rdata, rdlen);
+  return p + rdlen;
+}
+
+
+/* Answer the QUERY of length QUERYLEN into ANSWER and return the
+ * length of the answer or 0 to ignore the query.  */
+static size_t
+make_answer (const unsigned char *query, size_t querylen,
+             unsigned char *answer)
+{
+  static const unsigned char a_rdata[4] = { 10, 0, 0, 1 };
+  static const unsigned char srv_rdata[] =
+    { 0, 10, 0, 5, 0x01, 0xbb, 1, 'a', 4, 't', 'e', 's', 't', 0 };
+  char name[256];
+  size_t namelen = 0;
+  size_t off, n;
+  int type, ancount = 0;
+  unsigned char *p;
+
+  if (querylen < 12 + 5)
+    return 0;
+
+  /* Parse the question.  */
+  for (off = 12; off < querylen && query[off]; off += n + 1)
+    {
+      n = query[off];
+      if (n > 63 || off + n + 1 >= querylen || namelen + n + 1 >= sizeof name)
+        return 0;
+      if (namelen)
+        name[namelen++] = '.';
+      memcpy (name + namelen, query + off + 1, n);
+      namelen += n;
+    }
+  name[namelen] = 0;
+  off++;
+  if (off + 4 > querylen)
+    return 0;
+  type = (query[off] << 8) | query[off+1];
+  off += 4;
+
+  if (verbose)
+    fprintf (stderr, PGM ": server got query for '%s' type %d\n", name, type);
+
+  /* Header and question.  */
+  memcpy (answer, query, off);
+  answer[2] = 0x84 | (query[2] & 0x01);  /* QR, AA, RD */
+  answer[3] = 0x80;                      /* RA, NOERROR */
+  answer[6] = answer[7] = answer[8] = answer[9] = answer[10] = answer[11] = 0;
+  p = answer + off;
+
+  if (!strcasecmp (name, "a.test"))
+    {
+      if (type == 1)
+        {
+          p = put_rr (p, 1, 600, a_rdata, sizeof a_rdata);
+          ancount++;
+        }
+    }
+  else if (!strcasecmp (name, "_pgpkey-https._tcp.srv.test"))
+    {
+      if (type == 33)
+        {
+          p = put_rr (p, 33, 1, srv_rdata, sizeof srv_rdata);
+          ancount++;
+        }
+    }
+  else
+    answer[3] |= 3;  /* NXDOMAIN */
+
+  answer[7] = ancount;
+  return p - answer;
+}
+
+
+/* Start the nameserver and return its port.  The pid of the server
+ * is stored at R_PID.  */
+static unsigned short
+start_server (pid_t *r_pid)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  unsigned char query[512], answer[1024];
+  ssize_t n;
+  size_t len;
+  int fd;
+  pid_t pid;
+
+  fd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1)
+    fail (0);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind (fd, (struct sockaddr *)&addr, sizeof addr))
+    fail (0);
+  addrlen = sizeof addr;
+  if (getsockname (fd, (struct sockaddr *)&addr, &addrlen))
+    fail (0);
+
+  pid = fork ();
+  if (pid == (pid_t)(-1))
+    fail (0);
+  if (pid)
+    {
+      close (fd);
+      *r_pid = pid;
+      return ntohs (addr.sin_port);
+    }
+
+  /* The server process.  */
+  for (;;)
+    {
+      struct sockaddr_storage peer;
+      socklen_t peerlen = sizeof peer;
+
+      n = recvfrom (fd, query, sizeof query, 0,
+                    (struct sockaddr *)&peer, &peerlen);
+      if (n <= 0)
+        continue;
+      (*query_count)++;
+      len = make_answer (query, n, answer);
+      if (len)
+        sendto (fd, answer, len, 0, (struct sockaddr *)&peer, peerlen);
+    }
+}
+
+
+/* Resolve NAME and check that the first address is EXPECTED or that
+ * the lookup fails if EXPECTED is NULL.  */
+static void
+check_name (const char *name, const char *expected)
+{
+  gpg_error_t err;
+  dns_addrinfo_t aibuf, ai;
+  char buffer[INET_ADDRSTRLEN];
+
+  err = resolve_dns_name (NULL, name, 0, 0, SOCK_STREAM, &aibuf, NULL);
+  if (verbose)
+    fprintf (stderr, PGM ": resolve_dns_name(%s): %s\n",
+             name, gpg_strerror (err));
+  if (!expected)
+    {
+      if (!err)
+        fail (0);
+      return;
+    }
+  if (err)
+    fail (0);
+
+  for (ai = aibuf; ai; ai = ai->next)
+    if (ai->family == AF_INET)
+      break;
+  if (!ai
+      || !inet_ntop (AF_INET, &((struct sockaddr_in *)ai->addr)->sin_addr,
+                     buffer, sizeof buffer)
+      || strcmp (buffer, expected))
+    fail (0);
+  free_dns_addrinfo (aibuf);
+}
+
+
+/* Query the SRV record and check the result.  */
+static void
+check_srv (void)
+{
+  gpg_error_t err;
+  struct srventry *srvs;
+  unsigned int count;
+
+  err = get_dns_srv (NULL, "srv.test", "pgpkey-https", NULL, &srvs, &count);
+  if (err || count != 1
+      || srvs[0].port != 443 || strcmp (srvs[0].target, "a.test"))
+    fail (0);
+  xfree (srvs);
+}
+
+
+/* Check that the number of queries has not changed since the last
+ * call if NEW is false and that it has changed if NEW is true.  */
+static void
+check_queries (int new, int line)
+{
+  static unsigned int last;
+  unsigned int count = *query_count;
+
+  if (verbose)
+    fprintf (stderr, PGM ": line %d: %u queries\n", line, count);
+  if (new? (count == last) : (count != last))
+    fail (line);
+  last = count;
+}
+
+
+static void
+test_dns_cache (void)
+{
+  char fname[100];
+  FILE *fp;
+  pid_t pid;
+  unsigned short port;
+  struct dns_cache_stats_s stats;
+
+  query_count = mmap (NULL, sizeof *query_count, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (query_count == MAP_FAILED)
+    fail (0);
+  port = start_server (&pid);
+
+  snprintf (fname, sizeof fname, "t-dns-cache-%d.conf", (int)getpid ());
+  fp = fopen (fname, "w");
+  if (!fp)
+    fail (0);
+  fprintf (fp, "nameserver [127.0.0.1]:%hu\n", port);
+  fclose (fp);
+  set_dns_resolv_conf (fname);
+
+  /* Positive answers.  */
+  check_name ("a.test", "10.0.0.1");
+  check_queries (1, __LINE__);
+  check_name ("a.test", "10.0.0.1");
+  check_name ("A.TEST", "10.0.0.1");
+  check_queries (0, __LINE__);
+
+  /* Negative answers.  */
+  check_name ("nx.test", NULL);
+  check_queries (1, __LINE__);
+  check_name ("nx.test", NULL);
+  check_queries (0, __LINE__);
+
+  /* The SRV record expires after one second.  */
+  check_srv ();
+  check_queries (1, __LINE__);
+  check_srv ();
+  check_queries (0, __LINE__);
+  sleep (2);
+  check_srv ();
+  check_queries (1, __LINE__);
+
+  get_dns_cache_stats (&stats);
+  if (verbose)
+    fprintf (stderr, PGM ": entries=%u hits=%u neghits=%u misses=%u"
+             " expired=%u evicted=%u\n",
+             stats.entries, stats.hits, stats.neghits, stats.misses,
+             stats.expired, stats.evicted);
+  if (stats.entries != 3 || stats.hits != 3 || stats.neghits != 1
+      || stats.misses != 4 || stats.expired != 1 || stats.evicted)
+    fail (0);
+
+  /* A flushed cache asks the nameserver again.  */
+  flush_dns_cache ();
+  check_name ("a.test", "10.0.0.1");
+  check_queries (1, __LINE__);
+
+  /* With a size of one each new entry evicts the former one.  */
+  set_dns_cache_size (1);
+  check_name ("a.test", "10.0.0.1");
+  check_queries (0, __LINE__);
+  check_name ("nx.test", NULL);
+  check_queries (1, __LINE__);
+  check_name ("a.test", "10.0.0.1");
+  check_queries (1, __LINE__);
+  get_dns_cache_stats (&stats);
+  if (stats.entries != 1 || stats.evicted != 2)
+    fail (0);
+
+  /* A disabled cache asks the nameserver for each lookup.  */
+  set_dns_cache_size (0);
+  check_name ("a.test", "10.0.0.1");
+  check_queries (1, __LINE__);
+  check_name ("a.test", "10.0.0.1");
+  check_queries (1, __LINE__);
+
+  set_dns_resolv_conf (NULL);
+  remove (fname);
+  kill (pid, SIGTERM);
+  waitpid (pid, NULL, 0);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc)
+    { argc--; argv++; }
+  if (argc && !strcmp (*argv, "--verbose"))
+    {
+      verbose = 1;
+      argc--; argv++;
+    }
+  else if (argc && !strcmp (*argv, "--debug"))
+    {
+      verbose = 2;
+      argc--; argv++;
+    }
+
+  set_dns_verbose (verbose, verbose > 1);
+
+#ifndef HAVE_W32_SYSTEM
+  test_dns_cache ();
+#endif
+
+  return 0;
+}
@@ -0,0 +1,325 @@
+/* t-http-keepalive.c - Tests for the connection pool of http.c
+ * Copyright (C) 2020  g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The tests run a minimal HTTP server on the loopback interface in a
+ * child process.  For each accepted connection the server forks a
+ * handler which answers the requests on that connection.  The
+ * resource "/count" returns the number of connections the server has
+ * accepted so far and thus tells us whether a connection has been
+ * reused.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef HAVE_W32_SYSTEM
+# include <signal.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/wait.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+#include <assuan.h>
+
+#include "../common/util.h"
+#include "t-support.h"
+#include "http.h"
+
+#define PGM "t-http-keepalive"
+
+static int verbose;
+
+
+#ifndef HAVE_W32_SYSTEM
+
+/* Read a request from FD into BUFFER.  Returns false on EOF.  */
+static int
+read_request (int fd, char *buffer, size_t size)
+{
+  size_t len = 0;
+  ssize_t n;
+
+  while (len + 1 < size)
+    {
+      n = read (fd, buffer + len, 1);
+      if (n <= 0)
+        return 0;
+      len++;
+      buffer[len] = 0;
+      if (len >= 4 && !strcmp (buffer + len - 4, "\r\n\r\n"))
+        return 1;
+    }
+  return 0;
+}
+
+
+static void
+write_string (int fd, const char *string)
+{
+  size_t len = strlen (string);
+
+  if (write (fd, string, len) != (ssize_t)len)
+    exit (1);
+}
+
+
+/* Answer the requests on the connection FD.  COUNT is the number of
+ * connections accepted including this one.  */
+static void
+handle_connection (int fd, unsigned int count)
+{
+  char request[1024];
+  char line[256];
+  int keep_alive;
+
+  while (read_request (fd, request, sizeof request))
+    {
+      if (verbose)
+        fprintf (stderr, PGM ": server got '%.*s'\n",
+                 (int)strcspn (request, "\r\n"), request);
+      keep_alive = !!strstr (request, " HTTP/1.1\r\n");
+
+      if (!strncmp (request, "GET /cl ", 8))
+        write_string (fd, "HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 5\r\n"
+                      "\r\n"
+                      "hello");
+      else if (!strncmp (request, "GET /chunked ", 13))
+        write_string (fd, "HTTP/1.1 200 OK\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "\r\n"
+                      "3\r\nhel\r\n"
+                      "2;foo=bar\r\nlo\r\n"
+                      "0\r\n"
+                      "X-Trailer: foo\r\n"
+                      "\r\n");
+      else if (!strncmp (request, "GET /close ", 11))
+        {
+          write_string (fd, "HTTP/1.1 200 OK\r\n"
+                        "Content-Length: 5\r\n"
+                        "Connection: close\r\n"
+                        "\r\n"
+                        "hello");
+          keep_alive = 0;
+        }
+      else if (!strncmp (request, "GET /count ", 11))
+        {
+          snprintf (line, sizeof line, "HTTP/1.1 200 OK\r\n"
+                    "Content-Length: %d\r\n"
+                    "\r\n"
+                    "%u", snprintf (NULL, 0, "%u", count), count);
+          write_string (fd, line);
+        }
+      else
+        write_string (fd, "HTTP/1.1 404 Not Found\r\n"
+                      "Content-Length: 0\r\n"
+                      "\r\n");
+
+      if (!keep_alive)
+        break;
+    }
+  close (fd);
+}
+
+
+/* Start the server and return its port.  The pid of the server is
+ * stored at R_PID.  */
+static unsigned short
+start_server (pid_t *r_pid)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  unsigned int count = 0;
+  int lfd, fd;
+  pid_t pid;
+
+  lfd = socket (AF_INET, SOCK_STREAM, 0);
+  if (lfd == -1)
+    fail (0);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind (lfd, (struct sockaddr *)&addr, sizeof addr)
+      || listen (lfd, 5))
+    fail (0);
+  addrlen = sizeof addr;
+  if (getsockname (lfd, (struct sockaddr *)&addr, &addrlen))
+    fail (0);
+
+  pid = fork ();
+  if (pid == (pid_t)(-1))
+    fail (0);
+  if (pid)
+    {
+      close (lfd);
+      *r_pid = pid;
+      return ntohs (addr.sin_port);
+    }
+
+  /* The server process.  */
+  signal (SIGCHLD, SIG_IGN);
+  for (;;)
+    {
+      fd = accept (lfd, NULL, NULL);
+      if (fd == -1)
+        continue;
+      count++;
+      pid = fork ();
+      if (!pid)
+        {
+          close (lfd);
+          handle_connection (fd, count);
+          exit (0);
+        }
+      close (fd);
+    }
+}
+
+
+/* Fetch the resource PATH from the server at PORT and return its
+ * content.  */
+static char *
+fetch (unsigned short port, const char *path, unsigned int flags)
+{
+  gpg_error_t err;
+  http_t hd;
+  char url[100];
+  char buffer[256];
+  size_t len, nread;
+  estream_t fp;
+
+  snprintf (url, sizeof url, "http://127.0.0.1:%hu%s", port, path);
+  err = http_open_document (NULL, &hd, url, NULL, flags, NULL, NULL,
+                            NULL, NULL);
+  if (err)
+    {
+      fprintf (stderr, PGM ": fetching '%s' failed: %s\n",
+               url, gpg_strerror (err));
+      fail (0);
+    }
+  if (http_get_status_code (hd) != 200)
+    fail (http_get_status_code (hd));
+
+  fp = http_get_read_ptr (hd);
+  len = 0;
+  while (!es_read (fp, buffer + len, sizeof buffer - len - 1, &nread)
+         && nread)
+    len += nread;
+  if (es_ferror (fp))
+    fail (0);
+  buffer[len] = 0;
+  http_close (hd, 0);
+
+  if (verbose)
+    fprintf (stderr, PGM ": got '%s' for '%s'\n", buffer, path);
+  return xstrdup (buffer);
+}
+
+
+static void
+check_fetch (unsigned short port, const char *path, unsigned int flags,
+             const char *expected)
+{
+  char *result;
+
+  result = fetch (port, path, flags);
+  if (strcmp (result, expected))
+    {
+      fprintf (stderr, "want: '%s'\n", expected);
+      fprintf (stderr, "got : '%s'\n", result);
+      fail (0);
+    }
+  xfree (result);
+}
+
+
+static void
+test_keep_alive (void)
+{
+  unsigned short port;
+  pid_t pid;
+  unsigned int idle, hits, misses, resumed;
+
+  port = start_server (&pid);
+  http_set_keep_alive_timeout (30);
+
+  /* All these requests use the same connection.  */
+  check_fetch (port, "/cl", HTTP_FLAG_KEEP_ALIVE, "hello");
+  check_fetch (port, "/chunked", HTTP_FLAG_KEEP_ALIVE, "hello");
+  check_fetch (port, "/count", HTTP_FLAG_KEEP_ALIVE, "1");
+
+  /* The server closes the connection after this request.  */
+  check_fetch (port, "/close", HTTP_FLAG_KEEP_ALIVE, "hello");
+  check_fetch (port, "/count", HTTP_FLAG_KEEP_ALIVE, "2");
+
+  /* Without the flag a new connection is used.  */
+  check_fetch (port, "/count", 0, "3");
+  check_fetch (port, "/chunked", 0, "hello");
+
+  http_get_pool_stats ("127.0.0.1", &idle, &hits, &misses, &resumed);
+  if (idle != 1 || hits != 3 || misses != 2 || resumed)
+    {
+      fprintf (stderr, "idle=%u hits=%u misses=%u resumed=%u\n",
+               idle, hits, misses, resumed);
+      fail (0);
+    }
+
+  /* Disabling the pool closes the idle connection.  */
+  http_set_keep_alive_timeout (0);
+  http_get_pool_stats ("127.0.0.1", &idle, &hits, &misses, &resumed);
+  if (idle)
+    fail (0);
+  check_fetch (port, "/count", HTTP_FLAG_KEEP_ALIVE, "5");
+
+  kill (pid, SIGTERM);
+  waitpid (pid, NULL, 0);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc)
+    { argc--; argv++; }
+  if (argc && !strcmp (*argv, "--verbose"))
+    {
+      verbose = 1;
+      argc--; argv++;
+    }
+  else if (argc && !strcmp (*argv, "--debug"))
+    {
+      verbose = 2;
+      argc--; argv++;
+    }
+
+  http_set_verbose (verbose, verbose > 1);
+
+  assuan_sock_init ();
+
+#ifndef HAVE_W32_SYSTEM
+  test_keep_alive ();
+#endif
+
+  return 0;
+}
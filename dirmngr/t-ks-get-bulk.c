@@ -0,0 +1,454 @@
+/* t-ks-get-bulk.c - Tests for the KS_GET --bulk command
+ * Copyright (C) 2020  g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The tests run the dirmngr from the build directory in server mode
+ * and a minimal HKP server on the loopback interface in a child
+ * process, like t-http-keepalive does.  The server answers a lookup
+ * with a line telling whether the request was sent directly or to a
+ * proxy, the host it was meant for, and the search value.  The
+ * dirmngr passes the bodies through unchanged and thus the test
+ * knows how each key was fetched.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef HAVE_W32_SYSTEM
+# include <signal.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/wait.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+#include <assuan.h>
+
+#include "../common/util.h"
+#include "../common/membuf.h"
+#include "../common/sysutils.h"
+#include "t-support.h"
+
+#define PGM "t-ks-get-bulk"
+
+/* The dirmngr to test.  */
+#define DIRMNGR_PROGRAM "./dirmngr"
+
+/* The number of keys to fetch.  This is more than the number of
+ * workers used by ks_action_get_bulk.  */
+#define NKEYS 7
+
+static int verbose;
+
+
+#ifndef HAVE_W32_SYSTEM
+
+/* Read a request from FD into BUFFER.  Returns false on EOF.  */
+static int
+read_request (int fd, char *buffer, size_t size)
+{
+  size_t len = 0;
+  ssize_t n;
+
+  while (len + 1 < size)
+    {
+      n = read (fd, buffer + len, 1);
+      if (n <= 0)
+        return 0;
+      len++;
+      buffer[len] = 0;
+      if (len >= 4 && !strcmp (buffer + len - 4, "\r\n\r\n"))
+        return 1;
+    }
+  return 0;
+}
+
+
+static void
+write_string (int fd, const char *string)
+{
+  size_t len = strlen (string);
+
+  if (write (fd, string, len) != (ssize_t)len)
+    exit (1);
+}
+
+
+/* Answer the lookup requests on the connection FD.  A request with
+ * an absolute URL is a proxy request.  */
+static void
+handle_connection (int fd)
+{
+  char request[1024];
+  char body[256];
+  char line[512];
+  const char *target, *search;
+  int keep_alive, proxied;
+  size_t n;
+
+  while (read_request (fd, request, sizeof request))
+    {
+      if (verbose)
+        fprintf (stderr, PGM ": server got '%.*s'\n",
+                 (int)strcspn (request, "\r\n"), request);
+      keep_alive = !!strstr (request, " HTTP/1.1\r\n");
+
+      target = request + 4;
+      proxied = !strncmp (target, "http://", 7);
+      search = strstr (target, "/pks/lookup?");
+      if (strncmp (request, "GET ", 4) || !search
+          || !(search = strstr (search, "&search=")))
+        {
+          write_string (fd, "HTTP/1.1 404 Not Found\r\n"
+                        "Content-Length: 0\r\n"
+                        "\r\n");
+        }
+      else
+        {
+          search += 8;
+          if (proxied)
+            {
+              target += 7;
+              n = strcspn (target, "/");
+              snprintf (body, sizeof body, "proxy %.*s %.*s\n",
+                        (int)n, target,
+                        (int)strcspn (search, " &"), search);
+            }
+          else
+            snprintf (body, sizeof body, "direct %.*s\n",
+                      (int)strcspn (search, " &"), search);
+          snprintf (line, sizeof line, "HTTP/1.1 200 OK\r\n"
+                    "Content-Length: %u\r\n"
+                    "\r\n"
+                    "%s", (unsigned int)strlen (body), body);
+          write_string (fd, line);
+        }
+
+      if (!keep_alive)
+        break;
+    }
+  close (fd);
+}
+
+
+/* Start the server and return its port.  The pid of the server is
+ * stored at R_PID.  */
+static unsigned short
+start_server (pid_t *r_pid)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int lfd, fd;
+  pid_t pid;
+
+  lfd = socket (AF_INET, SOCK_STREAM, 0);
+  if (lfd == -1)
+    fail (0);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind (lfd, (struct sockaddr *)&addr, sizeof addr)
+      || listen (lfd, 5))
+    fail (0);
+  addrlen = sizeof addr;
+  if (getsockname (lfd, (struct sockaddr *)&addr, &addrlen))
+    fail (0);
+
+  fflush (NULL);
+  pid = fork ();
+  if (pid == (pid_t)(-1))
+    fail (0);
+  if (pid)
+    {
+      close (lfd);
+      *r_pid = pid;
+      return ntohs (addr.sin_port);
+    }
+
+  /* The server process.  */
+  signal (SIGCHLD, SIG_IGN);
+  for (;;)
+    {
+      fd = accept (lfd, NULL, NULL);
+      if (fd == -1)
+        continue;
+      pid = fork ();
+      if (!pid)
+        {
+          close (lfd);
+          handle_connection (fd);
+          exit (0);
+        }
+      close (fd);
+    }
+}
+
+
+/* Return a port on the loopback interface which refuses connections.
+ * The socket is stored at R_FD and must be kept open while the port
+ * is used.  */
+static unsigned short
+get_refusing_port (int *r_fd)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int fd;
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    fail (0);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  addrlen = sizeof addr;
+  if (bind (fd, (struct sockaddr *)&addr, sizeof addr)
+      || getsockname (fd, (struct sockaddr *)&addr, &addrlen))
+    fail (0);
+  *r_fd = fd;
+  return ntohs (addr.sin_port);
+}
+
+
+/* Start the dirmngr using DIR as its home directory.  */
+static assuan_context_t
+start_dirmngr (const char *dir)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  const char *argv[5];
+  assuan_fd_t no_close_list[2];
+
+  argv[0] = "dirmngr";
+  argv[1] = "--server";
+  argv[2] = "--homedir";
+  argv[3] = dir;
+  argv[4] = NULL;
+  no_close_list[0] = assuan_fd_from_posix_fd (fileno (stderr));
+  no_close_list[1] = ASSUAN_INVALID_FD;
+
+  err = assuan_new (&ctx);
+  if (err)
+    fail (0);
+  fflush (NULL);
+  err = assuan_pipe_connect (ctx, DIRMNGR_PROGRAM, argv,
+                             verbose? no_close_list : NULL, NULL, NULL, 0);
+  if (err)
+    {
+      fprintf (stderr, PGM ": can't start '%s': %s\n",
+               DIRMNGR_PROGRAM, gpg_strerror (err));
+      fail (0);
+    }
+  return ctx;
+}
+
+
+static void
+transact (assuan_context_t ctx, const char *line)
+{
+  gpg_error_t err;
+
+  err = assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    {
+      fprintf (stderr, PGM ": '%s' failed: %s\n", line, gpg_strerror (err));
+      fail (0);
+    }
+}
+
+
+struct inq_parm_s
+{
+  assuan_context_t ctx;
+  const char *patterns;
+};
+
+
+static gpg_error_t
+inq_cb (void *opaque, const char *line)
+{
+  struct inq_parm_s *parm = opaque;
+
+  if (strcmp (line, "PATTERNS"))
+    return gpg_error (GPG_ERR_ASS_UNKNOWN_INQUIRE);
+  return assuan_send_data (parm->ctx, parm->patterns, strlen (parm->patterns));
+}
+
+
+static gpg_error_t
+data_cb (void *opaque, const void *buffer, size_t length)
+{
+  membuf_t *mb = opaque;
+
+  if (buffer)
+    put_membuf (mb, buffer, length);
+  return 0;
+}
+
+
+/* Run KS_GET --bulk for NKEYS fingerprints and check that each key
+ * has been returned exactly once with the line built by FORMAT from
+ * the search value.  */
+static void
+check_bulk_get (assuan_context_t ctx, const char *format)
+{
+  gpg_error_t err;
+  struct inq_parm_s parm;
+  membuf_t mb;
+  char fpr[41];
+  char patterns[NKEYS * 41 + 1];
+  char expected[256];
+  char *result, *p;
+  size_t len, total;
+  int i;
+
+  *patterns = 0;
+  for (i=0; i < NKEYS; i++)
+    {
+      snprintf (fpr, sizeof fpr, "%040X", i + 1);
+      strcat (patterns, fpr);
+      strcat (patterns, "\n");
+    }
+
+  init_membuf (&mb, 1024);
+  parm.ctx = ctx;
+  parm.patterns = patterns;
+  err = assuan_transact (ctx, "KS_GET --bulk", data_cb, &mb,
+                         inq_cb, &parm, NULL, NULL);
+  put_membuf (&mb, "", 1);
+  result = get_membuf (&mb, &len);
+  if (!result)
+    fail (0);
+  if (err)
+    {
+      fprintf (stderr, PGM ": KS_GET --bulk failed: %s\n",
+               gpg_strerror (err));
+      fail (0);
+    }
+  if (verbose)
+    fprintf (stderr, PGM ": got:\n%s", result);
+
+  /* The keys arrive in any order.  */
+  total = 0;
+  for (i=0; i < NKEYS; i++)
+    {
+      snprintf (fpr, sizeof fpr, "%040X", i + 1);
+      snprintf (expected, sizeof expected, format, fpr);
+      p = strstr (result, expected);
+      if (!p || strstr (p + 1, expected))
+        {
+          fprintf (stderr, "want: '%s'\n", expected);
+          fail (i);
+        }
+      total += strlen (expected);
+    }
+  if (total != len - 1)
+    fail (0);
+
+  xfree (result);
+}
+
+
+static void
+test_bulk_get (const char *dir)
+{
+  assuan_context_t ctx;
+  unsigned short port, refusing_port;
+  int refusing_fd;
+  pid_t pid;
+  char line[256];
+  char format[100];
+
+  port = start_server (&pid);
+  refusing_port = get_refusing_port (&refusing_fd);
+  ctx = start_dirmngr (dir);
+
+  /* Fetch the keys directly.  */
+  snprintf (line, sizeof line, "KEYSERVER --clear hkp://127.0.0.1:%hu",
+            port);
+  transact (ctx, line);
+  check_bulk_get (ctx, "direct 0x%s\n");
+
+  /* Fetch the keys through the proxy set for this session.  The
+   * keyserver itself can't be reached and thus a worker not using
+   * the proxy fails.  */
+  snprintf (line, sizeof line, "OPTION http-proxy=http://127.0.0.1:%hu",
+            port);
+  transact (ctx, line);
+  snprintf (line, sizeof line, "KEYSERVER --clear hkp://127.0.0.1:%hu",
+            refusing_port);
+  transact (ctx, line);
+  snprintf (format, sizeof format, "proxy 127.0.0.1:%hu 0x%%s\n",
+            refusing_port);
+  check_bulk_get (ctx, format);
+
+  assuan_release (ctx);
+  close (refusing_fd);
+  kill (pid, SIGTERM);
+  waitpid (pid, NULL, 0);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+int
+main (int argc, char **argv)
+{
+  char *dir, *name;
+  const char *tmpdir;
+
+  if (argc)
+    { argc--; argv++; }
+  if (argc && !strcmp (*argv, "--verbose"))
+    {
+      verbose = 1;
+      argc--; argv++;
+    }
+
+  assuan_sock_init ();
+
+#ifndef HAVE_W32_SYSTEM
+  tmpdir = getenv ("TMPDIR");
+  dir = xstrconcat (tmpdir && *tmpdir? tmpdir : "/tmp",
+                    "/t-ks-get-bulk-XXXXXX", NULL);
+  if (!gnupg_mkdtemp (dir))
+    fail (0);
+
+  test_bulk_get (dir);
+  if (verbose)
+    fprintf (stderr, PGM ": all tests passed\n");
+
+  /* Remove what the dirmngr creates in its home directory.  */
+  name = make_filename (dir, "crls.d", "DIR.txt", NULL);
+  gnupg_remove (name);
+  xfree (name);
+  name = make_filename (dir, "crls.d", NULL);
+  rmdir (name);
+  xfree (name);
+  rmdir (dir);
+  xfree (dir);
+#else
+  (void)dir;
+  (void)name;
+  (void)tmpdir;
+#endif
+
+  return 0;
+}
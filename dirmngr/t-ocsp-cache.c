@@ -0,0 +1,312 @@
+/* t-ocsp-cache.c - Tests for the OCSP cache
+ * Copyright (C) 2020  g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The tests use the self-signed certificate from tls-ca.pem as
+ * subject and issuer.  The cache file is first written by the test
+ * to check the parser; later tests use the API and check the
+ * file.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dirmngr.h"
+#include "misc.h"
+#include "ocspcache.h"
+#include "t-support.h"
+
+#define PGM "t-ocsp-cache"
+
+static int verbose;
+
+/* The certificate and the name of the cache file.  */
+static ksba_cert_t cert;
+static char *fname;
+
+
+/* Prepend NAME with the srcdir environment variable's value and
+ * return an allocated filename.  */
+static char *
+prepend_srcdir (const char *name)
+{
+  static const char *srcdir;
+
+  if (!srcdir && !(srcdir = getenv ("srcdir")))
+    srcdir = ".";
+  return xstrconcat (srcdir, "/", name, NULL);
+}
+
+
+/* Read the first certificate from the PEM file NAME.  */
+static ksba_cert_t
+read_cert (const char *name)
+{
+  char *pemname;
+  FILE *fp;
+  char *buffer;
+  size_t length;
+  struct b64state state;
+  ksba_cert_t result;
+
+  pemname = prepend_srcdir (name);
+  fp = fopen (pemname, "rb");
+  if (!fp)
+    {
+      fprintf (stderr, PGM ": can't open '%s'\n", pemname);
+      exit (1);
+    }
+  buffer = xmalloc (65536);
+  length = fread (buffer, 1, 65536, fp);
+  fclose (fp);
+  xfree (pemname);
+
+  if (b64dec_start (&state, "")
+      || b64dec_proc (&state, buffer, length, &length)
+      || b64dec_finish (&state))
+    fail (0);
+  if (ksba_cert_new (&result)
+      || ksba_cert_init_from_mem (result, buffer, length))
+    fail (0);
+  xfree (buffer);
+  return result;
+}
+
+
+/* Store the current time plus SECONDS at ATIME.  */
+static void
+time_from_now (ksba_isotime_t atime, int seconds)
+{
+  epoch2isotime (atime, gnupg_get_time () + seconds);
+}
+
+
+/* Return the number of lines of the cache file or -1 if it does
+ * not exist.  */
+static int
+count_lines (void)
+{
+  FILE *fp;
+  int c, n = 0;
+
+  fp = fopen (fname, "r");
+  if (!fp)
+    return -1;
+  while ((c = getc (fp)) != EOF)
+    if (c == '\n')
+      n++;
+  fclose (fp);
+  return n;
+}
+
+
+/* Look up the certificate and return its status or -1 if it is not
+ * cached.  */
+static int
+lookup (int default_responder_only, struct ocsp_cache_status_s *r_status)
+{
+  struct ocsp_cache_status_s tmp;
+
+  if (!r_status)
+    r_status = &tmp;
+  if (!ocsp_cache_get (cert, cert, default_responder_only, r_status))
+    return -1;
+  if (r_status == &tmp)
+    xfree (tmp.signer_fpr);
+  return r_status->status;
+}
+
+
+static void
+store (ksba_status_t status, int default_responder,
+       int this_update, int next_update)
+{
+  struct ocsp_cache_status_s st;
+
+  memset (&st, 0, sizeof st);
+  st.status = status;
+  time_from_now (st.this_update, this_update);
+  time_from_now (st.next_update, next_update);
+  if (status == KSBA_STATUS_REVOKED)
+    gnupg_copy_time (st.revocation_time, st.this_update);
+  ocsp_cache_put (cert, cert, default_responder, &st);
+}
+
+
+/* Write a cache file with records to be read by the cache.  */
+static void
+test_parser (void)
+{
+  FILE *fp;
+  char *issuer_fpr, *serialno;
+  ksba_sexp_t serial;
+  ksba_isotime_t past, now, future, later;
+  struct ocsp_cache_status_s st;
+
+  serial = ksba_cert_get_serial (cert);
+  serialno = serial_hex (serial);
+  ksba_free (serial);
+  issuer_fpr = get_fingerprint_hexstring (cert);
+  if (!serialno || !issuer_fpr)
+    fail (0);
+  time_from_now (past, -3600);
+  time_from_now (now, 0);
+  time_from_now (future, 3600);
+  time_from_now (later, 7200);
+
+  fp = fopen (fname, "w");
+  if (!fp)
+    fail (0);
+  fprintf (fp, "v:1:\n");
+  fprintf (fp, "# A comment\n");
+  /* Invalid records.  */
+  fprintf (fp, "x:%s:%s::%s:%s::0::\n", issuer_fpr, serialno, now, future);
+  fprintf (fp, "g:%s:%s::%s:%s::0\n", issuer_fpr, serialno, now, future);
+  fprintf (fp, "g:1234:%s::%s:%s::0::\n", serialno, now, future);
+  fprintf (fp, "g:%s:%s::2020:%s::0::\n", issuer_fpr, serialno, future);
+  /* An expired record.  */
+  fprintf (fp, "g:%s:%s:d:%s:%s::0::\n", issuer_fpr, serialno, past, past);
+  /* A record which is replaced by the next one.  */
+  fprintf (fp, "g:%s:%s:d:%s:%s::0::\n", issuer_fpr, serialno, now, future);
+  fprintf (fp, "r:%s:%s::%s:%s:%s:2:%s:\n",
+           issuer_fpr, serialno, now, later, past, issuer_fpr);
+  /* A record for another certificate.  */
+  fprintf (fp, "g:%s:01:d:%s:%s::0::\n", issuer_fpr, now, future);
+  /* A truncated line.  */
+  fprintf (fp, "g:%s:02:d:%s", issuer_fpr, now);
+  if (fclose (fp))
+    fail (0);
+
+  if (lookup (0, &st) != KSBA_STATUS_REVOKED)
+    fail (0);
+  if (strcmp (st.next_update, later) || strcmp (st.revocation_time, past)
+      || st.reason != 2
+      || !st.signer_fpr || strcmp (st.signer_fpr, issuer_fpr))
+    fail (0);
+  xfree (st.signer_fpr);
+  if (lookup (1, NULL) != -1)
+    fail (0);
+
+  /* The file has been rewritten with the two valid records.  */
+  if (count_lines () != 3)
+    fail (0);
+
+  xfree (issuer_fpr);
+  xfree (serialno);
+}
+
+
+static void
+test_cache (void)
+{
+  int lines;
+
+  /* Only good and revoked states with a NEXT_UPDATE are stored.  */
+  ocsp_cache_flush ();
+  if (count_lines () != -1)
+    fail (0);
+  store (KSBA_STATUS_UNKNOWN, 1, 0, 3600);
+  store (KSBA_STATUS_GOOD, 1, -3600, -60);
+  store (KSBA_STATUS_GOOD, 1, -(int)opt.ocsp_max_period - 3600, 3600);
+  if (lookup (0, NULL) != -1 || count_lines () != -1)
+    fail (0);
+
+  /* A new entry is appended to the file.  */
+  store (KSBA_STATUS_GOOD, 0, 0, 3600);
+  if (lookup (0, NULL) != KSBA_STATUS_GOOD)
+    fail (0);
+  if (count_lines () != 2)
+    fail (0);
+
+  /* Only the default responder's entry is used if requested.  */
+  if (lookup (1, NULL) != -1)
+    fail (0);
+
+  /* A new response replaces the entry.  */
+  store (KSBA_STATUS_REVOKED, 1, 0, 3600);
+  if (lookup (1, NULL) != KSBA_STATUS_REVOKED)
+    fail (0);
+  if (count_lines () != 3)
+    fail (0);
+
+  /* An entry expires after the maximum period.  */
+  store (KSBA_STATUS_GOOD, 1, -3600, 3600);
+  lines = count_lines ();
+  opt.ocsp_max_period = 600;
+  if (lookup (0, NULL) != -1)
+    fail (0);
+  if (count_lines () != lines)
+    fail (0);
+
+  ocsp_cache_flush ();
+  if (count_lines () != -1)
+    fail (0);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  char *dir, *crldir;
+  const char *tmpdir;
+
+  if (argc)
+    { argc--; argv++; }
+  if (argc && !strcmp (*argv, "--verbose"))
+    {
+      verbose = 1;
+      argc--; argv++;
+    }
+  else if (argc && !strcmp (*argv, "--debug"))
+    {
+      verbose = 2;
+      opt.debug |= DBG_CACHE_VALUE;
+      argc--; argv++;
+    }
+
+  tmpdir = getenv ("TMPDIR");
+  dir = xstrconcat (tmpdir && *tmpdir? tmpdir : "/tmp",
+                    "/t-ocsp-cache-XXXXXX", NULL);
+  if (!gnupg_mkdtemp (dir))
+    fail (0);
+  crldir = make_filename (dir, "crls.d", NULL);
+  if (gnupg_mkdir (crldir, "-rwx"))
+    fail (0);
+  fname = make_filename (crldir, "ocsp.txt", NULL);
+  opt.homedir_cache = dir;
+  opt.ocsp_max_period = 90 * 86400;
+  opt.ocsp_max_clock_skew = 600;
+
+  cert = read_cert ("tls-ca.pem");
+  test_parser ();
+  test_cache ();
+  if (verbose)
+    fprintf (stderr, PGM ": all tests passed\n");
+
+  ksba_cert_release (cert);
+  gnupg_remove (fname);
+  rmdir (crldir);
+  rmdir (dir);
+  xfree (fname);
+  xfree (crldir);
+  xfree (dir);
+  return 0;
+}
@@ -41,6 +41,7 @@
 #include "../common/status.h"
 #include "../common/shareddefs.h"
 #include "../common/host2net.h"
+#include "../common/sexp-parse.h"
 
 #define CONTROL_D ('D' - 'A' + 1)
 
@@ -2100,6 +2101,198 @@ agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
 }
 
 
+
+/* Call the agent to decrypt the ciphertexts of the NITEMS ITEMS in
+   one go.  On success the result of each item is stored in the item;
+   the caller needs to release the BUF of the items.  Returns
+   GPG_ERR_NOT_SUPPORTED if the agent does not support this or if the
+   pinentry mode is loopback; a passphrase inquiry does not tell for
+   which item it is and thus NEED_PASSPHRASE could not be emitted.  */
+gpg_error_t
+agent_pkdecrypt_bulk (ctrl_t ctrl, struct agent_pkdecrypt_item_s *items,
+                      unsigned int nitems)
+{
+  gpg_error_t err;
+  membuf_t request, data;
+  struct default_inq_parm_s dfltparm;
+  struct cipher_parm_s parm;
+  unsigned char *canon;
+  size_t canonlen, n, len;
+  const unsigned char *s;
+  char *buf;
+  unsigned int idx;
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+  dfltparm.ctrl = ctrl;
+
+  for (idx=0; idx < nitems; idx++)
+    {
+      items[idx].err = gpg_error (GPG_ERR_NO_DATA);
+      items[idx].buf = NULL;
+      items[idx].buflen = 0;
+      items[idx].padding = -1;
+    }
+
+  if (opt.pinentry_mode == PINENTRY_MODE_LOOPBACK)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  if (assuan_transact (agent_ctx, "GETINFO cmd_has_option PKDECRYPT bulk",
+                       NULL, NULL, NULL, NULL, NULL, NULL))
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  err = assuan_transact (agent_ctx, "RESET",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    return err;
+
+  init_membuf (&request, 4096);
+  put_membuf_str (&request, "(4:bulk");
+  for (idx=0; idx < nitems; idx++)
+    {
+      if (!items[idx].keygrip || strlen (items[idx].keygrip) != 40
+          || !items[idx].s_ciphertext)
+        {
+          xfree (get_membuf (&request, NULL));
+          return gpg_error (GPG_ERR_INV_VALUE);
+        }
+      err = make_canon_sexp (items[idx].s_ciphertext, &canon, &canonlen);
+      if (err)
+        {
+          xfree (get_membuf (&request, NULL));
+          return err;
+        }
+      put_membuf_printf (&request, "(4:item(7:keygrip40:%s)",
+                         items[idx].keygrip);
+      if (items[idx].desc)
+        put_membuf_printf (&request, "(4:desc%u:%s)",
+                           (unsigned int)strlen (items[idx].desc),
+                           items[idx].desc);
+      put_membuf (&request, canon, canonlen);
+      put_membuf (&request, ")", 1);
+      xfree (canon);
+    }
+  put_membuf (&request, ")", 1);
+  parm.ciphertext = get_membuf (&request, &parm.ciphertextlen);
+  if (!parm.ciphertext)
+    return gpg_error_from_syserror ();
+
+  parm.dflt = &dfltparm;
+  parm.ctx = agent_ctx;
+  init_membuf_secure (&data, 4096);
+  err = assuan_transact (agent_ctx, "PKDECRYPT --bulk",
+                         put_membuf_cb, &data,
+                         inq_ciphertext_cb, &parm,
+                         NULL, NULL);
+  xfree (parm.ciphertext);
+  if (err)
+    {
+      xfree (get_membuf (&data, &len));
+      return err;
+    }
+  buf = get_membuf (&data, &len);
+  if (!buf)
+    return gpg_error_from_syserror ();
+
+  /* Parse the list of results.  */
+  s = (const unsigned char *)buf;
+  if (!gcry_sexp_canon_len (s, len, NULL, NULL) || *s != '(')
+    {
+      err = gpg_error (GPG_ERR_INV_SEXP);
+      goto leave;
+    }
+  s++;
+  n = snext (&s);
+  if (!smatch (&s, n, "results"))
+    {
+      err = gpg_error (GPG_ERR_INV_SEXP);
+      goto leave;
+    }
+  for (idx=0; idx < nitems && *s == '('; idx++)
+    {
+      s++;
+      n = snext (&s);
+      if (!smatch (&s, n, "result"))
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      while (*s == '(')
+        {
+          s++;
+          n = snext (&s);
+          if (smatch (&s, n, "error"))
+            {
+              n = snext (&s);
+              items[idx].err = strtoul ((const char *)s, NULL, 10);
+            }
+          else if (smatch (&s, n, "padding"))
+            {
+              n = snext (&s);
+              items[idx].padding = atoi ((const char *)s);
+            }
+          else if (smatch (&s, n, "value"))
+            {
+              n = snext (&s);
+              if (n && !items[idx].buf)
+                {
+                  items[idx].buf = xtrymalloc_secure (n);
+                  if (!items[idx].buf)
+                    {
+                      err = gpg_error_from_syserror ();
+                      goto leave;
+                    }
+                  memcpy (items[idx].buf, s, n);
+                  items[idx].buflen = n;
+                }
+            }
+          else
+            {
+              s += n;
+              n = snext (&s);
+            }
+          if (!n)
+            {
+              err = gpg_error (GPG_ERR_INV_SEXP);
+              goto leave;
+            }
+          s += n;
+          if (*s != ')')
+            {
+              err = gpg_error (GPG_ERR_INV_SEXP);
+              goto leave;
+            }
+          s++;
+        }
+      if (*s != ')')
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      s++;
+      if (!items[idx].err && !items[idx].buf)
+        items[idx].err = gpg_error (GPG_ERR_INV_SEXP);
+    }
+
+ leave:
+  if (err)
+    {
+      for (idx=0; idx < nitems; idx++)
+        {
+          xfree (items[idx].buf);
+          items[idx].buf = NULL;
+        }
+    }
+  wipememory (buf, len);
+  xfree (buf);
+  return err;
+}
+
+
 
 /* Retrieve a key encryption key from the agent.  With FOREXPORT true
    the key shall be used for export, with false for import.  On success
@@ -187,6 +187,23 @@ gpg_error_t agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
                              unsigned char **r_buf, size_t *r_buflen,
                              int *r_padding);
 
+/* An item for agent_pkdecrypt_bulk.  */
+struct agent_pkdecrypt_item_s
+{
+  const char *keygrip;        /* The hexified keygrip.  */
+  const char *desc;           /* The escaped description or NULL.  */
+  gcry_sexp_t s_ciphertext;   /* The ciphertext.  */
+  gpg_error_t err;            /* Result: The error of this item.  */
+  unsigned char *buf;         /* Result: The decoded value.  */
+  size_t buflen;              /* Result: The length of BUF.  */
+  int padding;                /* Result: The padding or -1.  */
+};
+
+/* Decrypt many ciphertexts.  */
+gpg_error_t agent_pkdecrypt_bulk (ctrl_t ctrl,
+                                  struct agent_pkdecrypt_item_s *items,
+                                  unsigned int nitems);
+
 /* Retrieve a key encryption key.  */
 gpg_error_t agent_keywrap_key (ctrl_t ctrl, int forexport,
                                void **r_kek, size_t *r_keklen);
@@ -73,6 +73,9 @@ struct ks_search_parm_s
 struct ks_get_parm_s
 {
   estream_t memfp;
+  assuan_context_t ctx;  /* Only used for the bulk variant.  */
+  const void *patterns;  /* The LF delimited patterns for the bulk */
+  size_t patternslen;    /* variant and their length.  */
 };
 
 
@@ -759,6 +762,104 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
 }
 
 
+/* Inquiry callback for the bulk variant of KS_GET.  */
+static gpg_error_t
+ks_get_bulk_inq_cb (void *opaque, const char *line)
+{
+  struct ks_get_parm_s *parm = opaque;
+  gpg_error_t err = 0;
+
+  if (has_leading_keyword (line, "PATTERNS"))
+    err = assuan_send_data (parm->ctx, parm->patterns, parm->patternslen);
+  else
+    log_info ("unsupported inquiry '%s'\n", line);
+
+  return err;
+}
+
+
+/* Run the KS_GET command in bulk mode using the patterns in the NULL
+   terminated array PATTERN.  Other than with gpg_dirmngr_ks_get the
+   number of patterns is not limited and dirmngr fetches the keys
+   concurrently.  On success an estream object is returned to
+   retrieve the keys.  If R_SOURCE is not NULL the source of the data
+   is stored as a malloced string there.  Returns
+   GPG_ERR_NOT_SUPPORTED if the dirmngr does not support the bulk
+   mode.  */
+gpg_error_t
+gpg_dirmngr_ks_get_bulk (ctrl_t ctrl, char **pattern,
+                         estream_t *r_fp, char **r_source)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  struct ks_status_parm_s stparm;
+  struct ks_get_parm_s parm;
+  char *patterns = NULL;
+  membuf_t mb;
+  int idx;
+
+  memset (&stparm, 0, sizeof stparm);
+  memset (&parm, 0, sizeof parm);
+
+  *r_fp = NULL;
+  if (r_source)
+    *r_source = NULL;
+
+  err = open_context (ctrl, &ctx);
+  if (err)
+    return err;
+
+  if (assuan_transact (ctx, "GETINFO cmd_has_option KS_GET bulk",
+                       NULL, NULL, NULL, NULL, NULL, NULL))
+    {
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+
+  init_membuf (&mb, 4096);
+  for (idx=0; pattern[idx]; idx++)
+    {
+      put_membuf_str (&mb, pattern[idx]);
+      put_membuf (&mb, "\n", 1);
+    }
+  patterns = get_membuf (&mb, &parm.patternslen);
+  if (!patterns)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  parm.patterns = patterns;
+  parm.ctx = ctx;
+
+  parm.memfp = es_fopenmem (0, "rwb");
+  if (!parm.memfp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = assuan_transact (ctx, "KS_GET --bulk", ks_get_data_cb, &parm,
+                         ks_get_bulk_inq_cb, &parm, ks_status_cb, &stparm);
+  if (err)
+    goto leave;
+
+  es_rewind (parm.memfp);
+  *r_fp = parm.memfp;
+  parm.memfp = NULL;
+
+ leave:
+  if (r_source && stparm.source)
+    {
+      *r_source = stparm.source;
+      stparm.source = NULL;
+    }
+  es_fclose (parm.memfp);
+  xfree (stparm.source);
+  xfree (patterns);
+  close_context (ctrl, ctx);
+  return err;
+}
+
+
 /* Run the KS_FETCH and pass URL as argument.  On success an estream
    object is returned to retrieve the keys.  On error an error code is
    returned and NULL stored at R_FP.
@@ -38,6 +38,11 @@
  * be a multiple of the OCB blocksize (16 byte).  */
 #define AEAD_ENC_BUFFER_SIZE (64*1024)
 
+/* The maximum amount of memory used for chunks processed in parallel
+ * and the minimum chunk size for which this is worth the effort.  */
+#define AEAD_PARALLEL_MAXMEM   (1024*1024*1024)
+#define AEAD_PARALLEL_MINCHUNK (64*1024)
+
 
 /* Wrapper around iobuf_write to make sure that a proper error code is
  * always returned.  */
@@ -55,27 +60,29 @@ my_iobuf_write (iobuf_t a, const void *buffer, size_t buflen)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  If
- * FINAL is set the final AEAD chunk is processed.  This also reset
- * the encryption machinery so that the handle can be used for a new
- * chunk.  */
-static gpg_error_t
-set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+/* Compute the nonce and the additional data for the chunk with
+ * CHUNKINDEX.  STARTIV is the Start-IV from the packet header.  NONCE
+ * must provide space for 16 bytes and AD for 13 bytes.  If FINAL is
+ * set the additional data for the final chunk is computed which also
+ * includes TOTAL; AD then needs space for 21 bytes.  Returns the
+ * length of the nonce.  */
+unsigned int
+aead_make_nonce_and_ad (byte *nonce, byte *ad, const byte *startiv,
+                        int cipher_algo, int aead_algo,
+                        byte chunkbyte, uint64_t chunkindex,
+                        uint64_t total, int final)
 {
-  gpg_error_t err;
-  unsigned char nonce[16];
-  unsigned char ad[21];
   int i;
 
-  switch (cfx->dek->use_aead)
+  switch (aead_algo)
     {
     case AEAD_ALGO_OCB:
-      memcpy (nonce, cfx->startiv, 15);
+      memcpy (nonce, startiv, 15);
       i = 7;
       break;
 
     case AEAD_ALGO_EAX:
-      memcpy (nonce, cfx->startiv, 16);
+      memcpy (nonce, startiv, 16);
       i = 8;
       break;
 
@@ -83,51 +90,225 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
       BUG ();
     }
 
-  nonce[i++] ^= cfx->chunkindex >> 56;
-  nonce[i++] ^= cfx->chunkindex >> 48;
-  nonce[i++] ^= cfx->chunkindex >> 40;
-  nonce[i++] ^= cfx->chunkindex >> 32;
-  nonce[i++] ^= cfx->chunkindex >> 24;
-  nonce[i++] ^= cfx->chunkindex >> 16;
-  nonce[i++] ^= cfx->chunkindex >>  8;
-  nonce[i++] ^= cfx->chunkindex;
-
-  if (DBG_CRYPTO)
-    log_printhex (nonce, 15, "nonce:");
-  err = gcry_cipher_setiv (cfx->cipher_hd, nonce, i);
-  if (err)
-    return err;
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
 
   ad[0] = (0xc0 | PKT_ENCRYPTED_AEAD);
   ad[1] = 1;
-  ad[2] = cfx->dek->algo;
-  ad[3] = cfx->dek->use_aead;
-  ad[4] = cfx->chunkbyte;
-  ad[5] = cfx->chunkindex >> 56;
-  ad[6] = cfx->chunkindex >> 48;
-  ad[7] = cfx->chunkindex >> 40;
-  ad[8] = cfx->chunkindex >> 32;
-  ad[9] = cfx->chunkindex >> 24;
-  ad[10]= cfx->chunkindex >> 16;
-  ad[11]= cfx->chunkindex >>  8;
-  ad[12]= cfx->chunkindex;
+  ad[2] = cipher_algo;
+  ad[3] = aead_algo;
+  ad[4] = chunkbyte;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
-      ad[13] = cfx->total >> 56;
-      ad[14] = cfx->total >> 48;
-      ad[15] = cfx->total >> 40;
-      ad[16] = cfx->total >> 32;
-      ad[17] = cfx->total >> 24;
-      ad[18] = cfx->total >> 16;
-      ad[19] = cfx->total >>  8;
-      ad[20] = cfx->total;
+      ad[13] = total >> 56;
+      ad[14] = total >> 48;
+      ad[15] = total >> 40;
+      ad[16] = total >> 32;
+      ad[17] = total >> 24;
+      ad[18] = total >> 16;
+      ad[19] = total >>  8;
+      ad[20] = total;
     }
+
+  return i;
+}
+
+
+/* Set the nonce and the additional data for the current chunk.  If
+ * FINAL is set the final AEAD chunk is processed.  This also reset
+ * the encryption machinery so that the handle can be used for a new
+ * chunk.  */
+static gpg_error_t
+set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+{
+  gpg_error_t err;
+  unsigned char nonce[16];
+  unsigned char ad[21];
+  unsigned int noncelen;
+
+  noncelen = aead_make_nonce_and_ad (nonce, ad, cfx->startiv,
+                                     cfx->dek->algo, cfx->dek->use_aead,
+                                     cfx->chunkbyte, cfx->chunkindex,
+                                     cfx->total, final);
+  if (DBG_CRYPTO)
+    log_printhex (nonce, noncelen, "nonce:");
+  err = gcry_cipher_setiv (cfx->cipher_hd, nonce, noncelen);
+  if (err)
+    return err;
+
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
   return gcry_cipher_authenticate (cfx->cipher_hd, ad, final? 21 : 13);
 }
 
 
+/* Return the number of AEAD chunks of CHUNKSIZE bytes which shall be
+ * processed in parallel.  Returns 0 if all chunks shall be processed
+ * by the main thread.  */
+int
+aead_parallel_chunks (uint64_t chunksize)
+{
+  int nthreads, nchunks;
+
+  if (opt.aead_threads < 1
+      || chunksize < AEAD_PARALLEL_MINCHUNK
+      || chunksize > AEAD_PARALLEL_MAXMEM / 2)
+    return 0;
+
+  nthreads = workpool_start ();
+  if (nthreads > opt.aead_threads)
+    nthreads = opt.aead_threads;
+  if (nthreads < 1)
+    return 0;
+
+  /* One more chunk than threads so that the main thread can fill or
+   * flush a chunk while the workers are busy.  */
+  nchunks = nthreads + 1;
+  if (nchunks > AEAD_PARALLEL_MAXMEM / chunksize)
+    nchunks = AEAD_PARALLEL_MAXMEM / chunksize;
+  return nchunks;
+}
+
+
+/* Create an array with NCHUNKS chunks and store it at R_CHUNKS.  The
+ * cipher handles of the chunks are set up for CIPHER_ALGO, AEAD_ALGO
+ * and KEY; set DECRYPT to decrypt instead of encrypt the chunks.  To
+ * save memory for short messages the buffers of BUFSIZE bytes are
+ * allocated by the caller when a chunk is first used.  */
+gpg_error_t
+aead_open_chunks (aead_chunk_t *r_chunks, int nchunks, int decrypt,
+                  int cipher_algo, int aead_algo,
+                  const void *key, size_t keylen, size_t bufsize)
+{
+  gpg_error_t err;
+  enum gcry_cipher_modes ciphermode;
+  unsigned int startivlen;
+  aead_chunk_t chunks;
+  int i;
+
+  *r_chunks = NULL;
+
+  err = openpgp_aead_algo_info (aead_algo, &ciphermode, &startivlen);
+  if (err)
+    return err;
+
+  chunks = xtrycalloc (nchunks, sizeof *chunks);
+  if (!chunks)
+    return gpg_error_from_syserror ();
+
+  for (i=0; i < nchunks && !err; i++)
+    {
+      chunks[i].decrypt = !!decrypt;
+      chunks[i].bufsize = bufsize;
+      err = openpgp_cipher_open (&chunks[i].cipher_hd, cipher_algo,
+                                 ciphermode, GCRY_CIPHER_SECURE);
+      if (!err)
+        err = gcry_cipher_setkey (chunks[i].cipher_hd, key, keylen);
+      if (gpg_err_code (err) == GPG_ERR_WEAK_KEY)
+        err = 0;  /* Already reported for the main cipher handle.  */
+    }
+  if (err)
+    {
+      aead_release_chunks (chunks, nchunks);
+      return err;
+    }
+
+  *r_chunks = chunks;
+  return 0;
+}
+
+
+/* The worker function to encrypt or decrypt a chunk.  This is called
+ * in a worker thread and must thus not print anything.  */
+static void
+chunk_worker (void *arg)
+{
+  aead_chunk_t chunk = arg;
+  gpg_error_t err;
+
+  err = gcry_cipher_setiv (chunk->cipher_hd, chunk->nonce, chunk->noncelen);
+  if (!err)
+    err = gcry_cipher_authenticate (chunk->cipher_hd, chunk->ad, 13);
+  if (!err)
+    {
+      gcry_cipher_final (chunk->cipher_hd);
+      if (chunk->decrypt)
+        err = gcry_cipher_decrypt (chunk->cipher_hd,
+                                   chunk->buffer, chunk->buflen, NULL, 0);
+      else
+        err = gcry_cipher_encrypt (chunk->cipher_hd,
+                                   chunk->buffer, chunk->buflen, NULL, 0);
+    }
+  if (!err)
+    {
+      if (chunk->decrypt)
+        err = gcry_cipher_checktag (chunk->cipher_hd, chunk->tag, 16);
+      else
+        err = gcry_cipher_gettag (chunk->cipher_hd, chunk->tag, 16);
+    }
+  chunk->err = err;
+}
+
+
+/* Encrypt or decrypt CHUNK using the work pool.  The caller must have
+ * set up the nonce, the additional data, the data and for decryption
+ * the expected tag.  The data may not be accessed until
+ * aead_chunk_wait has been called.  */
+void
+aead_chunk_submit (aead_chunk_t chunk)
+{
+  chunk->err = 0;
+  chunk->job = workpool_submit (chunk_worker, chunk);
+  if (!chunk->job)
+    chunk_worker (chunk);  /* No pool - do it right here.  */
+}
+
+
+/* Wait until CHUNK has been processed and return the result.  For
+ * decryption an error is returned if the tag does not match.  */
+gpg_error_t
+aead_chunk_wait (aead_chunk_t chunk)
+{
+  workpool_wait (chunk->job, 1);
+  chunk->job = NULL;
+  return chunk->err;
+}
+
+
+/* Release the array CHUNKS with NCHUNKS items.  Chunks which are
+ * still processed are waited for.  */
+void
+aead_release_chunks (aead_chunk_t chunks, int nchunks)
+{
+  int i;
+
+  if (!chunks)
+    return;
+
+  for (i=0; i < nchunks; i++)
+    {
+      workpool_wait (chunks[i].job, 0);
+      gcry_cipher_close (chunks[i].cipher_hd);
+      xfree (chunks[i].buffer);
+    }
+  xfree (chunks);
+}
+
+
 static gpg_error_t
 write_header (cipher_filter_context_t *cfx, iobuf_t a)
 {
@@ -200,6 +381,17 @@ write_header (cipher_filter_context_t *cfx, iobuf_t a)
   if (err)
     return err;
 
+  /* If requested encrypt the chunks in parallel.  If that is not
+   * possible we silently fall back to the main thread.  */
+  cfx->nchunks = aead_parallel_chunks (cfx->chunksize);
+  if (cfx->nchunks
+      && aead_open_chunks (&cfx->chunks, cfx->nchunks, 0,
+                           cfx->dek->algo, cfx->dek->use_aead,
+                           cfx->dek->key, cfx->dek->keylen, cfx->chunksize))
+    cfx->nchunks = 0;
+  if (DBG_FILTER && cfx->nchunks)
+    log_debug ("encrypting up to %d chunks in parallel\n", cfx->nchunks);
+
   cfx->wrote_header = 1;
 
  leave:
@@ -253,6 +445,93 @@ write_final_chunk (cipher_filter_context_t *cfx, iobuf_t a)
 }
 
 
+/* Submit CHUNK, which has been filled with plaintext, for
+ * encryption.  */
+static void
+submit_chunk (cipher_filter_context_t *cfx, aead_chunk_t chunk)
+{
+  if (DBG_FILTER)
+    log_debug ("submitting chunk %ju: len=%zu\n",
+               (uintmax_t)cfx->chunkindex, chunk->buflen);
+
+  chunk->noncelen = aead_make_nonce_and_ad (chunk->nonce, chunk->ad,
+                                            cfx->startiv, cfx->dek->algo,
+                                            cfx->dek->use_aead,
+                                            cfx->chunkbyte, cfx->chunkindex,
+                                            0, 0);
+  cfx->chunkindex++;
+  cfx->total += chunk->buflen;
+  cfx->nbusy++;
+  aead_chunk_submit (chunk);
+}
+
+
+/* Wait until the oldest submitted chunk has been encrypted and write
+ * it and its tag to stream A.  */
+static gpg_error_t
+write_oldest_chunk (cipher_filter_context_t *cfx, iobuf_t a)
+{
+  gpg_error_t err;
+  aead_chunk_t chunk = cfx->chunks + cfx->chunkhead;
+
+  log_assert (cfx->nbusy);
+  err = aead_chunk_wait (chunk);
+  if (err)
+    {
+      log_error ("encrypting chunk failed: %s\n", gpg_strerror (err));
+      return err;
+    }
+  err = my_iobuf_write (a, chunk->buffer, chunk->buflen);
+  if (!err)
+    err = my_iobuf_write (a, chunk->tag, 16);
+
+  chunk->buflen = 0;
+  cfx->chunkhead = (cfx->chunkhead + 1) % cfx->nchunks;
+  cfx->nbusy--;
+  return err;
+}
+
+
+/* The flush sub-function of cipher_filter_aead for parallel
+ * encryption.  Each chunk is collected in its own buffer and then
+ * passed to the work pool.  The chunks are written in order.  */
+static gpg_error_t
+do_flush_parallel (cipher_filter_context_t *cfx, iobuf_t a,
+                   byte *buf, size_t size)
+{
+  gpg_error_t err;
+  aead_chunk_t chunk;
+  size_t n;
+
+  while (size)
+    {
+      if (cfx->nbusy == cfx->nchunks)
+        {
+          err = write_oldest_chunk (cfx, a);
+          if (err)
+            return err;
+        }
+
+      chunk = cfx->chunks + (cfx->chunkhead + cfx->nbusy) % cfx->nchunks;
+      if (!chunk->buffer && !(chunk->buffer = xtrymalloc (chunk->bufsize)))
+        return gpg_error_from_syserror ();
+
+      n = cfx->chunksize - chunk->buflen;
+      if (n > size)
+        n = size;
+      memcpy (chunk->buffer + chunk->buflen, buf, n);
+      chunk->buflen += n;
+      buf  += n;
+      size -= n;
+
+      if (chunk->buflen == cfx->chunksize)
+        submit_chunk (cfx, chunk);
+    }
+
+  return 0;
+}
+
+
 /* The core of the flush sub-function of cipher_filter_aead.   */
 static gpg_error_t
 do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
@@ -362,7 +641,25 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   if (DBG_FILTER)
     log_debug ("do_free: buflen=%zu\n", cfx->buflen);
 
-  if (cfx->buflen)
+  if (cfx->chunks)
+    {
+      /* Submit the last chunk and write out all pending chunks.  */
+      if (cfx->nbusy < cfx->nchunks)
+        {
+          aead_chunk_t chunk;
+
+          chunk = cfx->chunks + (cfx->chunkhead + cfx->nbusy) % cfx->nchunks;
+          if (chunk->buflen)
+            submit_chunk (cfx, chunk);
+        }
+      while (cfx->nbusy)
+        {
+          err = write_oldest_chunk (cfx, a);
+          if (err)
+            goto leave;
+        }
+    }
+  else if (cfx->buflen || cfx->chunklen)
     {
       if (DBG_FILTER)
         log_debug ("encrypting last %zu bytes of the last chunk\n",cfx->buflen);
@@ -405,6 +702,9 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   err = write_final_chunk (cfx, a);
 
  leave:
+  aead_release_chunks (cfx->chunks, cfx->nchunks);
+  cfx->chunks = NULL;
+  cfx->nbusy = 0;
   xfree (cfx->buffer);
   cfx->buffer = NULL;
   gcry_cipher_close (cfx->cipher_hd);
@@ -432,6 +732,8 @@ cipher_filter_aead (void *opaque, int control,
     {
       if (!cfx->wrote_header && (rc=write_header (cfx, a)))
         ;
+      else if (cfx->chunks)
+        rc = do_flush_parallel (cfx, a, buf, size);
       else
         rc = do_flush (cfx, a, buf, size);
     }
@@ -70,6 +70,9 @@ struct decode_filter_context_s
    *   3 = premature EOF (general)       */
   unsigned int eof_seen : 2;
 
+  /* Set after an error while decrypting chunks in parallel.  */
+  unsigned int chunk_failed : 1;
+
   /* The actually used cipher algo for AEAD.  */
   byte cipher_algo;
 
@@ -94,6 +97,17 @@ struct decode_filter_context_s
   /* Remaining bytes in the packet according to the packet header.
    * Not used if PARTIAL is true.  */
   size_t length;
+
+  /* The AEAD chunks decrypted in parallel or NULL if all chunks are
+   * decrypted by the main thread.  CHUNKS is used as a ring buffer
+   * with NCHUNKS items; CHUNKHEAD is the index of the oldest chunk,
+   * NBUSY the number of chunks read but not yet returned and CHUNKOFF
+   * the number of bytes already returned from the oldest chunk.  */
+  aead_chunk_t chunks;
+  int nchunks;
+  int chunkhead;
+  int nbusy;
+  size_t chunkoff;
 };
 typedef struct decode_filter_context_s *decode_filter_ctx_t;
 
@@ -108,6 +122,8 @@ release_dfx_context (decode_filter_ctx_t dfx)
   log_assert (dfx->refcount);
   if ( !--dfx->refcount )
     {
+      aead_release_chunks (dfx->chunks, dfx->nchunks);
+      dfx->chunks = NULL;
       gcry_cipher_close (dfx->cipher_hd);
       dfx->cipher_hd = NULL;
       gcry_md_close (dfx->mdc_hash);
@@ -127,62 +143,18 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
   gpg_error_t err;
   unsigned char ad[21];
   unsigned char nonce[16];
-  int i;
-
-  switch (dfx->aead_algo)
-    {
-    case AEAD_ALGO_OCB:
-      memcpy (nonce, dfx->startiv, 15);
-      i = 7;
-      break;
-
-    case AEAD_ALGO_EAX:
-      memcpy (nonce, dfx->startiv, 16);
-      i = 8;
-      break;
-
-    default:
-      BUG ();
-    }
-  nonce[i++] ^= dfx->chunkindex >> 56;
-  nonce[i++] ^= dfx->chunkindex >> 48;
-  nonce[i++] ^= dfx->chunkindex >> 40;
-  nonce[i++] ^= dfx->chunkindex >> 32;
-  nonce[i++] ^= dfx->chunkindex >> 24;
-  nonce[i++] ^= dfx->chunkindex >> 16;
-  nonce[i++] ^= dfx->chunkindex >>  8;
-  nonce[i++] ^= dfx->chunkindex;
+  unsigned int noncelen;
 
+  noncelen = aead_make_nonce_and_ad (nonce, ad, dfx->startiv,
+                                     dfx->cipher_algo, dfx->aead_algo,
+                                     dfx->chunkbyte, dfx->chunkindex,
+                                     dfx->total, final);
   if (DBG_CRYPTO)
-    log_printhex (nonce, i, "nonce:");
-  err = gcry_cipher_setiv (dfx->cipher_hd, nonce, i);
+    log_printhex (nonce, noncelen, "nonce:");
+  err = gcry_cipher_setiv (dfx->cipher_hd, nonce, noncelen);
   if (err)
     return err;
 
-  ad[0] = (0xc0 | PKT_ENCRYPTED_AEAD);
-  ad[1] = 1;
-  ad[2] = dfx->cipher_algo;
-  ad[3] = dfx->aead_algo;
-  ad[4] = dfx->chunkbyte;
-  ad[5] = dfx->chunkindex >> 56;
-  ad[6] = dfx->chunkindex >> 48;
-  ad[7] = dfx->chunkindex >> 40;
-  ad[8] = dfx->chunkindex >> 32;
-  ad[9] = dfx->chunkindex >> 24;
-  ad[10]= dfx->chunkindex >> 16;
-  ad[11]= dfx->chunkindex >>  8;
-  ad[12]= dfx->chunkindex;
-  if (final)
-    {
-      ad[13] = dfx->total >> 56;
-      ad[14] = dfx->total >> 48;
-      ad[15] = dfx->total >> 40;
-      ad[16] = dfx->total >> 32;
-      ad[17] = dfx->total >> 24;
-      ad[18] = dfx->total >> 16;
-      ad[19] = dfx->total >>  8;
-      ad[20] = dfx->total;
-    }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
   return gcry_cipher_authenticate (dfx->cipher_hd, ad, final? 21 : 13);
@@ -368,6 +340,18 @@ decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek)
           goto leave;
         }
 
+      /* If requested decrypt the chunks in parallel.  If that is not
+       * possible we silently fall back to the main thread.  A chunk
+       * buffer also takes the tag and 16 bytes of look-ahead (see
+       * aead_read_chunk).  */
+      dfx->nchunks = aead_parallel_chunks (dfx->chunksize);
+      if (dfx->nchunks
+          && aead_open_chunks (&dfx->chunks, dfx->nchunks, 1,
+                               dfx->cipher_algo, dfx->aead_algo,
+                               dek->key, dek->keylen, dfx->chunksize + 32))
+        dfx->nchunks = 0;
+      if (DBG_FILTER && dfx->nchunks)
+        log_debug ("decrypting up to %d chunks in parallel\n", dfx->nchunks);
     }
   else /* CFB encryption.  */
     {
@@ -596,6 +580,29 @@ fill_buffer (decode_filter_ctx_t dfx, iobuf_t stream,
 }
 
 
+/* Check the final chunk of an AEAD packet.  TAGBUF has its 16 byte
+ * tag.  */
+static gpg_error_t
+aead_check_final (decode_filter_ctx_t dfx, const void *tagbuf)
+{
+  gpg_error_t err;
+
+  err = aead_set_nonce_and_ad (dfx, 1);
+  if (err)
+    return err;
+  gcry_cipher_final (dfx->cipher_hd);
+  /* Decrypt an empty string (using HOLDBACK as a dummy).  */
+  err = gcry_cipher_decrypt (dfx->cipher_hd, dfx->holdback, 0, NULL, 0);
+  if (err)
+    {
+      log_error ("gcry_cipher_decrypt failed (final): %s\n",
+                 gpg_strerror (err));
+      return err;
+    }
+  return aead_checktag (dfx, 1, tagbuf);
+}
+
+
 /* The core of the AEAD decryption.  This is the underflow function of
  * the aead_decode_filter.  */
 static gpg_error_t
@@ -802,20 +809,136 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
           off = 0;
         }
 
-      /* Check the final chunk.  */
-      err = aead_set_nonce_and_ad (dfx, 1);
+      err = aead_check_final (dfx, dfx->holdback+off);
       if (err)
         goto leave;
-      gcry_cipher_final (dfx->cipher_hd);
-      /* Decrypt an empty string (using HOLDBACK as a dummy).  */
-      err = gcry_cipher_decrypt (dfx->cipher_hd, dfx->holdback, 0, NULL, 0);
+      err = gpg_error (GPG_ERR_EOF);
+    }
+
+ leave:
+  if (DBG_FILTER)
+    log_debug ("aead_underflow: returning %zu (%s)\n",
+               totallen, gpg_strerror (err));
+
+  /* In case of an auth error we map the error code to the same as
+   * used by the MDC decryption.  */
+  if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+    err = gpg_error (GPG_ERR_BAD_SIGNATURE);
+
+  /* In case of an error we better wipe out the buffer than to convey
+   * partly decrypted data.  */
+  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+    memset (buf, 0, size);
+
+  *ret_len = totallen;
+
+  return err;
+}
+
+
+/* Read the next chunk for parallel decryption from stream A and
+ * submit it to the work pool.  At the end of the packet the final
+ * tag is stored in the holdback buffer.  */
+static gpg_error_t
+aead_read_chunk (decode_filter_ctx_t dfx, iobuf_t a)
+{
+  aead_chunk_t chunk;
+  size_t len;
+
+  chunk = dfx->chunks + (dfx->chunkhead + dfx->nbusy) % dfx->nchunks;
+  if (!chunk->buffer && !(chunk->buffer = xtrymalloc (chunk->bufsize)))
+    return gpg_error_from_syserror ();
+
+  /* A chunk is followed by its tag and the last chunk also by the
+   * tag of the final chunk.  Thus, like aead_underflow, we need 32
+   * bytes of look-ahead to detect the last chunk: We try to read the
+   * chunk, its tag and 16 more bytes which are kept in the holdback
+   * buffer for the next call.  If we get less than that we are at
+   * the end and the last 16 bytes are the tag of the final chunk.  */
+  memcpy (chunk->buffer, dfx->holdback, dfx->holdbacklen);
+  len = fill_buffer (dfx, a, chunk->buffer, chunk->bufsize, dfx->holdbacklen);
+  dfx->holdbacklen = 16;
+  if (len < chunk->bufsize)
+    {
+      log_assert (dfx->eof_seen);
+      if (len < 16 || (len > 16 && len <= 32))
+        return gpg_error (GPG_ERR_TRUNCATED);
+    }
+  len -= 16;
+  memcpy (dfx->holdback, chunk->buffer + len, 16);
+  if (!len)
+    return 0;
+
+  len -= 16;
+  memcpy (chunk->tag, chunk->buffer + len, 16);
+  chunk->buflen = len;
+  chunk->noncelen = aead_make_nonce_and_ad (chunk->nonce, chunk->ad,
+                                            dfx->startiv, dfx->cipher_algo,
+                                            dfx->aead_algo, dfx->chunkbyte,
+                                            dfx->chunkindex, 0, 0);
+  if (DBG_FILTER)
+    log_debug ("submitting chunk %ju: len=%zu\n",
+               (uintmax_t)dfx->chunkindex, len);
+  dfx->chunkindex++;
+  dfx->total += len;
+  dfx->nbusy++;
+  aead_chunk_submit (chunk);
+  return 0;
+}
+
+
+/* The underflow function of the aead_decode_filter used for
+ * parallel decryption.  The chunks are read ahead and decrypted by
+ * the work pool; a chunk is returned only after its tag has been
+ * verified.  */
+static gpg_error_t
+aead_underflow_parallel (decode_filter_ctx_t dfx, iobuf_t a,
+                         byte *buf, size_t *ret_len)
+{
+  const size_t size = *ret_len; /* The allocated size of BUF.  */
+  gpg_error_t err = 0;
+  size_t totallen = 0;
+  aead_chunk_t chunk;
+
+  /* Keep the work pool busy.  */
+  while (!dfx->eof_seen && dfx->nbusy < dfx->nchunks)
+    {
+      err = aead_read_chunk (dfx, a);
       if (err)
+        goto leave;
+    }
+
+  if (dfx->nbusy)
+    {
+      chunk = dfx->chunks + dfx->chunkhead;
+      if (!dfx->chunkoff)
         {
-          log_error ("gcry_cipher_decrypt failed (final): %s\n",
-                     gpg_strerror (err));
-          goto leave;
+          err = aead_chunk_wait (chunk);
+          if (err)
+            {
+              log_error ("decrypting chunk failed: %s\n", gpg_strerror (err));
+              goto leave;
+            }
         }
-      err = aead_checktag (dfx, 1, dfx->holdback+off);
+
+      totallen = chunk->buflen - dfx->chunkoff;
+      if (totallen > size)
+        totallen = size;
+      memcpy (buf, chunk->buffer + dfx->chunkoff, totallen);
+      dfx->chunkoff += totallen;
+      if (dfx->chunkoff == chunk->buflen)
+        {
+          dfx->chunkoff = 0;
+          dfx->chunkhead = (dfx->chunkhead + 1) % dfx->nchunks;
+          dfx->nbusy--;
+        }
+    }
+
+  if (dfx->eof_seen && !dfx->nbusy)
+    {
+      if (DBG_FILTER)
+        log_debug ("eof seen: holdback has the final tag\n");
+      err = aead_check_final (dfx, dfx->holdback);
       if (err)
         goto leave;
       err = gpg_error (GPG_ERR_EOF);
@@ -823,7 +946,7 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
 
  leave:
   if (DBG_FILTER)
-    log_debug ("aead_underflow: returning %zu (%s)\n",
+    log_debug ("aead_underflow_parallel: returning %zu (%s)\n",
                totallen, gpg_strerror (err));
 
   /* In case of an auth error we map the error code to the same as
@@ -831,10 +954,12 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
   if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
     err = gpg_error (GPG_ERR_BAD_SIGNATURE);
 
-  /* In case of an error we better wipe out the buffer than to convey
-   * partly decrypted data.  */
+  /* In case of an error we return nothing and stop processing.  */
   if (err && gpg_err_code (err) != GPG_ERR_EOF)
-    memset (buf, 0, size);
+    {
+      totallen = 0;
+      dfx->chunk_failed = 1;
+    }
 
   *ret_len = totallen;
 
@@ -850,7 +975,8 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
   decode_filter_ctx_t dfx = opaque;
   int rc = 0;
 
-  if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen )
+  if ( control == IOBUFCTRL_UNDERFLOW
+       && ((dfx->eof_seen && !dfx->nbusy) || dfx->chunk_failed))
     {
       *ret_len = 0;
       rc = -1;
@@ -859,7 +985,10 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
     {
       log_assert (a);
 
-      rc = aead_underflow (dfx, a, buf, ret_len);
+      if (dfx->chunks)
+        rc = aead_underflow_parallel (dfx, a, buf, ret_len);
+      else
+        rc = aead_underflow (dfx, a, buf, ret_len);
       if (gpg_err_code (rc) == GPG_ERR_EOF)
         rc = -1; /* We need to use the old convention in the filter.  */
 
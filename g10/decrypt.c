@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "gpg.h"
 #include "options.h"
@@ -35,6 +37,15 @@
 #include "../common/status.h"
 #include "../common/i18n.h"
 
+
+/* The number of files for which --decrypt-files decrypts the session
+ * keys with one request to the agent.  */
+#define PREFETCH_FILES 64
+
+/* The maximum number of packets looked at for the session keys.  */
+#define PREFETCH_MAX_PACKETS 64
+
+
 /* Assume that the input is an encrypted message and decrypt
  * (and if signed, verify the signature on) it.
  * This command differs from the default operation, as it never
@@ -164,6 +175,8 @@ decrypt_message_fd (ctrl_t ctrl, int input_fd, int output_fd)
 	}
     }
 
+  /* The server may be used for many messages.  */
+  reset_literals_seen ();
   err = proc_encryption_packets (ctrl, NULL, fp );
 
   iobuf_close (fp);
@@ -176,6 +189,121 @@ decrypt_message_fd (ctrl_t ctrl, int input_fd, int output_fd)
 }
 
 
+/* Prepend the public key encrypted session keys found at the start
+ * of FILENAME to the list at R_LIST.  Errors are ignored because the
+ * file will be looked at again for the actual decryption.  Only
+ * regular files are looked at; data read from a pipe, a FIFO or a
+ * device would be lost for the actual decryption.  */
+static void
+collect_pubkey_enc (const char *filename, struct pubkey_enc_list **r_list)
+{
+  iobuf_t fp;
+  struct parse_packet_ctx_s parsectx;
+  PACKET *pkt;
+  PKT_pubkey_enc *enc;
+  struct pubkey_enc_list *x;
+  struct stat st;
+  int count;
+
+  if (iobuf_is_pipe_filename (filename))
+    return;
+  if (stat (filename, &st) || !S_ISREG (st.st_mode))
+    return;
+
+  fp = iobuf_open (filename);
+  if (!fp)
+    return;
+  iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+  if (is_secured_file (iobuf_get_fd (fp))
+      || fstat (iobuf_get_fd (fp), &st) || !S_ISREG (st.st_mode))
+    {
+      iobuf_close (fp);
+      return;
+    }
+  if (!opt.no_armor && use_armor_filter (fp))
+    {
+      armor_filter_context_t *afx = new_armor_context ();
+      int rc = push_armor_filter (afx, fp);
+
+      release_armor_context (afx);
+      if (rc)
+        {
+          iobuf_close (fp);
+          return;
+        }
+    }
+
+  pkt = xmalloc (sizeof *pkt);
+  init_packet (pkt);
+  init_parse_packet (&parsectx, fp);
+  for (count = 0; count < PREFETCH_MAX_PACKETS; count++)
+    {
+      if (parse_packet (&parsectx, pkt))
+        break;
+      if (pkt->pkttype == PKT_PUBKEY_ENC)
+        {
+          enc = pkt->pkt.pubkey_enc;
+          x = xmalloc (sizeof *x);
+          x->keyid[0] = enc->keyid[0];
+          x->keyid[1] = enc->keyid[1];
+          x->pubkey_algo = enc->pubkey_algo;
+          x->data[0] = enc->data[0];
+          x->data[1] = enc->data[1];
+          enc->data[0] = enc->data[1] = NULL;
+          x->next = *r_list;
+          *r_list = x;
+        }
+      else if (pkt->pkttype != PKT_SYMKEY_ENC && pkt->pkttype != PKT_MARKER)
+        {
+          /* Don't let free_packet skip over the data of the packet.  */
+          if (pkt->pkttype == PKT_ENCRYPTED
+              || pkt->pkttype == PKT_ENCRYPTED_MDC
+              || pkt->pkttype == PKT_ENCRYPTED_AEAD)
+            pkt->pkt.encrypted->buf = NULL;
+          else if (pkt->pkttype == PKT_COMPRESSED)
+            pkt->pkt.compressed->buf = NULL;
+          else if (pkt->pkttype == PKT_PLAINTEXT)
+            pkt->pkt.plaintext->buf = NULL;
+          break;
+        }
+      free_packet (pkt, &parsectx);
+    }
+  free_packet (pkt, &parsectx);
+  deinit_parse_packet (&parsectx);
+  xfree (pkt);
+  iobuf_close (fp);
+}
+
+
+/* Decrypt the session keys of up to PREFETCH_FILES of the NFILES
+ * FILES with one request to the agent.  Returns the number of files
+ * looked at.  */
+static int
+prefetch_files (ctrl_t ctrl, int nfiles, char *files[])
+{
+  struct pubkey_enc_list *list = NULL;
+  struct pubkey_enc_list *x;
+  int i;
+
+  if (nfiles > PREFETCH_FILES)
+    nfiles = PREFETCH_FILES;
+  for (i=0; i < nfiles; i++)
+    collect_pubkey_enc (files[i], &list);
+
+  if (list)
+    prefetch_session_keys (ctrl, list);
+
+  while ((x = list))
+    {
+      list = x->next;
+      mpi_release (x->data[0]);
+      mpi_release (x->data[1]);
+      xfree (x);
+    }
+  return nfiles;
+}
+
+
 void
 decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
 {
@@ -184,6 +312,7 @@ decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
   char *p, *output = NULL;
   int rc=0,use_stdin=0;
   unsigned int lno=0;
+  int nprefetched = 0;
 
   if (opt.outfile)
     {
@@ -219,6 +348,14 @@ decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
 	{
 	  if(nfiles)
 	    {
+              /* Unless the file names are read from stdin, in which
+               * case the next name may only be written after the
+               * FILE_DONE status, the session keys of the next files
+               * are decrypted in one go.  */
+              if (nprefetched)
+                nprefetched--;
+              else if (nfiles > 1 && !opt.override_session_key)
+                nprefetched = prefetch_files (ctrl, nfiles, files) - 1;
 	      filename=*files;
 	      nfiles--;
 	      files++;
@@ -277,5 +414,6 @@ decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
     }
 
   set_next_passphrase(NULL);
+  release_prefetched_session_keys (ctrl);
   release_progress_context (pfx);
 }
@@ -86,6 +86,38 @@ struct compress_filter_context_s {
 typedef struct compress_filter_context_s compress_filter_context_t;
 
 
+/* An AEAD chunk which is encrypted or decrypted by a worker thread.
+ * See cipher-aead.c for the functions to process it.  */
+struct aead_chunk_s
+{
+  /* The chunk's own cipher handle or NULL if not yet set up.  */
+  gcry_cipher_hd_t cipher_hd;
+
+  /* Set to decrypt instead of encrypt the chunk.  */
+  unsigned int decrypt : 1;
+
+  /* The nonce and the additional data for this chunk.  */
+  byte nonce[16];
+  unsigned int noncelen;
+  byte ad[13];
+
+  /* The data of the chunk.  */
+  byte *buffer;
+  size_t bufsize;  /* Allocated length.  */
+  size_t buflen;   /* Used length.       */
+
+  /* The created or the expected authentication tag.  */
+  byte tag[16];
+
+  /* The result of the processing.  */
+  gpg_error_t err;
+
+  /* The job in the work pool or NULL.  */
+  struct workpool_job_s *job;
+};
+typedef struct aead_chunk_s *aead_chunk_t;
+
+
 typedef struct
 {
   /* Object with the key and algo */
@@ -132,6 +164,15 @@ typedef struct
   size_t bufsize;  /* Allocated length.  */
   size_t buflen;   /* Used length.       */
 
+  /* The chunks encrypted in parallel or NULL if all chunks are
+   * encrypted by the main thread.  CHUNKS is used as a ring buffer
+   * with NCHUNKS items; CHUNKHEAD is the index of the oldest chunk
+   * and NBUSY the number of chunks submitted to the work pool.  */
+  aead_chunk_t chunks;
+  int nchunks;
+  int chunkhead;
+  int nbusy;
+
 } cipher_filter_context_t;
 
 
@@ -184,6 +225,19 @@ int cipher_filter_cfb (void *opaque, int control,
 /*-- cipher-aead.c --*/
 int cipher_filter_aead (void *opaque, int control,
                         iobuf_t chain, byte *buf, size_t *ret_len);
+unsigned int aead_make_nonce_and_ad (byte *nonce, byte *ad,
+                                     const byte *startiv,
+                                     int cipher_algo, int aead_algo,
+                                     byte chunkbyte, uint64_t chunkindex,
+                                     uint64_t total, int final);
+int aead_parallel_chunks (uint64_t chunksize);
+gpg_error_t aead_open_chunks (aead_chunk_t *r_chunks, int nchunks,
+                              int decrypt, int cipher_algo, int aead_algo,
+                              const void *key, size_t keylen,
+                              size_t bufsize);
+void aead_chunk_submit (aead_chunk_t chunk);
+gpg_error_t aead_chunk_wait (aead_chunk_t chunk);
+void aead_release_chunks (aead_chunk_t chunks, int nchunks);
 
 /*-- textfilter.c --*/
 int text_filter( void *opaque, int control,
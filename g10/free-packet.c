@@ -83,6 +83,7 @@ free_seckey_enc( PKT_signature *sig )
       xfree (sig->pka_info);
     }
   xfree (sig->signers_uid);
+  xfree (sig->precheck);
 
   xfree(sig);
 }
@@ -269,6 +270,7 @@ copy_signature( PKT_signature *d, PKT_signature *s )
     d->unhashed = cp_subpktarea (s->unhashed);
     if (s->signers_uid)
       d->signers_uid = xstrdup (s->signers_uid);
+    d->precheck = NULL;
     if(s->numrevkeys)
       {
 	d->revkey=NULL;
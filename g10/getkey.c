@@ -112,19 +112,44 @@ static struct
 typedef struct keyid_list
 {
   struct keyid_list *next;
+  struct keyid_list *next_bykid;  /* Next in the key id hash bucket.  */
+  struct keyid_list *next_byfpr;  /* Next in the fingerprint bucket.  */
+  struct user_id_db *owner;       /* The user id cache entry.  */
   char fpr[MAX_FINGERPRINT_LEN];
   u32 keyid[2];
 } *keyid_list_t;
 
 
+/* The public key cache and the user id cache are both hash tables
+ * with CACHE_TABLE_SIZE buckets.  Their entries are also linked in
+ * the order of their last use so that the least recently used entry
+ * can be replaced when the cache holds CACHE_MAX_ENTRIES.  The size
+ * can be set with --key-cache-size.  */
+static unsigned int cache_table_size;
+static unsigned int cache_max_entries;
+
+/* Statistics for the caches.  */
+static struct
+{
+  unsigned int pk_hits;
+  unsigned int pk_misses;
+  unsigned int pk_evictions;
+  unsigned int uid_hits;
+  unsigned int uid_misses;
+  unsigned int uid_evictions;
+} cache_stats;
+
 #if MAX_PK_CACHE_ENTRIES
 typedef struct pk_cache_entry
 {
-  struct pk_cache_entry *next;
+  struct pk_cache_entry *next;      /* Next entry in the hash bucket.  */
+  struct pk_cache_entry *lru_prev;  /* The next more recently used.  */
+  struct pk_cache_entry *lru_next;  /* The next less recently used.  */
   u32 keyid[2];
   PKT_public_key *pk;
 } *pk_cache_entry_t;
-static pk_cache_entry_t pk_cache;
+static pk_cache_entry_t *pk_cache;  /* The hash table.  */
+static pk_cache_entry_t pk_cache_mru, pk_cache_lru;
 static int pk_cache_entries;	/* Number of entries in pk cache.  */
 static int pk_cache_disabled;
 #endif
@@ -134,12 +159,15 @@ static int pk_cache_disabled;
 #endif
 typedef struct user_id_db
 {
-  struct user_id_db *next;
+  struct user_id_db *lru_prev;
+  struct user_id_db *lru_next;
   keyid_list_t keyids;
   int len;
   char name[1];
 } *user_id_db_t;
-static user_id_db_t user_id_db;
+static keyid_list_t *uid_cache_bykid;  /* Hash table by key id.  */
+static keyid_list_t *uid_cache_byfpr;  /* Hash table by fingerprint.  */
+static user_id_db_t uid_cache_mru, uid_cache_lru;
 static int uid_cache_entries;	/* Number of entries in uid cache. */
 
 static void merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock);
@@ -169,6 +197,142 @@ print_stats ()
 #endif
 
 
+/* Allocate the hash tables for the public key and user id caches.  */
+static void
+init_caches (void)
+{
+  unsigned int n;
+
+  if (cache_table_size)
+    return;
+
+  n = opt.key_cache_size? opt.key_cache_size : PK_UID_CACHE_SIZE;
+  if (n < 5)
+    n = 5;
+  cache_max_entries = n;
+  for (cache_table_size = 64;
+       cache_table_size < n && cache_table_size < (1 << 20);
+       cache_table_size <<= 1)
+    ;
+#if MAX_PK_CACHE_ENTRIES
+  pk_cache = xcalloc (cache_table_size, sizeof *pk_cache);
+#endif
+  uid_cache_bykid = xcalloc (cache_table_size, sizeof *uid_cache_bykid);
+  uid_cache_byfpr = xcalloc (cache_table_size, sizeof *uid_cache_byfpr);
+}
+
+
+static inline unsigned int
+keyid_hash (const u32 *keyid)
+{
+  return keyid[1] & (cache_table_size - 1);
+}
+
+
+static inline unsigned int
+fpr_hash (const void *fpr)
+{
+  return buf32_to_uint (fpr) & (cache_table_size - 1);
+}
+
+
+/* Print statistics for the public key and user id caches.  */
+void
+getkey_dump_stats (void)
+{
+  log_info ("pk_cache: entries=%d max=%u hits=%u misses=%u evictions=%u\n",
+#if MAX_PK_CACHE_ENTRIES
+            pk_cache_entries,
+#else
+            0,
+#endif
+            cache_max_entries,
+            cache_stats.pk_hits,
+            cache_stats.pk_misses,
+            cache_stats.pk_evictions);
+  log_info ("uid_cache: entries=%d max=%u hits=%u misses=%u evictions=%u\n",
+            uid_cache_entries,
+            cache_max_entries,
+            cache_stats.uid_hits,
+            cache_stats.uid_misses,
+            cache_stats.uid_evictions);
+}
+
+
+#if MAX_PK_CACHE_ENTRIES
+/* Remove CE from the LRU list of the public key cache.  */
+static void
+pk_cache_unlink (pk_cache_entry_t ce)
+{
+  if (ce->lru_prev)
+    ce->lru_prev->lru_next = ce->lru_next;
+  else
+    pk_cache_mru = ce->lru_next;
+  if (ce->lru_next)
+    ce->lru_next->lru_prev = ce->lru_prev;
+  else
+    pk_cache_lru = ce->lru_prev;
+}
+
+
+/* Insert CE as the most recently used entry in the LRU list.  */
+static void
+pk_cache_push (pk_cache_entry_t ce)
+{
+  ce->lru_prev = NULL;
+  ce->lru_next = pk_cache_mru;
+  if (pk_cache_mru)
+    pk_cache_mru->lru_prev = ce;
+  else
+    pk_cache_lru = ce;
+  pk_cache_mru = ce;
+}
+
+
+/* Return the public key cache entry for KEYID or NULL if it is not
+ * cached.  The entry is marked as the most recently used one.  */
+static pk_cache_entry_t
+pk_cache_lookup (u32 *keyid)
+{
+  pk_cache_entry_t ce;
+
+  init_caches ();
+  for (ce = pk_cache[keyid_hash (keyid)]; ce; ce = ce->next)
+    if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
+      {
+        if (ce != pk_cache_mru)
+          {
+            pk_cache_unlink (ce);
+            pk_cache_push (ce);
+          }
+        cache_stats.pk_hits++;
+        return ce;
+      }
+  cache_stats.pk_misses++;
+  return NULL;
+}
+
+
+/* Remove the least recently used entry from the public key cache.  */
+static void
+pk_cache_evict (void)
+{
+  pk_cache_entry_t ce = pk_cache_lru;
+  pk_cache_entry_t *cep;
+
+  pk_cache_unlink (ce);
+  for (cep = &pk_cache[keyid_hash (ce->keyid)]; *cep != ce;
+       cep = &(*cep)->next)
+    ;
+  *cep = ce->next;
+  free_public_key (ce->pk);
+  xfree (ce);
+  pk_cache_entries--;
+  cache_stats.pk_evictions++;
+}
+#endif /*MAX_PK_CACHE_ENTRIES*/
+
+
 /* Cache a copy of a public key in the public key cache.  PK is not
  * cached if caching is disabled (via getkey_disable_caches), if
  * PK->FLAGS.DONT_CACHE is set, we don't know how to derive a key id
@@ -185,8 +349,9 @@ void
 cache_public_key (PKT_public_key * pk)
 {
 #if MAX_PK_CACHE_ENTRIES
-  pk_cache_entry_t ce, ce2;
+  pk_cache_entry_t ce;
   u32 keyid[2];
+  unsigned int hash;
 
   if (pk_cache_disabled)
     return;
@@ -206,7 +371,9 @@ cache_public_key (PKT_public_key * pk)
   else
     return; /* Don't know how to get the keyid.  */
 
-  for (ce = pk_cache; ce; ce = ce->next)
+  init_caches ();
+  hash = keyid_hash (keyid);
+  for (ce = pk_cache[hash]; ce; ce = ce->next)
     if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
       {
 	if (DBG_CACHE)
@@ -214,32 +381,13 @@ cache_public_key (PKT_public_key * pk)
 	return;
       }
 
-  if (pk_cache_entries >= MAX_PK_CACHE_ENTRIES)
-    {
-      int n;
-
-      /* Remove the last 50% of the entries.  */
-      for (ce = pk_cache, n = 0; ce && n < pk_cache_entries/2; n++)
-        ce = ce->next;
-      if (ce && ce != pk_cache && ce->next)
-        {
-          ce2 = ce->next;
-          ce->next = NULL;
-          ce = ce2;
-          for (; ce; ce = ce2)
-            {
-              ce2 = ce->next;
-              free_public_key (ce->pk);
-              xfree (ce);
-              pk_cache_entries--;
-            }
-        }
-      log_assert (pk_cache_entries < MAX_PK_CACHE_ENTRIES);
-    }
+  if (pk_cache_entries >= cache_max_entries)
+    pk_cache_evict ();
   pk_cache_entries++;
   ce = xmalloc (sizeof *ce);
-  ce->next = pk_cache;
-  pk_cache = ce;
+  ce->next = pk_cache[hash];
+  pk_cache[hash] = ce;
+  pk_cache_push (ce);
   ce->pk = copy_public_key (NULL, pk);
   ce->keyid[0] = keyid[0];
   ce->keyid[1] = keyid[1];
@@ -299,6 +447,100 @@ release_keyid_list (keyid_list_t k)
     }
 }
 
+/* Remove R from the LRU list of the user id cache.  */
+static void
+uid_cache_unlink (user_id_db_t r)
+{
+  if (r->lru_prev)
+    r->lru_prev->lru_next = r->lru_next;
+  else
+    uid_cache_mru = r->lru_next;
+  if (r->lru_next)
+    r->lru_next->lru_prev = r->lru_prev;
+  else
+    uid_cache_lru = r->lru_prev;
+}
+
+
+/* Insert R as the most recently used entry in the LRU list.  */
+static void
+uid_cache_push (user_id_db_t r)
+{
+  r->lru_prev = NULL;
+  r->lru_next = uid_cache_mru;
+  if (uid_cache_mru)
+    uid_cache_mru->lru_prev = r;
+  else
+    uid_cache_lru = r;
+  uid_cache_mru = r;
+}
+
+
+/* Return the user id cache entry for the key with KEYID or, if KEYID
+ * is NULL, with the fingerprint FPR.  Returns NULL if the key is not
+ * cached.  The entry is marked as the most recently used one.  */
+static user_id_db_t
+uid_cache_lookup (const u32 *keyid, const byte *fpr)
+{
+  keyid_list_t a;
+  user_id_db_t r;
+
+  init_caches ();
+  if (keyid)
+    {
+      for (a = uid_cache_bykid[keyid_hash (keyid)]; a; a = a->next_bykid)
+        if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
+          break;
+    }
+  else
+    {
+      for (a = uid_cache_byfpr[fpr_hash (fpr)]; a; a = a->next_byfpr)
+        if (!memcmp (a->fpr, fpr, MAX_FINGERPRINT_LEN))
+          break;
+    }
+  if (!a)
+    {
+      cache_stats.uid_misses++;
+      return NULL;
+    }
+
+  r = a->owner;
+  if (r != uid_cache_mru)
+    {
+      uid_cache_unlink (r);
+      uid_cache_push (r);
+    }
+  cache_stats.uid_hits++;
+  return r;
+}
+
+
+/* Remove the least recently used entry from the user id cache.  */
+static void
+uid_cache_evict (void)
+{
+  user_id_db_t r = uid_cache_lru;
+  keyid_list_t a, *ap;
+
+  uid_cache_unlink (r);
+  for (a = r->keyids; a; a = a->next)
+    {
+      for (ap = &uid_cache_bykid[keyid_hash (a->keyid)]; *ap != a;
+           ap = &(*ap)->next_bykid)
+        ;
+      *ap = a->next_bykid;
+      for (ap = &uid_cache_byfpr[fpr_hash (a->fpr)]; *ap != a;
+           ap = &(*ap)->next_byfpr)
+        ;
+      *ap = a->next_byfpr;
+    }
+  release_keyid_list (r->keyids);
+  xfree (r);
+  uid_cache_entries--;
+  cache_stats.uid_evictions++;
+}
+
+
 /****************
  * Store the association of keyid and userid
  * Feed only public keys to this function.
@@ -310,35 +552,33 @@ cache_user_id (KBNODE keyblock)
   const char *uid;
   size_t uidlen;
   keyid_list_t keyids = NULL;
+  keyid_list_t a, b;
+  unsigned int hash;
   KBNODE k;
 
+  init_caches ();
   for (k = keyblock; k; k = k->next)
     {
       if (k->pkt->pkttype == PKT_PUBLIC_KEY
 	  || k->pkt->pkttype == PKT_PUBLIC_SUBKEY)
 	{
-	  keyid_list_t a = xmalloc_clear (sizeof *a);
+	  a = xmalloc_clear (sizeof *a);
 	  /* Hmmm: For a long list of keyids it might be an advantage
 	   * to append the keys.  */
           fingerprint_from_pk (k->pkt->pkt.public_key, a->fpr, NULL);
 	  keyid_from_pk (k->pkt->pkt.public_key, a->keyid);
 	  /* First check for duplicates.  */
-	  for (r = user_id_db; r; r = r->next)
-	    {
-	      keyid_list_t b;
-
-	      for (b = r->keyids; b; b = b->next)
-		{
-		  if (!memcmp (b->fpr, a->fpr, MAX_FINGERPRINT_LEN))
-		    {
-		      if (DBG_CACHE)
-			log_debug ("cache_user_id: already in cache\n");
-		      release_keyid_list (keyids);
-		      xfree (a);
-		      return;
-		    }
-		}
-	    }
+          for (b = uid_cache_byfpr[fpr_hash (a->fpr)]; b; b = b->next_byfpr)
+            {
+              if (!memcmp (b->fpr, a->fpr, MAX_FINGERPRINT_LEN))
+                {
+                  if (DBG_CACHE)
+                    log_debug ("cache_user_id: already in cache\n");
+                  release_keyid_list (keyids);
+                  xfree (a);
+                  return;
+                }
+            }
 	  /* Now put it into the cache.  */
 	  a->next = keyids;
 	  keyids = a;
@@ -350,21 +590,23 @@ cache_user_id (KBNODE keyblock)
 
   uid = get_primary_uid (keyblock, &uidlen);
 
-  if (uid_cache_entries >= MAX_UID_CACHE_ENTRIES)
-    {
-      /* fixme: use another algorithm to free some cache slots */
-      r = user_id_db;
-      user_id_db = r->next;
-      release_keyid_list (r->keyids);
-      xfree (r);
-      uid_cache_entries--;
-    }
+  if (uid_cache_entries >= cache_max_entries)
+    uid_cache_evict ();
   r = xmalloc (sizeof *r + uidlen - 1);
   r->keyids = keyids;
   r->len = uidlen;
   memcpy (r->name, uid, r->len);
-  r->next = user_id_db;
-  user_id_db = r;
+  for (a = keyids; a; a = a->next)
+    {
+      a->owner = r;
+      hash = keyid_hash (a->keyid);
+      a->next_bykid = uid_cache_bykid[hash];
+      uid_cache_bykid[hash] = a;
+      hash = fpr_hash (a->fpr);
+      a->next_byfpr = uid_cache_byfpr[hash];
+      uid_cache_byfpr[hash] = a;
+    }
+  uid_cache_push (r);
   uid_cache_entries++;
 }
 
@@ -379,15 +621,17 @@ getkey_disable_caches ()
   {
     pk_cache_entry_t ce, ce2;
 
-    for (ce = pk_cache; ce; ce = ce2)
+    for (ce = pk_cache_mru; ce; ce = ce2)
       {
-	ce2 = ce->next;
+	ce2 = ce->lru_next;
 	free_public_key (ce->pk);
 	xfree (ce);
       }
     pk_cache_disabled = 1;
     pk_cache_entries = 0;
-    pk_cache = NULL;
+    pk_cache_mru = pk_cache_lru = NULL;
+    if (pk_cache)
+      memset (pk_cache, 0, cache_table_size * sizeof *pk_cache);
   }
 #endif
   /* fixme: disable user id cache ? */
@@ -472,17 +716,15 @@ get_pubkey (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
       /* Try to get it from the cache.  We don't do this when pk is
          NULL as it does not guarantee that the user IDs are
          cached. */
-      pk_cache_entry_t ce;
-      for (ce = pk_cache; ce; ce = ce->next)
-	{
-	  if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	    /* XXX: We don't check PK->REQ_USAGE here, but if we don't
-	       read from the cache, we do check it!  */
-	    {
-	      copy_public_key (pk, ce->pk);
-	      return 0;
-	    }
-	}
+      pk_cache_entry_t ce = pk_cache_lookup (keyid);
+
+      /* XXX: We don't check PK->REQ_USAGE here, but if we don't
+         read from the cache, we do check it!  */
+      if (ce)
+        {
+          copy_public_key (pk, ce->pk);
+          return 0;
+        }
     }
 #endif
   /* More init stuff.  */
@@ -572,19 +814,16 @@ get_pubkey_fast (PKT_public_key * pk, u32 * keyid)
 #if MAX_PK_CACHE_ENTRIES
   {
     /* Try to get it from the cache */
-    pk_cache_entry_t ce;
+    pk_cache_entry_t ce = pk_cache_lookup (keyid);
 
-    for (ce = pk_cache; ce; ce = ce->next)
+    /* Only consider primary keys.  */
+    if (ce
+        && ce->pk->keyid[0] == ce->pk->main_keyid[0]
+        && ce->pk->keyid[1] == ce->pk->main_keyid[1])
       {
-	if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1]
-	    /* Only consider primary keys.  */
-	    && ce->pk->keyid[0] == ce->pk->main_keyid[0]
-	    && ce->pk->keyid[1] == ce->pk->main_keyid[1])
-	  {
-	    if (pk)
-	      copy_public_key (pk, ce->pk);
-	    return 0;
-	  }
+        if (pk)
+          copy_public_key (pk, ce->pk);
+        return 0;
       }
   }
 #endif
@@ -3844,7 +4083,6 @@ get_user_id_string (ctrl_t ctrl, u32 * keyid, int mode, size_t *r_len,
                     int *r_nouid)
 {
   user_id_db_t r;
-  keyid_list_t a;
   int pass = 0;
   char *p;
 
@@ -3854,39 +4092,34 @@ get_user_id_string (ctrl_t ctrl, u32 * keyid, int mode, size_t *r_len,
   /* Try it two times; second pass reads from the database.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
-	{
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
-		{
-                  if (mode == 2)
-                    {
-                      /* An empty string as user id is possible.  Make
-                         sure that the malloc allocates one byte and
-                         does not bail out.  */
-                      p = xmalloc (r->len? r->len : 1);
-                      memcpy (p, r->name, r->len);
-                      if (r_len)
-                        *r_len = r->len;
-                    }
-                  else
-                    {
-                      if (mode)
-                        p = xasprintf ("%08lX%08lX %.*s",
-                                       (ulong) keyid[0], (ulong) keyid[1],
-                                       r->len, r->name);
-                      else
-                        p = xasprintf ("%s %.*s", keystr (keyid),
-                                       r->len, r->name);
-                      if (r_len)
-                        *r_len = strlen (p);
-                    }
+      r = uid_cache_lookup (keyid, NULL);
+      if (r)
+        {
+          if (mode == 2)
+            {
+              /* An empty string as user id is possible.  Make
+                 sure that the malloc allocates one byte and
+                 does not bail out.  */
+              p = xmalloc (r->len? r->len : 1);
+              memcpy (p, r->name, r->len);
+              if (r_len)
+                *r_len = r->len;
+            }
+          else
+            {
+              if (mode)
+                p = xasprintf ("%08lX%08lX %.*s",
+                               (ulong) keyid[0], (ulong) keyid[1],
+                               r->len, r->name);
+              else
+                p = xasprintf ("%s %.*s", keystr (keyid),
+                               r->len, r->name);
+              if (r_len)
+                *r_len = strlen (p);
+            }
 
-                  return p;
-		}
-	    }
-	}
+          return p;
+        }
     }
   while (++pass < 2 && !get_pubkey (ctrl, NULL, keyid));
 
@@ -3957,23 +4190,17 @@ get_user_id_byfpr (ctrl_t ctrl, const byte *fpr, size_t *rn)
   /* Try it two times; second pass reads from the database.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
-	{
-	  keyid_list_t a;
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (!memcmp (a->fpr, fpr, MAX_FINGERPRINT_LEN))
-		{
-                  /* An empty string as user id is possible.  Make
-                     sure that the malloc allocates one byte and does
-                     not bail out.  */
-		  p = xmalloc (r->len? r->len : 1);
-		  memcpy (p, r->name, r->len);
-		  *rn = r->len;
-		  return p;
-		}
-	    }
-	}
+      r = uid_cache_lookup (NULL, fpr);
+      if (r)
+        {
+          /* An empty string as user id is possible.  Make
+             sure that the malloc allocates one byte and does
+             not bail out.  */
+          p = xmalloc (r->len? r->len : 1);
+          memcpy (p, r->name, r->len);
+          *rn = r->len;
+          return p;
+        }
     }
   while (++pass < 2
 	 && !get_pubkey_byfprint (ctrl, NULL, NULL, fpr, MAX_FINGERPRINT_LEN));
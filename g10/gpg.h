@@ -71,6 +71,9 @@ typedef struct kbnode_struct *kbnode_t;
 /* The handle for keydb operations.  */
 typedef struct keydb_handle *KEYDB_HANDLE;
 
+/* A list of secret keys.  */
+struct sk_list;
+
 /* TOFU database meta object.  */
 struct tofu_dbs_s;
 typedef struct tofu_dbs_s *tofu_dbs_t;
@@ -104,6 +107,13 @@ struct server_control_s
 
   /* This is used to cache a key data base handle.  */
   KEYDB_HANDLE cached_getkey_kdb;
+
+  /* The secret keys found by get_session_key.  They are tried first
+   * for the next message.  */
+  struct sk_list *decrypt_keys;
+
+  /* The session key frames decrypted ahead by prefetch_session_keys.  */
+  struct decrypt_prefetch_s *decrypt_prefetch;
 };
 
 
@@ -335,6 +335,16 @@ check_trustdb_stale (ctrl_t ctrl)
   (void)ctrl;
 }
 
+void
+tdb_notice_key_changed (ctrl_t ctrl, kbnode_t kb,
+                        const byte *oldstate, const byte *newstate)
+{
+  (void)ctrl;
+  (void)kb;
+  (void)oldstate;
+  (void)newstate;
+}
+
 int
 get_validity_info (ctrl_t ctrl, kbnode_t kb, PKT_public_key *pk,
                    PKT_user_id *uid)
@@ -44,6 +44,13 @@
 #include "key-clean.h"
 
 
+/* The number of keyblocks per worker thread read ahead by import.  */
+#define IMPORT_READAHEAD 4
+
+/* The number of keys stored in one transaction with import-batch.  */
+#define IMPORT_BATCH_KEYS 1000
+
+
 struct import_stats_s
 {
   ulong count;
@@ -62,6 +69,15 @@ struct import_stats_s
   ulong n_sigs_cleaned;
   ulong n_uids_cleaned;
   ulong v3keys;   /* Number of V3 keys seen.  */
+  /* Set while the keys are stored in one transaction.  */
+  unsigned int in_batch:1;
+  /* Set if the trustdb needs a revalidation at the end of the
+   * transaction.  */
+  unsigned int revalidation_pending:1;
+  /* The handle of the transaction and the number of keys stored in
+   * it so far.  */
+  KEYDB_HANDLE batch_hd;
+  unsigned int batch_keys;
 };
 
 
@@ -195,6 +211,9 @@ parse_import_options(char *str,unsigned int *options,int noisy)
       {"repair-keys", IMPORT_REPAIR_KEYS, NULL,
        N_("repair keys on import")},
 
+      {"import-batch", IMPORT_BATCH, NULL,
+       N_("store imported keys in transactions")},
+
       /* No description to avoid string change: Fixme for 2.3 */
       {"show-only", (IMPORT_SHOW | IMPORT_DRY_RUN), NULL,
        NULL},
@@ -304,6 +323,44 @@ import_release_stats_handle (import_stats_t p)
 }
 
 
+/* Mark the trustdb for a revalidation.  During a batch import this is
+ * done only once at the end of the transaction.  */
+static void
+import_revalidation_mark (ctrl_t ctrl, struct import_stats_s *stats)
+{
+  if (stats->in_batch)
+    stats->revalidation_pending = 1;
+  else
+    revalidation_mark (ctrl);
+}
+
+
+/* Commit the transaction of a batch import.  If RESTART is set a new
+ * transaction is started; if that fails or RESTART is not set the
+ * following keys are stored one by one.  */
+static gpg_error_t
+import_commit_batch (ctrl_t ctrl, struct import_stats_s *stats, int restart)
+{
+  gpg_error_t err;
+
+  stats->in_batch = 0;
+  err = keydb_end_transaction (stats->batch_hd, 0);
+  if (!err && stats->revalidation_pending)
+    revalidation_mark (ctrl);
+  stats->revalidation_pending = 0;
+  stats->batch_keys = 0;
+
+  if (!err && restart && !keydb_begin_transaction (stats->batch_hd))
+    stats->in_batch = 1;
+  else
+    {
+      keydb_release (stats->batch_hd);
+      stats->batch_hd = NULL;
+    }
+  return err;
+}
+
+
 /* Read a key from a file.  Only the first key in the file is
  * considered and stored at R_KEYBLOCK.  FNAME is the name of the
  * file.
@@ -451,11 +508,30 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
 {
   int i;
   gpg_error_t err = 0;
+  gpg_error_t err2;
   struct import_stats_s *stats = stats_handle;
+  int batch = 0;
 
   if (!stats)
     stats = import_new_stats_handle ();
 
+  /* Store the keys in transactions of IMPORT_BATCH_KEYS keys so that
+   * we lock the keyrings only once and do not need to sync them for
+   * each key.  */
+  if ((options & IMPORT_BATCH) && !opt.dry_run && !stats->batch_hd
+      && !(options & (IMPORT_DRY_RUN | IMPORT_EXPORT)))
+    {
+      stats->batch_hd = keydb_new ();
+      if (stats->batch_hd && keydb_begin_transaction (stats->batch_hd))
+        {
+          /* Fall back to storing each key on its own.  */
+          keydb_release (stats->batch_hd);
+          stats->batch_hd = NULL;
+        }
+      if (stats->batch_hd)
+        stats->in_batch = batch = 1;
+    }
+
   if (inp)
     {
       err = import (ctrl, inp, "[stream]", stats, fpr, fpr_len, options,
@@ -497,6 +573,13 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
 	}
     }
 
+  if (batch && stats->batch_hd)
+    {
+      err2 = import_commit_batch (ctrl, stats, 0);
+      if (err2 && !err)
+        err = err2;
+    }
+
   if (!stats_handle)
     {
       if ((options & (IMPORT_SHOW | IMPORT_DRY_RUN))
@@ -556,6 +639,15 @@ import_keys_es_stream (ctrl_t ctrl, estream_t fp,
 }
 
 
+/* Worker function to verify the self-signatures of the keyblock ARG
+ * in advance.  */
+static void
+check_ahead_worker (void *arg)
+{
+  check_self_sigs_ahead (arg);
+}
+
+
 static int
 import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
 	unsigned char **fpr,size_t *fpr_len, unsigned int options,
@@ -566,8 +658,18 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
   kbnode_t keyblock = NULL;  /* Need to initialize because gcc can't
                                 grasp the return semantics of
                                 read_block. */
+  struct {
+    kbnode_t keyblock;
+    int v3keys;
+    workpool_job_t job;
+  } *ahead;               /* Ring buffer with keyblocks read ahead.  */
+  int aheadsize;          /* Allocated size of AHEAD.  */
+  int aheadpos = 0;       /* Index of the next keyblock in AHEAD.  */
+  int naheads = 0;        /* Number of keyblocks in AHEAD.  */
   int rc = 0;
-  int v3keys;
+  int readrc = 0;
+  int v3keys, readv3keys;
+  int i;
 
   getkey_disable_caches ();
 
@@ -581,9 +683,53 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
       release_armor_context (afx);
     }
 
-  while (!(rc = read_block (inp, !!(options & IMPORT_RESTORE),
-                            &pending_pkt, &keyblock, &v3keys)))
+  /* While the keyblocks are imported one after the other, the
+   * self-signatures of the next few keyblocks are verified by worker
+   * threads.  We don't do this in verbose mode or with status output
+   * because the diagnostics and status lines from reading the
+   * keyblocks would then show up before those of the import of the
+   * previous keyblocks.  */
+  aheadsize = 1;
+  if (!opt.verbose && !is_status_enabled ())
+    aheadsize = IMPORT_READAHEAD * workpool_start ();
+  if (aheadsize < 1)
+    aheadsize = 1;
+  ahead = xtrycalloc (aheadsize, sizeof *ahead);
+  if (!ahead)
+    return gpg_error_from_syserror ();
+
+  for (;;)
     {
+      while (!readrc && naheads < aheadsize)
+        {
+          readrc = read_block (inp, !!(options & IMPORT_RESTORE),
+                               &pending_pkt, &keyblock, &readv3keys);
+          if (readrc)
+            break;
+          i = (aheadpos + naheads) % aheadsize;
+          ahead[i].keyblock = keyblock;
+          ahead[i].v3keys = readv3keys;
+          ahead[i].job = NULL;
+          naheads++;
+          if (aheadsize > 1 && keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
+            {
+              /* The worker needs the keyid of the primary key.  */
+              keyid_from_pk (keyblock->pkt->pkt.public_key, NULL);
+              ahead[i].job = workpool_submit (check_ahead_worker, keyblock);
+            }
+        }
+      if (!naheads)
+        {
+          rc = readrc;
+          v3keys = readv3keys;
+          break;
+        }
+      keyblock = ahead[aheadpos].keyblock;
+      v3keys = ahead[aheadpos].v3keys;
+      workpool_wait (ahead[aheadpos].job, 0);
+      aheadpos = (aheadpos + 1) % aheadsize;
+      naheads--;
+
       stats->v3keys += v3keys;
       if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
         rc = import_one (ctrl, keyblock,
@@ -614,6 +760,15 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
       else if (rc)
         break;
 
+      /* Commit a batch import from time to time so that an
+       * interrupted import does not lose all keys.  */
+      if (stats->in_batch && ++stats->batch_keys >= IMPORT_BATCH_KEYS)
+        {
+          rc = import_commit_batch (ctrl, stats, 1);
+          if (rc)
+            break;
+        }
+
       if (!(++stats->count % 100) && !opt.quiet)
         log_info (_("%lu keys processed so far\n"), stats->count );
     }
@@ -623,6 +778,15 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
   else if (rc && gpg_err_code (rc) != GPG_ERR_INV_KEYRING)
     log_error (_("error reading '%s': %s\n"), fname, gpg_strerror (rc));
 
+  /* Release the keyblocks read ahead but not imported due to an
+   * error.  */
+  for (; naheads; naheads--, aheadpos = (aheadpos + 1) % aheadsize)
+    {
+      workpool_wait (ahead[aheadpos].job, 0);
+      release_kbnode (ahead[aheadpos].keyblock);
+    }
+  xfree (ahead);
+
   return rc;
 }
 
@@ -1944,7 +2108,7 @@ import_one (ctrl_t ctrl,
             }
         }
 
-      err = keydb_insert_keyblock (hd, keyblock );
+      err = keydb_insert_keyblock (ctrl, hd, keyblock);
       if (err)
         log_error (_("error writing keyring '%s': %s\n"),
                    keydb_get_resource_name (hd), gpg_strerror (err));
@@ -1958,7 +2122,7 @@ import_one (ctrl_t ctrl,
 
           clear_ownertrusts (ctrl, pk);
           if (non_self)
-            revalidation_mark (ctrl);
+            import_revalidation_mark (ctrl, stats);
         }
 
       /* Release the handle and thus unlock the keyring asap.  */
@@ -2045,7 +2209,7 @@ import_one (ctrl_t ctrl,
             log_error (_("error writing keyring '%s': %s\n"),
                        keydb_get_resource_name (hd), gpg_strerror (err));
           else if (non_self)
-            revalidation_mark (ctrl);
+            import_revalidation_mark (ctrl, stats);
 
           /* Release the handle and thus unlock the keyring asap.  */
           keydb_release (hd);
@@ -3036,7 +3200,7 @@ import_revoke_cert (ctrl_t ctrl, kbnode_t node, unsigned int options,
       if (get_ownertrust (ctrl, pk) == TRUST_ULTIMATE)
         clear_ownertrusts (ctrl, pk);
 
-      revalidation_mark (ctrl);
+      import_revalidation_mark (ctrl, stats);
     }
   stats->n_revoc++;
 
@@ -35,6 +35,7 @@
 #include "keyring.h"
 #include "../kbx/keybox.h"
 #include "keydb.h"
+#include "trustdb.h"
 #include "../common/i18n.h"
 
 static int active_handles;
@@ -100,6 +101,10 @@ struct keydb_handle
    * keydb_release.  */
   int keep_lock;
 
+  /* Set while a transaction started by keydb_begin_transaction is
+   * active.  */
+  int in_transaction;
+
   /* The index into ACTIVE of the resources in which the last search
      result was found.  Initially -1.  */
   int found;
@@ -175,6 +180,7 @@ struct
   unsigned int update_keyblocks;/* Number of update_keyblock calls.       */
   unsigned int insert_keyblocks;/* Number of update_keyblock calls.       */
   unsigned int delete_keyblocks;/* Number of delete_keyblock calls.       */
+  unsigned int transactions;    /* Number of committed transactions.     */
   unsigned int search_resets;   /* Number of keydb_search_reset calls.    */
   unsigned int found;           /* Number of successful keydb_search calls. */
   unsigned int found_cached;    /* Ditto but from the cache.              */
@@ -864,11 +870,12 @@ keydb_dump_stats (void)
             keydb_stats.locks,
             keydb_stats.parse_keyblocks,
             keydb_stats.get_keyblocks);
-  log_info ("       build=%u update=%u insert=%u delete=%u\n",
+  log_info ("       build=%u update=%u insert=%u delete=%u txn=%u\n",
             keydb_stats.build_keyblocks,
             keydb_stats.update_keyblocks,
             keydb_stats.insert_keyblocks,
-            keydb_stats.delete_keyblocks);
+            keydb_stats.delete_keyblocks,
+            keydb_stats.transactions);
   log_info ("       reset=%u found=%u not=%u cache=%u not=%u\n",
             keydb_stats.search_resets,
             keydb_stats.found,
@@ -968,6 +975,8 @@ keydb_release (KEYDB_HANDLE hd)
   log_assert (active_handles > 0);
   active_handles--;
 
+  if (hd->in_transaction)
+    keydb_end_transaction (hd, 1);
   hd->keep_lock = 0;
   unlock_all (hd);
   for (i=0; i < hd->used; i++)
@@ -1008,6 +1017,114 @@ keydb_lock (KEYDB_HANDLE hd)
 }
 
 
+/* Start a transaction on all resources of HD.  This takes and keeps
+ * the locks like keydb_lock and disables caching.  All inserts,
+ * updates and deletions until keydb_end_transaction, done via any
+ * handle, are then applied as one unit: Keyboxes are synced only once
+ * and keyrings are not rewritten for new keys.  */
+gpg_error_t
+keydb_begin_transaction (KEYDB_HANDLE hd)
+{
+  gpg_error_t err;
+  int i;
+
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (hd->in_transaction)
+    return gpg_error (GPG_ERR_CONFLICT);
+
+  err = keydb_lock (hd);
+  if (err)
+    return err;
+  keydb_disable_caching (hd);
+
+  for (i=0; !err && i < hd->used; i++)
+    {
+      switch (hd->active[i].type)
+        {
+        case KEYDB_RESOURCE_TYPE_NONE:
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYRING:
+          err = keyring_begin_transaction (hd->active[i].u.kr);
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          err = keybox_begin_transaction (hd->active[i].u.kb);
+          break;
+        }
+    }
+
+  if (err)
+    {
+      /* Revert the already started transactions.  */
+      for (i--; i >= 0; i--)
+        {
+          switch (hd->active[i].type)
+            {
+            case KEYDB_RESOURCE_TYPE_NONE:
+              break;
+            case KEYDB_RESOURCE_TYPE_KEYRING:
+              keyring_end_transaction (hd->active[i].u.kr, 1);
+              break;
+            case KEYDB_RESOURCE_TYPE_KEYBOX:
+              keybox_end_transaction (hd->active[i].u.kb, 1);
+              break;
+            }
+        }
+      log_error ("error starting a keydb transaction: %s\n",
+                 gpg_strerror (err));
+    }
+  else
+    hd->in_transaction = 1;
+
+  return err;
+}
+
+
+/* End the transaction on HD.  If CANCEL is set all changes are rolled
+ * back.  The locks are kept until keydb_release.  */
+gpg_error_t
+keydb_end_transaction (KEYDB_HANDLE hd, int cancel)
+{
+  gpg_error_t err = 0;
+  gpg_error_t rc;
+  int i;
+
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (!hd->in_transaction)
+    return gpg_error (GPG_ERR_INV_STATE);
+
+  for (i=0; i < hd->used; i++)
+    {
+      rc = 0;
+      switch (hd->active[i].type)
+        {
+        case KEYDB_RESOURCE_TYPE_NONE:
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYRING:
+          rc = keyring_end_transaction (hd->active[i].u.kr, cancel);
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          rc = keybox_end_transaction (hd->active[i].u.kb, cancel);
+          break;
+        }
+      if (rc && !err)
+        err = rc;
+    }
+  hd->in_transaction = 0;
+
+  /* The caches may describe keys which are gone after a rollback.  */
+  kid_not_found_flush ();
+  keyblock_cache_clear (hd);
+
+  if (err)
+    log_error ("error ending a keydb transaction: %s\n", gpg_strerror (err));
+  else if (!cancel)
+    keydb_stats.transactions++;
+  return err;
+}
+
+
 /* Set a flag on the handle to suppress use of cached results.  This
  * is required for updating a keyring and for key listings.  Fixme:
  * Using a new parameter for keydb_new might be a better solution.  */
@@ -1060,6 +1177,58 @@ keydb_get_resource_name (KEYDB_HANDLE hd)
 }
 
 
+/* Store a digest describing the state of the files of the resources
+ * of HD at STATE, which must provide space for KEYDB_STATE_LEN bytes.
+ * The digest is taken over the names, sizes, modification times and
+ * inode numbers of the files and thus changes with each modification
+ * of the files.  */
+gpg_error_t
+keydb_get_state (KEYDB_HANDLE hd, byte *state)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  struct stat st;
+  const char *fname;
+  unsigned long long vals[3];
+  int idx;
+
+  err = gcry_md_open (&md, GCRY_MD_SHA1, 0);
+  if (err)
+    return err;
+
+  for (idx=0; idx < hd->used; idx++)
+    {
+      switch (hd->active[idx].type)
+        {
+        case KEYDB_RESOURCE_TYPE_KEYRING:
+          fname = keyring_get_resource_name (hd->active[idx].u.kr);
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          fname = keybox_get_resource_name (hd->active[idx].u.kb);
+          break;
+        default:
+          fname = NULL;
+          break;
+        }
+      if (!fname)
+        continue;
+      gcry_md_write (md, fname, strlen (fname) + 1);
+      memset (vals, 0, sizeof vals);
+      if (!stat (fname, &st))
+        {
+          vals[0] = st.st_size;
+          vals[1] = st.st_mtime;
+          vals[2] = st.st_ino;
+        }
+      gcry_md_write (md, vals, sizeof vals);
+    }
+
+  memcpy (state, gcry_md_read (md, GCRY_MD_SHA1), KEYDB_STATE_LEN);
+  gcry_md_close (md);
+  return 0;
+}
+
+
 
 static int
 lock_all (KEYDB_HANDLE hd)
@@ -1505,6 +1674,8 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   PKT_public_key *pk;
   KEYDB_SEARCH_DESC desc;
   size_t len;
+  byte oldstate[KEYDB_STATE_LEN], newstate[KEYDB_STATE_LEN];
+  int have_state;
 
   log_assert (kb);
   log_assert (kb->pkt->pkttype == PKT_PUBLIC_KEY);
@@ -1540,6 +1711,8 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
     return gpg_error (GPG_ERR_VALUE_NOT_FOUND);
   log_assert (hd->found >= 0 && hd->found < hd->used);
 
+  have_state = !keydb_get_state (hd, oldstate);
+
   switch (hd->active[hd->found].type)
     {
     case KEYDB_RESOURCE_TYPE_NONE:
@@ -1564,9 +1737,17 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
       break;
     }
 
+  if (!err && have_state)
+    have_state = !keydb_get_state (hd, newstate);
   unlock_all (hd);
   if (!err)
-    keydb_stats.update_keyblocks++;
+    {
+      keydb_stats.update_keyblocks++;
+#ifndef NO_TRUST_MODELS
+      tdb_notice_key_changed (ctrl, kb, have_state? oldstate : NULL,
+                              have_state? newstate : NULL);
+#endif
+    }
   return err;
 }
 
@@ -1582,10 +1763,12 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
  *
  * Returns 0 on success.  Otherwise, it returns an error code.  */
 gpg_error_t
-keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
+keydb_insert_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
 {
   gpg_error_t err;
   int idx;
+  byte oldstate[KEYDB_STATE_LEN], newstate[KEYDB_STATE_LEN];
+  int have_state;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
@@ -1607,6 +1790,8 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   if (err)
     return err;
 
+  have_state = !keydb_get_state (hd, oldstate);
+
   switch (hd->active[idx].type)
     {
     case KEYDB_RESOURCE_TYPE_NONE:
@@ -1634,9 +1819,17 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
       break;
     }
 
+  if (!err && have_state)
+    have_state = !keydb_get_state (hd, newstate);
   unlock_all (hd);
   if (!err)
-    keydb_stats.insert_keyblocks++;
+    {
+      keydb_stats.insert_keyblocks++;
+#ifndef NO_TRUST_MODELS
+      tdb_notice_key_changed (ctrl, kb, have_state? oldstate : NULL,
+                              have_state? newstate : NULL);
+#endif
+    }
   return err;
 }
 
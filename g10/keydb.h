@@ -191,6 +191,13 @@ void keydb_release (KEYDB_HANDLE hd);
  * update.  This lock is released with keydb_release.  */
 gpg_error_t keydb_lock (KEYDB_HANDLE hd);
 
+/* Start a transaction on all resources of HD; the resources are
+ * locked until the transaction is ended.  */
+gpg_error_t keydb_begin_transaction (KEYDB_HANDLE hd);
+
+/* Commit or, if CANCEL is set, roll back a transaction.  */
+gpg_error_t keydb_end_transaction (KEYDB_HANDLE hd, int cancel);
+
 /* Set a flag on the handle to suppress use of cached results.  This
    is required for updating a keyring and for key listings.  Fixme:
    Using a new parameter for keydb_new might be a better solution.  */
@@ -205,6 +212,10 @@ void keydb_pop_found_state (KEYDB_HANDLE hd);
 /* Return the file name of the resource.  */
 const char *keydb_get_resource_name (KEYDB_HANDLE hd);
 
+/* Return a digest describing the state of the files.  */
+#define KEYDB_STATE_LEN 20
+gpg_error_t keydb_get_state (KEYDB_HANDLE hd, byte *state);
+
 /* Return the keyblock last found by keydb_search.  */
 gpg_error_t keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb);
 
@@ -212,7 +223,7 @@ gpg_error_t keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb);
 gpg_error_t keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb);
 
 /* Insert a keyblock into one of the underlying keyrings or keyboxes.  */
-gpg_error_t keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb);
+gpg_error_t keydb_insert_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb);
 
 /* Delete the currently selected keyblock.  */
 gpg_error_t keydb_delete_keyblock (KEYDB_HANDLE hd);
@@ -313,6 +324,9 @@ void cache_public_key( PKT_public_key *pk );
 /* Disable and drop the public key cache.  */
 void getkey_disable_caches(void);
 
+/* Print statistics for the public key and user id caches.  */
+void getkey_dump_stats (void);
+
 /* Return the public key used for signature SIG and store it at PK.  */
 gpg_error_t get_pubkey_for_sig (ctrl_t ctrl,
                                 PKT_public_key *pk, PKT_signature *sig);
@@ -4947,7 +4947,7 @@ do_generate_keypair (ctrl_t ctrl, struct para_data_s *para,
 
       if (!err)
         {
-          err = keydb_insert_keyblock (pub_hd, pub_root);
+          err = keydb_insert_keyblock (ctrl, pub_hd, pub_root);
           if (err)
             log_error (_("error writing public keyring '%s': %s\n"),
                        keydb_get_resource_name (pub_hd), gpg_strerror (err));
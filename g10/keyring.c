@@ -46,6 +46,11 @@ struct keyring_resource
   dotlock_t lockhd;
   int is_locked;
   int did_full_scan;
+  /* Set during a transaction (see keyring_begin_transaction).
+     TXN_SIZE is then the size of the file at its start or -1 if the
+     transaction can't be rolled back.  */
+  int in_transaction;
+  off_t txn_size;
   char fname[1];
 };
 typedef struct keyring_resource const * CONST_KR_RESOURCE;
@@ -79,6 +84,7 @@ static int active_handles;
 
 static int do_copy (int mode, const char *fname, KBNODE root,
                     off_t start_offset, unsigned int n_packets );
+static int write_keyblock (IOBUF fp, KBNODE keyblock);
 
 
 
@@ -210,6 +216,8 @@ keyring_register_filename (const char *fname, int read_only, void **ptr)
     kr->lockhd = NULL;
     kr->is_locked = 0;
     kr->did_full_scan = 0;
+    kr->in_transaction = 0;
+    kr->txn_size = -1;
     /* keep a list of all issued pointers */
     kr->next = kr_resources;
     kr_resources = kr;
@@ -355,6 +363,8 @@ keyring_lock (KEYRING_HANDLE hd, int yes)
                 continue;
             if (!kr->is_locked)
                 continue;
+            if (kr->in_transaction)
+                continue; /* Released by keyring_end_transaction.  */
 
             if (dotlock_release (kr->lockhd))
                 log_info ("can't unlock '%s'\n", kr->fname );
@@ -367,6 +377,137 @@ keyring_lock (KEYRING_HANDLE hd, int yes)
 }
 
 
+
+/* Start a transaction on all writable keyrings.  The keyrings need
+ * to be locked; the locks are kept until the end of the transaction.
+ * Within a transaction new keyblocks are appended to the keyring
+ * instead of rewriting it for each key.  */
+int
+keyring_begin_transaction (KEYRING_HANDLE hd)
+{
+    KR_RESOURCE kr;
+    struct stat st;
+
+    (void)hd;
+
+    for (kr=kr_resources; kr; kr = kr->next) {
+        if (!keyring_is_writable(kr))
+            continue;
+        if (!kr->is_locked)
+            return gpg_error (GPG_ERR_NOT_LOCKED);
+    }
+
+    for (kr=kr_resources; kr; kr = kr->next) {
+        if (!keyring_is_writable(kr) || kr->in_transaction)
+            continue;
+        if (!stat (kr->fname, &st))
+            kr->txn_size = st.st_size;
+        else if (errno == ENOENT)
+            kr->txn_size = 0;
+        else
+            kr->txn_size = -1;
+        kr->in_transaction = 1;
+    }
+
+    return 0;
+}
+
+
+/* End a transaction started with keyring_begin_transaction.  If
+ * CANCEL is set the appended keyblocks are removed again.  This is
+ * not possible if an existing keyblock has been updated or deleted
+ * within the transaction.  */
+int
+keyring_end_transaction (KEYRING_HANDLE hd, int cancel)
+{
+    KR_RESOURCE kr;
+    int rc = 0;
+
+    (void)hd;
+
+    for (kr=kr_resources; kr; kr = kr->next) {
+        if (!kr->in_transaction)
+            continue;
+        kr->in_transaction = 0;
+        if (!cancel)
+            continue;
+
+        if (kr->txn_size == -1) {
+            log_error ("%s: can't roll back the changes\n", kr->fname);
+            rc = gpg_error (GPG_ERR_NOT_SUPPORTED);
+            continue;
+        }
+        iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, kr->fname);
+        if (truncate (kr->fname, kr->txn_size) && errno != ENOENT) {
+            rc = gpg_error_from_syserror ();
+            log_error ("%s: truncate failed: %s\n",
+                       kr->fname, gpg_strerror (rc));
+        }
+    }
+
+    return rc;
+}
+
+
+/* Return true if FNAME is a keyring in a transaction.  */
+static int
+in_transaction (const char *fname)
+{
+    KR_RESOURCE kr;
+
+    for (kr=kr_resources; kr; kr = kr->next)
+        if (kr->in_transaction && !strcmp (kr->fname, fname))
+            return 1;
+    return 0;
+}
+
+
+/* Note that the keyring RESOURCE is rewritten and thus a running
+ * transaction can't be rolled back.  */
+static void
+no_rollback (CONST_KR_RESOURCE resource)
+{
+    KR_RESOURCE kr;
+
+    for (kr=kr_resources; kr; kr = kr->next)
+        if (kr == resource)
+            kr->txn_size = -1;
+}
+
+
+/* Append KEYBLOCK to the existing keyring FNAME.  */
+static int
+append_keyblock (const char *fname, KBNODE keyblock)
+{
+    iobuf_t tmp;
+    estream_t fp;
+    int rc;
+
+    tmp = iobuf_temp ();
+    rc = write_keyblock (tmp, keyblock);
+    if (rc) {
+        iobuf_close (tmp);
+        return rc;
+    }
+
+    fp = es_fopen (fname, "ab");
+    if (!fp) {
+        rc = gpg_error_from_syserror ();
+        log_error (_("can't open '%s': %s\n"), fname, gpg_strerror (rc));
+        iobuf_close (tmp);
+        return rc;
+    }
+    if (es_write (fp, iobuf_get_temp_buffer (tmp),
+                  iobuf_get_temp_length (tmp), NULL))
+        rc = gpg_error_from_syserror ();
+    if (es_fclose (fp) && !rc)
+        rc = gpg_error_from_syserror ();
+    if (rc)
+        log_error ("%s: write failed: %s\n", fname, gpg_strerror (rc));
+    iobuf_close (tmp);
+    return rc;
+}
+
 
 /*
  * Return the last found keyblock.  Caller must free it.
@@ -553,6 +694,7 @@ keyring_update_keyblock (KEYRING_HANDLE hd, KBNODE kb)
     hd->current.iobuf = NULL;
 
     /* do the update */
+    no_rollback (hd->found.kr);
     rc = do_copy (3, hd->found.kr->fname, kb,
                   hd->found.offset, hd->found.n_packets );
     if (!rc) {
@@ -601,7 +743,10 @@ keyring_insert_keyblock (KEYRING_HANDLE hd, KBNODE kb)
     hd->current.iobuf = NULL;
 
     /* do the insert */
-    rc = do_copy (1, fname, kb, 0, 0 );
+    if (in_transaction (fname) && !access (fname, F_OK))
+      rc = append_keyblock (fname, kb);
+    else
+      rc = do_copy (1, fname, kb, 0, 0 );
     if (!rc && key_present_hash)
       {
         key_present_hash_update_from_kb (key_present_hash, kb);
@@ -641,6 +786,7 @@ keyring_delete_keyblock (KEYRING_HANDLE hd)
     hd->current.iobuf = NULL;
 
     /* do the delete */
+    no_rollback (hd->found.kr);
     rc = do_copy (2, hd->found.kr->fname, NULL,
                   hd->found.offset, hd->found.n_packets );
     if (!rc) {
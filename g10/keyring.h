@@ -33,6 +33,8 @@ void keyring_push_found_state (KEYRING_HANDLE hd);
 void keyring_pop_found_state (KEYRING_HANDLE hd);
 const char *keyring_get_resource_name (KEYRING_HANDLE hd);
 int keyring_lock (KEYRING_HANDLE hd, int yes);
+int keyring_begin_transaction (KEYRING_HANDLE hd);
+int keyring_end_transaction (KEYRING_HANDLE hd, int cancel);
 int keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb);
 int keyring_update_keyblock (KEYRING_HANDLE hd, KBNODE kb);
 int keyring_insert_keyblock (KEYRING_HANDLE hd, KBNODE kb);
@@ -110,6 +110,8 @@ static gpg_error_t keyserver_get (ctrl_t ctrl,
                                   struct keyserver_spec *override_keyserver,
                                   int quick,
                                   unsigned char **r_fpr, size_t *r_fprlen);
+static gpg_error_t keyserver_get_bulk (ctrl_t ctrl,
+                                       KEYDB_SEARCH_DESC *desc, int ndesc);
 static gpg_error_t keyserver_put (ctrl_t ctrl, strlist_t keyspecs);
 
 
@@ -1459,7 +1461,9 @@ keyserver_refresh (ctrl_t ctrl, strlist_t users)
             }
           xfree (tmpuri);
 
-          err = keyserver_get (ctrl, desc, numdesc, NULL, 0, NULL, NULL);
+          err = keyserver_get_bulk (ctrl, desc, numdesc);
+          if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+            err = keyserver_get (ctrl, desc, numdesc, NULL, 0, NULL, NULL);
         }
     }
 
@@ -1575,6 +1579,54 @@ keyserver_search (ctrl_t ctrl, strlist_t tokens)
   return err;
 }
 
+/* Create the KS_GET search pattern for DESC and store it at
+   R_PATTERN.  The caller must release it.  */
+static gpg_error_t
+make_ks_get_pattern (KEYDB_SEARCH_DESC *desc, char **r_pattern)
+{
+  char *pattern;
+
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_FPR20:
+    case KEYDB_SEARCH_MODE_FPR16:
+      pattern = xtrymalloc (2+2*20+1);
+      if (pattern)
+        {
+          strcpy (pattern, "0x");
+          bin2hex (desc->u.fpr,
+                   desc->mode == KEYDB_SEARCH_MODE_FPR20? 20 : 16,
+                   pattern+2);
+        }
+      break;
+
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      pattern = xtryasprintf ("0x%08lX%08lX",
+                              (ulong)desc->u.kid[0], (ulong)desc->u.kid[1]);
+      break;
+
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+      pattern = xtryasprintf ("0x%08lX", (ulong)desc->u.kid[1]);
+      break;
+
+    case KEYDB_SEARCH_MODE_EXACT:
+      /* The Dirmngr also uses classify_user_id to detect the type
+         of the search string.  By adding the '=' prefix we force
+         Dirmngr's KS_GET to consider this an exact search string.
+         (In gpg 1.4 and gpg 2.0 the keyserver helpers used the
+         KS_GETNAME command to indicate this.)  */
+      pattern = strconcat ("=", desc->u.name, NULL);
+      break;
+
+    default:
+      BUG();
+    }
+
+  *r_pattern = pattern;
+  return pattern? 0 : gpg_error_from_syserror ();
+}
+
+
 /* Helper for keyserver_get.  Here we only receive a chunk of the
    description to be processed in one batch.  This is required due to
    the limited number of patterns the dirmngr interface (KS_GET) can
@@ -1616,85 +1668,10 @@ keyserver_get_chunk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
   linelen = 17; /* "KS_GET --quick --" */
   for (npat=npat_fpr=0, idx=0; idx < ndesc; idx++)
     {
-      int quiet = 0;
-
-      if (desc[idx].mode == KEYDB_SEARCH_MODE_FPR20
-          || desc[idx].mode == KEYDB_SEARCH_MODE_FPR16)
-        {
-          n = 1+2+2*20;
-          if (idx && linelen + n > MAX_KS_GET_LINELEN)
-            break; /* Declare end of this chunk.  */
-          linelen += n;
-
-          pattern[npat] = xtrymalloc (n);
-          if (!pattern[npat])
-            err = gpg_error_from_syserror ();
-          else
-            {
-              strcpy (pattern[npat], "0x");
-              bin2hex (desc[idx].u.fpr,
-                       desc[idx].mode == KEYDB_SEARCH_MODE_FPR20? 20 : 16,
-                       pattern[npat]+2);
-              npat++;
-              if (desc[idx].mode == KEYDB_SEARCH_MODE_FPR20)
-                npat_fpr++;
-            }
-        }
-      else if(desc[idx].mode == KEYDB_SEARCH_MODE_LONG_KID)
-        {
-          n = 1+2+16;
-          if (idx && linelen + n > MAX_KS_GET_LINELEN)
-            break; /* Declare end of this chunk.  */
-          linelen += n;
-
-          pattern[npat] = xtryasprintf ("0x%08lX%08lX",
-                                        (ulong)desc[idx].u.kid[0],
-                                        (ulong)desc[idx].u.kid[1]);
-          if (!pattern[npat])
-            err = gpg_error_from_syserror ();
-          else
-            npat++;
-        }
-      else if(desc[idx].mode == KEYDB_SEARCH_MODE_SHORT_KID)
-        {
-          n = 1+2+8;
-          if (idx && linelen + n > MAX_KS_GET_LINELEN)
-            break; /* Declare end of this chunk.  */
-          linelen += n;
-
-          pattern[npat] = xtryasprintf ("0x%08lX", (ulong)desc[idx].u.kid[1]);
-          if (!pattern[npat])
-            err = gpg_error_from_syserror ();
-          else
-            npat++;
-        }
-      else if(desc[idx].mode == KEYDB_SEARCH_MODE_EXACT)
-        {
-          /* The Dirmngr also uses classify_user_id to detect the type
-             of the search string.  By adding the '=' prefix we force
-             Dirmngr's KS_GET to consider this an exact search string.
-             (In gpg 1.4 and gpg 2.0 the keyserver helpers used the
-             KS_GETNAME command to indicate this.)  */
-
-          n = 1+1+strlen (desc[idx].u.name);
-          if (idx && linelen + n > MAX_KS_GET_LINELEN)
-            break; /* Declare end of this chunk.  */
-          linelen += n;
-
-          pattern[npat] = strconcat ("=", desc[idx].u.name, NULL);
-          if (!pattern[npat])
-            err = gpg_error_from_syserror ();
-          else
-            {
-              npat++;
-              quiet = 1;
-            }
-        }
-      else if (desc[idx].mode == KEYDB_SEARCH_MODE_NONE)
+      if (desc[idx].mode == KEYDB_SEARCH_MODE_NONE)
         continue;
-      else
-        BUG();
 
+      err = make_ks_get_pattern (&desc[idx], &pattern[npat]);
       if (err)
         {
           for (idx=0; idx < npat; idx++)
@@ -1703,7 +1680,21 @@ keyserver_get_chunk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
           return err;
         }
 
-      if (!quiet && override_keyserver)
+      n = 1 + strlen (pattern[npat]);
+      if (idx && linelen + n > MAX_KS_GET_LINELEN)
+        {
+          /* Declare end of this chunk.  */
+          xfree (pattern[npat]);
+          pattern[npat] = NULL;
+          break;
+        }
+      linelen += n;
+      npat++;
+      if (desc[idx].mode == KEYDB_SEARCH_MODE_FPR20)
+        npat_fpr++;
+
+      /* Exact searches are not logged.  */
+      if (desc[idx].mode != KEYDB_SEARCH_MODE_EXACT && override_keyserver)
         {
           if (override_keyserver->host)
             log_info (_("requesting key %s from %s server %s\n"),
@@ -1801,6 +1792,72 @@ keyserver_get (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
 }
 
 
+/* Retrieve the keys (DESC,NDESC) from the configured keyserver
+   using the bulk variant of KS_GET and import them in one batch.
+   Entries with KEYDB_SEARCH_MODE_NONE are skipped.  Returns
+   GPG_ERR_NOT_SUPPORTED if the dirmngr does not support this.  */
+static gpg_error_t
+keyserver_get_bulk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc)
+{
+  gpg_error_t err = 0;
+  char **pattern;
+  int idx, npat, npat_fpr;
+  estream_t datastream;
+  char *source = NULL;
+  import_stats_t stats_handle;
+  struct ks_retrieval_screener_arg_s screenerarg;
+
+  pattern = xtrycalloc (ndesc+1, sizeof *pattern);
+  if (!pattern)
+    return gpg_error_from_syserror ();
+
+  for (npat=npat_fpr=0, idx=0; !err && idx < ndesc; idx++)
+    {
+      if (desc[idx].mode == KEYDB_SEARCH_MODE_NONE)
+        continue;
+      err = make_ks_get_pattern (&desc[idx], &pattern[npat]);
+      if (!err)
+        {
+          npat++;
+          if (desc[idx].mode == KEYDB_SEARCH_MODE_FPR20)
+            npat_fpr++;
+        }
+    }
+  if (!err && !npat)
+    err = gpg_error (GPG_ERR_NO_USER_ID);
+  if (!err)
+    err = gpg_dirmngr_ks_get_bulk (ctrl, pattern, &datastream, &source);
+  for (idx=0; idx < npat; idx++)
+    xfree (pattern[idx]);
+  xfree (pattern);
+  if (err)
+    {
+      xfree (source);
+      return err;
+    }
+  if (opt.verbose && source)
+    log_info ("data source: %s\n", source);
+
+  /* The keys are stored in keydb transactions only if requested with
+   * the import option "import-batch".  */
+  stats_handle = import_new_stats_handle ();
+  screenerarg.desc = desc;
+  screenerarg.ndesc = ndesc;
+  import_keys_es_stream (ctrl, datastream, stats_handle, NULL, NULL,
+                         (opt.keyserver_options.import_options
+                          | IMPORT_NO_SECKEY),
+                         keyserver_retrieval_screener, &screenerarg,
+                         npat == npat_fpr? KEYORG_KS : 0,
+                         source);
+  import_print_stats (stats_handle);
+  import_release_stats_handle (stats_handle);
+
+  es_fclose (datastream);
+  xfree (source);
+  return 0;
+}
+
+
 /* Send all keys specified by KEYSPECS to the configured keyserver.  */
 static gpg_error_t
 keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
@@ -301,6 +301,26 @@ gpg_error_t check_signature_over_key_or_uid (ctrl_t ctrl,
                                              int *is_selfsig,
                                              PKT_public_key *ret_pk);
 
+/* Verify the self-signatures of KEYBLOCK in advance.  This may be
+   called from a worker thread.  */
+void check_self_sigs_ahead (kbnode_t keyblock);
+
+/*-- sigcache.c --*/
+#define SIGCACHE_KEYLEN 32
+gpg_error_t sigcache_make_key (byte *key, PKT_public_key *pk,
+                               PKT_signature *sig, gcry_md_hd_t digest);
+int  sigcache_lookup (const byte *key);
+void sigcache_put (const byte *key);
+void sigcache_flush (void);
+void sigcache_dump_stats (void);
+
+/*-- workpool.c --*/
+typedef void (*workpool_func_t) (void *arg);
+typedef struct workpool_job_s *workpool_job_t;
+int  workpool_start (void);
+workpool_job_t workpool_submit (workpool_func_t func, void *arg);
+void workpool_wait (workpool_job_t job, int run);
+
 
 /*-- delkey.c --*/
 gpg_error_t delete_keys (ctrl_t ctrl,
@@ -356,6 +376,8 @@ void make_session_key( DEK *dek );
 gcry_mpi_t encode_session_key( int openpgp_pk_algo, DEK *dek, unsigned nbits );
 gcry_mpi_t encode_md_value (PKT_public_key *pk,
                             gcry_md_hd_t md, int hash_algo );
+gcry_mpi_t encode_md_value_quiet (PKT_public_key *pk,
+                                  gcry_md_hd_t md, int hash_algo);
 
 /*-- import.c --*/
 struct import_stats_s;
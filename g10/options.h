@@ -65,6 +65,10 @@ struct
   /* The AEAD chunk size expressed as a power of 2.  */
   int chunk_size;
 
+  /* The number of threads used to process AEAD chunks in parallel or
+   * 0 to process them in the main thread.  */
+  int aead_threads;
+
   int dry_run;
   int autostart;
   int list_only;
@@ -216,6 +220,10 @@ struct
   int try_all_secrets;
   int no_expensive_trust_checks;
   int no_sig_cache;
+  int persistent_sig_cache;
+  /* The maximum number of entries in the in-memory public key and
+   * user id caches or 0 for the default.  */
+  unsigned int key_cache_size;
   int no_auto_check_trustdb;
   int preserve_permissions;
   int no_homedir_creation;
@@ -361,6 +369,7 @@ EXTERN_UNLESS_MAIN_MODULE int memory_stat_debug_mode;
 #define IMPORT_REPAIR_KEYS               (1<<11)
 #define IMPORT_DRY_RUN                   (1<<12)
 #define IMPORT_DROP_UIDS                 (1<<13)
+#define IMPORT_BATCH                     (1<<14)
 
 #define EXPORT_LOCAL_SIGS                (1<<0)
 #define EXPORT_ATTRIBUTES                (1<<1)
@@ -264,6 +264,9 @@ typedef struct
      the digest's value has not been saved here.  */
   byte digest[512 / 8];
   int digest_len;
+  /* The result of a verification done in advance by a worker thread
+     or NULL.  See check_self_sigs_ahead.  (Not copied.)  */
+  struct sig_precheck_s *precheck;
 } PKT_signature;
 
 #define ATTRIB_IMAGE 1
@@ -904,6 +907,8 @@ gpg_error_t check_signature2 (ctrl_t ctrl,
 
 
 /*-- pubkey-enc.c --*/
+void release_prefetched_session_keys (ctrl_t ctrl);
+void prefetch_session_keys (ctrl_t ctrl, struct pubkey_enc_list *list);
 gpg_error_t get_session_key (ctrl_t ctrl, struct pubkey_enc_list *k, DEK *dek);
 gpg_error_t get_override_session_key (DEK *dek, const char *string);
 
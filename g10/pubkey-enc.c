@@ -38,10 +38,274 @@
 #include "../common/compliance.h"
 
 
+/* A session key frame decrypted ahead of its use by
+ * prefetch_session_keys.  */
+struct decrypt_prefetch_s
+{
+  struct decrypt_prefetch_s *next;
+  char keygrip[41];            /* The hexified keygrip.  */
+  unsigned char *ciphertext;   /* The canonical ciphertext.  */
+  size_t ciphertextlen;
+  unsigned char *frame;        /* The decrypted frame (secure memory).  */
+  size_t nframe;
+  int padding;
+};
+
+
+/* The maximum number of ciphertexts sent to the agent in one
+ * request.  */
+#define PREFETCH_MAX_ITEMS 256
+
+
 static gpg_error_t get_it (ctrl_t ctrl, struct pubkey_enc_list *k,
                            DEK *dek, PKT_public_key *sk, u32 *keyid);
 
 
+/* Convert the encrypted session key ENC for the key SK to an
+ * S-expression and store it at R_SEXP.  */
+static gpg_error_t
+make_enc_sexp (struct pubkey_enc_list *enc, PKT_public_key *sk,
+               gcry_sexp_t *r_sexp)
+{
+  gpg_error_t err;
+
+  *r_sexp = NULL;
+  if (sk->pubkey_algo == PUBKEY_ALGO_ELGAMAL
+      || sk->pubkey_algo == PUBKEY_ALGO_ELGAMAL_E)
+    {
+      if (!enc->data[0] || !enc->data[1])
+        err = gpg_error (GPG_ERR_BAD_MPI);
+      else
+        err = gcry_sexp_build (r_sexp, NULL, "(enc-val(elg(a%m)(b%m)))",
+                               enc->data[0], enc->data[1]);
+    }
+  else if (sk->pubkey_algo == PUBKEY_ALGO_RSA
+           || sk->pubkey_algo == PUBKEY_ALGO_RSA_E)
+    {
+      if (!enc->data[0])
+        err = gpg_error (GPG_ERR_BAD_MPI);
+      else
+        err = gcry_sexp_build (r_sexp, NULL, "(enc-val(rsa(a%m)))",
+                               enc->data[0]);
+    }
+  else if (sk->pubkey_algo == PUBKEY_ALGO_ECDH)
+    {
+      if (!enc->data[0] || !enc->data[1])
+        err = gpg_error (GPG_ERR_BAD_MPI);
+      else
+        err = gcry_sexp_build (r_sexp, NULL, "(enc-val(ecdh(s%m)(e%m)))",
+                               enc->data[1], enc->data[0]);
+    }
+  else
+    err = gpg_error (GPG_ERR_BUG);
+
+  return err;
+}
+
+
+/* Release all prefetched session key frames of CTRL.  */
+void
+release_prefetched_session_keys (ctrl_t ctrl)
+{
+  struct decrypt_prefetch_s *item;
+
+  while ((item = ctrl->decrypt_prefetch))
+    {
+      ctrl->decrypt_prefetch = item->next;
+      xfree (item->ciphertext);
+      wipememory (item->frame, item->nframe);
+      xfree (item->frame);
+      xfree (item);
+    }
+}
+
+
+/* Look for a prefetched frame for the ciphertext S_DATA of the key
+ * with KEYGRIP.  If one is found, it is removed from the list of
+ * CTRL, stored at R_FRAME, R_NFRAME, and R_PADDING and true is
+ * returned.  */
+static int
+take_prefetched_frame (ctrl_t ctrl, const char *keygrip, gcry_sexp_t s_data,
+                       byte **r_frame, size_t *r_nframe, int *r_padding)
+{
+  struct decrypt_prefetch_s *item, **itemp;
+  unsigned char *canon;
+  size_t canonlen;
+
+  if (!ctrl->decrypt_prefetch)
+    return 0;
+  if (make_canon_sexp (s_data, &canon, &canonlen))
+    return 0;
+
+  for (itemp = &ctrl->decrypt_prefetch; (item = *itemp); itemp = &item->next)
+    if (!strcmp (item->keygrip, keygrip)
+        && item->ciphertextlen == canonlen
+        && !memcmp (item->ciphertext, canon, canonlen))
+      break;
+  xfree (canon);
+  if (!item)
+    return 0;
+
+  *itemp = item->next;
+  *r_frame = item->frame;
+  *r_nframe = item->nframe;
+  *r_padding = item->padding;
+  xfree (item->ciphertext);
+  xfree (item);
+  return 1;
+}
+
+
+/* Find the secret key for encrypted session key ENC which may be
+ * used for decryption.  The keys already looked up are kept in
+ * SEEN.  Returns the key or NULL.  */
+static PKT_public_key *
+find_prefetch_key (ctrl_t ctrl, struct pubkey_enc_list *enc, SK_LIST *seen)
+{
+  SK_LIST r;
+  PKT_public_key *sk = NULL;
+  u32 keyid[2];
+
+  for (r = *seen; r; r = r->next)
+    {
+      keyid_from_pk (r->pk, keyid);
+      if (keyid[0] == enc->keyid[0] && keyid[1] == enc->keyid[1])
+        return r->pk->pubkey_algo? r->pk : NULL;
+    }
+
+  /* Try the keys used for the previous messages first.  */
+  for (r = ctrl->decrypt_keys; r; r = r->next)
+    {
+      keyid_from_pk (r->pk, keyid);
+      if (keyid[0] == enc->keyid[0] && keyid[1] == enc->keyid[1])
+        {
+          sk = copy_public_key (NULL, r->pk);
+          break;
+        }
+    }
+  if (!sk)
+    {
+      sk = xmalloc_clear (sizeof *sk);
+      sk->req_usage = PUBKEY_USAGE_ENC;
+      if (get_seckey (ctrl, sk, enc->keyid)
+          || !(sk->pubkey_usage & PUBKEY_USAGE_ENC)
+          || !gnupg_pk_is_allowed (opt.compliance, PK_USE_DECRYPTION,
+                                   sk->pubkey_algo,
+                                   sk->pkey, nbits_from_pk (sk), NULL))
+        {
+          /* Remember that there is no usable key for this keyid.  */
+          release_public_key_parts (sk);
+          memset (sk, 0, sizeof *sk);
+          sk->keyid[0] = enc->keyid[0];
+          sk->keyid[1] = enc->keyid[1];
+        }
+    }
+
+  r = xtrycalloc (1, sizeof *r);
+  if (!r)
+    {
+      free_public_key (sk);
+      return NULL;
+    }
+  r->pk = sk;
+  r->next = *seen;
+  *seen = r;
+  return sk->pubkey_algo? sk : NULL;
+}
+
+
+/* Decrypt the session keys of all messages with the encrypted
+ * session keys in LIST with one request to the agent.  The frames are
+ * kept in CTRL and later used by get_session_key.  This is used by
+ * --decrypt-files so that the agent does not need to be asked for
+ * each message.  Errors are ignored because get_session_key will try
+ * again.  */
+void
+prefetch_session_keys (ctrl_t ctrl, struct pubkey_enc_list *list)
+{
+  struct agent_pkdecrypt_item_s *items;
+  struct decrypt_prefetch_s *item;
+  struct pubkey_enc_list *k;
+  SK_LIST seen = NULL;
+  PKT_public_key *sk;
+  unsigned int nitems, idx;
+
+  items = xtrycalloc (PREFETCH_MAX_ITEMS, sizeof *items);
+  if (!items)
+    return;
+
+  nitems = 0;
+  for (k = list; k && nitems < PREFETCH_MAX_ITEMS; k = k->next)
+    {
+      /* Anonymous recipients would require to try all keys.  */
+      if (!k->keyid[0] && !k->keyid[1])
+        continue;
+      if (!(k->pubkey_algo == PUBKEY_ALGO_ELGAMAL_E
+            || k->pubkey_algo == PUBKEY_ALGO_ECDH
+            || k->pubkey_algo == PUBKEY_ALGO_RSA
+            || k->pubkey_algo == PUBKEY_ALGO_RSA_E
+            || k->pubkey_algo == PUBKEY_ALGO_ELGAMAL))
+        continue;
+      if (openpgp_pk_test_algo2 (k->pubkey_algo, PUBKEY_USAGE_ENC))
+        continue;
+
+      sk = find_prefetch_key (ctrl, k, &seen);
+      if (!sk || sk->pubkey_algo != k->pubkey_algo)
+        continue;
+
+      if (hexkeygrip_from_pk (sk, (char **)&items[nitems].keygrip))
+        continue;
+      if (make_enc_sexp (k, sk, &items[nitems].s_ciphertext))
+        {
+          xfree ((char *)items[nitems].keygrip);
+          continue;
+        }
+      items[nitems].desc = gpg_format_keydesc (ctrl, sk,
+                                               FORMAT_KEYDESC_NORMAL, 1);
+      nitems++;
+    }
+
+  if (nitems && !agent_pkdecrypt_bulk (ctrl, items, nitems))
+    {
+      for (idx=0; idx < nitems; idx++)
+        {
+          if (items[idx].err || !items[idx].buf)
+            continue;
+          item = xtrycalloc (1, sizeof *item);
+          if (!item)
+            continue;
+          if (make_canon_sexp (items[idx].s_ciphertext,
+                               &item->ciphertext, &item->ciphertextlen))
+            {
+              xfree (item);
+              continue;
+            }
+          mem2str (item->keygrip, items[idx].keygrip, sizeof item->keygrip);
+          item->frame = items[idx].buf;
+          item->nframe = items[idx].buflen;
+          item->padding = items[idx].padding;
+          items[idx].buf = NULL;
+          item->next = ctrl->decrypt_prefetch;
+          ctrl->decrypt_prefetch = item;
+        }
+    }
+
+  for (idx=0; idx < nitems; idx++)
+    {
+      xfree ((char *)items[idx].keygrip);
+      xfree ((char *)items[idx].desc);
+      gcry_sexp_release (items[idx].s_ciphertext);
+      if (items[idx].buf)
+        {
+          wipememory (items[idx].buf, items[idx].buflen);
+          xfree (items[idx].buf);
+        }
+    }
+  xfree (items);
+  release_sk_list (seen);
+}
+
+
 /* Check that the given algo is mentioned in one of the valid user-ids. */
 static int
 is_algo_in_prefs (kbnode_t keyblock, preftype_t type, int algo)
@@ -67,6 +331,78 @@ is_algo_in_prefs (kbnode_t keyblock, preftype_t type, int algo)
 }
 
 
+/* Try to get the session key from one of the pubkey enc packets in
+ * LIST using the secret key SK.  Returns 0 on success,
+ * GPG_ERR_FULLY_CANCELED if no other key shall be tried and
+ * GPG_ERR_NO_SECKEY otherwise.  If R_TRIED is not NULL it is set to
+ * true if SK has been used for a decryption attempt.  */
+static gpg_error_t
+try_secret_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek,
+                PKT_public_key *sk, int *r_tried)
+{
+  struct pubkey_enc_list *k;
+  gpg_error_t rc;
+  u32 keyid[2];
+
+  /* FIXME: The list needs to be sorted so that we try the keys in
+   * an appropriate order.  For example:
+   * - On-disk keys w/o protection
+   * - On-disk keys with a cached passphrase
+   * - On-card keys of an active card
+   * - On-disk keys with protection
+   * - On-card keys from cards which are not plugged it.  Here a
+   *   cancel-all button should stop aksing for other cards.
+   * Without any anonymous keys the sorting can be skipped.
+   */
+  for (k = list; k; k = k->next)
+    {
+      if (!(k->pubkey_algo == PUBKEY_ALGO_ELGAMAL_E
+            || k->pubkey_algo == PUBKEY_ALGO_ECDH
+            || k->pubkey_algo == PUBKEY_ALGO_RSA
+            || k->pubkey_algo == PUBKEY_ALGO_RSA_E
+            || k->pubkey_algo == PUBKEY_ALGO_ELGAMAL))
+        continue;
+
+      if (openpgp_pk_test_algo2 (k->pubkey_algo, PUBKEY_USAGE_ENC))
+        continue;
+
+      if (sk->pubkey_algo != k->pubkey_algo)
+        continue;
+
+      keyid_from_pk (sk, keyid);
+
+      if (!k->keyid[0] && !k->keyid[1])
+        {
+          if (opt.skip_hidden_recipients)
+            continue;
+
+          if (!opt.quiet)
+            log_info (_("anonymous recipient; trying secret key %s ...\n"),
+                      keystr (keyid));
+        }
+      else if (opt.try_all_secrets
+               || (k->keyid[0] == keyid[0] && k->keyid[1] == keyid[1]))
+        ;
+      else
+        continue;
+
+      if (r_tried)
+        *r_tried = 1;
+      rc = get_it (ctrl, k, dek, sk, keyid);
+      if (!rc)
+        {
+          if (!opt.quiet && !k->keyid[0] && !k->keyid[1])
+            log_info (_("okay, we are the anonymous recipient.\n"));
+          return 0;
+        }
+      else if (gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
+        return rc; /* Don't try any more secret keys.  */
+    }
+
+  return GPG_ERR_NO_SECKEY;
+}
+
+
 /*
  * Get the session key from a pubkey enc packet and return it in DEK,
  * which should have been allocated in secure memory by the caller.
@@ -75,18 +411,28 @@ gpg_error_t
 get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
 {
   PKT_public_key *sk = NULL;
-  int rc;
+  gpg_error_t rc;
   void *enum_context = NULL;
-  u32 keyid[2];
-  int search_for_secret_keys = 1;
+  SK_LIST r, *rp, found = NULL, *found_tail = &found;
 
   if (DBG_CLOCK)
     log_clock ("get_session_key enter");
 
-  while (search_for_secret_keys)
+  /* With --decrypt-files and in server mode the same secret keys are
+   * used for many messages.  Enumerating them requires a round trip
+   * to the agent for each key and a look at the cards; thus we first
+   * try the keys found for the previous messages.  */
+  for (r = ctrl->decrypt_keys; r; r = r->next)
+    r->mark = 0;
+  for (r = ctrl->decrypt_keys; r; r = r->next)
     {
-      struct pubkey_enc_list *k;
+      rc = try_secret_key (ctrl, list, dek, r->pk, &r->mark);
+      if (!rc || gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
+        goto leave;
+    }
 
+  for (;;)
+    {
       sk = xmalloc_clear (sizeof *sk);
       rc = enum_secret_keys (ctrl, &enum_context, sk);
       if (rc)
@@ -110,65 +456,51 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
           continue;
         }
 
-      /* FIXME: The list needs to be sorted so that we try the keys in
-       * an appropriate order.  For example:
-       * - On-disk keys w/o protection
-       * - On-disk keys with a cached passphrase
-       * - On-card keys of an active card
-       * - On-disk keys with protection
-       * - On-card keys from cards which are not plugged it.  Here a
-       *   cancel-all button should stop aksing for other cards.
-       * Without any anonymous keys the sorting can be skipped.
-       */
-      for (k = list; k; k = k->next)
+      /* Remember the key for the next message.  */
+      r = xtrycalloc (1, sizeof *r);
+      if (r)
         {
-          if (!(k->pubkey_algo == PUBKEY_ALGO_ELGAMAL_E
-                || k->pubkey_algo == PUBKEY_ALGO_ECDH
-                || k->pubkey_algo == PUBKEY_ALGO_RSA
-                || k->pubkey_algo == PUBKEY_ALGO_RSA_E
-                || k->pubkey_algo == PUBKEY_ALGO_ELGAMAL))
-            continue;
-
-          if (openpgp_pk_test_algo2 (k->pubkey_algo, PUBKEY_USAGE_ENC))
-            continue;
-
-          if (sk->pubkey_algo != k->pubkey_algo)
-            continue;
+          r->pk = copy_public_key (NULL, sk);
+          *found_tail = r;
+          found_tail = &r->next;
+        }
 
-          keyid_from_pk (sk, keyid);
+      /* Don't ask again for a key which has already been tried.  */
+      for (r = ctrl->decrypt_keys; r; r = r->next)
+        if (r->mark && !cmp_public_keys (r->pk, sk))
+          break;
+      if (r)
+        continue;
 
-          if (!k->keyid[0] && !k->keyid[1])
-            {
-              if (opt.skip_hidden_recipients)
-                continue;
+      rc = try_secret_key (ctrl, list, dek, sk, NULL);
+      if (!rc || gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
+        break;
+    }
+  enum_secret_keys (ctrl, &enum_context, NULL);  /* free context */
 
-              if (!opt.quiet)
-                log_info (_("anonymous recipient; trying secret key %s ...\n"),
-                          keystr (keyid));
-            }
-          else if (opt.try_all_secrets
-                   || (k->keyid[0] == keyid[0] && k->keyid[1] == keyid[1]))
-            ;
-          else
-            continue;
+  /* The enumeration stops at the first matching key; thus keep those
+   * keys from the old list which have not been seen this time.  */
+  for (rp = &ctrl->decrypt_keys; (r = *rp); )
+    {
+      SK_LIST r2;
 
-          rc = get_it (ctrl, k, dek, sk, keyid);
-          if (!rc)
-            {
-              if (!opt.quiet && !k->keyid[0] && !k->keyid[1])
-                log_info (_("okay, we are the anonymous recipient.\n"));
-              search_for_secret_keys = 0;
-              break;
-            }
-          else if (gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
-            {
-              search_for_secret_keys = 0;
-              break; /* Don't try any more secret keys.  */
-            }
+      for (r2 = found; r2; r2 = r2->next)
+        if (!cmp_public_keys (r2->pk, r->pk))
+          break;
+      if (r2)
+        rp = &r->next;
+      else
+        {
+          *rp = r->next;
+          r->next = NULL;
+          *found_tail = r;
+          found_tail = &r->next;
         }
     }
-  enum_secret_keys (ctrl, &enum_context, NULL);  /* free context */
+  release_sk_list (ctrl->decrypt_keys);
+  ctrl->decrypt_keys = found;
 
+ leave:
   if (DBG_CLOCK)
     log_clock ("get_session_key leave");
   return rc;
@@ -200,35 +532,7 @@ get_it (ctrl_t ctrl,
     goto leave;
 
   /* Convert the data to an S-expression.  */
-  if (sk->pubkey_algo == PUBKEY_ALGO_ELGAMAL
-      || sk->pubkey_algo == PUBKEY_ALGO_ELGAMAL_E)
-    {
-      if (!enc->data[0] || !enc->data[1])
-        err = gpg_error (GPG_ERR_BAD_MPI);
-      else
-        err = gcry_sexp_build (&s_data, NULL, "(enc-val(elg(a%m)(b%m)))",
-                               enc->data[0], enc->data[1]);
-    }
-  else if (sk->pubkey_algo == PUBKEY_ALGO_RSA
-           || sk->pubkey_algo == PUBKEY_ALGO_RSA_E)
-    {
-      if (!enc->data[0])
-        err = gpg_error (GPG_ERR_BAD_MPI);
-      else
-        err = gcry_sexp_build (&s_data, NULL, "(enc-val(rsa(a%m)))",
-                               enc->data[0]);
-    }
-  else if (sk->pubkey_algo == PUBKEY_ALGO_ECDH)
-    {
-      if (!enc->data[0] || !enc->data[1])
-        err = gpg_error (GPG_ERR_BAD_MPI);
-      else
-        err = gcry_sexp_build (&s_data, NULL, "(enc-val(ecdh(s%m)(e%m)))",
-                               enc->data[1], enc->data[0]);
-    }
-  else
-    err = gpg_error (GPG_ERR_BUG);
-
+  err = make_enc_sexp (enc, sk, &s_data);
   if (err)
     goto leave;
 
@@ -239,11 +543,15 @@ get_it (ctrl_t ctrl,
     }
 
   /* Decrypt. */
-  desc = gpg_format_keydesc (ctrl, sk, FORMAT_KEYDESC_NORMAL, 1);
-  err = agent_pkdecrypt (NULL, keygrip,
-                         desc, sk->keyid, sk->main_keyid, sk->pubkey_algo,
-                         s_data, &frame, &nframe, &padding);
-  xfree (desc);
+  if (!take_prefetched_frame (ctrl, keygrip, s_data,
+                              &frame, &nframe, &padding))
+    {
+      desc = gpg_format_keydesc (ctrl, sk, FORMAT_KEYDESC_NORMAL, 1);
+      err = agent_pkdecrypt (NULL, keygrip,
+                             desc, sk->keyid, sk->main_keyid, sk->pubkey_algo,
+                             s_data, &frame, &nframe, &padding);
+      xfree (desc);
+    }
   gcry_sexp_release (s_data);
   if (err)
     goto leave;
@@ -204,7 +204,7 @@ encode_session_key (int openpgp_pk_algo, DEK *dek, unsigned int nbits)
 
 static gcry_mpi_t
 do_encode_md( gcry_md_hd_t md, int algo, size_t len, unsigned nbits,
-	      const byte *asn, size_t asnlen )
+	      const byte *asn, size_t asnlen, int quiet )
 {
     size_t nframe = (nbits+7) / 8;
     byte *frame;
@@ -213,8 +213,9 @@ do_encode_md( gcry_md_hd_t md, int algo, size_t len, unsigned nbits,
 
     if (len + asnlen + 4  > nframe)
       {
-        log_error ("can't encode a %d bit MD into a %d bits frame, algo=%d\n",
-                   (int)(len*8), (int)nbits, algo);
+        if (!quiet)
+          log_error ("can't encode a %d bit MD into a %d bits frame, algo=%d\n",
+                     (int)(len*8), (int)nbits, algo);
         return NULL;
       }
 
@@ -257,10 +258,11 @@ do_encode_md( gcry_md_hd_t md, int algo, size_t len, unsigned nbits,
  * Encode a message digest into an MPI.
  * If it's for a DSA signature, make sure that the hash is large
  * enough to fill up q.  If the hash is too big, take the leftmost
- * bits.
+ * bits.  If QUIET is set no diagnostics are printed.
  */
-gcry_mpi_t
-encode_md_value (PKT_public_key *pk, gcry_md_hd_t md, int hash_algo)
+static gcry_mpi_t
+do_encode_md_value (PKT_public_key *pk, gcry_md_hd_t md, int hash_algo,
+                    int quiet)
 {
   gcry_mpi_t frame;
   size_t mdlen;
@@ -290,8 +292,9 @@ encode_md_value (PKT_public_key *pk, gcry_md_hd_t md, int hash_algo)
       /* Make sure it is a multiple of 8 bits. */
       if ((qbits%8))
 	{
-	  log_error(_("DSA requires the hash length to be a"
-		      " multiple of 8 bits\n"));
+          if (!quiet)
+            log_error(_("DSA requires the hash length to be a"
+                        " multiple of 8 bits\n"));
 	  return NULL;
 	}
 
@@ -303,9 +306,10 @@ encode_md_value (PKT_public_key *pk, gcry_md_hd_t md, int hash_algo)
 	 DSA. ;) */
       if (qbits < 160)
 	{
-	  log_error (_("%s key %s uses an unsafe (%zu bit) hash\n"),
-                     openpgp_pk_algo_name (pk->pubkey_algo),
-                     keystr_from_pk (pk), qbits);
+          if (!quiet)
+            log_error (_("%s key %s uses an unsafe (%zu bit) hash\n"),
+                       openpgp_pk_algo_name (pk->pubkey_algo),
+                       keystr_from_pk (pk), qbits);
 	  return NULL;
 	}
 
@@ -321,11 +325,12 @@ encode_md_value (PKT_public_key *pk, gcry_md_hd_t md, int hash_algo)
       mdlen = gcry_md_get_algo_dlen (hash_algo);
       if (mdlen < qbits/8)
 	{
-	  log_error (_("%s key %s requires a %zu bit or larger hash "
-                       "(hash is %s)\n"),
-                     openpgp_pk_algo_name (pk->pubkey_algo),
-                     keystr_from_pk (pk), qbits,
-                     gcry_md_algo_name (hash_algo));
+          if (!quiet)
+            log_error (_("%s key %s requires a %zu bit or larger hash "
+                         "(hash is %s)\n"),
+                       openpgp_pk_algo_name (pk->pubkey_algo),
+                       keystr_from_pk (pk), qbits,
+                       gcry_md_algo_name (hash_algo));
 	  return NULL;
 	}
 
@@ -351,9 +356,26 @@ encode_md_value (PKT_public_key *pk, gcry_md_hd_t md, int hash_algo)
       if ( gcry_md_algo_info (hash_algo, GCRYCTL_GET_ASNOID, asn, &asnlen) )
         BUG();
       frame = do_encode_md (md, hash_algo, gcry_md_get_algo_dlen (hash_algo),
-                            gcry_mpi_get_nbits (pk->pkey[0]), asn, asnlen);
+                            gcry_mpi_get_nbits (pk->pkey[0]), asn, asnlen,
+                            quiet);
       xfree (asn);
     }
 
   return frame;
 }
+
+
+gcry_mpi_t
+encode_md_value (PKT_public_key *pk, gcry_md_hd_t md, int hash_algo)
+{
+  return do_encode_md_value (pk, md, hash_algo, 0);
+}
+
+
+/* Same as encode_md_value but does not print any diagnostics.  This
+ * is used when verifying signatures in worker threads.  */
+gcry_mpi_t
+encode_md_value_quiet (PKT_public_key *pk, gcry_md_hd_t md, int hash_algo)
+{
+  return do_encode_md_value (pk, md, hash_algo, 1);
+}
@@ -42,6 +42,17 @@ static int check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 
 static int check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
                                        gcry_md_hd_t digest);
+static void hash_sig_trailer (gcry_md_hd_t digest, PKT_signature *sig);
+
+
+/* The result of a signature verification done in advance.  */
+struct sig_precheck_s
+{
+  PKT_public_key *signer;  /* The key used for the verification.  */
+  gpg_error_t rc;          /* The result of pk_verify.  */
+  unsigned int digestlen;  /* The length of DIGEST.  */
+  byte digest[512 / 8];    /* The digest which has been verified.  */
+};
 
 
 /* Statistics for signature verification.  */
@@ -452,6 +463,8 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
   gcry_mpi_t result = NULL;
   int rc = 0;
   const struct weakhash *weak;
+  byte cachekey[SIGCACHE_KEYLEN];
+  int use_sigcache = 0;
 
   if (!opt.flags.allow_weak_digest_algos)
     {
@@ -496,6 +509,63 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
   gcry_md_enable (digest, sig->digest_algo);
 
   /* Complete the digest. */
+  hash_sig_trailer (digest, sig);
+
+  /* Key signatures may have been verified by an earlier invocation
+   * of gpg.  */
+  if (opt.persistent_sig_cache && !opt.no_sig_cache
+      && (IS_CERT (sig) || IS_BACK_SIG (sig)))
+    use_sigcache = !sigcache_make_key (cachekey, pk, sig, digest);
+
+  if (use_sigcache && sigcache_lookup (cachekey))
+    {
+      rc = 0;
+      use_sigcache = 0;
+    }
+  else if (sig->precheck && sig->precheck->signer == pk
+      && sig->precheck->digestlen == gcry_md_get_algo_dlen (sig->digest_algo)
+      && !memcmp (sig->precheck->digest,
+                  gcry_md_read (digest, sig->digest_algo),
+                  sig->precheck->digestlen))
+    {
+      /* The signature has already been verified by a worker thread
+       * using the same key and the same digest.  */
+      rc = sig->precheck->rc;
+    }
+  else
+    {
+      /* Convert the digest to an MPI.  */
+      result = encode_md_value (pk, digest, sig->digest_algo );
+      if (!result)
+        return GPG_ERR_GENERAL;
+
+      /* Verify the signature.  */
+      if (DBG_CLOCK && sig->sig_class <= 0x01)
+        log_clock ("enter pk_verify");
+      rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
+      if (DBG_CLOCK && sig->sig_class <= 0x01)
+        log_clock ("leave pk_verify");
+      gcry_mpi_release (result);
+    }
+
+  if (!rc && use_sigcache)
+    sigcache_put (cachekey);
+
+  if (!rc && sig->flags.unknown_critical)
+    {
+      log_info(_("assuming bad signature from key %s"
+                 " due to an unknown critical bit\n"),keystr_from_pk(pk));
+      rc = GPG_ERR_BAD_SIGNATURE;
+    }
+
+  return rc;
+}
+
+
+/* Add the trailer of signature SIG to DIGEST and finalize it.  */
+static void
+hash_sig_trailer (gcry_md_hd_t digest, PKT_signature *sig)
+{
   if (sig->version >= 4)
     gcry_md_putc (digest, sig->version);
 
@@ -549,28 +619,6 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
 	gcry_md_write (digest, buf, i);
     }
     gcry_md_final( digest );
-
-    /* Convert the digest to an MPI.  */
-    result = encode_md_value (pk, digest, sig->digest_algo );
-    if (!result)
-        return GPG_ERR_GENERAL;
-
-    /* Verify the signature.  */
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("enter pk_verify");
-    rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("leave pk_verify");
-    gcry_mpi_release (result);
-
-  if (!rc && sig->flags.unknown_critical)
-    {
-      log_info(_("assuming bad signature from key %s"
-                 " due to an unknown critical bit\n"),keystr_from_pk(pk));
-      rc = GPG_ERR_BAD_SIGNATURE;
-    }
-
-  return rc;
 }
 
 
@@ -781,6 +829,46 @@ check_backsig (PKT_public_key *main_pk,PKT_public_key *sub_pk,
 }
 
 
+/* Hash the data signed by the key signature SIG into MD.  PRIPK is
+ * the primary key of the keyblock, SIGNER the key which allegedly
+ * issued SIG, and PACKET the key, subkey or user ID packet over which
+ * SIG has been made.  */
+static void
+hash_key_sig_data (gcry_md_hd_t md, PKT_signature *sig,
+                   PKT_public_key *pripk, PKT_public_key *signer,
+                   PACKET *packet)
+{
+  if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
+    {
+      log_assert (packet->pkttype == PKT_PUBLIC_KEY);
+      hash_public_key (md, packet->pkt.public_key);
+    }
+  else if (IS_BACK_SIG (sig))
+    {
+      log_assert (packet->pkttype == PKT_PUBLIC_KEY);
+      hash_public_key (md, packet->pkt.public_key);
+      hash_public_key (md, signer);
+    }
+  else if (IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig))
+    {
+      log_assert (packet->pkttype == PKT_PUBLIC_SUBKEY);
+      hash_public_key (md, pripk);
+      hash_public_key (md, packet->pkt.public_key);
+    }
+  else if (IS_UID_SIG (sig) || IS_UID_REV (sig))
+    {
+      log_assert (packet->pkttype == PKT_USER_ID);
+      hash_public_key (md, pripk);
+      hash_uid_packet (packet->pkt.user_id, md, sig);
+    }
+  else
+    {
+      /* We should never get here.  (The callers check the class.)  */
+      BUG ();
+    }
+}
+
+
 /* Check that a signature over a key is valid.  This is a
  * specialization of check_key_signature2 with the unnamed parameters
  * passed as NULL.  See the documentation for that function for more
@@ -808,7 +896,8 @@ check_key_signature (ctrl_t ctrl, kbnode_t root, kbnode_t node,
  *
  * Unlike check_key_signature, this function ignores any cached
  * results!  That is, it does not consider SIG->FLAGS.CHECKED and
- * SIG->FLAGS.VALID nor does it set them.
+ * SIG->FLAGS.VALID nor does it set them.  Only the persistent cache
+ * of the public key operations is used (see sigcache.c).
  *
  * This doesn't check the signature's semantic mean.  Concretely, it
  * doesn't check whether a non-self signed revocation signature was
@@ -954,40 +1043,8 @@ check_signature_over_key_or_uid (ctrl_t ctrl, PKT_public_key *signer,
     BUG ();
 
   /* Hash the relevant data.  */
-
-  if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
-    {
-      log_assert (packet->pkttype == PKT_PUBLIC_KEY);
-      hash_public_key (md, packet->pkt.public_key);
-      rc = check_signature_end_simple (signer, sig, md);
-    }
-  else if (IS_BACK_SIG (sig))
-    {
-      log_assert (packet->pkttype == PKT_PUBLIC_KEY);
-      hash_public_key (md, packet->pkt.public_key);
-      hash_public_key (md, signer);
-      rc = check_signature_end_simple (signer, sig, md);
-    }
-  else if (IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig))
-    {
-      log_assert (packet->pkttype == PKT_PUBLIC_SUBKEY);
-      hash_public_key (md, pripk);
-      hash_public_key (md, packet->pkt.public_key);
-      rc = check_signature_end_simple (signer, sig, md);
-    }
-  else if (IS_UID_SIG (sig) || IS_UID_REV (sig))
-    {
-      log_assert (packet->pkttype == PKT_USER_ID);
-      hash_public_key (md, pripk);
-      hash_uid_packet (packet->pkt.user_id, md, sig);
-      rc = check_signature_end_simple (signer, sig, md);
-    }
-  else
-    {
-      /* We should never get here.  (The first if above should have
-       * already caught this error.)  */
-      BUG ();
-    }
+  hash_key_sig_data (md, sig, pripk, signer, packet);
+  rc = check_signature_end_simple (signer, sig, md);
 
   gcry_md_close (md);
 
@@ -1038,7 +1095,9 @@ check_signature_over_key_or_uid (ctrl_t ctrl, PKT_public_key *signer,
  *
  * If OPT.NO_SIG_CACHE is not set, this function will first check if
  * the result of a previous verification is already cached in the
- * signature packet's data structure.
+ * signature packet's data structure.  If OPT.PERSISTENT_SIG_CACHE is
+ * also set, the public key operation is skipped for signatures which
+ * an earlier invocation of gpg has already verified (see sigcache.c).
  *
  * TODO: add r_revoked here as well.  It has the same problems as
  * r_expiredate and r_expired and the cache.  */
@@ -1202,3 +1261,91 @@ check_key_signature2 (ctrl_t ctrl,
 
   return rc;
 }
+
+
+/* Verify the self-signatures over the primary key, the user IDs and
+ * the subkeys of KEYBLOCK in advance.  Only the public key operation
+ * is done here; the result is stored with the signature and later
+ * used by check_key_signature if the signer and the digest are still
+ * the same.  All other checks and all diagnostics are left to the
+ * regular code.  This function prints nothing and does not change any
+ * global state; thus it may be run by a worker thread as long as no
+ * other thread accesses KEYBLOCK.  The caller needs to make sure that
+ * the keyid of the primary key has been computed.  */
+void
+check_self_sigs_ahead (kbnode_t keyblock)
+{
+  PKT_public_key *pripk = keyblock->pkt->pkt.public_key;
+  const struct weakhash *weak;
+  kbnode_t node;
+  kbnode_t unode = NULL;  /* The last user ID node.  */
+  kbnode_t snode = NULL;  /* The last subkey node.  */
+  PKT_signature *sig;
+  PACKET *packet;
+  gcry_md_hd_t md;
+  gcry_mpi_t result;
+  struct sig_precheck_s *precheck;
+
+  log_assert (keyblock->pkt->pkttype == PKT_PUBLIC_KEY);
+
+  for (node = keyblock->next; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_USER_ID)
+        unode = node;
+      else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        snode = node;
+      if (node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+
+      sig = node->pkt->pkt.signature;
+      if (sig->precheck || sig->flags.checked)
+        continue;
+      if (sig->keyid[0] != pripk->keyid[0] || sig->keyid[1] != pripk->keyid[1])
+        continue;  /* Not a self-signature.  */
+      if (openpgp_pk_test_algo (sig->pubkey_algo)
+          || openpgp_md_test_algo (sig->digest_algo))
+        continue;
+      if (!opt.flags.allow_weak_digest_algos)
+        {
+          for (weak = opt.weak_digests; weak; weak = weak->next)
+            if (sig->digest_algo == weak->algo)
+              break;
+          if (weak)
+            continue;
+        }
+
+      /* Select the signed packet the same way check_key_signature2
+       * does.  */
+      if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
+        packet = keyblock->pkt;
+      else if ((IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig)) && snode)
+        packet = snode->pkt;
+      else if ((IS_UID_SIG (sig) || IS_UID_REV (sig)) && unode)
+        packet = unode->pkt;
+      else
+        continue;
+
+      if (gcry_md_open (&md, sig->digest_algo, 0))
+        continue;
+      hash_key_sig_data (md, sig, pripk, pripk, packet);
+      hash_sig_trailer (md, sig);
+
+      result = encode_md_value_quiet (pripk, md, sig->digest_algo);
+      if (result)
+        {
+          precheck = xtrymalloc (sizeof *precheck);
+          if (precheck)
+            {
+              precheck->signer = pripk;
+              precheck->rc = pk_verify (pripk->pubkey_algo, result,
+                                        sig->data, pripk->pkey);
+              precheck->digestlen = gcry_md_get_algo_dlen (sig->digest_algo);
+              memcpy (precheck->digest, gcry_md_read (md, sig->digest_algo),
+                      precheck->digestlen);
+              sig->precheck = precheck;
+            }
+          gcry_mpi_release (result);
+        }
+      gcry_md_close (md);
+    }
+}
@@ -0,0 +1,490 @@
+/* sigcache.c - Persistent cache of verified key signatures
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The verification status of key signatures is cached only in the
+ * signature packets (and in the ring trust packets of a keyring).
+ * Thus each gpg process using a keybox verifies all key signatures
+ * of the keys it looks at again.  With --persistent-sig-cache this
+ * module remembers the key signatures which have been verified as
+ * good in the file "sigcache.dat" in the home directory.
+ *
+ * An entry is the SHA-256 hash over the fingerprint of the signer,
+ * the signature algorithms, the final digest over the signed data
+ * and the signature values.  Thus an entry is only found if the same
+ * key issued the same signature over the same data; a changed signer
+ * key has a different fingerprint and thus does not match the old
+ * entries.  Only the public key operation is covered by the cache;
+ * the checks for expiration and revocation are done as usual.
+ *
+ * The file consists of an 8 byte header followed by the entries in
+ * the order they were added.  It is read on first use and the new
+ * entries are appended when gpg terminates.  The file is opened in
+ * append mode and each entry is stored with a single write so that
+ * the entries of concurrent gpg processes do not mix.  If the file
+ * has too many entries only the newer half is read.  A file which is
+ * to be replaced, for example after dropping the old entries, is
+ * written to a temporary file which is then renamed; entries appended
+ * to the old file meanwhile are lost, which is harmless for a cache.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/host2net.h"
+#include "../common/i18n.h"
+#include "packet.h"
+#include "keydb.h"
+#include "main.h"
+#include "options.h"
+
+
+/* The header of the cache file.  The 5th byte is the version.  */
+#define SIGCACHE_MAGIC      "\x00gsc\x01\x00\x00\x00"
+#define SIGCACHE_MAGICLEN   8
+
+/* The maximum number of entries read from the file.  If the file has
+ * more entries the older half of them is dropped.  */
+#define SIGCACHE_MAX_ENTRIES 250000
+
+/* The initial number of buckets of the hash table.  */
+#define SIGCACHE_MIN_BUCKETS 1024
+
+
+/* An entry of the cache.  */
+struct sigcache_item_s
+{
+  struct sigcache_item_s *next;
+  struct sigcache_item_s *newer;  /* The next entry in file order.  */
+  unsigned int is_new:1;  /* Not yet stored in the file.  */
+  byte key[SIGCACHE_KEYLEN];
+};
+typedef struct sigcache_item_s *sigcache_item_t;
+
+
+/* The hash table with TABLE_SIZE buckets.  TABLE_SIZE is a power of
+ * two.  */
+static sigcache_item_t *table;
+static unsigned int table_size;
+
+/* All entries from the oldest to the newest.  */
+static sigcache_item_t oldest, newest;
+
+/* The number of entries and the number of new entries.  */
+static unsigned int n_entries;
+static unsigned int n_new_entries;
+
+/* Set once we tried to read the file.  */
+static int loaded;
+
+/* Set if the file needs to be written from scratch.  */
+static int need_rewrite;
+
+/* Statistics.  */
+static struct
+{
+  unsigned int lookups;
+  unsigned int hits;
+} sigcache_stats;
+
+
+/* Return the name of the cache file.  The caller must free it.  */
+static char *
+sigcache_fname (void)
+{
+  return make_filename (gnupg_homedir (), "sigcache.dat", NULL);
+}
+
+
+static unsigned int
+bucket_of (const byte *key)
+{
+  return buf32_to_uint (key) & (table_size - 1);
+}
+
+
+/* Resize the hash table to NEWSIZE buckets.  Returns false if there
+ * is not enough memory; the table is then left unchanged.  */
+static int
+resize_table (unsigned int newsize)
+{
+  sigcache_item_t *newtable, item, next;
+  unsigned int oldsize = table_size;
+  unsigned int i;
+
+  newtable = xtrycalloc (newsize, sizeof *newtable);
+  if (!newtable)
+    return 0;
+  table_size = newsize;
+  for (i=0; i < oldsize; i++)
+    for (item = table[i]; item; item = next)
+      {
+        next = item->next;
+        item->next = newtable[bucket_of (item->key)];
+        newtable[bucket_of (item->key)] = item;
+      }
+  xfree (table);
+  table = newtable;
+  return 1;
+}
+
+
+/* Release the table and all entries.  */
+static void
+release_table (void)
+{
+  sigcache_item_t item;
+
+  while ((item = oldest))
+    {
+      oldest = item->newer;
+      xfree (item);
+    }
+  newest = NULL;
+  xfree (table);
+  table = NULL;
+  table_size = 0;
+  n_entries = n_new_entries = 0;
+}
+
+
+/* Return true if KEY is in the table.  */
+static int
+find_key (const byte *key)
+{
+  sigcache_item_t item;
+
+  for (item = table[bucket_of (key)]; item; item = item->next)
+    if (!memcmp (item->key, key, SIGCACHE_KEYLEN))
+      return 1;
+  return 0;
+}
+
+
+/* Insert KEY into the table.  IS_NEW is true if it is not yet in the
+ * file.  */
+static void
+insert_key (const byte *key, int is_new)
+{
+  sigcache_item_t item;
+
+  if (n_entries >= 2 * table_size
+      && !resize_table (2 * table_size))
+    return;
+
+  item = xtrymalloc (sizeof *item);
+  if (!item)
+    return;
+  memcpy (item->key, key, SIGCACHE_KEYLEN);
+  item->is_new = !!is_new;
+  item->next = table[bucket_of (key)];
+  table[bucket_of (key)] = item;
+  item->newer = NULL;
+  if (newest)
+    newest->newer = item;
+  else
+    oldest = item;
+  newest = item;
+  n_entries++;
+  if (is_new)
+    n_new_entries++;
+}
+
+
+/* Read the cache file into the table.  */
+static void
+load_sigcache (void)
+{
+  char *fname;
+  estream_t fp;
+  byte buffer[SIGCACHE_MAGICLEN];
+  byte key[SIGCACHE_KEYLEN];
+  size_t nread;
+  off_t size;
+  unsigned long total;
+  unsigned int count = 0;
+
+  loaded = 1;
+  if (!resize_table (SIGCACHE_MIN_BUCKETS))
+    return;
+
+  fname = sigcache_fname ();
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("can't open '%s': %s\n"), fname, strerror (errno));
+      need_rewrite = 1;
+      xfree (fname);
+      return;
+    }
+
+  if (es_read (fp, buffer, SIGCACHE_MAGICLEN, &nread)
+      || nread != SIGCACHE_MAGICLEN
+      || memcmp (buffer, SIGCACHE_MAGIC, SIGCACHE_MAGICLEN))
+    {
+      if (opt.verbose)
+        log_info ("'%s' is not a signature cache - ignored\n", fname);
+      need_rewrite = 1;
+      goto leave;
+    }
+
+  /* Skip the older entries of a file which grew too large.  */
+  if (!es_fseeko (fp, 0, SEEK_END) && (size = es_ftello (fp)) != -1)
+    {
+      total = (size - SIGCACHE_MAGICLEN) / SIGCACHE_KEYLEN;
+      if (total > SIGCACHE_MAX_ENTRIES)
+        {
+          total -= SIGCACHE_MAX_ENTRIES / 2;
+          need_rewrite = 1;
+        }
+      else
+        total = 0;
+      if (es_fseeko (fp, SIGCACHE_MAGICLEN + (off_t)total * SIGCACHE_KEYLEN,
+                     SEEK_SET))
+        {
+          need_rewrite = 1;
+          goto leave;
+        }
+    }
+
+  while (count < SIGCACHE_MAX_ENTRIES
+         && !es_read (fp, key, SIGCACHE_KEYLEN, &nread)
+         && nread == SIGCACHE_KEYLEN)
+    {
+      count++;
+      if (!find_key (key))
+        insert_key (key, 0);
+    }
+  if (nread || need_rewrite)
+    {
+      /* A truncated last entry or too many entries.  The file is
+       * written anew with the remaining entries.  */
+      if (opt.verbose)
+        log_info ("signature cache '%s' will be rewritten\n", fname);
+      need_rewrite = 1;
+    }
+  if (DBG_CACHE)
+    log_debug ("sigcache: %u entries read from '%s'\n", n_entries, fname);
+
+ leave:
+  es_fclose (fp);
+  xfree (fname);
+}
+
+
+/* Compute the cache key for the signature SIG made by PK into KEY,
+ * which must provide space for SIGCACHE_KEYLEN bytes.  DIGEST is the
+ * finalized digest over the signed data.  Returns 0 on success.  */
+gpg_error_t
+sigcache_make_key (byte *key, PKT_public_key *pk, PKT_signature *sig,
+                   gcry_md_hd_t digest)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  const byte *dgst;
+  unsigned char *buf;
+  unsigned int nbits;
+  size_t n;
+  int i, nsig;
+
+  dgst = gcry_md_read (digest, sig->digest_algo);
+  nsig = pubkey_get_nsig (sig->pubkey_algo);
+  if (!dgst || !nsig)
+    return gpg_error (GPG_ERR_INV_VALUE);
+
+  err = gcry_md_open (&md, GCRY_MD_SHA256, 0);
+  if (err)
+    return err;
+
+  fingerprint_from_pk (pk, fpr, &fprlen);
+  gcry_md_putc (md, fprlen);
+  gcry_md_write (md, fpr, fprlen);
+  gcry_md_putc (md, sig->pubkey_algo);
+  gcry_md_putc (md, sig->digest_algo);
+  gcry_md_write (md, dgst, gcry_md_get_algo_dlen (sig->digest_algo));
+
+  for (i=0; i < nsig && !err; i++)
+    {
+      if (!sig->data[i])
+        err = gpg_error (GPG_ERR_INV_VALUE);
+      else if (gcry_mpi_get_flag (sig->data[i], GCRYMPI_FLAG_OPAQUE))
+        {
+          const byte *p = gcry_mpi_get_opaque (sig->data[i], &nbits);
+
+          n = (nbits + 7) / 8;
+          gcry_md_putc (md, nbits >> 8);
+          gcry_md_putc (md, nbits);
+          if (p)
+            gcry_md_write (md, p, n);
+        }
+      else
+        {
+          err = gcry_mpi_aprint (GCRYMPI_FMT_PGP, &buf, &n, sig->data[i]);
+          if (!err)
+            {
+              gcry_md_write (md, buf, n);
+              gcry_free (buf);
+            }
+        }
+    }
+
+  if (!err)
+    memcpy (key, gcry_md_read (md, GCRY_MD_SHA256), SIGCACHE_KEYLEN);
+  gcry_md_close (md);
+  return err;
+}
+
+
+/* Return true if KEY is in the cache.  */
+int
+sigcache_lookup (const byte *key)
+{
+  if (!loaded)
+    load_sigcache ();
+  if (!table_size)
+    return 0;
+
+  sigcache_stats.lookups++;
+  if (!find_key (key))
+    return 0;
+  sigcache_stats.hits++;
+  return 1;
+}
+
+
+/* Add KEY of a good signature to the cache.  */
+void
+sigcache_put (const byte *key)
+{
+  if (!loaded)
+    load_sigcache ();
+  if (!table_size || find_key (key))
+    return;
+  insert_key (key, 1);
+}
+
+
+/* Write all entries to a new cache file which replaces FNAME.  */
+static gpg_error_t
+rewrite_file (const char *fname)
+{
+  gpg_error_t err = 0;
+  char *tmpfname;
+  estream_t fp;
+  sigcache_item_t item;
+
+  tmpfname = xtryasprintf ("%s.%lu.tmp", fname, (unsigned long)getpid ());
+  if (!tmpfname)
+    return gpg_error_from_syserror ();
+  fp = es_fopen (tmpfname, "wb,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (tmpfname);
+      return err;
+    }
+
+  if (es_write (fp, SIGCACHE_MAGIC, SIGCACHE_MAGICLEN, NULL))
+    err = gpg_error_from_syserror ();
+  for (item = oldest; item && !err; item = item->newer)
+    if (es_write (fp, item->key, SIGCACHE_KEYLEN, NULL))
+      err = gpg_error_from_syserror ();
+  if (es_fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+  xfree (tmpfname);
+  return err;
+}
+
+
+/* Append the new entries to the cache file FNAME.  Each entry is
+ * written with one system call so that the entries of concurrent
+ * processes don't mix.  */
+static gpg_error_t
+append_to_file (const char *fname)
+{
+  gpg_error_t err = 0;
+  estream_t fp;
+  sigcache_item_t item;
+
+  fp = es_fopen (fname, "ab,mode=-rw");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  es_setvbuf (fp, NULL, _IONBF, 0);
+
+  for (item = oldest; item && !err; item = item->newer)
+    if (item->is_new && es_write (fp, item->key, SIGCACHE_KEYLEN, NULL))
+      err = gpg_error_from_syserror ();
+  if (es_fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  return err;
+}
+
+
+/* Write the new entries to the cache file and release the cache.
+ * This is called when gpg terminates.  */
+void
+sigcache_flush (void)
+{
+  gpg_error_t err;
+  char *fname;
+
+  if (opt.dry_run || !(n_new_entries || (need_rewrite && n_entries)))
+    goto leave;
+
+  fname = sigcache_fname ();
+  if (need_rewrite)
+    err = rewrite_file (fname);
+  else
+    err = append_to_file (fname);
+  if (err)
+    log_info (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+  else if (DBG_CACHE)
+    log_debug ("sigcache: %u new entries written to '%s'\n",
+               n_new_entries, fname);
+  xfree (fname);
+
+ leave:
+  release_table ();
+  need_rewrite = 0;
+  loaded = 0;
+}
+
+
+/* Dump the statistics.  */
+void
+sigcache_dump_stats (void)
+{
+  if (loaded)
+    log_info ("sigcache: entries=%u new=%u lookups=%u hits=%u\n",
+              n_entries, n_new_entries,
+              sigcache_stats.lookups, sigcache_stats.hits);
+}
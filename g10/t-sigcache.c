@@ -0,0 +1,201 @@
+/* t-sigcache.c - Tests for sigcache.c.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "test.c"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gpg.h"
+#include "main.h"
+#include "../common/util.h"
+#include "../common/sysutils.h"
+
+/* Must match sigcache.c.  */
+#define MAGIC      "\x00gsc\x01\x00\x00\x00"
+#define MAGICLEN   8
+#define MAX_ENTRIES 250000
+
+static char *fname;
+
+
+/* Store the cache key number N at KEY.  */
+static void
+make_key (byte *key, unsigned long n)
+{
+  memset (key, 0xa5, SIGCACHE_KEYLEN);
+  key[0] = n >> 24;
+  key[1] = n >> 16;
+  key[2] = n >> 8;
+  key[3] = n;
+}
+
+
+/* Return the size of the cache file or -1 if it does not exist.  */
+static long
+file_size (void)
+{
+  struct stat st;
+
+  if (stat (fname, &st))
+    return -1;
+  return (long)st.st_size;
+}
+
+
+/* Return true if the file has the header and KEY number N as its
+ * entry number IDX.  */
+static int
+file_has_key (unsigned long idx, unsigned long n)
+{
+  FILE *fp;
+  byte buf[MAGICLEN];
+  byte key[SIGCACHE_KEYLEN], want[SIGCACHE_KEYLEN];
+  int okay;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return 0;
+  okay = (fread (buf, MAGICLEN, 1, fp) == 1
+          && !memcmp (buf, MAGIC, MAGICLEN)
+          && !fseek (fp, MAGICLEN + idx * SIGCACHE_KEYLEN, SEEK_SET)
+          && fread (key, SIGCACHE_KEYLEN, 1, fp) == 1);
+  fclose (fp);
+  make_key (want, n);
+  return okay && !memcmp (key, want, SIGCACHE_KEYLEN);
+}
+
+
+static int
+lookup (unsigned long n)
+{
+  byte key[SIGCACHE_KEYLEN];
+
+  make_key (key, n);
+  return sigcache_lookup (key);
+}
+
+
+static void
+put (unsigned long n)
+{
+  byte key[SIGCACHE_KEYLEN];
+
+  make_key (key, n);
+  sigcache_put (key);
+}
+
+
+/* Write a cache file with the keys FIRST to LAST.  */
+static void
+write_file (const char *magic, unsigned long first, unsigned long last)
+{
+  FILE *fp;
+  byte key[SIGCACHE_KEYLEN];
+  unsigned long n;
+
+  fp = fopen (fname, "wb");
+  if (!fp)
+    ABORT ("can't create cache file");
+  fwrite (magic, MAGICLEN, 1, fp);
+  for (n = first; n <= last; n++)
+    {
+      make_key (key, n);
+      fwrite (key, SIGCACHE_KEYLEN, 1, fp);
+    }
+  if (fclose (fp))
+    ABORT ("error writing cache file");
+}
+
+
+static void
+do_test (int argc, char *argv[])
+{
+  char *homedir;
+  const char *tmpdir;
+  FILE *fp;
+
+  (void)argc;
+  (void)argv;
+
+  tmpdir = getenv ("TMPDIR");
+  homedir = xstrconcat (tmpdir && *tmpdir? tmpdir : "/tmp",
+                        "/t-sigcache-XXXXXX", NULL);
+  if (!gnupg_mkdtemp (homedir))
+    ABORT ("can't create temporary directory");
+  gnupg_set_homedir (homedir);
+  fname = make_filename (homedir, "sigcache.dat", NULL);
+
+  TEST_GROUP ("new entries");
+  TEST_P ("empty cache", !lookup (1));
+  put (1);
+  put (2);
+  put (1);
+  TEST_P ("found after put", lookup (1) && lookup (2));
+  sigcache_flush ();
+  TEST ("file created", file_size (), MAGICLEN + 2 * SIGCACHE_KEYLEN);
+  TEST_P ("entries in order", file_has_key (0, 1) && file_has_key (1, 2));
+
+  TEST_GROUP ("reading and appending");
+  TEST_P ("read back", lookup (1) && lookup (2) && !lookup (3));
+  put (3);
+  sigcache_flush ();
+  TEST ("appended", file_size (), MAGICLEN + 3 * SIGCACHE_KEYLEN);
+  TEST_P ("entries kept", file_has_key (0, 1) && file_has_key (2, 3));
+  TEST_P ("nothing new", lookup (3));
+  sigcache_flush ();
+  TEST ("not written", file_size (), MAGICLEN + 3 * SIGCACHE_KEYLEN);
+
+  TEST_GROUP ("truncated entry");
+  fp = fopen (fname, "ab");
+  if (!fp)
+    ABORT ("can't open cache file");
+  fwrite ("\x01\x02\x03\x04\x05", 5, 1, fp);
+  fclose (fp);
+  TEST_P ("whole entries read", lookup (1) && lookup (3));
+  sigcache_flush ();
+  TEST ("rewritten", file_size (), MAGICLEN + 3 * SIGCACHE_KEYLEN);
+  TEST_P ("entries kept", file_has_key (0, 1) && file_has_key (2, 3));
+
+  TEST_GROUP ("invalid header");
+  write_file ("\x00gsc\x02\x00\x00\x00", 1, 3);
+  TEST_P ("file ignored", !lookup (1) && !lookup (3));
+  put (4);
+  sigcache_flush ();
+  TEST ("rewritten", file_size (), MAGICLEN + SIGCACHE_KEYLEN);
+  TEST_P ("new entry", file_has_key (0, 4));
+
+  TEST_GROUP ("too many entries");
+  write_file (MAGIC, 1, MAX_ENTRIES + 10);
+  TEST_P ("oldest dropped", !lookup (1) && !lookup (MAX_ENTRIES / 2 + 10));
+  TEST_P ("newest kept", (lookup (MAX_ENTRIES / 2 + 11)
+                          && lookup (MAX_ENTRIES + 10)));
+  sigcache_flush ();
+  TEST ("rewritten", file_size (),
+        MAGICLEN + (long)MAX_ENTRIES / 2 * SIGCACHE_KEYLEN);
+  TEST_P ("order kept", (file_has_key (0, MAX_ENTRIES / 2 + 11)
+                         && file_has_key (MAX_ENTRIES / 2 - 1,
+                                          MAX_ENTRIES + 10)));
+
+  gnupg_remove (fname);
+  rmdir (homedir);
+  xfree (fname);
+  xfree (homedir);
+}
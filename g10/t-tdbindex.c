@@ -0,0 +1,194 @@
+/* t-tdbindex.c - Tests for tdbindex.c.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "test.c"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "keydb.h"
+#include "tdbio.h"
+#include "../common/sysutils.h"
+
+
+/* Return the size of the file FNAME or -1 if it does not exist.  */
+static long
+file_size (const char *fname)
+{
+  struct stat st;
+
+  if (stat (fname, &st))
+    return -1;
+  return (long)st.st_size;
+}
+
+
+/* Return the number of keys in IDX.  */
+static unsigned int
+count_keys (tdbindex_t idx)
+{
+  struct tdbindex_key_s *k;
+  unsigned int n = 0;
+
+  for (k = tdbindex_first (idx); k; k = k->next)
+    n++;
+  return n;
+}
+
+
+/* Return true if the keys of A are all in B with the same
+ * certifiers.  */
+static int
+same_keys (tdbindex_t a, tdbindex_t b)
+{
+  struct tdbindex_key_s *ka, *kb;
+
+  for (ka = tdbindex_first (a); ka; ka = ka->next)
+    {
+      for (kb = tdbindex_first (b); kb; kb = kb->next)
+        if (kb->fprlen == ka->fprlen
+            && !memcmp (kb->fpr, ka->fpr, ka->fprlen))
+          break;
+      if (!kb
+          || kb->kid[0] != ka->kid[0] || kb->kid[1] != ka->kid[1]
+          || kb->nsigners != ka->nsigners
+          || (ka->nsigners
+              && memcmp (kb->signers, ka->signers,
+                         2 * ka->nsigners * sizeof *ka->signers)))
+        return 0;
+    }
+  return 1;
+}
+
+
+static void
+do_test (int argc, char *argv[])
+{
+  gpg_error_t err;
+  KEYDB_HANDLE hd;
+  kbnode_t kb, firstkb = NULL;
+  tdbindex_t idx, idx2;
+  byte state[KEYDB_STATE_LEN], state2[KEYDB_STATE_LEN];
+  byte otherstate[KEYDB_STATE_LEN];
+  char *fname, *dbname, *dir;
+  const char *tmpdir;
+  long size;
+  unsigned int nkeys;
+  FILE *fp;
+
+  (void)argc;
+  (void)argv;
+
+  fname = prepend_srcdir ("t-keydb-keyring.kbx");
+  err = keydb_add_resource (fname, KEYDB_RESOURCE_FLAG_READONLY);
+  test_free (fname);
+  if (err)
+    ABORT ("Failed to open keyring.");
+  hd = keydb_new ();
+  if (!hd)
+    ABORT ("");
+
+  tmpdir = getenv ("TMPDIR");
+  dir = xstrconcat (tmpdir && *tmpdir? tmpdir : "/tmp",
+                    "/t-tdbindex-XXXXXX", NULL);
+  if (!gnupg_mkdtemp (dir))
+    ABORT ("can't create temporary directory");
+  dbname = make_filename (dir, "trustdb.gpg", NULL);
+  fname = tdbindex_fname (dbname);
+
+  TEST_GROUP ("keydb state");
+  TEST ("get state", keydb_get_state (hd, state), 0);
+  TEST ("get state again", keydb_get_state (hd, state2), 0);
+  TEST_P ("state unchanged", !memcmp (state, state2, KEYDB_STATE_LEN));
+  memcpy (otherstate, state, KEYDB_STATE_LEN);
+  otherstate[0] ^= 1;
+
+  TEST_GROUP ("building");
+  if (tdbindex_new (&idx))
+    ABORT ("tdbindex_new failed");
+  for (err = keydb_search_first (hd); !err; err = keydb_search_next (hd))
+    {
+      if (keydb_get_keyblock (hd, &kb))
+        ABORT ("keydb_get_keyblock failed");
+      TEST ("put", tdbindex_put (idx, kb), 0);
+      if (!firstkb)
+        firstkb = kb;
+      else
+        release_kbnode (kb);
+    }
+  if (!firstkb)
+    ABORT ("no keys found");
+  nkeys = count_keys (idx);
+  TEST_P ("keys indexed", nkeys > 1);
+  TEST ("put again", tdbindex_put (idx, firstkb), 0);
+  TEST ("no duplicate", count_keys (idx), nkeys);
+
+  TEST_GROUP ("writing and loading");
+  TEST ("no index to append to", tdbindex_append (fname, firstkb,
+                                                  state, state2), 0);
+  TEST ("no file created", file_size (fname), -1);
+  TEST ("write", tdbindex_write (idx, fname, state), 0);
+  TEST ("load", tdbindex_load (fname, &idx2), 0);
+  TEST_P ("same keys", (count_keys (idx) == count_keys (idx2)
+                        && same_keys (idx, idx2)));
+  TEST_P ("stamp", (tdbindex_matches (idx2, state)
+                    && !tdbindex_matches (idx2, otherstate)));
+  TEST_P ("no rewrite", !tdbindex_need_rewrite (idx2));
+  tdbindex_release (idx2);
+
+  TEST_GROUP ("appending");
+  size = file_size (fname);
+  TEST ("outdated index", tdbindex_append (fname, firstkb,
+                                           otherstate, state), 0);
+  TEST ("nothing appended", file_size (fname), size);
+  TEST ("append", tdbindex_append (fname, firstkb, state, otherstate), 0);
+  TEST_P ("record appended", file_size (fname) > size);
+  TEST ("load", tdbindex_load (fname, &idx2), 0);
+  TEST_P ("record replaced", (count_keys (idx) == count_keys (idx2)
+                              && same_keys (idx, idx2)));
+  TEST_P ("new stamp", (tdbindex_matches (idx2, otherstate)
+                        && !tdbindex_matches (idx2, state)));
+  tdbindex_release (idx2);
+
+  TEST_GROUP ("damaged file");
+  fp = fopen (fname, "ab");
+  if (!fp)
+    ABORT ("can't open index");
+  fputc (20, fp);
+  fclose (fp);
+  TEST ("truncated record", gpg_err_code (tdbindex_load (fname, &idx2)),
+        GPG_ERR_INV_DATA);
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    ABORT ("can't open index");
+  fwrite ("\x00gti\x01", 5, 1, fp);
+  fclose (fp);
+  TEST ("old version", gpg_err_code (tdbindex_load (fname, &idx2)),
+        GPG_ERR_INV_DATA);
+
+  release_kbnode (firstkb);
+  tdbindex_release (idx);
+  keydb_release (hd);
+  gnupg_remove (fname);
+  rmdir (dir);
+  xfree (fname);
+  xfree (dbname);
+  xfree (dir);
+}
@@ -0,0 +1,534 @@
+/* tdbindex.c - Certification index for the trustdb validation
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The validation of the trustdb needs to know which keys have user
+ * IDs certified by the keys found valid so far.  Without further
+ * information this requires a walk over all keys of the keydb for
+ * each level of the web of trust.  This module maintains an index
+ * which lists for each key the key IDs of the keys which certified
+ * one of its user IDs.  The index is kept in a file next to the
+ * trustdb (e.g. "trustdb.gpg.idx").  It is built by a walk over the
+ * keydb when it does not yet exist and is updated each time a
+ * keyblock is stored (see tdb_notice_key_changed).  Keys which are
+ * deleted are not removed from the index; the validation ignores
+ * entries for which no key can be found.
+ *
+ * The index is stamped with the state of the keydb files (see
+ * keydb_get_state).  A record is only appended if the stamp matches
+ * the state before the keyblock was stored; the stamp is then set to
+ * the new state.  Thus any change of the keydb which was not recorded,
+ * for example by an older gpg version, leaves a stamp which does not
+ * match and the validation builds the index anew.  Deleting a key
+ * also changes the state.  The updates of the file are done while
+ * holding the lock of the trustdb.
+ *
+ * The file consists of an 8 byte header and the 20 byte stamp
+ * followed by records:
+ *
+ *   byte  fprlen
+ *   byte  fpr[fprlen]
+ *   u16   n      - The number of certifiers.
+ *   u32   kid[2] - N times the key ID of a certifier.
+ *
+ * A later record for the same fingerprint replaces the former one.
+ * Thus an update only needs to append a record; the file is written
+ * anew by the validation when it contains too many stale records.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/host2net.h"
+#include "../common/membuf.h"
+#include "../common/i18n.h"
+#include "packet.h"
+#include "keydb.h"
+#include "options.h"
+#include "main.h"
+#include "tdbio.h"
+
+
+/* The header of the index file.  The 5th byte is the version.  */
+#define TDBINDEX_MAGIC      "\x00gti\x02\x00\x00\x00"
+#define TDBINDEX_MAGICLEN   8
+
+/* The length of the header including the stamp.  */
+#define TDBINDEX_HEADERLEN  (TDBINDEX_MAGICLEN + KEYDB_STATE_LEN)
+
+/* The number of buckets of the hash table.  */
+#define TDBINDEX_BUCKETS    4096
+
+
+/* The index object.  */
+struct tdbindex_s
+{
+  struct tdbindex_key_s *keys;    /* List of all keys.  */
+  struct tdbindex_key_s **table;  /* Hash table by fingerprint.  */
+  unsigned int nkeys;             /* Number of keys.  */
+  unsigned int nrecords;          /* Number of records in the file.  */
+  byte state[KEYDB_STATE_LEN];    /* The stamp of the file.  */
+};
+
+
+/* Return the name of the index for the trustdb DBNAME.  The caller
+ * must free it.  */
+char *
+tdbindex_fname (const char *dbname)
+{
+  return xstrconcat (dbname, EXTSEP_S "idx", NULL);
+}
+
+
+static unsigned int
+bucket_of (const byte *fpr, size_t fprlen)
+{
+  return buf32_to_uint (fpr + fprlen - 4) % TDBINDEX_BUCKETS;
+}
+
+
+/* Create a new empty index and store it at R_IDX.  */
+gpg_error_t
+tdbindex_new (tdbindex_t *r_idx)
+{
+  tdbindex_t idx;
+
+  *r_idx = NULL;
+  idx = xtrycalloc (1, sizeof *idx);
+  if (!idx)
+    return gpg_error_from_syserror ();
+  idx->table = xtrycalloc (TDBINDEX_BUCKETS, sizeof *idx->table);
+  if (!idx->table)
+    {
+      xfree (idx);
+      return gpg_error_from_syserror ();
+    }
+  *r_idx = idx;
+  return 0;
+}
+
+
+/* Release the index IDX.  */
+void
+tdbindex_release (tdbindex_t idx)
+{
+  struct tdbindex_key_s *k, *k2;
+
+  if (!idx)
+    return;
+  for (k = idx->keys; k; k = k2)
+    {
+      k2 = k->next;
+      xfree (k->signers);
+      xfree (k);
+    }
+  xfree (idx->table);
+  xfree (idx);
+}
+
+
+/* Return the first key of the index.  The keys are linked by their
+ * NEXT field.  */
+struct tdbindex_key_s *
+tdbindex_first (tdbindex_t idx)
+{
+  return idx->keys;
+}
+
+
+/* Store the key with the fingerprint FPR and the NSIGNERS certifiers
+ * SIGNERS in IDX.  SIGNERS is taken over by this function.  */
+static gpg_error_t
+put_key (tdbindex_t idx, const byte *fpr, size_t fprlen,
+         u32 *signers, unsigned int nsigners)
+{
+  struct tdbindex_key_s *k;
+  unsigned int hash = bucket_of (fpr, fprlen);
+
+  for (k = idx->table[hash]; k; k = k->hnext)
+    if (k->fprlen == fprlen && !memcmp (k->fpr, fpr, fprlen))
+      break;
+  if (!k)
+    {
+      k = xtrycalloc (1, sizeof *k);
+      if (!k)
+        {
+          xfree (signers);
+          return gpg_error_from_syserror ();
+        }
+      k->fprlen = fprlen;
+      memcpy (k->fpr, fpr, fprlen);
+      if (fprlen == 20)
+        {
+          k->kid[0] = buf32_to_u32 (fpr + 12);
+          k->kid[1] = buf32_to_u32 (fpr + 16);
+        }
+      else
+        {
+          k->kid[0] = buf32_to_u32 (fpr);
+          k->kid[1] = buf32_to_u32 (fpr + 4);
+        }
+      k->hnext = idx->table[hash];
+      idx->table[hash] = k;
+      k->next = idx->keys;
+      idx->keys = k;
+      idx->nkeys++;
+    }
+  xfree (k->signers);
+  k->signers = signers;
+  k->nsigners = nsigners;
+  return 0;
+}
+
+
+/* Collect the certifiers of the user IDs of KB.  On success the
+ * fingerprint is stored at FPR and FPRLEN and a malloced array with
+ * the key IDs of the certifiers at R_SIGNERS and R_NSIGNERS.  */
+static gpg_error_t
+collect_signers (kbnode_t kb, byte *fpr, size_t *fprlen,
+                 u32 **r_signers, unsigned int *r_nsigners)
+{
+  PKT_public_key *pk = kb->pkt->pkt.public_key;
+  kbnode_t node;
+  PKT_signature *sig;
+  u32 kid[2];
+  u32 *signers = NULL;
+  unsigned int nsigners = 0;
+  unsigned int size = 0;
+  unsigned int i;
+  int in_uid = 0;
+
+  *r_signers = NULL;
+  *r_nsigners = 0;
+  fingerprint_from_pk (pk, fpr, fprlen);
+  keyid_from_pk (pk, kid);
+
+  for (node = kb->next; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_USER_ID)
+        in_uid = 1;
+      else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        in_uid = 0;
+      if (!in_uid || node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = node->pkt->pkt.signature;
+      if (!IS_UID_SIG (sig)
+          || (sig->keyid[0] == kid[0] && sig->keyid[1] == kid[1]))
+        continue;
+
+      for (i=0; i < nsigners; i++)
+        if (signers[2*i] == sig->keyid[0] && signers[2*i+1] == sig->keyid[1])
+          break;
+      if (i < nsigners)
+        continue;
+      if (nsigners == 65535)
+        break;  /* The record can't hold more.  */
+      if (nsigners == size)
+        {
+          u32 *tmp;
+
+          size += 16;
+          tmp = xtryrealloc (signers, 2 * size * sizeof *signers);
+          if (!tmp)
+            {
+              gpg_error_t err = gpg_error_from_syserror ();
+              xfree (signers);
+              return err;
+            }
+          signers = tmp;
+        }
+      signers[2*nsigners] = sig->keyid[0];
+      signers[2*nsigners+1] = sig->keyid[1];
+      nsigners++;
+    }
+
+  *r_signers = signers;
+  *r_nsigners = nsigners;
+  return 0;
+}
+
+
+/* Add the keyblock KB to the index IDX or replace the former entry.  */
+gpg_error_t
+tdbindex_put (tdbindex_t idx, kbnode_t kb)
+{
+  gpg_error_t err;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  u32 *signers;
+  unsigned int nsigners;
+
+  err = collect_signers (kb, fpr, &fprlen, &signers, &nsigners);
+  if (err)
+    return err;
+  return put_key (idx, fpr, fprlen, signers, nsigners);
+}
+
+
+/* Append the record for FPR and SIGNERS to MB.  */
+static void
+put_record (membuf_t *mb, const byte *fpr, size_t fprlen,
+            const u32 *signers, unsigned int nsigners)
+{
+  byte buf[8];
+  unsigned int i;
+
+  buf[0] = fprlen;
+  put_membuf (mb, buf, 1);
+  put_membuf (mb, fpr, fprlen);
+  buf[0] = nsigners >> 8;
+  buf[1] = nsigners;
+  put_membuf (mb, buf, 2);
+  for (i=0; i < nsigners; i++)
+    {
+      ulongtobuf (buf, signers[2*i]);
+      ulongtobuf (buf + 4, signers[2*i+1]);
+      put_membuf (mb, buf, 8);
+    }
+}
+
+
+/* Load the index from the file FNAME.  Returns GPG_ERR_ENOENT if
+ * there is no such file and GPG_ERR_INV_DATA if the file is
+ * corrupt.  */
+gpg_error_t
+tdbindex_load (const char *fname, tdbindex_t *r_idx)
+{
+  gpg_error_t err;
+  tdbindex_t idx = NULL;
+  estream_t fp;
+  byte buf[TDBINDEX_HEADERLEN];
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen, nread;
+  u32 *signers;
+  unsigned int nsigners, i;
+  int c;
+
+  *r_idx = NULL;
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  if (es_read (fp, buf, TDBINDEX_HEADERLEN, &nread)
+      || nread != TDBINDEX_HEADERLEN
+      || memcmp (buf, TDBINDEX_MAGIC, TDBINDEX_MAGICLEN))
+    {
+      err = gpg_error (GPG_ERR_INV_DATA);
+      goto leave;
+    }
+
+  err = tdbindex_new (&idx);
+  if (err)
+    goto leave;
+  memcpy (idx->state, buf + TDBINDEX_MAGICLEN, KEYDB_STATE_LEN);
+
+  while ((c = es_getc (fp)) != EOF)
+    {
+      fprlen = c;
+      if ((fprlen != 20 && fprlen != 32)
+          || es_read (fp, fpr, fprlen, &nread) || nread != fprlen
+          || es_read (fp, buf, 2, &nread) || nread != 2)
+        {
+          err = gpg_error (GPG_ERR_INV_DATA);
+          goto leave;
+        }
+      nsigners = buf16_to_uint (buf);
+      signers = NULL;
+      if (nsigners)
+        {
+          signers = xtrymalloc (2 * nsigners * sizeof *signers);
+          if (!signers)
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+        }
+      for (i=0; i < nsigners; i++)
+        {
+          if (es_read (fp, buf, 8, &nread) || nread != 8)
+            {
+              xfree (signers);
+              err = gpg_error (GPG_ERR_INV_DATA);
+              goto leave;
+            }
+          signers[2*i] = buf32_to_u32 (buf);
+          signers[2*i+1] = buf32_to_u32 (buf + 4);
+        }
+      err = put_key (idx, fpr, fprlen, signers, nsigners);
+      if (err)
+        goto leave;
+      idx->nrecords++;
+    }
+  if (es_ferror (fp))
+    err = gpg_error_from_syserror ();
+
+ leave:
+  es_fclose (fp);
+  if (err)
+    tdbindex_release (idx);
+  else
+    *r_idx = idx;
+  return err;
+}
+
+
+/* Return true if the index IDX is stamped with the keydb STATE.  */
+int
+tdbindex_matches (tdbindex_t idx, const byte *state)
+{
+  return !memcmp (idx->state, state, KEYDB_STATE_LEN);
+}
+
+
+/* Write the index IDX stamped with the keydb STATE to the file
+ * FNAME.  */
+gpg_error_t
+tdbindex_write (tdbindex_t idx, const char *fname, const byte *state)
+{
+  gpg_error_t err;
+  struct tdbindex_key_s *k;
+  membuf_t mb;
+  estream_t fp;
+  char *tmpfname;
+  void *buffer;
+  size_t length;
+
+  init_membuf (&mb, 65536);
+  put_membuf (&mb, TDBINDEX_MAGIC, TDBINDEX_MAGICLEN);
+  put_membuf (&mb, state, KEYDB_STATE_LEN);
+  for (k = idx->keys; k; k = k->next)
+    put_record (&mb, k->fpr, k->fprlen, k->signers, k->nsigners);
+  buffer = get_membuf (&mb, &length);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+
+  tmpfname = xtryasprintf ("%s.tmp", fname);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (buffer);
+      return err;
+    }
+
+  tdbio_lock ();
+  fp = es_fopen (tmpfname, "wb,mode=-rw");
+  if (!fp)
+    err = gpg_error_from_syserror ();
+  else if (es_write (fp, buffer, length, NULL))
+    {
+      err = gpg_error_from_syserror ();
+      es_fclose (fp);
+    }
+  else if (es_fclose (fp))
+    err = gpg_error_from_syserror ();
+  else
+    err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+  tdbio_unlock ();
+  if (!err)
+    {
+      idx->nrecords = idx->nkeys;
+      memcpy (idx->state, state, KEYDB_STATE_LEN);
+    }
+
+  xfree (tmpfname);
+  xfree (buffer);
+  return err;
+}
+
+
+/* Return true if the file of IDX has so many stale records that it
+ * should be written anew.  */
+int
+tdbindex_need_rewrite (tdbindex_t idx)
+{
+  return idx->nrecords > 2 * idx->nkeys + 1000;
+}
+
+
+/* Append the record for the keyblock KB to the index file FNAME and
+ * change its stamp from the keydb state OLDSTATE to NEWSTATE.
+ * Nothing is done if the index file does not exist or is not stamped
+ * with OLDSTATE; it will then be built anew by the next
+ * validation.  */
+gpg_error_t
+tdbindex_append (const char *fname, kbnode_t kb,
+                 const byte *oldstate, const byte *newstate)
+{
+  gpg_error_t err;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  u32 *signers;
+  unsigned int nsigners;
+  membuf_t mb;
+  estream_t fp;
+  void *buffer;
+  size_t length, nread;
+  byte header[TDBINDEX_HEADERLEN];
+
+  if (access (fname, F_OK))
+    return 0;
+
+  err = collect_signers (kb, fpr, &fprlen, &signers, &nsigners);
+  if (err)
+    return err;
+  init_membuf (&mb, 256);
+  put_record (&mb, fpr, fprlen, signers, nsigners);
+  xfree (signers);
+  buffer = get_membuf (&mb, &length);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+
+  tdbio_lock ();
+  fp = es_fopen (fname, "r+b");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+        err = 0;
+      goto leave;
+    }
+  if (es_read (fp, header, TDBINDEX_HEADERLEN, &nread)
+      || nread != TDBINDEX_HEADERLEN
+      || memcmp (header, TDBINDEX_MAGIC, TDBINDEX_MAGICLEN)
+      || memcmp (header + TDBINDEX_MAGICLEN, oldstate, KEYDB_STATE_LEN))
+    goto leave;  /* Outdated or corrupt - leave it to the validation.  */
+
+  /* The stamp is updated only after the record has been written.  */
+  if (es_fseek (fp, 0, SEEK_END)
+      || es_write (fp, buffer, length, NULL)
+      || es_fflush (fp)
+      || es_fseek (fp, TDBINDEX_MAGICLEN, SEEK_SET)
+      || es_write (fp, newstate, KEYDB_STATE_LEN, NULL))
+    err = gpg_error_from_syserror ();
+
+ leave:
+  if (fp && es_fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  tdbio_unlock ();
+  xfree (buffer);
+  return err;
+}
@@ -534,6 +534,24 @@ tdbio_cancel_transaction () /* Not yet used.  */
 #endif  /* Not yet used.  */
 
 
+/* Take the lock of the trustdb.  This is also used to serialize the
+ * updates of the certification index.  The lock may be taken again
+ * by the same process.  */
+void
+tdbio_lock (void)
+{
+  take_write_lock ();
+}
+
+
+/* Release a lock taken by tdbio_lock.  */
+void
+tdbio_unlock (void)
+{
+  release_write_lock ();
+}
+
+
 
 /********************************************************
  **************** cached I/O functions ******************
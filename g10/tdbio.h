@@ -108,6 +108,8 @@ int tdbio_sync(void);
 int tdbio_begin_transaction(void);
 int tdbio_end_transaction(void);
 int tdbio_cancel_transaction(void);
+void tdbio_lock (void);
+void tdbio_unlock (void);
 int tdbio_delete_record (ctrl_t ctrl, ulong recnum);
 ulong tdbio_new_recnum (ctrl_t ctrl);
 gpg_error_t tdbio_search_trust_byfpr (ctrl_t ctrl, const byte *fingerprint,
@@ -118,4 +120,32 @@ gpg_error_t tdbio_search_trust_bypk (ctrl_t ctrl, PKT_public_key *pk,
 void tdbio_how_to_fix (void);
 void tdbio_invalid(void);
 
+/*-- tdbindex.c --*/
+
+/* An entry of the certification index.  */
+struct tdbindex_key_s
+{
+  struct tdbindex_key_s *next;   /* The next key of the index.  */
+  struct tdbindex_key_s *hnext;  /* The next key in the hash bucket.  */
+  u32 kid[2];                    /* The key ID of the key.  */
+  byte fprlen;                   /* The fingerprint of the key.  */
+  byte fpr[MAX_FINGERPRINT_LEN];
+  unsigned int nsigners;         /* The key IDs of the keys which  */
+  u32 *signers;                  /* certified a user ID (2*NSIGNERS). */
+};
+typedef struct tdbindex_s *tdbindex_t;
+
+char *tdbindex_fname (const char *dbname);
+gpg_error_t tdbindex_new (tdbindex_t *r_idx);
+void tdbindex_release (tdbindex_t idx);
+struct tdbindex_key_s *tdbindex_first (tdbindex_t idx);
+gpg_error_t tdbindex_put (tdbindex_t idx, kbnode_t kb);
+gpg_error_t tdbindex_load (const char *fname, tdbindex_t *r_idx);
+int tdbindex_matches (tdbindex_t idx, const byte *state);
+gpg_error_t tdbindex_write (tdbindex_t idx, const char *fname,
+                            const byte *state);
+int tdbindex_need_rewrite (tdbindex_t idx);
+gpg_error_t tdbindex_append (const char *fname, kbnode_t kb,
+                             const byte *oldstate, const byte *newstate);
+
 #endif /*G10_TDBIO_H*/
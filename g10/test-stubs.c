@@ -35,6 +35,7 @@
 #include "options.h"
 #include "keydb.h"
 #include "trustdb.h"
+#include "tdbio.h"
 #include "filter.h"
 #include "../common/ttyio.h"
 #include "../common/i18n.h"
@@ -100,6 +101,26 @@ check_trustdb_stale (ctrl_t ctrl)
   (void)ctrl;
 }
 
+void
+tdb_notice_key_changed (ctrl_t ctrl, kbnode_t kb,
+                        const byte *oldstate, const byte *newstate)
+{
+  (void)ctrl;
+  (void)kb;
+  (void)oldstate;
+  (void)newstate;
+}
+
+void
+tdbio_lock (void)
+{
+}
+
+void
+tdbio_unlock (void)
+{
+}
+
 int
 get_validity_info (ctrl_t ctrl, kbnode_t kb, PKT_public_key *pk,
                    PKT_user_id *uid)
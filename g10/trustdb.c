@@ -590,6 +590,39 @@ tdb_revalidation_mark (ctrl_t ctrl)
   pending_check_trustdb = 1;
 }
 
+
+/* This is called by the keydb after the keyblock KB has been stored.
+ * OLDSTATE and NEWSTATE describe the keydb before and after storing
+ * (see keydb_get_state); they are NULL if not known.  This records
+ * the certifications of KB in the index used by the validation.  This
+ * is done regardless of the current trust model, so that the index
+ * is still complete after a switch to a model using it.  */
+void
+tdb_notice_key_changed (ctrl_t ctrl, kbnode_t kb,
+                        const byte *oldstate, const byte *newstate)
+{
+  gpg_error_t err;
+  char *fname;
+
+  /* Without the states the index can't be updated; its stamp then
+   * does not match anymore and the next validation builds it anew.  */
+  if (!oldstate || !newstate)
+    return;
+  if (init_trustdb (ctrl, 1) || trustdb_args.no_trustdb)
+    return;
+
+  fname = tdbindex_fname (tdbio_get_dbname ());
+  err = tdbindex_append (fname, kb, oldstate, newstate);
+  if (err)
+    {
+      /* Without this record the index is incomplete; remove it so
+       * that the next validation builds it anew.  */
+      log_info (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+      gnupg_remove (fname);
+    }
+  xfree (fname);
+}
+
 int
 trustdb_pending_check(void)
 {
@@ -1793,65 +1826,100 @@ validate_one_keyblock (ctrl_t ctrl, kbnode_t kb, struct key_item *klist,
 }
 
 
-static int
-search_skipfnc (void *opaque, u32 *kid, int dummy_uid_no)
+/*
+ * Walk over all keys of the keydb and return an index with the
+ * certifiers of each key at R_INDEX.  The caller has to pass keydb
+ * handle so that we don't use to create our own.
+ */
+static gpg_error_t
+build_tdbindex (KEYDB_HANDLE hd, tdbindex_t *r_index)
 {
-  (void)dummy_uid_no;
-  return test_key_hash_table ((KeyHashTable)opaque, kid);
+  gpg_error_t err;
+  tdbindex_t index;
+  KBNODE keyblock;
+
+  *r_index = NULL;
+  err = tdbindex_new (&index);
+  if (err)
+    return err;
+
+  keydb_search_reset (hd);
+  for (err = keydb_search_first (hd); !err; err = keydb_search_next (hd))
+    {
+      err = keydb_get_keyblock (hd, &keyblock);
+      if (err)
+        {
+          log_error ("keydb_get_keyblock failed: %s\n", gpg_strerror (err));
+          break;
+        }
+      if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
+        err = tdbindex_put (index, keyblock);
+      release_kbnode (keyblock);
+      if (err)
+        break;
+    }
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    err = 0;
+  else if (err)
+    log_error ("building the certification index failed: %s\n",
+               gpg_strerror (err));
+
+  if (err)
+    tdbindex_release (index);
+  else
+    *r_index = index;
+  return err;
 }
 
 
 /*
- * Scan all keys and return a key_array of all suitable keys from
- * kllist.  The caller has to pass keydb handle so that we don't use
- * to create our own.  Returns either a key_array or NULL in case of
- * an error.  No results found are indicated by an empty array.
- * Caller hast to release the returned array.
+ * Return a key_array of all suitable keys certified by a key from
+ * klist.  The candidates are taken from INDEX.  The caller has to
+ * pass keydb handle so that we don't use to create our own.  Returns
+ * either a key_array or NULL in case of an error.  No results found
+ * are indicated by an empty array.  Caller hast to release the
+ * returned array.
  */
 static struct key_array *
-validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
-                   struct key_item *klist, u32 curtime, u32 *next_expire)
+validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, tdbindex_t index,
+                   KeyHashTable full_trust, struct key_item *klist,
+                   u32 curtime, u32 *next_expire)
 {
   KBNODE keyblock = NULL;
   struct key_array *keys = NULL;
   size_t nkeys, maxkeys;
   int rc;
-  KEYDB_SEARCH_DESC desc;
+  struct tdbindex_key_s *ik;
+  struct key_item *k;
+  KeyHashTable signers;
+  unsigned int i;
 
   maxkeys = 1000;
   keys = xmalloc ((maxkeys+1) * sizeof *keys);
   nkeys = 0;
 
-  rc = keydb_search_reset (hd);
-  if (rc)
-    {
-      log_error ("keydb_search_reset failed: %s\n", gpg_strerror (rc));
-      xfree (keys);
-      return NULL;
-    }
+  signers = new_key_hash_table ();
+  for (k=klist; k; k = k->next)
+    add_key_hash_table (signers, k->kid);
 
-  memset (&desc, 0, sizeof desc);
-  desc.mode = KEYDB_SEARCH_MODE_FIRST;
-  desc.skipfnc = search_skipfnc;
-  desc.skipfncvalue = full_trust;
-  rc = keydb_search (hd, &desc, 1, NULL);
-  if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND)
-    {
-      keys[nkeys].keyblock = NULL;
-      return keys;
-    }
-  if (rc)
-    {
-      log_error ("keydb_search(first) failed: %s\n", gpg_strerror (rc));
-      goto die;
-    }
-
-  desc.mode = KEYDB_SEARCH_MODE_NEXT; /* change mode */
-  do
+  for (ik = tdbindex_first (index); ik; ik = ik->next)
     {
       PKT_public_key *pk;
 
-      rc = keydb_get_keyblock (hd, &keyblock);
+      if (test_key_hash_table (full_trust, ik->kid))
+        continue;
+      for (i=0; i < ik->nsigners; i++)
+        if (test_key_hash_table (signers, ik->signers + 2*i))
+          break;
+      if (i == ik->nsigners)
+        continue;  /* Not certified by a key in klist.  */
+
+      keydb_search_reset (hd);
+      rc = keydb_search_fpr (hd, ik->fpr);
+      if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND)
+        continue;  /* The key has been deleted.  */
+      if (!rc)
+        rc = keydb_get_keyblock (hd, &keyblock);
       if (rc)
         {
           log_error ("keydb_get_keyblock failed: %s\n", gpg_strerror (rc));
@@ -1864,6 +1932,7 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
                      keyblock->pkt->pkttype);
           dump_kbnode (keyblock);
           release_kbnode(keyblock);
+          keyblock = NULL;
           continue;
         }
 
@@ -1907,18 +1976,13 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
       release_kbnode (keyblock);
       keyblock = NULL;
     }
-  while (!(rc = keydb_search (hd, &desc, 1, NULL)));
-
-  if (rc && gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
-    {
-      log_error ("keydb_search_next failed: %s\n", gpg_strerror (rc));
-      goto die;
-    }
 
+  release_key_hash_table (signers);
   keys[nkeys].keyblock = NULL;
   return keys;
 
  die:
+  release_key_hash_table (signers);
   keys[nkeys].keyblock = NULL;
   release_key_array (keys);
   return NULL;
@@ -1978,6 +2042,8 @@ reset_trust_records (ctrl_t ctrl)
  * Step 3:   if OWNERTRUST of any key in klist is undefined
  *             ask user to assign ownertrust
  * Step 4:   Loop over all keys in the keyDB which are not marked seen
+ *           and which are certified by a key in klist.  These keys
+ *           are taken from the certification index (see tdbindex.c)
  * Step 5:     if key is revoked or expired
  *                mark key as seen
  *                continue loop at Step 4
@@ -2007,13 +2073,11 @@ validate_keys (ctrl_t ctrl, int interactive)
   int ot_unknown, ot_undefined, ot_never, ot_marginal, ot_full, ot_ultimate;
   KeyHashTable stored,used,full_trust;
   u32 start_time, next_expire;
-
-  /* Make sure we have all sigs cached.  TODO: This is going to
-     require some architectural re-thinking, as it is agonizingly slow.
-     Perhaps combine this with reset_trust_records(), or only check
-     the caches on keys that are actually involved in the web of
-     trust. */
-  keydb_rebuild_caches (ctrl, 0);
+  tdbindex_t index = NULL;
+  char *indexname;
+  byte state[KEYDB_STATE_LEN];
+  int have_state;
+  gpg_error_t err;
 
   kdb = keydb_new ();
   if (!kdb)
@@ -2073,6 +2137,48 @@ validate_keys (ctrl_t ctrl, int interactive)
        trusted keys.  */
     goto leave;
 
+  /* Get the index of the certifications.  Only the keys listed there
+   * as certified by a key of the current level need to be looked at.
+   * We do not rebuild the signature caches of all keys anymore; only
+   * the keys which are actually involved in the web of trust are
+   * read.  */
+  indexname = tdbindex_fname (tdbio_get_dbname ());
+  have_state = !keydb_get_state (kdb, state);
+  if (have_state)
+    {
+      err = tdbindex_load (indexname, &index);
+      if (err && gpg_err_code (err) != GPG_ERR_ENOENT)
+        log_info (_("error reading '%s': %s\n"),
+                  indexname, gpg_strerror (err));
+      else if (!err && !tdbindex_matches (index, state))
+        {
+          /* The keydb has been changed without updating the index.  */
+          if (opt.verbose)
+            log_info ("certification index '%s' is outdated\n", indexname);
+          tdbindex_release (index);
+          index = NULL;
+        }
+    }
+  err = 0;
+  if (!index)
+    {
+      if (!opt.quiet)
+        log_info (_("building the certification index\n"));
+      rc = build_tdbindex (kdb, &index);
+      if (rc)
+        {
+          xfree (indexname);
+          goto leave;
+        }
+      if (have_state && !opt.dry_run)
+        err = tdbindex_write (index, indexname, state);
+    }
+  else if (tdbindex_need_rewrite (index) && !opt.dry_run)
+    err = tdbindex_write (index, indexname, state);
+  if (err)
+    log_info (_("error writing '%s': %s\n"), indexname, gpg_strerror (err));
+  xfree (indexname);
+
   klist = utk_list;
 
   if (!opt.quiet)
@@ -2144,7 +2250,7 @@ validate_keys (ctrl_t ctrl, int interactive)
         }
 
       /* Find all keys which are signed by a key in kdlist */
-      keys = validate_key_list (ctrl, kdb, full_trust, klist,
+      keys = validate_key_list (ctrl, kdb, index, full_trust, klist,
 				start_time, &next_expire);
       if (!keys)
         {
@@ -2222,6 +2328,7 @@ validate_keys (ctrl_t ctrl, int interactive)
 
  leave:
   keydb_release (kdb);
+  tdbindex_release (index);
   release_key_array (keys);
   if (klist != utk_list)
     release_key_items (klist);
@@ -91,6 +91,8 @@ gpg_error_t init_trustdb (ctrl_t ctrl, int no_create);
 int have_trustdb (ctrl_t ctrl);
 void tdb_check_trustdb_stale (ctrl_t ctrl);
 void tdb_revalidation_mark (ctrl_t ctrl);
+void tdb_notice_key_changed (ctrl_t ctrl, kbnode_t kb,
+                             const byte *oldstate, const byte *newstate);
 int trustdb_pending_check(void);
 void tdb_check_or_update (ctrl_t ctrl);
 
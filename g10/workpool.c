@@ -0,0 +1,250 @@
+/* workpool.c - A pool of worker threads for gpg
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* gpg is a single threaded program and most of its code must not be
+ * used by more than one thread.  This module provides a small pool
+ * of worker threads for CPU bound jobs which neither print anything
+ * nor touch any global state; for example the verification of
+ * self-signatures of keyblocks read ahead by the import code (see
+ * check_self_sigs_ahead) or the encryption of AEAD chunks.  Such
+ * jobs may run in parallel to the main thread.
+ *
+ * nPth allows only one thread at a time to run in its protected
+ * state.  To get real parallelism the main thread leaves the
+ * protected state right after initialization and enters it only to
+ * access the queue.  The workers leave it while running a job.  The
+ * state of the pool is protected by a mutex.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <npth.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/sysutils.h"
+#include "packet.h"
+#include "main.h"
+
+
+/* The maximum number of worker threads.  */
+#define MAX_WORKERS 16
+
+
+/* An object for one job in the queue.  */
+struct workpool_job_s
+{
+  struct workpool_job_s *next;
+  workpool_func_t func;  /* The function to run.  */
+  void *arg;             /* Its argument.  */
+  int state;             /* 0 = queued, 1 = running, 2 = done.  */
+};
+typedef struct workpool_job_s *job_t;
+
+
+/* The number of worker threads or 0 if the pool has not been
+ * started or could not be started.  */
+static int nworkers;
+
+/* Set if starting the pool failed.  */
+static int pool_failed;
+
+/* All jobs in the order they have been submitted.  */
+static job_t jobs;
+
+/* The mutex for the above list and the condition variables.  */
+static npth_mutex_t pool_lock;
+static npth_cond_t work_available;
+static npth_cond_t work_done;
+
+
+/* Lock the pool.  This is called by the main thread.  */
+static void
+lock_pool (void)
+{
+  int res;
+
+  npth_protect ();
+  res = npth_mutex_lock (&pool_lock);
+  if (res)
+    log_fatal ("failed to acquire work pool lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Unlock the pool.  This is called by the main thread.  */
+static void
+unlock_pool (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&pool_lock);
+  if (res)
+    log_fatal ("failed to release work pool lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  npth_unprotect ();
+}
+
+
+/* The thread function of the workers.  */
+static void *
+worker_thread (void *arg)
+{
+  job_t job;
+
+  (void)arg;
+
+  npth_mutex_lock (&pool_lock);
+  for (;;)
+    {
+      for (job = jobs; job; job = job->next)
+        if (!job->state)
+          break;
+      if (!job)
+        {
+          npth_cond_wait (&work_available, &pool_lock);
+          continue;
+        }
+
+      job->state = 1;
+      npth_mutex_unlock (&pool_lock);
+      npth_unprotect ();
+      job->func (job->arg);
+      npth_protect ();
+      npth_mutex_lock (&pool_lock);
+      job->state = 2;
+      npth_cond_broadcast (&work_done);
+    }
+
+  return NULL;  /*NOTREACHED*/
+}
+
+
+/* Start the pool if this has not yet been done.  Returns the number
+ * of worker threads; 0 if the pool is not available.  */
+int
+workpool_start (void)
+{
+  npth_attr_t tattr;
+  npth_t thread;
+  unsigned int ncpus;
+  int res;
+
+  if (nworkers || pool_failed)
+    return nworkers;
+
+  /* Using only one worker would not give us anything.  */
+  ncpus = gnupg_get_ncpus ();
+  if (ncpus < 2)
+    {
+      pool_failed = 1;
+      return 0;
+    }
+
+  npth_init ();
+  if (npth_mutex_init (&pool_lock, NULL)
+      || npth_cond_init (&work_available, NULL)
+      || npth_cond_init (&work_done, NULL)
+      || npth_attr_init (&tattr))
+    {
+      log_error ("error initializing the work pool\n");
+      pool_failed = 1;
+      npth_unprotect ();
+      return 0;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+
+  for (; nworkers < ncpus && nworkers < MAX_WORKERS; nworkers++)
+    {
+      res = npth_create (&thread, &tattr, worker_thread, NULL);
+      if (res)
+        {
+          if (!nworkers)
+            {
+              log_error ("error spawning pool worker: %s\n",
+                         gpg_strerror (gpg_error_from_errno (res)));
+              pool_failed = 1;
+            }
+          break;
+        }
+    }
+  npth_attr_destroy (&tattr);
+
+  /* From now on the main thread runs unprotected.  */
+  npth_unprotect ();
+  return nworkers;
+}
+
+
+/* Queue FUNC for being called with ARG by a worker thread.  FUNC
+ * must neither print anything nor access any global state.  Returns
+ * a handle for the job or NULL if the pool is not available.  In the
+ * latter case the caller needs to call FUNC itself.  A non-NULL
+ * handle must be passed to workpool_wait later.  */
+workpool_job_t
+workpool_submit (workpool_func_t func, void *arg)
+{
+  job_t job, *jobp;
+
+  if (!nworkers)
+    return NULL;
+
+  job = xtrycalloc (1, sizeof *job);
+  if (!job)
+    return NULL;
+  job->func = func;
+  job->arg = arg;
+
+  lock_pool ();
+  for (jobp = &jobs; *jobp; jobp = &(*jobp)->next)
+    ;
+  *jobp = job;
+  npth_cond_signal (&work_available);
+  unlock_pool ();
+  return job;
+}
+
+
+/* Wait until JOB has been finished and release it.  If no worker has
+ * yet picked up the job it is removed from the queue; if RUN is set
+ * it is then run by the calling thread.  JOB may be NULL.  */
+void
+workpool_wait (workpool_job_t job, int run)
+{
+  job_t *jobp;
+
+  if (!job)
+    return;
+
+  lock_pool ();
+  for (jobp = &jobs; *jobp && *jobp != job; jobp = &(*jobp)->next)
+    ;
+  log_assert (*jobp);
+  while (job->state == 1)
+    npth_cond_wait (&work_done, &pool_lock);
+  *jobp = job->next;
+  unlock_pool ();
+
+  if (!job->state && run)
+    job->func (job->arg);
+  xfree (job);
+}
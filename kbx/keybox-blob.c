@@ -46,7 +46,9 @@
           bit 0 - RFU
           bit 1 - Is being or has been used for OpenPGP blobs
    - b4   Magic 'KBXf'
-   - u32  RFU
+   - u32  Number of bytes in blobs marked as deleted since the last
+          maintenance run.  This is only a hint for keybox_compress;
+          it is 0 in files written before GnuPG 2.3.
    - u32  file_created_at
    - u32  last_maintenance_run
    - u32  RFU
@@ -79,6 +81,10 @@
       - u16  Key flags
              bit 0 = qualified signature (not yet implemented}
       - u16  RFU
+      - b20  The keygrip of the key or all zeroes if it could not be
+             computed.  Only present if the size of the key
+             information structure is at least 48; blobs written
+             before GnuPG 2.3 do not have it.
       - bN   Optional filler up to the specified length of this
              structure.
    - u16  Size of the serial number (may be zero)
@@ -181,6 +187,7 @@ struct keyboxblob_key {
   u32    off_kid;
   ulong  off_kid_addr;
   u16    flags;
+  char   grip[20];  /* All zeroes if not known.  */
 };
 struct keyboxblob_uid {
   u32    off;
@@ -208,6 +215,7 @@ struct keyboxblob {
   byte *blob;
   size_t bloblen;
   off_t fileoffset;
+  int mapped;    /* BLOB points into a mapped file and is not owned.  */
 
   /* stuff used only by keybox_create_blob */
   unsigned char *serialbuf;
@@ -395,6 +403,7 @@ pgp_create_key_part_single (KEYBOXBLOB blob, int n,
   else
     blob->keys[n].off_kid = 0; /* Will be fixed up later */
   blob->keys[n].flags = 0;
+  memcpy (blob->keys[n].grip, kinfo->grip, 20);
   return 0;
 }
 
@@ -549,7 +558,7 @@ create_blob_header (KEYBOXBLOB blob, int blobtype, int as_ephemeral)
   put32 ( a, 0 ); /* length of the raw data, needs fixup */
 
   put16 ( a, blob->nkeys );
-  put16 ( a, 20 + 4 + 2 + 2 );  /* size of key info */
+  put16 ( a, 20 + 4 + 2 + 2 + 20 );  /* size of key info */
   for ( i=0; i < blob->nkeys; i++ )
     {
       put_membuf (a, blob->keys[i].fpr, 20);
@@ -557,6 +566,7 @@ create_blob_header (KEYBOXBLOB blob, int blobtype, int as_ephemeral)
       put32 ( a, 0 ); /* offset to keyid, fixed up later */
       put16 ( a, blob->keys[i].flags );
       put16 ( a, 0 ); /* reserved */
+      put_membuf (a, blob->keys[i].grip, 20);
     }
 
   put16 (a, blob->seriallen); /*fixme: check that it fits into 16 bits*/
@@ -826,6 +836,36 @@ x509_email_kludge (const char *name)
 
 
 
+/* Compute the keygrip of the public key in CERT and store it at the
+   20 byte buffer GRIP.  */
+gpg_error_t
+_keybox_x509_keygrip (ksba_cert_t cert, unsigned char *grip)
+{
+  gpg_error_t err;
+  ksba_sexp_t p;
+  gcry_sexp_t s_pkey;
+  size_t n;
+
+  p = ksba_cert_get_public_key (cert);
+  if (!p)
+    return gpg_error (GPG_ERR_NO_PUBKEY);
+  n = gcry_sexp_canon_len (p, 0, NULL, NULL);
+  if (!n)
+    {
+      xfree (p);
+      return gpg_error (GPG_ERR_INV_SEXP);
+    }
+  err = gcry_sexp_sscan (&s_pkey, NULL, (char*)p, n);
+  xfree (p);
+  if (err)
+    return err;
+  if (!gcry_pk_get_keygrip (s_pkey, grip))
+    err = gpg_error (GPG_ERR_PUBKEY_ALGO); /* Can't calculate keygrip. */
+  gcry_sexp_release (s_pkey);
+  return err;
+}
+
+
 /* Note: We should move calculation of the digest into libksba and
    remove that parameter */
 int
@@ -923,6 +963,8 @@ _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
   memcpy (blob->keys[0].fpr, sha1_digest, 20);
   blob->keys[0].off_kid = 0; /* We don't have keyids */
   blob->keys[0].flags = 0;
+  if (_keybox_x509_keygrip (cert, blob->keys[0].grip))
+    memset (blob->keys[0].grip, 0, 20);
 
   /* issuer and subject names */
   for (i=0; i < blob->nuids; i++)
@@ -1000,6 +1042,54 @@ _keybox_new_blob (KEYBOXBLOB *r_blob,
 }
 
 
+/* Make *R_BLOB refer to the IMAGE of length IMAGELEN at file offset
+   OFF of a mapped keybox.  The image is not copied and must stay
+   valid as long as the blob is used.  If *R_BLOB is not NULL it must
+   be a blob created by this function and is reused; this way a scan
+   over a mapped keybox does not need an allocation per blob.  */
+int
+_keybox_new_mapped_blob (KEYBOXBLOB *r_blob,
+                         const unsigned char *image, size_t imagelen,
+                         off_t off)
+{
+  KEYBOXBLOB blob = *r_blob;
+
+  if (!blob)
+    {
+      blob = xtrycalloc (1, sizeof *blob);
+      if (!blob)
+        return gpg_error_from_syserror ();
+      blob->mapped = 1;
+      *r_blob = blob;
+    }
+  assert (blob->mapped);
+
+  blob->blob = (byte*)image;
+  blob->bloblen = imagelen;
+  blob->fileoffset = off;
+  return 0;
+}
+
+
+/* Store a copy of BLOB which owns its image at R_BLOB.  */
+int
+_keybox_copy_blob (KEYBOXBLOB blob, KEYBOXBLOB *r_blob)
+{
+  unsigned char *image;
+  int rc;
+
+  *r_blob = NULL;
+  image = xtrymalloc (blob->bloblen);
+  if (!image)
+    return gpg_error_from_syserror ();
+  memcpy (image, blob->blob, blob->bloblen);
+  rc = _keybox_new_blob (r_blob, image, blob->bloblen, blob->fileoffset);
+  if (rc)
+    xfree (image);
+  return rc;
+}
+
+
 void
 _keybox_release_blob (KEYBOXBLOB blob)
 {
@@ -1017,7 +1107,8 @@ _keybox_release_blob (KEYBOXBLOB blob)
     xfree (blob->uids[i].name);
   xfree (blob->uids );
   xfree (blob->sigs );
-  xfree (blob->blob );
+  if (!blob->mapped)
+    xfree (blob->blob );
   xfree (blob );
 }
 
@@ -1037,6 +1128,22 @@ _keybox_get_blob_fileoffset (KEYBOXBLOB blob)
 }
 
 
+/* Return true if the SHA-1 checksum at the end of the blob IMAGE of
+   length IMAGELEN is valid.  Note that blobs written by GnuPG before
+   2.1 carry an MD5 checksum and that older versions did not update
+   the checksum in keybox_set_flags.  */
+int
+_keybox_blob_checksum_ok (const unsigned char *image, size_t imagelen)
+{
+  unsigned char digest[20];
+
+  if (imagelen < 5 + 20)
+    return 0;
+  gcry_md_hash_buffer (GCRY_MD_SHA1, digest, image, imagelen - 20);
+  return !memcmp (image + imagelen - 20, digest, 20);
+}
+
+
 
 void
 _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp)
@@ -1051,6 +1158,9 @@ _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp)
       blob->blob[20+2] = (val >>  8);
       blob->blob[20+3] = (val      );
 
+      /* A maintenance run removes all deleted blobs.  */
+      memset (blob->blob + 12, 0, 4);
+
       if (for_openpgp)
         blob->blob[7] |= 0x02;  /* OpenPGP data may be available.  */
     }
@@ -38,6 +38,7 @@
 
 
 typedef struct keyboxblob *KEYBOXBLOB;
+typedef struct keybox_index_s *keybox_index_t;
 
 
 typedef struct keybox_name *KB_NAME;
@@ -65,6 +66,16 @@ struct keybox_name
   /* Not yet used.  */
   int did_full_scan;
 
+  /* The sidecar index for fingerprint and key ID lookups or NULL if
+     not yet loaded.  See keybox-index.c.  */
+  keybox_index_t index;
+
+  /* True while a transaction started by keybox_begin_transaction is
+     active.  TXN_JOURNAL is then the open journal file.  See
+     keybox-update.c.  */
+  int in_transaction;
+  FILE *txn_journal;
+
   /* The name of the resource file. */
   char fname[1];
 };
@@ -85,6 +96,12 @@ struct keybox_handle {
   int error;
   int ephemeral;
   int for_openpgp;        /* Used by gpg.  */
+  /* If not NULL the file opened at FP mapped into memory with a
+     length of MAPLEN.  MAP_BLOB is the blob object reused for all
+     blobs read from the mapping.  See keybox-file.c.  */
+  const unsigned char *map;
+  size_t maplen;
+  KEYBOXBLOB map_blob;
   struct keybox_found_s found;
   struct keybox_found_s saved_found;
   struct {
@@ -102,6 +119,7 @@ struct _keybox_openpgp_key_info
   unsigned char keyid[8];
   int fprlen;  /* Either 16 or 20 */
   unsigned char fpr[20];
+  unsigned char grip[20];  /* All zeroes if not computable.  */
 };
 
 struct _keybox_openpgp_uid_info
@@ -150,14 +168,20 @@ gpg_error_t _keybox_create_openpgp_blob (KEYBOXBLOB *r_blob,
 #ifdef KEYBOX_WITH_X509
 int _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
                               unsigned char *sha1_digest, int as_ephemeral);
+gpg_error_t _keybox_x509_keygrip (ksba_cert_t cert, unsigned char *grip);
 #endif /*KEYBOX_WITH_X509*/
 
 int  _keybox_new_blob (KEYBOXBLOB *r_blob,
                        unsigned char *image, size_t imagelen,
                        off_t off);
+int  _keybox_new_mapped_blob (KEYBOXBLOB *r_blob,
+                              const unsigned char *image, size_t imagelen,
+                              off_t off);
+int  _keybox_copy_blob (KEYBOXBLOB blob, KEYBOXBLOB *r_blob);
 void _keybox_release_blob (KEYBOXBLOB blob);
 const unsigned char *_keybox_get_blob_image (KEYBOXBLOB blob, size_t *n);
 off_t _keybox_get_blob_fileoffset (KEYBOXBLOB blob);
+int  _keybox_blob_checksum_ok (const unsigned char *image, size_t imagelen);
 void _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp);
 
 /*-- keybox-openpgp.c --*/
@@ -169,8 +193,26 @@ void _keybox_destroy_openpgp_info (keybox_openpgp_info_t info);
 
 /*-- keybox-file.c --*/
 int _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted);
+void _keybox_map_file (KEYBOX_HANDLE hd);
+void _keybox_unmap_file (KEYBOX_HANDLE hd);
+int _keybox_read_mapped_blob (KEYBOX_HANDLE hd, off_t *r_off,
+                              KEYBOXBLOB *r_blob);
 int _keybox_write_blob (KEYBOXBLOB blob, FILE *fp);
 
+/*-- keybox-index.c --*/
+void _keybox_index_release (keybox_index_t idx);
+void _keybox_index_invalidate (KB_NAME kb);
+int _keybox_index_desc_p (KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                          int *r_grips);
+int _keybox_index_usable (KEYBOX_HANDLE hd, int for_grips);
+off_t _keybox_index_next (keybox_index_t idx,
+                          KEYBOX_SEARCH_DESC *desc, size_t ndesc, off_t pos);
+int _keybox_index_begin_update (KB_NAME kb);
+void _keybox_index_end_update (KB_NAME kb, int in_sync,
+                               off_t deloff, KEYBOXBLOB newblob,
+                               off_t newoff);
+void _keybox_index_flush (KB_NAME kb);
+
 /*-- keybox-search.c --*/
 gpg_err_code_t _keybox_get_flag_location (const unsigned char *buffer,
                                           size_t length,
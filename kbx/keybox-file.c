@@ -23,8 +23,15 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_MMAP && !defined(HAVE_W32_SYSTEM)
+# include <sys/mman.h>
+# define USE_MMAP 1
+#endif
 
 #include "keybox-defs.h"
+#include "../common/host2net.h"
 
 
 #define IMAGELEN_LIMIT (5*1024*1024)
@@ -46,7 +53,9 @@ ftello (FILE *stream)
 
 
 /* Read a block at the current position and return it in R_BLOB.
-   R_BLOB may be NULL to simply skip the current block.  */
+   R_BLOB may be NULL to simply skip the current block.  A block at
+   the end of the file which has not been written completely is
+   taken as the end of the file.  */
 int
 _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
 {
@@ -71,10 +80,8 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
       || (c4 = getc (fp)) == EOF
       || (type = getc (fp)) == EOF)
     {
-      if ( c1 == EOF && !ferror (fp) )
-        return -1; /* eof */
       if (!ferror (fp))
-        return gpg_error (GPG_ERR_TOO_SHORT);
+        return -1; /* eof or a blob being appended */
       return gpg_error_from_syserror ();
     }
 
@@ -116,7 +123,8 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
   image[0] = c1; image[1] = c2; image[2] = c3; image[3] = c4; image[4] = type;
   if (fread (image+5, imagelen-5, 1, fp) != 1)
     {
-      gpg_error_t tmperr = gpg_error_from_syserror ();
+      /* At the end of the file this is a blob being appended.  */
+      gpg_error_t tmperr = ferror (fp)? gpg_error_from_syserror () : -1;
       xfree (image);
       return tmperr;
     }
@@ -128,6 +136,109 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
 }
 
 
+/* Map the file opened at HD->FP into memory so that a search can
+   read the blobs without a system call and an allocation per blob.
+   An existing mapping is replaced if the size of the file changed.
+   Failing to map the file is not an error; the search then falls
+   back to _keybox_read_blob.  Readers do not take the keybox lock;
+   thus blobs appended or changed in place by another process show up
+   in the shared mapping while we read it.  A blob at the end which
+   has not yet been written completely is taken as the end of the
+   file and keybox_search checks the found blobs by their checksum.  */
+void
+_keybox_map_file (KEYBOX_HANDLE hd)
+{
+#ifdef USE_MMAP
+  struct stat st;
+  size_t len;
+  void *map;
+
+  if (!hd->fp || fstat (fileno (hd->fp), &st))
+    {
+      _keybox_unmap_file (hd);
+      return;
+    }
+  if (hd->map && (uint64_t)hd->maplen == (uint64_t)st.st_size)
+    return;  /* Still up to date.  */
+  _keybox_unmap_file (hd);
+
+  len = (size_t)st.st_size;
+  if (!len || (off_t)len != st.st_size)
+    return;  /* Empty or too large to map.  */
+
+  map = mmap (NULL, len, PROT_READ, MAP_SHARED, fileno (hd->fp), 0);
+  if (map == MAP_FAILED)
+    return;
+# ifdef MADV_SEQUENTIAL
+  madvise (map, len, MADV_SEQUENTIAL);
+# endif
+  hd->map = map;
+  hd->maplen = len;
+#else /*!USE_MMAP*/
+  (void)hd;
+#endif /*!USE_MMAP*/
+}
+
+
+/* Release the mapping of HD.  */
+void
+_keybox_unmap_file (KEYBOX_HANDLE hd)
+{
+  _keybox_release_blob (hd->map_blob);
+  hd->map_blob = NULL;
+#ifdef USE_MMAP
+  if (hd->map)
+    munmap ((void*)hd->map, hd->maplen);
+#endif
+  hd->map = NULL;
+  hd->maplen = 0;
+}
+
+
+/* This is the same as _keybox_read_blob but reads the blob at the
+   file offset *R_OFF from the mapping of HD.  *R_OFF is advanced
+   past the blob.  The blob stored at R_BLOB is HD->MAP_BLOB and only
+   valid until the next call; use _keybox_copy_blob to keep it.  */
+int
+_keybox_read_mapped_blob (KEYBOX_HANDLE hd, off_t *r_off, KEYBOXBLOB *r_blob)
+{
+  const unsigned char *image;
+  size_t imagelen, rest;
+  off_t off;
+  int rc;
+
+  *r_blob = NULL;
+  for (;;)
+    {
+      off = *r_off;
+      if (off < 0 || (uint64_t)off > (uint64_t)hd->maplen)
+        return gpg_error (GPG_ERR_INV_VALUE);
+      rest = hd->maplen - off;
+      if (rest < 5)
+        return -1; /* eof or a blob being appended */
+
+      image = hd->map + off;
+      imagelen = buf32_to_size_t (image);
+      if (imagelen < 5)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      if (imagelen > rest)
+        return -1; /* A blob being appended.  */
+      *r_off = off + imagelen;
+
+      if (!image[4])
+        continue;  /* Skip empty blobs.  */
+      if (imagelen > IMAGELEN_LIMIT) /* Sanity check. */
+        return gpg_error (GPG_ERR_TOO_LARGE);
+      break;
+    }
+
+  rc = _keybox_new_mapped_blob (&hd->map_blob, image, imagelen, off);
+  if (!rc)
+    *r_blob = hd->map_blob;
+  return rc;
+}
+
+
 /* Write the block to the current file position */
 int
 _keybox_write_blob (KEYBOXBLOB blob, FILE *fp)
@@ -0,0 +1,894 @@
+/* keybox-index.c - Sidecar index for keybox files
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+* The keybox index format
+
+   To avoid a linear scan of the keybox for the common lookups by
+   fingerprint, key ID or keygrip, we keep a sorted table of all
+   fingerprints and keygrips along with the file offset of the blob
+   holding them.  The table is
+   stored in a file with the same name as the keybox plus the suffix
+   ".idx".  The index is only a cache: it records the size, the
+   modification time and the inode of the keybox it describes and is
+   ignored if these do not match the keybox.  The nanoseconds of the
+   modification time are included so that a rewrite of the keybox
+   with the same size in the same second by a writer not knowing
+   about the index is detected.  All integers are stored in network
+   byte order.
+
+   - b4   Magic 'KBXi'
+   - byte Version number (3)
+   - byte Index flags
+          bit 0 = All X.509 blobs have stored keygrips
+   - b2   RFU
+   - u64  Size of the keybox file
+   - u64  Modification time of the keybox file
+   - u64  Inode number of the keybox file (0 if not known)
+   - u32  [NENTRIES] Number of entries
+   - u32  Nanoseconds of the modification time (0 if not known)
+   - NENTRIES times, sorted as described below:
+      - byte Entry type
+             1 = Fingerprint as stored in the blob's key information
+             2 = Keygrip as stored in the blob's key information
+      - b3   RFU
+      - b20  The key
+      - u64  File offset of the blob
+
+   The entries are sorted by type and then by the bytes 16 to 19, 12
+   to 15 and 0 to 11 of the key.  For fingerprints this puts the
+   short and the long key ID first so that a binary search on a prefix
+   of the sort key can be used for all three lookup modes.
+
+   Blobs written by older versions do not store keygrips.  For
+   OpenPGP blobs a keygrip search never matched them anyway, but
+   X.509 blobs are then matched by parsing the certificate.  Thus the
+   index can only be used for keygrip searches if flag bit 0 is set.
+
+*/
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "keybox-defs.h"
+#include "../common/sysutils.h"
+#include "../common/host2net.h"
+
+
+#define INDEX_MAGIC     "KBXi"
+#define INDEX_VERSION   3
+#define INDEX_HDRLEN    40
+#define INDEX_ENTRYLEN  32
+
+/* The entry types.  */
+#define INDEX_TYPE_FPR  1
+#define INDEX_TYPE_GRIP 2
+
+/* The index flags.  */
+#define INDEX_FLAG_X509_GRIPS 1
+
+/* The maximum number of entries added by updates which are kept
+   unsorted at the end of the table before they are merged.  */
+#define INDEX_MAX_UNSORTED 1024
+
+
+#if !defined(HAVE_FTELLO) && !defined(ftello)
+static off_t
+ftello (FILE *stream)
+{
+  long int off;
+
+  off = ftell (stream);
+  if (off == -1)
+    return (off_t)-1;
+  return off;
+}
+#endif /* !defined(HAVE_FTELLO) && !defined(ftello) */
+
+
+
+struct index_entry_s
+{
+  unsigned char type;   /* One of the INDEX_TYPE_ constants.  */
+  unsigned char key[20];
+  off_t off;            /* File offset of the blob.  */
+};
+
+struct keybox_index_s
+{
+  /* The stamp of the keybox file described by this index.  */
+  uint64_t kbx_size;
+  uint64_t kbx_mtime;
+  u32 kbx_mtime_nsec;
+  uint64_t kbx_ino;
+
+  /* The INDEX_FLAG_ values.  */
+  unsigned int flags;
+
+  /* The table with NENTRIES used out of ALLOCATED entries.  The
+     first NSORTED entries are sorted; the others have been added by
+     updates and are searched linearly.  */
+  size_t nentries;
+  size_t nsorted;
+  size_t allocated;
+  struct index_entry_s *entries;
+};
+
+
+static inline void
+put32 (unsigned char *p, u32 a)
+{
+  p[0] = a >> 24;
+  p[1] = a >> 16;
+  p[2] = a >>  8;
+  p[3] = a;
+}
+
+static inline void
+put64 (unsigned char *p, uint64_t a)
+{
+  put32 (p, a >> 32);
+  put32 (p+4, a);
+}
+
+static inline uint64_t
+get64 (const unsigned char *p)
+{
+  return (((uint64_t)buf32_to_u32 (p)) << 32) | buf32_to_u32 (p+4);
+}
+
+
+/* Return the malloced name of the index file for KB or NULL on
+ * error.  */
+static char *
+index_fname (KB_NAME kb)
+{
+  return strconcat (kb->fname, EXTSEP_S "idx", NULL);
+}
+
+
+/* Compare the search key KEY of TYPE with the entry E.  Only the
+ * first KEYLEN bytes in sort order are considered; that is 4 for a
+ * short key ID, 8 for a long key ID and 20 for the entire key.  */
+static int
+cmp_key (int type, const unsigned char *key, int keylen,
+         const struct index_entry_s *e)
+{
+  int c;
+
+  if (type != e->type)
+    return type < e->type? -1 : 1;
+  c = memcmp (key+16, e->key+16, 4);
+  if (c || keylen <= 4)
+    return c;
+  c = memcmp (key+12, e->key+12, 4);
+  if (c || keylen <= 8)
+    return c;
+  return memcmp (key, e->key, 12);
+}
+
+
+/* The qsort compare function for index entries.  */
+static int
+cmp_entries (const void *a_arg, const void *b_arg)
+{
+  const struct index_entry_s *a = a_arg;
+  const struct index_entry_s *b = b_arg;
+  int c;
+
+  c = cmp_key (a->type, a->key, 20, b);
+  if (!c)
+    c = a->off < b->off? -1 : a->off > b->off? 1 : 0;
+  return c;
+}
+
+
+/* Return the position of the first entry in IDX which is not less
+ * than KEY.  */
+static size_t
+lower_bound (keybox_index_t idx, int type,
+             const unsigned char *key, int keylen)
+{
+  size_t lo, hi, mid;
+
+  lo = 0;
+  hi = idx->nsorted;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (cmp_key (type, key, keylen, idx->entries + mid) > 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+
+/* Return the nanoseconds of the modification time in ST or 0 if the
+ * system does not provide them.  */
+static u32
+mtime_nsec (const struct stat *st)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+  return st->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+  return st->st_mtimespec.tv_nsec;
+#else
+  (void)st;
+  return 0;
+#endif
+}
+
+
+static void
+set_stamp (keybox_index_t idx, const struct stat *st)
+{
+  idx->kbx_size  = st->st_size;
+  idx->kbx_mtime = st->st_mtime;
+  idx->kbx_mtime_nsec = mtime_nsec (st);
+  idx->kbx_ino   = st->st_ino;
+}
+
+
+/* Return true if IDX describes the keybox file with the status ST.  */
+static int
+stamp_matches (keybox_index_t idx, const struct stat *st)
+{
+  return (idx
+          && idx->kbx_size  == (uint64_t)st->st_size
+          && idx->kbx_mtime == (uint64_t)st->st_mtime
+          && idx->kbx_mtime_nsec == mtime_nsec (st)
+          && idx->kbx_ino   == (uint64_t)st->st_ino);
+}
+
+
+/* Make sure that IDX has space for N more entries.  */
+static gpg_error_t
+reserve_entries (keybox_index_t idx, size_t n)
+{
+  struct index_entry_s *tmp;
+  size_t newsize;
+
+  if (idx->nentries + n <= idx->allocated)
+    return 0;
+
+  newsize = idx->allocated? idx->allocated : 1024;
+  while (newsize < idx->nentries + n)
+    newsize *= 2;
+  tmp = xtryrealloc (idx->entries, newsize * sizeof *tmp);
+  if (!tmp)
+    return gpg_error_from_syserror ();
+  idx->entries = tmp;
+  idx->allocated = newsize;
+  return 0;
+}
+
+
+/* Merge the unsorted entries at the end of the table of IDX into the
+ * sorted part.  */
+static void
+merge_unsorted (keybox_index_t idx)
+{
+  struct index_entry_s *tail;
+  size_t ntail, i, j, k;
+
+  ntail = idx->nentries - idx->nsorted;
+  if (!ntail)
+    return;
+
+  tail = xtrymalloc (ntail * sizeof *tail);
+  if (!tail)
+    {
+      /* Sorting the entire table does not need extra memory.  */
+      qsort (idx->entries, idx->nentries, sizeof *idx->entries, cmp_entries);
+      idx->nsorted = idx->nentries;
+      return;
+    }
+  memcpy (tail, idx->entries + idx->nsorted, ntail * sizeof *tail);
+  qsort (tail, ntail, sizeof *tail, cmp_entries);
+
+  i = idx->nsorted;
+  j = ntail;
+  k = idx->nentries;
+  while (j)
+    {
+      if (i && cmp_entries (idx->entries + i - 1, tail + j - 1) > 0)
+        idx->entries[--k] = idx->entries[--i];
+      else
+        idx->entries[--k] = tail[--j];
+    }
+  xfree (tail);
+  idx->nsorted = idx->nentries;
+}
+
+
+/* Add the entries for the blob BUFFER,LENGTH located at file offset
+ * OFF to IDX.  The entries are appended to the table.  If UPDATE is
+ * set they are kept in the unsorted part of the table, otherwise the
+ * caller needs to sort the table.  */
+static gpg_error_t
+add_blob_entries (keybox_index_t idx, const unsigned char *buffer,
+                  size_t length, off_t off, int update)
+{
+  gpg_error_t err;
+  size_t nkeys, keyinfolen, n;
+  const unsigned char *key;
+  static const unsigned char nogrip[20];
+  int type;
+  struct index_entry_s *e;
+
+  if (length < 40)
+    return 0; /* Blob too short - nothing to index.  */
+  if (buffer[4] != KEYBOX_BLOBTYPE_PGP && buffer[4] != KEYBOX_BLOBTYPE_X509)
+    return 0;
+
+  nkeys = buf16_to_ulong (buffer + 16);
+  keyinfolen = buf16_to_ulong (buffer + 18);
+  if (keyinfolen < 28
+      || 20 + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
+    return 0; /* Invalid blob - a search won't find it either.  */
+
+  if (keyinfolen < 48 && buffer[4] == KEYBOX_BLOBTYPE_X509)
+    idx->flags &= ~INDEX_FLAG_X509_GRIPS;
+
+  err = reserve_entries (idx, 2*nkeys);
+  if (err)
+    return err;
+
+  for (n=0; n < 2*nkeys; n++)
+    {
+      key = buffer + 20 + (n/2)*keyinfolen;
+      if (!(n & 1))
+        type = INDEX_TYPE_FPR;
+      else if (keyinfolen >= 48 && memcmp (key + 28, nogrip, 20))
+        {
+          type = INDEX_TYPE_GRIP;
+          key += 28;
+        }
+      else
+        continue;
+
+      e = idx->entries + idx->nentries;
+      e->type = type;
+      memcpy (e->key, key, 20);
+      e->off = off;
+      idx->nentries++;
+    }
+
+  if (update && idx->nentries - idx->nsorted > INDEX_MAX_UNSORTED)
+    merge_unsorted (idx);
+
+  return 0;
+}
+
+
+/* Build a new index by scanning the keybox opened at FP which has
+ * the file status ST.  The file position of FP is restored.  */
+static gpg_error_t
+build_index (FILE *fp, const struct stat *st, keybox_index_t *r_idx)
+{
+  gpg_error_t err;
+  off_t savepos;
+  keybox_index_t idx;
+  KEYBOXBLOB blob;
+  const unsigned char *buffer;
+  size_t length;
+
+  *r_idx = NULL;
+
+  savepos = ftello (fp);
+  if (savepos == (off_t)-1)
+    return gpg_error_from_syserror ();
+  /* The file has been changed; make sure that stdio does not return
+   * data buffered before the change.  */
+  if (fflush (fp) || fseeko (fp, 0, SEEK_SET))
+    return gpg_error_from_syserror ();
+
+  idx = xtrycalloc (1, sizeof *idx);
+  if (!idx)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  set_stamp (idx, st);
+  idx->flags = INDEX_FLAG_X509_GRIPS;
+
+  for (;;)
+    {
+      err = _keybox_read_blob (&blob, fp, NULL);
+      if (err == -1)
+        {
+          err = 0;
+          break;
+        }
+      if (gpg_err_code (err) == GPG_ERR_TOO_LARGE
+          && gpg_err_source (err) == GPG_ERR_SOURCE_KEYBOX)
+        continue;  /* The search skips them as well.  */
+      if (err)
+        break;
+
+      buffer = _keybox_get_blob_image (blob, &length);
+      err = add_blob_entries (idx, buffer, length,
+                              _keybox_get_blob_fileoffset (blob), 0);
+      _keybox_release_blob (blob);
+      if (err)
+        break;
+    }
+
+  if (!err)
+    {
+      qsort (idx->entries, idx->nentries, sizeof *idx->entries, cmp_entries);
+      idx->nsorted = idx->nentries;
+    }
+
+ leave:
+  if (fseeko (fp, savepos, SEEK_SET) && !err)
+    err = gpg_error_from_syserror ();
+  if (err)
+    _keybox_index_release (idx);
+  else
+    *r_idx = idx;
+  return err;
+}
+
+
+/* Read the index file of KB.  Returns NULL if there is no index file
+ * or it is not usable.  */
+static keybox_index_t
+read_index_file (KB_NAME kb)
+{
+  char *fname;
+  FILE *fp;
+  struct stat st;
+  unsigned char buffer[INDEX_HDRLEN];
+  keybox_index_t idx = NULL;
+  struct index_entry_s *e;
+  size_t n, nentries;
+
+  fname = index_fname (kb);
+  if (!fname)
+    return NULL;
+  fp = fopen (fname, "rb");
+  xfree (fname);
+  if (!fp)
+    return NULL;
+
+  if (fstat (fileno (fp), &st)
+      || fread (buffer, INDEX_HDRLEN, 1, fp) != 1
+      || memcmp (buffer, INDEX_MAGIC, 4)
+      || buffer[4] != INDEX_VERSION)
+    goto leave;
+
+  nentries = buf32_to_size_t (buffer + 32);
+  if ((uint64_t)st.st_size
+      != INDEX_HDRLEN + (uint64_t)nentries * INDEX_ENTRYLEN)
+    goto leave;  /* Truncated or garbage appended.  */
+
+  idx = xtrycalloc (1, sizeof *idx);
+  if (!idx)
+    goto leave;
+  idx->kbx_size  = get64 (buffer + 8);
+  idx->kbx_mtime = get64 (buffer + 16);
+  idx->kbx_ino   = get64 (buffer + 24);
+  idx->kbx_mtime_nsec = buf32_to_u32 (buffer + 36);
+  idx->flags     = buffer[5];
+  if (reserve_entries (idx, nentries))
+    goto failed;
+
+  for (n=0; n < nentries; n++)
+    {
+      if (fread (buffer, INDEX_ENTRYLEN, 1, fp) != 1)
+        goto failed;
+      e = idx->entries + n;
+      e->type = buffer[0];
+      memcpy (e->key, buffer + 4, 20);
+      e->off = get64 (buffer + 24);
+      if (n && cmp_key (e->type, e->key, 20, e - 1) < 0)
+        goto failed;  /* Not sorted.  */
+      idx->nentries++;
+    }
+  idx->nsorted = idx->nentries;
+  goto leave;
+
+ failed:
+  _keybox_index_release (idx);
+  idx = NULL;
+ leave:
+  fclose (fp);
+  return idx;
+}
+
+
+/* Write IDX to the index file of KB.  The file is replaced
+ * atomically.  */
+static gpg_error_t
+write_index_file (KB_NAME kb, keybox_index_t idx)
+{
+  gpg_error_t err = 0;
+  char *fname, *tmpfname;
+  FILE *fp;
+  unsigned char buffer[INDEX_HDRLEN];
+  struct index_entry_s *e;
+  size_t n;
+
+  merge_unsorted (idx);
+
+  fname = index_fname (kb);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  /* Readers may rebuild the index concurrently; thus we need a
+   * process specific name for the temporary file.  */
+  tmpfname = xtryasprintf ("%s.%lu.tmp", fname, (unsigned long)getpid ());
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (fname);
+      return err;
+    }
+
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  memset (buffer, 0, INDEX_HDRLEN);
+  memcpy (buffer, INDEX_MAGIC, 4);
+  buffer[4] = INDEX_VERSION;
+  buffer[5] = idx->flags;
+  put64 (buffer + 8, idx->kbx_size);
+  put64 (buffer + 16, idx->kbx_mtime);
+  put64 (buffer + 24, idx->kbx_ino);
+  put32 (buffer + 32, idx->nentries);
+  put32 (buffer + 36, idx->kbx_mtime_nsec);
+  if (fwrite (buffer, INDEX_HDRLEN, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+
+  for (n=0, e=idx->entries; !err && n < idx->nentries; n++, e++)
+    {
+      memset (buffer, 0, INDEX_ENTRYLEN);
+      buffer[0] = e->type;
+      memcpy (buffer + 4, e->key, 20);
+      put64 (buffer + 24, e->off);
+      if (fwrite (buffer, INDEX_ENTRYLEN, 1, fp) != 1)
+        err = gpg_error_from_syserror ();
+    }
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+  return err;
+}
+
+
+
+/* Write the index IDX built by a search of KB to its file.  This is
+ * done under the keybox lock so that we do not race a writer.  If
+ * another process holds the lock we don't wait but skip the write;
+ * the index will then be written by the next search.  */
+static void
+store_built_index (KB_NAME kb, keybox_index_t idx)
+{
+  struct stat st;
+  int locked = 0;
+
+  if (!kb->is_locked)
+    {
+      if (!kb->lockhd)
+        kb->lockhd = dotlock_create (kb->fname, 0);
+      if (!kb->lockhd || dotlock_take (kb->lockhd, 0))
+        return;
+      locked = 1;
+    }
+
+  /* The keybox may have been changed before we got the lock.  */
+  if (!stat (kb->fname, &st) && stamp_matches (idx, &st))
+    write_index_file (kb, idx);
+
+  if (locked)
+    dotlock_release (kb->lockhd);
+}
+
+
+
+void
+_keybox_index_release (keybox_index_t idx)
+{
+  if (!idx)
+    return;
+  xfree (idx->entries);
+  xfree (idx);
+}
+
+
+/* Drop the index of KB and remove its file.  The next search will
+ * rebuild it.  */
+void
+_keybox_index_invalidate (KB_NAME kb)
+{
+  char *fname;
+
+  _keybox_index_release (kb->index);
+  kb->index = NULL;
+
+  fname = index_fname (kb);
+  if (fname)
+    {
+      gnupg_remove (fname);
+      xfree (fname);
+    }
+}
+
+
+/* Return true if all NDESC search descriptions in DESC can be
+ * answered using the index.  If R_GRIPS is not NULL true is stored
+ * there if one of them is a keygrip search.  */
+int
+_keybox_index_desc_p (KEYBOX_SEARCH_DESC *desc, size_t ndesc, int *r_grips)
+{
+  size_t n;
+
+  if (r_grips)
+    *r_grips = 0;
+  if (!ndesc)
+    return 0;
+
+  for (n=0; n < ndesc; n++)
+    switch (desc[n].mode)
+      {
+      case KEYDB_SEARCH_MODE_SHORT_KID:
+      case KEYDB_SEARCH_MODE_LONG_KID:
+      case KEYDB_SEARCH_MODE_FPR:
+      case KEYDB_SEARCH_MODE_FPR20:
+        break;
+      case KEYDB_SEARCH_MODE_KEYGRIP:
+        if (r_grips)
+          *r_grips = 1;
+        break;
+      default:
+        return 0;
+      }
+
+  return 1;
+}
+
+
+/* Return true if the index of the keybox used by HD can be used for
+ * a search.  The index is loaded or rebuilt as needed so that it
+ * describes the file currently opened at HD->FP.  If FOR_GRIPS is
+ * set the search includes keygrips.  */
+int
+_keybox_index_usable (KEYBOX_HANDLE hd, int for_grips)
+{
+  KB_NAME kb = hd->kb;
+  keybox_index_t idx;
+  struct stat st;
+
+  if (!hd->fp || fstat (fileno (hd->fp), &st))
+    return 0;
+  if (stamp_matches (kb->index, &st))
+    goto leave;
+
+  /* Another process may have updated the index file.  */
+  idx = read_index_file (kb);
+  if (!stamp_matches (idx, &st))
+    {
+      _keybox_index_release (idx);
+      if (build_index (hd->fp, &st, &idx))
+        return 0;
+      /* Failing to store the index is not an error; we will then
+       * rebuild it in the next process.  */
+      store_built_index (kb, idx);
+    }
+
+  _keybox_index_release (kb->index);
+  kb->index = idx;
+
+ leave:
+  if (for_grips && !(kb->index->flags & INDEX_FLAG_X509_GRIPS))
+    return 0;
+  return 1;
+}
+
+
+/* Return the lowest file offset not less than POS of a blob which
+ * may match one of the NDESC search descriptions in DESC.  Returns -1
+ * if there is no such blob.  The caller must have checked the
+ * descriptions using _keybox_index_desc_p.  */
+off_t
+_keybox_index_next (keybox_index_t idx,
+                    KEYBOX_SEARCH_DESC *desc, size_t ndesc, off_t pos)
+{
+  unsigned char key[20];
+  int type, keylen;
+  size_t n, i;
+  off_t off;
+  off_t best = (off_t)-1;
+
+  for (n=0; n < ndesc; n++)
+    {
+      type = INDEX_TYPE_FPR;
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_SHORT_KID:
+          put32 (key+16, desc[n].u.kid[1]);
+          keylen = 4;
+          break;
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          put32 (key+12, desc[n].u.kid[0]);
+          put32 (key+16, desc[n].u.kid[1]);
+          keylen = 8;
+          break;
+        case KEYDB_SEARCH_MODE_FPR:
+        case KEYDB_SEARCH_MODE_FPR20:
+          memcpy (key, desc[n].u.fpr, 20);
+          keylen = 20;
+          break;
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+          type = INDEX_TYPE_GRIP;
+          memcpy (key, desc[n].u.grip, 20);
+          keylen = 20;
+          break;
+        default:
+          continue;
+        }
+
+      for (i = lower_bound (idx, type, key, keylen);
+           (i < idx->nsorted
+            && !cmp_key (type, key, keylen, idx->entries + i));
+           i++)
+        {
+          off = idx->entries[i].off;
+          if (off >= pos && (best == (off_t)-1 || off < best))
+            best = off;
+        }
+      for (i = idx->nsorted; i < idx->nentries; i++)
+        if (!cmp_key (type, key, keylen, idx->entries + i))
+          {
+            off = idx->entries[i].off;
+            if (off >= pos && (best == (off_t)-1 || off < best))
+              best = off;
+          }
+    }
+
+  return best;
+}
+
+
+/* Prepare for an update of the keybox KB.  Returns true if the index
+ * currently describes the keybox so that _keybox_index_end_update
+ * can update it instead of throwing it away.  */
+int
+_keybox_index_begin_update (KB_NAME kb)
+{
+  keybox_index_t idx;
+  struct stat st;
+
+  if (stat (kb->fname, &st))
+    {
+      if (errno != ENOENT)
+        return 0;
+      /* A new keybox will be created - start with an empty index.  */
+      idx = xtrycalloc (1, sizeof *idx);
+      if (!idx)
+        return 0;
+      idx->flags = INDEX_FLAG_X509_GRIPS;
+      _keybox_index_release (kb->index);
+      kb->index = idx;
+      return 1;
+    }
+
+  if (!st.st_size)
+    return 0; /* No header blob - we can't tell the offsets.  */
+  if (stamp_matches (kb->index, &st))
+    return 1;
+
+  idx = read_index_file (kb);
+  if (!stamp_matches (idx, &st))
+    {
+      _keybox_index_release (idx);
+      return 0;
+    }
+  _keybox_index_release (kb->index);
+  kb->index = idx;
+  return 1;
+}
+
+
+/* Finish an update of the keybox KB started by a call to
+ * _keybox_index_begin_update which returned IN_SYNC.  The blob at
+ * file offset DELOFF has been marked as deleted and NEWBLOB has been
+ * written at file offset NEWOFF.  DELOFF may be -1 and NEWBLOB NULL;
+ * if neither is given only flags have been changed in place.  Blobs
+ * are never moved by an update.  */
+void
+_keybox_index_end_update (KB_NAME kb, int in_sync,
+                          off_t deloff, KEYBOXBLOB newblob, off_t newoff)
+{
+  keybox_index_t idx = kb->index;
+  struct stat st;
+  const unsigned char *buffer;
+  size_t length;
+  size_t i, n, nsorted = 0;
+
+  if (!in_sync || !idx || stat (kb->fname, &st))
+    {
+      _keybox_index_invalidate (kb);
+      return;
+    }
+
+  if (deloff != (off_t)-1)
+    {
+      for (i=n=0; i < idx->nentries; i++)
+        {
+          if (i == idx->nsorted)
+            nsorted = n;
+          if (idx->entries[i].off != deloff)
+            idx->entries[n++] = idx->entries[i];
+        }
+      if (idx->nsorted == idx->nentries)
+        nsorted = n;
+      idx->nsorted = nsorted;
+      idx->nentries = n;
+    }
+
+  if (newblob)
+    {
+      buffer = _keybox_get_blob_image (newblob, &length);
+      if (add_blob_entries (idx, buffer, length, newoff, 1))
+        {
+          _keybox_index_invalidate (kb);
+          return;
+        }
+    }
+
+  set_stamp (idx, &st);
+  /* Within a transaction the file is written only at its end.  */
+  if (!kb->in_transaction)
+    write_index_file (kb, idx);
+}
+
+
+/* Write the index of KB to its file if it describes the current
+ * keybox.  This is used at the end of a transaction.  */
+void
+_keybox_index_flush (KB_NAME kb)
+{
+  struct stat st;
+
+  if (kb->index && !stat (kb->fname, &st) && stamp_matches (kb->index, &st))
+    write_index_file (kb, kb->index);
+  else
+    _keybox_index_invalidate (kb);
+}
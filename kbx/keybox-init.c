@@ -63,6 +63,9 @@ keybox_register_file (const char *fname, int secret, void **r_token)
   kr->lockhd = NULL;
   kr->is_locked = 0;
   kr->did_full_scan = 0;
+  kr->index = NULL;
+  kr->in_transaction = 0;
+  kr->txn_journal = NULL;
   /* keep a list of all issued pointers */
   kr->next = kb_names;
   kb_names = kr;
@@ -177,6 +180,7 @@ keybox_release (KEYBOX_HANDLE hd)
     }
   _keybox_release_blob (hd->found.blob);
   _keybox_release_blob (hd->saved_found.blob);
+  _keybox_unmap_file (hd);
   if (hd->fp)
     {
       fclose (hd->fp);
@@ -250,6 +254,7 @@ _keybox_close_file (KEYBOX_HANDLE hd)
   for (idx=0; idx < hd->kb->handle_table_size; idx++)
     if ((roverhd = hd->kb->handle_table[idx]))
       {
+        _keybox_unmap_file (roverhd);
         if (roverhd->fp)
           {
             fclose (roverhd->fp);
@@ -296,6 +301,7 @@ keybox_lock (KEYBOX_HANDLE hd, int yes)
              * waiting for the lock but we have the base file still
              * open, keybox_file_rename will never succeed as we are
              * in a deadlock.  */
+          _keybox_unmap_file (hd);
           if (hd->fp)
             {
               fclose (hd->fp);
@@ -311,6 +317,8 @@ keybox_lock (KEYBOX_HANDLE hd, int yes)
             kb->is_locked = 1;
         }
     }
+  else if (kb->in_transaction)
+    ; /* The lock is released by keybox_end_transaction.  */
   else /* Release the lock.  */
     {
       if (kb->is_locked)
@@ -165,6 +165,98 @@ next_packet (unsigned char const **bufptr, size_t *buflen,
 }
 
 
+/* Compute the keygrip of the public key ALGO with the NPARAM public
+   key parameters given by PARAMS and PARAMLENS and store it at GRIP.
+   For ECC keys the first parameter is the curve OID including its
+   length byte.  This mirrors keygrip_from_pk in g10/keyid.c.  */
+static gpg_error_t
+keygrip_from_params (int algo, const unsigned char **params,
+                     const size_t *paramlens, int nparam,
+                     unsigned char *grip)
+{
+  gpg_error_t err = 0;
+  gcry_mpi_t mpis[4] = { NULL, NULL, NULL, NULL };
+  gcry_sexp_t s_pkey = NULL;
+  char *curve = NULL;
+  int i;
+
+  for (i=0; i < nparam && i < DIM (mpis) && !err; i++)
+    {
+      if (i == 0 && (algo == PUBKEY_ALGO_ECDH
+                     || algo == PUBKEY_ALGO_ECDSA
+                     || algo == PUBKEY_ALGO_EDDSA))
+        {
+          mpis[i] = gcry_mpi_set_opaque_copy (NULL, params[i],
+                                              paramlens[i]*8);
+          if (!mpis[i])
+            err = gpg_error_from_syserror ();
+        }
+      else
+        err = gcry_mpi_scan (&mpis[i], GCRYMPI_FMT_USG,
+                             params[i], paramlens[i], NULL);
+    }
+  if (err)
+    goto leave;
+
+  switch (algo)
+    {
+    case PUBKEY_ALGO_DSA:
+      err = gcry_sexp_build (&s_pkey, NULL,
+                             "(public-key(dsa(p%m)(q%m)(g%m)(y%m)))",
+                             mpis[0], mpis[1], mpis[2], mpis[3]);
+      break;
+
+    case PUBKEY_ALGO_ELGAMAL_E:
+    case PUBKEY_ALGO_ELGAMAL:
+      err = gcry_sexp_build (&s_pkey, NULL,
+                             "(public-key(elg(p%m)(g%m)(y%m)))",
+                             mpis[0], mpis[1], mpis[2]);
+      break;
+
+    case PUBKEY_ALGO_RSA:
+    case PUBKEY_ALGO_RSA_E:
+    case PUBKEY_ALGO_RSA_S:
+      err = gcry_sexp_build (&s_pkey, NULL,
+                             "(public-key(rsa(n%m)(e%m)))",
+                             mpis[0], mpis[1]);
+      break;
+
+    case PUBKEY_ALGO_EDDSA:
+    case PUBKEY_ALGO_ECDSA:
+    case PUBKEY_ALGO_ECDH:
+      curve = openpgp_oid_to_str (mpis[0]);
+      if (!curve)
+        err = gpg_error_from_syserror ();
+      else
+        err = gcry_sexp_build (&s_pkey, NULL,
+                               algo == PUBKEY_ALGO_EDDSA?
+                               "(public-key(ecc(curve%s)(flags eddsa)(q%m)))":
+                               (algo == PUBKEY_ALGO_ECDH
+                                && openpgp_oid_is_cv25519 (mpis[0]))?
+                               "(public-key(ecc(curve%s)(flags djb-tweak)(q%m)))":
+                               "(public-key(ecc(curve%s)(q%m)))",
+                               curve, mpis[1]);
+      break;
+
+    default:
+      err = gpg_error (GPG_ERR_PUBKEY_ALGO);
+      break;
+    }
+  if (err)
+    goto leave;
+
+  if (!gcry_pk_get_keygrip (s_pkey, grip))
+    err = gpg_error (GPG_ERR_PUBKEY_ALGO);
+
+ leave:
+  gcry_sexp_release (s_pkey);
+  xfree (curve);
+  for (i=0; i < DIM (mpis); i++)
+    gcry_mpi_release (mpis[i]);
+  return err;
+}
+
+
 /* Parse a key packet and store the information in KI. */
 static gpg_error_t
 parse_key (const unsigned char *data, size_t datalen,
@@ -180,6 +272,8 @@ parse_key (const unsigned char *data, size_t datalen,
   size_t mpi_n_len = 0, mpi_e_len = 0;
   gcry_md_hd_t md;
   int is_ecc = 0;
+  const unsigned char *params[4];
+  size_t paramlens[4];
 
   if (datalen < 5)
     return gpg_error (GPG_ERR_INV_PACKET);
@@ -265,6 +359,8 @@ parse_key (const unsigned char *data, size_t datalen,
             mpi_e_len = nbytes;
         }
 
+      params[i] = data;
+      paramlens[i] = nbytes;
       data += nbytes; datalen -= nbytes;
     }
   n = data - data_start;
@@ -327,6 +423,11 @@ parse_key (const unsigned char *data, size_t datalen,
       memcpy (ki->keyid, ki->fpr+12, 8);
     }
 
+  /* A key we can't compute a keygrip for is still a valid key; it
+     just can't be found by keygrip.  */
+  if (keygrip_from_params (algorithm, params, paramlens, npkey, ki->grip))
+    memset (ki->grip, 0, 20);
+
   return 0;
 }
 
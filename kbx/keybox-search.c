@@ -44,6 +44,10 @@ struct sn_array_s {
 #define get32(a) buf32_to_ulong ((a))
 #define get16(a) buf16_to_ulong ((a))
 
+/* The number of times a found blob with a bad checksum is read
+   again.  */
+#define MAX_CHECKSUM_RETRIES 3
+
 
 static inline unsigned int
 blob_get_blob_flags (KEYBOXBLOB blob)
@@ -497,11 +501,49 @@ blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr,
 }
 
 
+/* Return the key number (1..n) of the key in BLOB with the 20 byte
+   keygrip GRIP, 0 if there is no such key, or -1 if the blob has no
+   stored keygrips.  */
+static int
+blob_cmp_grip (KEYBOXBLOB blob, const unsigned char *grip)
+{
+  const unsigned char *buffer;
+  size_t length;
+  size_t pos, off;
+  size_t nkeys, keyinfolen;
+  int idx;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return 0; /* blob too short */
+
+  /*keys*/
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18 );
+  if (keyinfolen < 28)
+    return 0; /* invalid blob */
+  if (keyinfolen < 48)
+    return -1; /* old blob without keygrips */
+  pos = 20;
+  if (pos + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
+    return 0; /* out of bounds */
+
+  for (idx=0; idx < nkeys; idx++)
+    {
+      off = pos + idx*keyinfolen;
+      if (!memcmp (buffer + off + 28, grip, 20))
+        return idx+1; /* found */
+    }
+  return 0; /* not found */
+}
+
+
 #ifdef KEYBOX_WITH_X509
 /* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.
-   We don't have the keygrips as meta data, thus we need to parse the
-   certificate. Fixme: We might want to return proper error codes
-   instead of failing a search for invalid certificates etc.  */
+   This is used for blobs which don't have the keygrips as meta data,
+   thus we need to parse the certificate. Fixme: We might want to
+   return proper error codes instead of failing a search for invalid
+   certificates etc.  */
 static int
 blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
 {
@@ -511,11 +553,7 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
   size_t cert_off, cert_len;
   ksba_reader_t reader = NULL;
   ksba_cert_t cert = NULL;
-  ksba_sexp_t p = NULL;
-  gcry_sexp_t s_pkey;
   unsigned char array[20];
-  unsigned char *rcp;
-  size_t n;
 
   buffer = _keybox_get_blob_image (blob, &length);
   if (length < 40)
@@ -537,29 +575,14 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
   rc = ksba_cert_read_der (cert, reader);
   if (rc)
     goto failed;
-  p = ksba_cert_get_public_key (cert);
-  if (!p)
-    goto failed;
-  n = gcry_sexp_canon_len (p, 0, NULL, NULL);
-  if (!n)
-    goto failed;
-  rc = gcry_sexp_sscan (&s_pkey, NULL, (char*)p, n);
+  rc = _keybox_x509_keygrip (cert, array);
   if (rc)
-    {
-      gcry_sexp_release (s_pkey);
-      goto failed;
-    }
-  rcp = gcry_pk_get_keygrip (s_pkey, array);
-  gcry_sexp_release (s_pkey);
-  if (!rcp)
-    goto failed; /* Can't calculate keygrip. */
+    goto failed;
 
-  xfree (p);
   ksba_cert_release (cert);
   ksba_reader_release (reader);
   return !memcmp (array, grip, 20);
  failed:
-  xfree (p);
   ksba_cert_release (cert);
   ksba_reader_release (reader);
   return 0;
@@ -606,12 +629,16 @@ has_fingerprint (KEYBOXBLOB blob, const unsigned char *fpr)
 static inline int
 has_keygrip (KEYBOXBLOB blob, const unsigned char *grip)
 {
+  int pk_no;
+
+  pk_no = blob_cmp_grip (blob, grip);
+  if (pk_no != -1)
+    return pk_no;
+
+  /* An old blob without stored keygrips.  */
 #ifdef KEYBOX_WITH_X509
   if (blob_get_type (blob) == KEYBOX_BLOBTYPE_X509)
     return blob_x509_has_grip (blob, grip);
-#else
-  (void)blob;
-  (void)grip;
 #endif
   return 0;
 }
@@ -738,6 +765,7 @@ open_file (KEYBOX_HANDLE hd)
       return hd->error;
     }
 
+  _keybox_map_file (hd);
   return 0;
 }
 
@@ -767,6 +795,7 @@ keybox_search_reset (KEYBOX_HANDLE hd)
         {
           /* Ooops.  Seek did not work.  Close so that the search will
            * open the file again.  */
+          _keybox_unmap_file (hd);
           fclose (hd->fp);
           hd->fp = NULL;
         }
@@ -789,10 +818,16 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
 {
   gpg_error_t rc;
   size_t n;
-  int need_words, any_skip;
+  int need_words, any_skip, use_index, any_grip;
   KEYBOXBLOB blob = NULL;
+  KEYBOXBLOB copy = NULL;
   struct sn_array_s *sn_array = NULL;
   int pk_no, uid_no;
+  off_t mappos = 0;
+  off_t off;
+  const unsigned char *buffer;
+  size_t length;
+  int retries = 0;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -846,6 +881,8 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
           return rc;
         }
     }
+  else
+    _keybox_map_file (hd);  /* The file may have grown.  */
 
   /* Kludge: We need to convert an SN given as hexstring to its binary
      representation - in some cases we are not able to store it in the
@@ -907,6 +944,26 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         }
     }
 
+  /* For exact key lookups we consult the index to directly seek to
+     the candidate blobs.  Everything else still works as with a
+     linear scan because a candidate is checked as usual.  */
+  use_index = (_keybox_index_desc_p (desc, ndesc, &any_grip)
+               && _keybox_index_usable (hd, any_grip));
+
+  /* If the file is mapped we read the blobs directly from the
+     mapping and track the file position in MAPPOS; the file position
+     of HD->FP is only updated when we are done.  */
+  if (hd->map)
+    {
+      mappos = ftello (hd->fp);
+      if (mappos == (off_t)-1)
+        {
+          hd->error = gpg_error_from_syserror ();
+          if (sn_array)
+            release_sn_array (sn_array, ndesc);
+          return hd->error;
+        }
+    }
 
   pk_no = uid_no = 0;
   for (;;)
@@ -914,8 +971,44 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       unsigned int blobflags;
       int blobtype;
 
-      _keybox_release_blob (blob); blob = NULL;
-      rc = _keybox_read_blob (&blob, hd->fp, NULL);
+      if (blob != hd->map_blob)
+        _keybox_release_blob (blob);
+      blob = NULL;
+      if (copy)
+        {
+          /* Check the copy of a found blob again.  */
+          blob = copy;
+          copy = NULL;
+          goto check_blob;
+        }
+      if (use_index)
+        {
+          off_t pos, next;
+
+          pos = hd->map? mappos : ftello (hd->fp);
+          if (pos == (off_t)-1)
+            {
+              rc = gpg_error_from_syserror ();
+              break;
+            }
+          next = _keybox_index_next (hd->kb->index, desc, ndesc, pos);
+          if (next == (off_t)-1)
+            {
+              rc = -1; /* No more candidates.  */
+              break;
+            }
+          if (hd->map)
+            mappos = next;
+          else if (next != pos && fseeko (hd->fp, next, SEEK_SET))
+            {
+              rc = gpg_error_from_syserror ();
+              break;
+            }
+        }
+      if (hd->map)
+        rc = _keybox_read_mapped_blob (hd, &mappos, &blob);
+      else
+        rc = _keybox_read_blob (&blob, hd->fp, NULL);
       if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
           && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
         {
@@ -926,6 +1019,7 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       if (rc)
         break;
 
+    check_blob:
       blobtype = blob_get_type (blob);
       if (blobtype == KEYBOX_BLOBTYPE_HEADER)
         continue;
@@ -1003,7 +1097,8 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_KEYGRIP:
-              if (has_keygrip (blob, desc[n].u.grip))
+              pk_no = has_keygrip (blob, desc[n].u.grip);
+              if (pk_no)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_FIRST:
@@ -1032,10 +1127,48 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
 	      && desc[n].skipfnc (desc[n].skipfncvalue, kid, uid_no))
 		break;
         }
-      if (n == ndesc)
-        break; /* got it */
+      if (n < ndesc)
+        continue;
+      if (rc)
+        break;
+
+      /* A blob read from the mapping may be changed by another
+         process and is only valid until the next read.  Thus we
+         check a copy of it again.  */
+      if (blob == hd->map_blob)
+        {
+          rc = _keybox_copy_blob (hd->map_blob, &copy);
+          if (rc)
+            break;
+          continue;
+        }
+
+      /* Another process may have replaced the blob while we read it.
+         Such a torn blob is detected by its checksum and read again.
+         If this does not help the checksum is simply wrong.  */
+      buffer = _keybox_get_blob_image (blob, &length);
+      if (retries < MAX_CHECKSUM_RETRIES
+          && !_keybox_blob_checksum_ok (buffer, length))
+        {
+          retries++;
+          off = _keybox_get_blob_fileoffset (blob);
+          if (hd->map)
+            mappos = off;
+          else if (fflush (hd->fp) || fseeko (hd->fp, off, SEEK_SET))
+            {
+              rc = gpg_error_from_syserror ();
+              break;
+            }
+          continue;
+        }
+      break; /* got it */
     }
 
+  if (blob == hd->map_blob)
+    blob = NULL;
+  if (hd->map && fseeko (hd->fp, mappos, SEEK_SET) && !rc)
+    rc = gpg_error_from_syserror ();
+
   if (!rc)
     {
       hd->found.blob = blob;
@@ -25,6 +25,8 @@
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "keybox-defs.h"
 #include "../common/sysutils.h"
@@ -37,6 +39,20 @@
 #define FILECOPY_DELETE 2
 #define FILECOPY_UPDATE 3
 
+#define JOURNAL_MAGIC   "KBXj"
+#define JOURNAL_VERSION 1
+#define JOURNAL_LEN     48
+#define JOURNAL_RECLEN  16
+
+/* The journal flags.  */
+#define JOURNAL_FLAG_TXN     1
+#define JOURNAL_FLAG_INPLACE 2
+
+/* Run keybox_compress after an update if the deleted blobs take up
+   more than this part of the file and at least COMPRESS_MIN bytes.  */
+#define COMPRESS_RATIO  4
+#define COMPRESS_MIN    (1024*1024)
+
 
 #if !defined(HAVE_FSEEKO) && !defined(fseeko)
 
@@ -353,6 +369,728 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
 }
 
 
+/*
+ * In-place updates
+
+   Instead of copying the entire keybox for each change, new blobs
+   are appended to the file and replaced or deleted blobs are marked
+   as deleted by setting their type to 0 (see keybox-blob.c).
+   keybox_compress removes them later.  To survive a crash in the
+   middle of an update we write a journal before touching the keybox.
+   It is stored in a file with the same name as the keybox plus the
+   suffix ".jnl" and removed when the update is complete.  All
+   integers are stored in network byte order.
+
+   - b4   Magic 'KBXj'
+   - byte Version number (1)
+   - byte Journal flags
+          bit 0 = Transaction journal
+          bit 1 = In-place replacement
+   - b2   RFU
+   - u64  File offset of the new blob; this is the size of the keybox
+          before the update.
+   - u64  File offset of the blob to mark as deleted or all ones.
+   - u32  Length of the new blob
+   - b20  SHA-1 hash of the new blob
+
+   The journal is synced to disk before the new blob is appended and
+   the new blob before the old one is marked as deleted.  If a
+   journal is found by the next update, the update is completed if
+   the new blob has been written entirely; otherwise the partially
+   written blob is marked as deleted.  The keybox is never truncated
+   because other processes may have mapped it (see _keybox_map_file).
+
+   Appending a new version of a blob would move the key to the end of
+   the keybox and change the order of --list-keys and the choice of
+   the default key.  Thus if the new version is not larger than the
+   old one, it is written over the old one.  If it is shorter, the
+   rest of the old blob is turned into an empty blob; this requires
+   at least 5 spare bytes.  The journal of such an update has flag
+   bit 1 set, the file offset of the old blob as the offset of the
+   new blob, the length of the old blob instead of the offset of the
+   deleted blob and is followed by the new blob.  If a complete
+   journal of this kind is found, the new blob is written again.  A
+   larger blob is still appended and the old one marked as deleted.
+
+   Syncing three times per update is too slow for importing many
+   keys.  Thus a caller holding the lock may group updates into a
+   transaction (keybox_begin_transaction).  Its journal has flag bit 0
+   set, no offset of a deleted blob and instead of the length of the
+   new blob the counter of deleted bytes from the header blob.  Blobs
+   are then appended without syncing; before a blob is marked as
+   deleted a record is appended to the journal and synced:
+
+   - u64  File offset of the blob marked as deleted
+   - byte The former blob type
+   - b7   RFU
+
+   At the end of the transaction the keybox is synced and the journal
+   removed.  If a transaction journal is found, the transaction has
+   not been completed and is rolled back: The marked blobs and the
+   counter are restored and the appended blobs are marked as deleted.
+
+*/
+
+/* Return the malloced name of the journal file for the keybox
+ * FNAME or NULL on error.  */
+static char *
+journal_fname (const char *fname)
+{
+  return strconcat (fname, EXTSEP_S "jnl", NULL);
+}
+
+
+static void
+put64 (unsigned char *p, uint64_t a)
+{
+  p[0] = a >> 56;
+  p[1] = a >> 48;
+  p[2] = a >> 40;
+  p[3] = a >> 32;
+  p[4] = a >> 24;
+  p[5] = a >> 16;
+  p[6] = a >>  8;
+  p[7] = a;
+}
+
+static uint64_t
+get64 (const unsigned char *p)
+{
+  return (((uint64_t)buf32_to_u32 (p)) << 32) | buf32_to_u32 (p+4);
+}
+
+
+/* Flush FP and make sure that the data has been written to disk.  */
+static gpg_error_t
+sync_file (FILE *fp)
+{
+  if (fflush (fp))
+    return gpg_error_from_syserror ();
+#ifdef HAVE_FSYNC
+  if (fsync (fileno (fp)))
+    return gpg_error_from_syserror ();
+#endif
+  return 0;
+}
+
+
+/* Write the journal for an update of the keybox FNAME which appends
+ * the blob IMAGE,IMAGELEN at file offset NEWOFF and marks the blob at
+ * DELOFF as deleted.  DELOFF may be -1.  If FLAGS has
+ * JOURNAL_FLAG_INPLACE set, the blob replaces the one at NEWOFF
+ * whose length is given by DELOFF.  */
+static gpg_error_t
+write_journal (const char *fname, int flags, off_t newoff, off_t deloff,
+               const unsigned char *image, size_t imagelen)
+{
+  gpg_error_t err;
+  char *jfname;
+  FILE *fp;
+  unsigned char buffer[JOURNAL_LEN];
+
+  memset (buffer, 0, sizeof buffer);
+  memcpy (buffer, JOURNAL_MAGIC, 4);
+  buffer[4] = JOURNAL_VERSION;
+  buffer[5] = flags;
+  put64 (buffer + 8, newoff);
+  put64 (buffer + 16, deloff == (off_t)-1? (uint64_t)-1 : (uint64_t)deloff);
+  buffer[24] = imagelen >> 24;
+  buffer[25] = imagelen >> 16;
+  buffer[26] = imagelen >>  8;
+  buffer[27] = imagelen;
+  gcry_md_hash_buffer (GCRY_MD_SHA1, buffer + 28, image, imagelen);
+
+  jfname = journal_fname (fname);
+  if (!jfname)
+    return gpg_error_from_syserror ();
+  fp = fopen (jfname, "wb");
+  if (!fp)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      if (fwrite (buffer, sizeof buffer, 1, fp) != 1
+          || ((flags & JOURNAL_FLAG_INPLACE)
+              && fwrite (image, imagelen, 1, fp) != 1))
+        err = gpg_error_from_syserror ();
+      else
+        err = sync_file (fp);
+      if (fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+      if (err)
+        gnupg_remove (jfname);
+    }
+  xfree (jfname);
+  return err;
+}
+
+
+/* Remove the journal of the keybox FNAME.  */
+static void
+remove_journal (const char *fname)
+{
+  char *jfname;
+
+  jfname = journal_fname (fname);
+  if (jfname)
+    {
+      gnupg_remove (jfname);
+      xfree (jfname);
+    }
+}
+
+
+/* Add LENGTH to the counter of deleted bytes in the header blob of
+ * the keybox open at FP.  The file position is not preserved.  */
+static gpg_error_t
+count_deleted (FILE *fp, uint64_t length)
+{
+  unsigned char buffer[16];
+  uint64_t val;
+
+  if (fseeko (fp, 0, SEEK_SET)
+      || fread (buffer, 16, 1, fp) != 1)
+    return gpg_error_from_syserror ();
+  if (buffer[4] != KEYBOX_BLOBTYPE_HEADER)
+    return 0;  /* No header blob.  */
+  val = buf32_to_u32 (buffer + 12) + length;
+  if (val > 0xffffffff)
+    val = 0xffffffff;
+  buffer[12] = val >> 24;
+  buffer[13] = val >> 16;
+  buffer[14] = val >>  8;
+  buffer[15] = val;
+  if (fseeko (fp, 12, SEEK_SET)
+      || fwrite (buffer + 12, 4, 1, fp) != 1)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Write the blob IMAGE,IMAGELEN over the blob of OLDLEN bytes at file
+ * offset OFF of the keybox open at FP.  The caller must have checked
+ * that the new blob fits.  Readers do not take the lock; thus the
+ * old blob is first marked as deleted so that readers skip it while
+ * it is overwritten.  The type of the new blob is written last.  A
+ * reader which already started to read the old blob detects the
+ * change by the checksum.  */
+static gpg_error_t
+write_inplace (FILE *fp, off_t off, const unsigned char *image,
+               size_t imagelen, size_t oldlen)
+{
+  unsigned char header[5];
+  size_t restlen = oldlen - imagelen;
+
+  if (fseeko (fp, off + 4, SEEK_SET) || putc (0, fp) == EOF
+      || fflush (fp))
+    return gpg_error_from_syserror ();
+
+  /* The rest of the old blob becomes an empty blob.  */
+  if (restlen)
+    {
+      header[0] = restlen >> 24;
+      header[1] = restlen >> 16;
+      header[2] = restlen >>  8;
+      header[3] = restlen;
+      header[4] = 0;
+      if (fseeko (fp, off + imagelen, SEEK_SET)
+          || fwrite (header, 5, 1, fp) != 1)
+        return gpg_error_from_syserror ();
+    }
+  if (fseeko (fp, off + 5, SEEK_SET)
+      || fwrite (image + 5, imagelen - 5, 1, fp) != 1
+      || fflush (fp))
+    return gpg_error_from_syserror ();
+
+  /* Now the length and finally the type.  */
+  if (restlen
+      && (fseeko (fp, off, SEEK_SET) || fwrite (image, 4, 1, fp) != 1
+          || fflush (fp)))
+    return gpg_error_from_syserror ();
+  if (fseeko (fp, off + 4, SEEK_SET) || putc (image[4], fp) == EOF
+      || fflush (fp))
+    return gpg_error_from_syserror ();
+
+  return restlen? count_deleted (fp, restlen) : 0;
+}
+
+
+/* Mark all blobs from file offset OFF to the end of the keybox open
+ * at FP as deleted.  This is used instead of truncating the file to
+ * undo appends.  A partially written blob at the end is turned into
+ * an empty blob reaching up to the end of the file.  The number of
+ * bytes marked as deleted is stored at R_LENGTH.  The file position
+ * is not preserved.  */
+static gpg_error_t
+discard_tail (FILE *fp, uint64_t off, uint64_t *r_length)
+{
+  struct stat st;
+  unsigned char header[5];
+  uint64_t size, rest, len;
+
+  *r_length = 0;
+  if (fflush (fp) || fstat (fileno (fp), &st))
+    return gpg_error_from_syserror ();
+  size = st.st_size;
+
+  for (; off < size; off += len)
+    {
+      rest = size - off;
+      len = 0;
+      if (rest >= 5)
+        {
+          if (fseeko (fp, off, SEEK_SET) || fread (header, 5, 1, fp) != 1)
+            return gpg_error_from_syserror ();
+          len = buf32_to_u32 (header);
+        }
+      if (len < 5 || len > rest)
+        {
+          /* The last blob has not been written entirely.  If not even
+           * its header is there the file is extended to hold one.  */
+          len = rest < 5? 5 : rest;
+          header[0] = len >> 24;
+          header[1] = len >> 16;
+          header[2] = len >>  8;
+          header[3] = len;
+          header[4] = 0;
+          if (fseeko (fp, off, SEEK_SET) || fwrite (header, 5, 1, fp) != 1)
+            return gpg_error_from_syserror ();
+          *r_length += len;
+          break;
+        }
+      if (header[4]
+          && (fseeko (fp, off + 4, SEEK_SET) || putc (0, fp) == EOF))
+        return gpg_error_from_syserror ();
+      *r_length += len;
+    }
+
+  return 0;
+}
+
+
+/* Roll back the transaction described by the journal header BUFFER
+ * and the records read from JFP on the keybox open at FP.  NEWOFF is
+ * the size of the keybox at the start of the transaction.  */
+static gpg_error_t
+rollback_transaction (FILE *fp, FILE *jfp, const unsigned char *buffer,
+                      uint64_t newoff)
+{
+  gpg_error_t err;
+  unsigned char rec[JOURNAL_RECLEN];
+  uint64_t deloff, dellen;
+
+  /* Each blob is marked at most once; thus the order does not
+   * matter.  */
+  while (fread (rec, sizeof rec, 1, jfp) == 1)
+    {
+      deloff = get64 (rec);
+      if (deloff + 5 > newoff)
+        continue;  /* Appended within the transaction.  */
+      if (fseeko (fp, deloff + 4, SEEK_SET) || putc (rec[8], fp) == EOF)
+        return gpg_error_from_syserror ();
+    }
+
+  /* If the keybox has been created within the transaction we keep
+   * its header blob.  */
+  if (!newoff)
+    {
+      if (fseeko (fp, 0, SEEK_SET) || fread (rec, 5, 1, fp) != 1)
+        return feof (fp)? 0 : gpg_error_from_syserror ();
+      if (rec[4] == KEYBOX_BLOBTYPE_HEADER)
+        newoff = buf32_to_u32 (rec);
+    }
+
+  /* Restore the counter of deleted bytes.  */
+  if (newoff >= 16)
+    {
+      if (fseeko (fp, 12, SEEK_SET)
+          || fwrite (buffer + 24, 4, 1, fp) != 1)
+        return gpg_error_from_syserror ();
+    }
+
+  /* Discard the appended blobs.  */
+  err = discard_tail (fp, newoff, &dellen);
+  if (!err && dellen)
+    err = count_deleted (fp, dellen);
+  return err;
+}
+
+
+/* Check whether an earlier update of the keybox KB has been
+ * interrupted and complete or undo it.  The keybox needs to be
+ * locked.  Nothing is done within a transaction.  */
+static gpg_error_t
+recover_journal (KB_NAME kb)
+{
+  gpg_error_t err = 0;
+  const char *fname = kb->fname;
+  char *jfname;
+  FILE *jfp, *fp = NULL;
+  unsigned char buffer[JOURNAL_LEN];
+  unsigned char digest[20];
+  unsigned char *image = NULL;
+  struct stat st;
+  uint64_t newoff, deloff, dellen;
+  size_t imagelen;
+  int complete = 0;
+
+  if (kb->in_transaction)
+    return 0;
+
+  jfname = journal_fname (fname);
+  if (!jfname)
+    return gpg_error_from_syserror ();
+  jfp = fopen (jfname, "rb");
+  if (!jfp)
+    {
+      if (errno != ENOENT)
+        err = gpg_error_from_syserror ();
+      xfree (jfname);
+      return err;  /* No journal - nothing to do.  */
+    }
+  if (fread (buffer, sizeof buffer, 1, jfp) != 1
+      || memcmp (buffer, JOURNAL_MAGIC, 4)
+      || buffer[4] != JOURNAL_VERSION)
+    {
+      /* We crashed while writing the journal; thus the keybox has
+       * not yet been touched.  */
+      goto leave;
+    }
+
+  newoff   = get64 (buffer + 8);
+  deloff   = get64 (buffer + 16);
+  imagelen = buf32_to_size_t (buffer + 24);
+
+  fp = fopen (fname, "r+b");
+  if (!fp && errno == ENOENT && (buffer[5] & JOURNAL_FLAG_TXN) && !newoff)
+    goto leave;  /* The transaction did not yet create the keybox.  */
+  if (!fp || fstat (fileno (fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if ((uint64_t)st.st_size < newoff)
+    goto leave;  /* Someone else rewrote the file.  */
+
+  if ((buffer[5] & JOURNAL_FLAG_TXN))
+    {
+      err = rollback_transaction (fp, jfp, buffer, newoff);
+      if (!err)
+        err = sync_file (fp);
+      /* The index may describe the discarded blobs.  */
+      _keybox_index_invalidate (kb);
+      goto leave;
+    }
+
+  if ((buffer[5] & JOURNAL_FLAG_INPLACE))
+    {
+      /* Write the new blob again unless we crashed while writing the
+       * journal.  DELOFF is the length of the old blob.  */
+      if (imagelen < 5 || imagelen > deloff
+          || (deloff != imagelen && deloff - imagelen < 5)
+          || newoff + deloff > (uint64_t)st.st_size)
+        goto leave;
+      image = xtrymalloc (imagelen);
+      if (!image)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (fread (image, imagelen, 1, jfp) != 1)
+        goto leave;
+      gcry_md_hash_buffer (GCRY_MD_SHA1, digest, image, imagelen);
+      if (memcmp (digest, buffer + 28, 20))
+        goto leave;
+      err = write_inplace (fp, newoff, image, imagelen, deloff);
+      if (!err)
+        err = sync_file (fp);
+      /* The index may still describe the old blob.  */
+      _keybox_index_invalidate (kb);
+      goto leave;
+    }
+
+  /* The update is complete if the new blob is there.  */
+  if ((uint64_t)st.st_size >= newoff + imagelen && imagelen >= 5)
+    {
+      image = xtrymalloc (imagelen);
+      if (!image)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (!fseeko (fp, newoff, SEEK_SET)
+          && fread (image, imagelen, 1, fp) == 1)
+        {
+          gcry_md_hash_buffer (GCRY_MD_SHA1, digest, image, imagelen);
+          complete = !memcmp (digest, buffer + 28, 20);
+        }
+    }
+
+  if (complete)
+    {
+      unsigned char lenbuf[5];
+
+      if (deloff != (uint64_t)-1)
+        {
+          if (fseeko (fp, deloff, SEEK_SET)
+              || fread (lenbuf, 5, 1, fp) != 1)
+            err = gpg_error_from_syserror ();
+          else if (!lenbuf[4])
+            ; /* Already marked as deleted.  */
+          else if (fseeko (fp, deloff + 4, SEEK_SET) || putc (0, fp) == EOF)
+            err = gpg_error_from_syserror ();
+          else
+            err = count_deleted (fp, buf32_to_size_t (lenbuf));
+        }
+    }
+  else
+    {
+      /* Undo the partial append.  */
+      err = discard_tail (fp, newoff, &dellen);
+      if (!err && dellen)
+        {
+          err = count_deleted (fp, dellen);
+          /* The index may describe the discarded blob.  */
+          _keybox_index_invalidate (kb);
+        }
+    }
+  if (!err)
+    err = sync_file (fp);
+
+ leave:
+  fclose (jfp);
+  if (fp && fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    gnupg_remove (jfname);
+  xfree (image);
+  xfree (jfname);
+  return err;
+}
+
+
+/* Mark the blob of LENGTH bytes at file offset OFF of the keybox KB
+ * open at FP as deleted.  Within a transaction the old type is first
+ * recorded in the journal.  */
+static gpg_error_t
+mark_deleted (KB_NAME kb, FILE *fp, off_t off, size_t length)
+{
+  gpg_error_t err;
+  unsigned char rec[JOURNAL_RECLEN];
+  int c;
+
+  if (kb->in_transaction)
+    {
+      if (fseeko (fp, off + 4, SEEK_SET) || (c = getc (fp)) == EOF)
+        return gpg_error_from_syserror ();
+      if (!c)
+        return 0;  /* Already marked as deleted.  */
+      memset (rec, 0, sizeof rec);
+      put64 (rec, off);
+      rec[8] = c;
+      if (fwrite (rec, sizeof rec, 1, kb->txn_journal) != 1)
+        return gpg_error_from_syserror ();
+      err = sync_file (kb->txn_journal);
+      if (err)
+        return err;
+    }
+
+  if (fseeko (fp, off + 4, SEEK_SET) || putc (0, fp) == EOF)
+    return gpg_error_from_syserror ();
+  return count_deleted (fp, length);
+}
+
+
+/* Append BLOB to the keybox KB and, if DELOFF is not -1, mark the
+ * blob of length DELLEN at file offset DELOFF as deleted.  The file
+ * offset of the new blob is stored at R_NEWOFF.  If the keybox does
+ * not yet exist, it is created.  FOR_OPENPGP indicates that this is
+ * called due to an OpenPGP keyblock change.  */
+static gpg_error_t
+blob_append (KB_NAME kb, KEYBOXBLOB blob, int for_openpgp,
+             off_t deloff, size_t dellen, off_t *r_newoff)
+{
+  gpg_error_t err;
+  const char *fname = kb->fname;
+  FILE *fp;
+  const unsigned char *image;
+  size_t imagelen;
+  unsigned char header[8];
+  off_t newoff;
+
+  *r_newoff = (off_t)-1;
+  image = _keybox_get_blob_image (blob, &imagelen);
+
+  err = recover_journal (kb);
+  if (err)
+    return err;
+
+  if (access (fname, W_OK))
+    {
+      if (errno == ENOENT && deloff == (off_t)-1)
+        {
+          /* Create a new keybox.  */
+          err = blob_filecopy (FILECOPY_INSERT, fname, blob, 0,
+                               for_openpgp, 0);
+          if (!err)
+            *r_newoff = 32;
+          return err;
+        }
+      return gpg_error_from_syserror ();
+    }
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  /* Make sure that the OpenPGP flag is set in the header.  */
+  if (fread (header, 8, 1, fp) != 1)
+    {
+      err = ferror (fp)? gpg_error_from_syserror ()
+                       : gpg_error (GPG_ERR_TOO_SHORT);
+      goto leave;
+    }
+  if (for_openpgp && header[4] == KEYBOX_BLOBTYPE_HEADER
+      && !(header[7] & 0x02))
+    {
+      header[7] |= 0x02;  /* OpenPGP data may be available.  */
+      if (fseeko (fp, 7, SEEK_SET) || putc (header[7], fp) == EOF)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  if (fseeko (fp, 0, SEEK_END))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  newoff = ftello (fp);
+  if (newoff == (off_t)-1)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  if (kb->in_transaction)
+    {
+      /* The transaction journal takes care of a crash.  */
+      err = _keybox_write_blob (blob, fp);
+      if (!err && deloff != (off_t)-1)
+        err = mark_deleted (kb, fp, deloff, dellen);
+      if (!err)
+        *r_newoff = newoff;
+      goto leave;
+    }
+
+  err = write_journal (fname, 0, newoff, deloff, image, imagelen);
+  if (err)
+    goto leave;
+
+  err = _keybox_write_blob (blob, fp);
+  if (!err)
+    err = sync_file (fp);
+  if (!err && deloff != (off_t)-1)
+    {
+      err = mark_deleted (kb, fp, deloff, dellen);
+      if (!err)
+        err = sync_file (fp);
+    }
+  if (!err)
+    {
+      remove_journal (fname);
+      *r_newoff = newoff;
+    }
+  /* On error we keep the journal; the next update will clean up.  */
+
+ leave:
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  return err;
+}
+
+
+/* Replace the blob of OLDLEN bytes at file offset OFF of the keybox
+ * KB by BLOB.  The new blob must not be larger than the old one and
+ * if it is shorter, at least 5 bytes shorter.  This must not be used
+ * within a transaction.  */
+static gpg_error_t
+blob_replace (KB_NAME kb, KEYBOXBLOB blob, off_t off, size_t oldlen)
+{
+  gpg_error_t err;
+  const char *fname = kb->fname;
+  FILE *fp;
+  const unsigned char *image;
+  size_t imagelen;
+
+  image = _keybox_get_blob_image (blob, &imagelen);
+  assert (imagelen == oldlen || imagelen + 5 <= oldlen);
+  assert (!kb->in_transaction);
+
+  err = recover_journal (kb);
+  if (err)
+    return err;
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  err = write_journal (fname, JOURNAL_FLAG_INPLACE, off, oldlen,
+                       image, imagelen);
+  if (err)
+    goto leave;
+
+  err = write_inplace (fp, off, image, imagelen, oldlen);
+  if (!err)
+    err = sync_file (fp);
+  if (!err)
+    remove_journal (fname);
+  /* On error we keep the journal; the next update will clean up.  */
+
+ leave:
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  return err;
+}
+
+
+/* Return true if DELETED bytes of blobs marked as deleted in a
+ * keybox of SIZE bytes are worth a compress run.  */
+static int
+compress_needed (u32 deleted, off_t size)
+{
+  return (deleted >= COMPRESS_MIN
+          && (uint64_t)deleted >= (uint64_t)size / COMPRESS_RATIO);
+}
+
+
+/* Run keybox_compress if the blobs marked as deleted take up a
+ * significant part of the keybox of HD.  */
+static void
+maybe_compress (KEYBOX_HANDLE hd)
+{
+  FILE *fp;
+  struct stat st;
+  unsigned char buffer[16];
+  u32 deleted = 0;
+
+  if (hd->kb->in_transaction)
+    return;  /* Done by keybox_end_transaction.  */
+
+  fp = fopen (hd->kb->fname, "rb");
+  if (!fp)
+    return;
+  if (!fstat (fileno (fp), &st)
+      && fread (buffer, 16, 1, fp) == 1
+      && buffer[4] == KEYBOX_BLOBTYPE_HEADER)
+    deleted = buf32_to_u32 (buffer + 12);
+  fclose (fp);
+
+  if (compress_needed (deleted, st.st_size))
+    keybox_compress (hd);
+}
+
+
 /* Insert the OpenPGP keyblock {IMAGE,IMAGELEN} into HD. */
 gpg_error_t
 keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
@@ -362,6 +1100,8 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
+  int in_sync;
+  off_t newoff;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -386,12 +1126,11 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   _keybox_destroy_openpgp_info (&info);
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      in_sync = _keybox_index_begin_update (hd->kb);
+      err = blob_append (hd->kb, blob, 1, (off_t)-1, 0, &newoff);
+      if (!err)
+        _keybox_index_end_update (hd->kb, in_sync, (off_t)-1, blob, newoff);
       _keybox_release_blob (blob);
-      /*    if (!rc && !hd->secret && kb_offtbl) */
-      /*      { */
-      /*        update_offset_hash_table_from_kb (kb_offtbl, kb, 0); */
-      /*      } */
     }
   return err;
 }
@@ -405,9 +1144,12 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   gpg_error_t err;
   const char *fname;
   off_t off;
+  size_t oldlen, newlen;
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
+  int in_sync;
+  off_t newoff;
 
   if (!hd || !image || !imagelen)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -422,6 +1164,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
+  _keybox_get_blob_image (hd->found.blob, &oldlen);
 
   /* Close this the file so that we do no mess up the position for a
      next search.  */
@@ -436,11 +1179,28 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
                                      hd->ephemeral);
   _keybox_destroy_openpgp_info (&info);
 
-  /* Update the keyblock.  */
+  /* Update the keyblock.  If the new version fits into the space of
+     the old one it is written in place so that the order of the keys
+     does not change.  Otherwise, and within a transaction which could
+     not undo an overwrite, it is appended and the old one marked as
+     deleted.  */
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_UPDATE, fname, blob, hd->secret, 1, off);
+      _keybox_get_blob_image (blob, &newlen);
+      in_sync = _keybox_index_begin_update (hd->kb);
+      if (!hd->kb->in_transaction
+          && (newlen == oldlen || newlen + 5 <= oldlen))
+        {
+          err = blob_replace (hd->kb, blob, off, oldlen);
+          newoff = off;
+        }
+      else
+        err = blob_append (hd->kb, blob, 1, off, oldlen, &newoff);
+      if (!err)
+        _keybox_index_end_update (hd->kb, in_sync, off, blob, newoff);
       _keybox_release_blob (blob);
+      if (!err)
+        maybe_compress (hd);
     }
   return err;
 }
@@ -455,6 +1215,8 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   int rc;
   const char *fname;
   KEYBOXBLOB blob;
+  int in_sync;
+  off_t newoff;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -472,12 +1234,11 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   rc = _keybox_create_x509_blob (&blob, cert, sha1_digest, hd->ephemeral);
   if (!rc)
     {
-      rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      in_sync = _keybox_index_begin_update (hd->kb);
+      rc = blob_append (hd->kb, blob, 0, (off_t)-1, 0, &newoff);
+      if (!rc)
+        _keybox_index_end_update (hd->kb, in_sync, (off_t)-1, blob, newoff);
       _keybox_release_blob (blob);
-      /*    if (!rc && !hd->secret && kb_offtbl) */
-      /*      { */
-      /*        update_offset_hash_table_from_kb (kb_offtbl, kb, 0); */
-      /*      } */
     }
   return rc;
 }
@@ -508,6 +1269,11 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   size_t flag_pos, flag_size;
   const unsigned char *buffer;
   size_t length;
+  unsigned char tmp[4];
+  unsigned char digest[20];
+  unsigned char *image;
+  int with_checksum = 0;
+  int in_sync;
 
   (void)idx;  /* Not yet used.  */
 
@@ -532,38 +1298,48 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   if (ec)
     return gpg_error (ec);
 
-  off += flag_pos;
+  switch (flag_size)
+    {
+    case 1:
+    case 2:
+    case 4:
+      break;
+    default:
+      return gpg_error (GPG_ERR_BUG);
+    }
+  tmp[0] = value >> 24;
+  tmp[1] = value >> 16;
+  tmp[2] = value >>  8;
+  tmp[3] = value;
+
+  /* Readers use the checksum to detect a blob changed while they read
+     it; thus we update it as well unless it is already wrong.  */
+  if (_keybox_blob_checksum_ok (buffer, length))
+    {
+      image = xtrymalloc (length);
+      if (!image)
+        return gpg_error_from_syserror ();
+      memcpy (image, buffer, length);
+      memcpy (image + flag_pos, tmp + 4 - flag_size, flag_size);
+      gcry_md_hash_buffer (GCRY_MD_SHA1, digest, image, length - 20);
+      xfree (image);
+      with_checksum = 1;
+    }
 
   _keybox_close_file (hd);
+  in_sync = _keybox_index_begin_update (hd->kb);
   fp = fopen (hd->kb->fname, "r+b");
   if (!fp)
     return gpg_error_from_syserror ();
 
   ec = 0;
-  if (fseeko (fp, off, SEEK_SET))
+  if (fseeko (fp, off + flag_pos, SEEK_SET)
+      || fwrite (tmp+4-flag_size, flag_size, 1, fp) != 1)
+    ec = gpg_err_code_from_syserror ();
+  else if (with_checksum
+           && (fseeko (fp, off + length - 20, SEEK_SET)
+               || fwrite (digest, 20, 1, fp) != 1))
     ec = gpg_err_code_from_syserror ();
-  else
-    {
-      unsigned char tmp[4];
-
-      tmp[0] = value >> 24;
-      tmp[1] = value >> 16;
-      tmp[2] = value >>  8;
-      tmp[3] = value;
-
-      switch (flag_size)
-        {
-        case 1:
-        case 2:
-        case 4:
-          if (fwrite (tmp+4-flag_size, flag_size, 1, fp) != 1)
-            ec = gpg_err_code_from_syserror ();
-          break;
-        default:
-          ec = GPG_ERR_BUG;
-          break;
-        }
-    }
 
   if (fclose (fp))
     {
@@ -571,6 +1347,10 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
         ec = gpg_err_code_from_syserror ();
     }
 
+  /* The offsets did not change; only the stamp needs an update.  */
+  if (!ec)
+    _keybox_index_end_update (hd->kb, in_sync, (off_t)-1, NULL, (off_t)-1);
+
   return gpg_error (ec);
 }
 
@@ -580,9 +1360,11 @@ int
 keybox_delete (KEYBOX_HANDLE hd)
 {
   off_t off;
+  size_t length;
   const char *fname;
   FILE *fp;
   int rc;
+  int in_sync;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -597,19 +1379,18 @@ keybox_delete (KEYBOX_HANDLE hd)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
-  off += 4;
+  _keybox_get_blob_image (hd->found.blob, &length);
 
   _keybox_close_file (hd);
+  in_sync = _keybox_index_begin_update (hd->kb);
+  rc = recover_journal (hd->kb);
+  if (rc)
+    return rc;
   fp = fopen (hd->kb->fname, "r+b");
   if (!fp)
     return gpg_error_from_syserror ();
 
-  if (fseeko (fp, off, SEEK_SET))
-    rc = gpg_error_from_syserror ();
-  else if (putc (0, fp) == EOF)
-    rc = gpg_error_from_syserror ();
-  else
-    rc = 0;
+  rc = mark_deleted (hd->kb, fp, off, length);
 
   if (fclose (fp))
     {
@@ -617,6 +1398,12 @@ keybox_delete (KEYBOX_HANDLE hd)
         rc = gpg_error_from_syserror ();
     }
 
+  if (!rc)
+    {
+      _keybox_index_end_update (hd->kb, in_sync, off, NULL, (off_t)-1);
+      maybe_compress (hd);
+    }
+
   return rc;
 }
 
@@ -646,6 +1433,8 @@ keybox_compress (KEYBOX_HANDLE hd)
   fname = hd->kb->fname;
   if (!fname)
     return gpg_error (GPG_ERR_INV_HANDLE);
+  if (hd->kb->in_transaction)
+    return gpg_error (GPG_ERR_CONFLICT);  /* Can't be rolled back.  */
 
   _keybox_close_file (hd);
 
@@ -654,6 +1443,11 @@ keybox_compress (KEYBOX_HANDLE hd)
   if (access (fname, W_OK))
     return gpg_error_from_syserror ();
 
+  /* Finish an interrupted update first.  */
+  rc = recover_journal (hd->kb);
+  if (rc)
+    return rc;
+
   fp = fopen (fname, "rb");
   if (!fp && errno == ENOENT)
     return 0; /* Ready. File has been deleted right after the access above. */
@@ -671,11 +1465,15 @@ keybox_compress (KEYBOX_HANDLE hd)
       size_t length;
 
       buffer = _keybox_get_blob_image (blob, &length);
-      if (length > 4 && buffer[4] == KEYBOX_BLOBTYPE_HEADER)
+      if (length >= 32 && buffer[4] == KEYBOX_BLOBTYPE_HEADER)
         {
           u32 last_maint = buf32_to_u32 (buffer+20);
+          u32 deleted = buf32_to_u32 (buffer+12);
+          struct stat st;
 
-          if ( (last_maint + 3*3600) > time (NULL) )
+          if ( (last_maint + 3*3600) > time (NULL)
+               && !(!fstat (fileno (fp), &st)
+                    && compress_needed (deleted, st.st_size)))
             {
               fclose (fp);
               _keybox_release_blob (blob);
@@ -789,9 +1587,153 @@ keybox_compress (KEYBOX_HANDLE hd)
   if (rc || !any_changes)
     gnupg_remove (tmpfname);
   else
-    rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+    {
+      rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+      /* All offsets have changed; the next search rebuilds the index.  */
+      _keybox_index_invalidate (hd->kb);
+    }
 
   xfree(bakfname);
   xfree(tmpfname);
   return rc;
 }
+
+
+/* Start a transaction on the keybox of HD.  All following updates of
+ * the keybox by any handle are applied as one unit which is either
+ * committed or rolled back by keybox_end_transaction.  The keybox
+ * needs to be locked; the lock is kept until the end of the
+ * transaction.  Note that flags changed with keybox_set_flags are
+ * not rolled back.  */
+gpg_error_t
+keybox_begin_transaction (KEYBOX_HANDLE hd)
+{
+  gpg_error_t err;
+  KB_NAME kb;
+  char *jfname;
+  FILE *fp;
+  struct stat st;
+  unsigned char header[16];
+  unsigned char buffer[JOURNAL_LEN];
+  uint64_t size = 0;
+
+  if (!hd || !hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  kb = hd->kb;
+  if (kb->in_transaction)
+    return gpg_error (GPG_ERR_CONFLICT);
+  if (!kb->is_locked)
+    return gpg_error (GPG_ERR_NOT_LOCKED);
+
+  _keybox_close_file (hd);
+  err = recover_journal (kb);
+  if (err)
+    return err;
+
+  memset (buffer, 0, sizeof buffer);
+  memcpy (buffer, JOURNAL_MAGIC, 4);
+  buffer[4] = JOURNAL_VERSION;
+  buffer[5] = JOURNAL_FLAG_TXN;
+  put64 (buffer + 16, (uint64_t)-1);
+
+  fp = fopen (kb->fname, "rb");
+  if (fp)
+    {
+      if (fstat (fileno (fp), &st))
+        err = gpg_error_from_syserror ();
+      else
+        {
+          size = st.st_size;
+          if (fread (header, 16, 1, fp) == 1
+              && header[4] == KEYBOX_BLOBTYPE_HEADER)
+            memcpy (buffer + 24, header + 12, 4);
+        }
+      fclose (fp);
+      if (err)
+        return err;
+    }
+  else if (errno != ENOENT)
+    return gpg_error_from_syserror ();
+  put64 (buffer + 8, size);
+
+  jfname = journal_fname (kb->fname);
+  if (!jfname)
+    return gpg_error_from_syserror ();
+  fp = fopen (jfname, "wb");
+  if (!fp)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      if (fwrite (buffer, sizeof buffer, 1, fp) != 1)
+        err = gpg_error_from_syserror ();
+      else
+        err = sync_file (fp);
+      if (err)
+        {
+          fclose (fp);
+          gnupg_remove (jfname);
+        }
+    }
+  xfree (jfname);
+  if (err)
+    return err;
+
+  kb->txn_journal = fp;
+  kb->in_transaction = 1;
+  return 0;
+}
+
+
+/* End the transaction started by keybox_begin_transaction on the
+ * keybox of HD.  If CANCEL is set or committing fails, all updates
+ * done within the transaction are rolled back.  */
+gpg_error_t
+keybox_end_transaction (KEYBOX_HANDLE hd, int cancel)
+{
+  gpg_error_t err = 0;
+  gpg_error_t rc;
+  KB_NAME kb;
+  FILE *fp;
+
+  if (!hd || !hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  kb = hd->kb;
+  if (!kb->in_transaction)
+    return gpg_error (GPG_ERR_INV_STATE);
+
+  _keybox_close_file (hd);
+
+  if (!cancel)
+    {
+      fp = fopen (kb->fname, "r+b");
+      if (fp)
+        {
+          err = sync_file (fp);
+          if (fclose (fp) && !err)
+            err = gpg_error_from_syserror ();
+        }
+      else if (errno != ENOENT)
+        err = gpg_error_from_syserror ();
+    }
+
+  fclose (kb->txn_journal);
+  kb->txn_journal = NULL;
+  kb->in_transaction = 0;
+
+  if (!cancel && !err)
+    {
+      remove_journal (kb->fname);
+      _keybox_index_flush (kb);
+      maybe_compress (hd);
+    }
+  else
+    {
+      /* The index may describe blobs which are now removed.  */
+      _keybox_index_invalidate (kb);
+      rc = recover_journal (kb);
+      if (!err)
+        err = rc;
+    }
+
+  return err;
+}
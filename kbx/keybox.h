@@ -117,6 +117,9 @@ int keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value);
 int keybox_delete (KEYBOX_HANDLE hd);
 int keybox_compress (KEYBOX_HANDLE hd);
 
+gpg_error_t keybox_begin_transaction (KEYBOX_HANDLE hd);
+gpg_error_t keybox_end_transaction (KEYBOX_HANDLE hd, int cancel);
+
 
 /*--  --*/
 
@@ -0,0 +1,950 @@
+/* t-keybox-search.c - Tests for keybox-search.c
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+# include <fcntl.h>
+#else
+# include <utime.h>
+#endif
+#include <gcrypt.h>
+
+#include "keybox-defs.h"
+#include "../common/sysutils.h"
+#include "../common/openpgpdefs.h"
+#include "../common/host2net.h"
+
+#define PGM "t-keybox-search"
+
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                      errcount++;                                \
+                      exit (1);                                  \
+                   } while(0)
+
+static int verbose;
+static int errcount;
+
+/* The size of the RSA modulus of the test keys in bytes.  */
+#define NBYTES 128
+
+struct testkey_s
+{
+  unsigned char packet[3 + 6 + 2 + NBYTES + 2 + 3];
+  unsigned char grip[20];
+  unsigned char fpr[20];
+};
+
+
+/* Create a v4 RSA public key packet with a random modulus and
+ * compute its keygrip and fingerprint the same way gpg does.  */
+static void
+make_testkey (struct testkey_s *key)
+{
+  unsigned char *p = key->packet;
+  size_t len = sizeof key->packet - 3;
+  gcry_mpi_t n, e;
+  gcry_sexp_t s_pkey;
+
+  *p++ = 0x99;  /* CTB for a public key with a 2 byte length.  */
+  *p++ = len >> 8;
+  *p++ = len;
+  *p++ = 4;     /* Version.  */
+  memset (p, 0, 4);
+  p += 4;
+  *p++ = PUBKEY_ALGO_RSA;
+  *p++ = (NBYTES*8) >> 8;
+  *p++ = (NBYTES*8) & 0xff;
+  gcry_create_nonce (p, NBYTES);
+  p[0] |= 0x80;
+  p[NBYTES-1] |= 1;
+  if (gcry_mpi_scan (&n, GCRYMPI_FMT_USG, p, NBYTES, NULL))
+    fail (0);
+  p += NBYTES;
+  *p++ = 0;
+  *p++ = 17;
+  *p++ = 0x01;
+  *p++ = 0x00;
+  *p++ = 0x01;
+  e = gcry_mpi_set_ui (NULL, 65537);
+
+  if (gcry_sexp_build (&s_pkey, NULL, "(public-key(rsa(n%m)(e%m)))", n, e))
+    fail (0);
+  if (!gcry_pk_get_keygrip (s_pkey, key->grip))
+    fail (0);
+  gcry_sexp_release (s_pkey);
+  gcry_mpi_release (n);
+  gcry_mpi_release (e);
+
+  /* The packet starts with the 0x99 and the 2 byte length as hashed
+   * for a v4 fingerprint.  */
+  gcry_md_hash_buffer (GCRY_MD_SHA1, key->fpr, key->packet,
+                       sizeof key->packet);
+}
+
+
+/* Write a new keybox FNAME with the NKEYS keys from KEYS.  */
+static void
+write_keybox (const char *fname, struct testkey_s *keys, int nkeys)
+{
+  FILE *fp;
+  struct _keybox_openpgp_info info;
+  KEYBOXBLOB blob;
+  int i;
+
+  fp = fopen (fname, "wb");
+  if (!fp)
+    fail (0);
+  if (_keybox_write_header_blob (fp, 1))
+    fail (0);
+  for (i=0; i < nkeys; i++)
+    {
+      if (_keybox_parse_openpgp (keys[i].packet, sizeof keys[i].packet,
+                                 NULL, &info))
+        fail (i);
+      if (memcmp (info.primary.grip, keys[i].grip, 20))
+        fail (i);  /* The parser computed a different keygrip.  */
+      if (_keybox_create_openpgp_blob (&blob, &info, keys[i].packet,
+                                       sizeof keys[i].packet, 0))
+        fail (i);
+      _keybox_destroy_openpgp_info (&info);
+      if (_keybox_write_blob (blob, fp))
+        fail (i);
+      _keybox_release_blob (blob);
+    }
+  if (fclose (fp))
+    fail (0);
+}
+
+
+/* Run the search DESC from the start of the keybox HD and return
+ * true if a blob was found.  */
+static int
+search_desc (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc)
+{
+  unsigned long skipped;
+  gpg_error_t err;
+
+  if (keybox_search_reset (hd))
+    fail (0);
+  err = keybox_search (hd, desc, 1, KEYBOX_BLOBTYPE_PGP, NULL, &skipped);
+  if (err == -1 || gpg_err_code (err) == GPG_ERR_EOF)
+    return 0;
+  if (err)
+    fail (0);
+  return 1;
+}
+
+
+/* Search for GRIP in the keybox HD and return true if it was found.  */
+static int
+search_grip (KEYBOX_HANDLE hd, const unsigned char *grip)
+{
+  KEYBOX_SEARCH_DESC desc;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_KEYGRIP;
+  memcpy (desc.u.grip, grip, 20);
+  return search_desc (hd, &desc);
+}
+
+
+/* Search for the fingerprint FPR in the keybox HD using the search
+ * MODE and return true if it was found.  For the key ID modes only
+ * the respective bytes of FPR are used.  */
+static int
+search_fpr (KEYBOX_HANDLE hd, int mode, const unsigned char *fpr)
+{
+  KEYBOX_SEARCH_DESC desc;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = mode;
+  if (mode == KEYDB_SEARCH_MODE_FPR20)
+    memcpy (desc.u.fpr, fpr, 20);
+  else
+    {
+      desc.u.kid[0] = buf32_to_u32 (fpr + 12);
+      desc.u.kid[1] = buf32_to_u32 (fpr + 16);
+    }
+  return search_desc (hd, &desc);
+}
+
+
+/* Check that the blob found by the last search in HD holds the key
+ * packet of KEY and that the primary key (key number 1) matched.  */
+static void
+check_found (KEYBOX_HANDLE hd, const struct testkey_s *key)
+{
+  const unsigned char *buffer;
+  size_t length, image_off, image_len;
+
+  if (!hd->found.blob)
+    fail (0);
+  buffer = _keybox_get_blob_image (hd->found.blob, &length);
+  if (length < 40)
+    fail (0);
+  image_off = buf32_to_size_t (buffer+8);
+  image_len = buf32_to_size_t (buffer+12);
+  if (image_off + image_len > length
+      || image_len != sizeof key->packet
+      || memcmp (buffer + image_off, key->packet, image_len))
+    fail (0);
+  if (hd->found.pk_no != 1)
+    fail (0);
+}
+
+
+/* Walk over all blobs of the keybox HD and check that there are
+ * NKEYS of them.  With the keybox mapped into memory this does not
+ * need an allocation per blob.  */
+static void
+test_full_scan (KEYBOX_HANDLE hd, int nkeys)
+{
+  KEYBOX_SEARCH_DESC desc;
+  unsigned long skipped;
+  gpg_error_t err;
+  int count = 0;
+
+  if (keybox_search_reset (hd))
+    fail (0);
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_FIRST;
+  while (!(err = keybox_search (hd, &desc, 1, KEYBOX_BLOBTYPE_PGP,
+                                NULL, &skipped)))
+    {
+      count++;
+      desc.mode = KEYDB_SEARCH_MODE_NEXT;
+    }
+  if (err != -1 && gpg_err_code (err) != GPG_ERR_EOF)
+    fail (0);
+  if (count != nkeys)
+    fail (count);
+}
+
+
+/* Look up all keys of a keybox with NKEYS keys by keygrip and check
+ * that the index is used for this and not rebuilt.  */
+static void
+test_grip_search (int nkeys)
+{
+  char fname[50], idxfname[50];
+  struct testkey_s *keys;
+  unsigned char grip[20];
+  void *token;
+  KEYBOX_HANDLE hd;
+  KEYBOX_SEARCH_DESC desc;
+  struct stat st, st2;
+  keybox_index_t idx;
+  off_t off;
+  int i;
+
+  snprintf (fname, sizeof fname, "%s-%d.kbx", PGM, nkeys);
+  snprintf (idxfname, sizeof idxfname, "%s.idx", fname);
+  keys = xtrycalloc (nkeys, sizeof *keys);
+  if (!keys)
+    fail (0);
+  for (i=0; i < nkeys; i++)
+    make_testkey (keys + i);
+  write_keybox (fname, keys, nkeys);
+
+  if (keybox_register_file (fname, 0, &token))
+    fail (0);
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (0);
+
+  /* The first search builds the index.  */
+  if (!search_grip (hd, keys[0].grip))
+    fail (0);
+  check_found (hd, keys + 0);
+  idx = hd->kb->index;
+  if (!idx || stat (idxfname, &st))
+    fail (0);
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_KEYGRIP;
+  for (i=0; i < nkeys; i++)
+    {
+      if (!search_grip (hd, keys[i].grip))
+        fail (i);
+      check_found (hd, keys + i);
+      /* The index points straight at the found blob.  */
+      memcpy (desc.u.grip, keys[i].grip, 20);
+      off = _keybox_get_blob_fileoffset (hd->found.blob);
+      if (_keybox_index_next (idx, &desc, 1, 0) != off)
+        fail (i);
+    }
+
+  memcpy (grip, keys[0].grip, 20);
+  grip[19] ^= 1;
+  if (search_grip (hd, grip))
+    fail (0);
+  memcpy (desc.u.grip, grip, 20);
+  if (_keybox_index_next (idx, &desc, 1, 0) != (off_t)-1)
+    fail (0);
+
+  /* The index has been used and neither been rebuilt nor rewritten.  */
+  if (hd->kb->index != idx || stat (idxfname, &st2)
+      || st2.st_ino != st.st_ino || st2.st_size != st.st_size
+      || st2.st_mtime != st.st_mtime)
+    fail (0);
+
+  test_full_scan (hd, nkeys);
+
+  keybox_release (hd);
+  gnupg_remove (fname);
+  gnupg_remove (idxfname);
+  xfree (keys);
+}
+
+
+/* Change the modification time of FNAME which had the status ST to
+ * a different time in the same second if the system supports
+ * nanoseconds.  */
+static void
+touch_same_second (const char *fname, const struct stat *st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  struct timespec ts[2];
+
+  ts[0] = st->st_atim;
+  ts[1] = st->st_mtim;
+  ts[1].tv_nsec = (ts[1].tv_nsec + 1) % 1000000000;
+  if (utimensat (AT_FDCWD, fname, ts, 0))
+    fail (0);
+#else
+  struct utimbuf ut;
+
+  ut.actime = st->st_atime;
+  ut.modtime = st->st_mtime + 1;
+  if (utime (fname, &ut))
+    fail (0);
+#endif
+}
+
+
+/* Look up keys by fingerprint and key ID using the index.  Then
+ * rewrite the keybox with other keys of the same size behind the
+ * back of the index and check that the stale index is not used.  */
+static void
+test_index_lookup (void)
+{
+  char fname[50], idxfname[50];
+  struct testkey_s keys[20];
+  unsigned char fpr[20];
+  void *token;
+  KEYBOX_HANDLE hd;
+  struct stat st, st2;
+  keybox_index_t idx;
+  int i;
+
+  snprintf (fname, sizeof fname, "%s-lookup.kbx", PGM);
+  snprintf (idxfname, sizeof idxfname, "%s.idx", fname);
+  for (i=0; i < DIM (keys); i++)
+    make_testkey (keys + i);
+  write_keybox (fname, keys, 10);
+
+  if (keybox_register_file (fname, 0, &token))
+    fail (0);
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (0);
+
+  /* The first search builds the index and writes its file.  */
+  if (!search_fpr (hd, KEYDB_SEARCH_MODE_FPR20, keys[0].fpr))
+    fail (0);
+  idx = hd->kb->index;
+  if (!idx || stat (idxfname, &st))
+    fail (0);
+
+  for (i=0; i < 10; i++)
+    {
+      if (!search_fpr (hd, KEYDB_SEARCH_MODE_FPR20, keys[i].fpr))
+        fail (i);
+      check_found (hd, keys + i);
+      if (!search_fpr (hd, KEYDB_SEARCH_MODE_LONG_KID, keys[i].fpr))
+        fail (i);
+      check_found (hd, keys + i);
+      if (!search_fpr (hd, KEYDB_SEARCH_MODE_SHORT_KID, keys[i].fpr))
+        fail (i);
+      check_found (hd, keys + i);
+    }
+  memcpy (fpr, keys[0].fpr, 20);
+  fpr[0] ^= 1;  /* Same key ID but different fingerprint.  */
+  if (search_fpr (hd, KEYDB_SEARCH_MODE_FPR20, fpr))
+    fail (0);
+  fpr[0] ^= 1;
+  fpr[19] ^= 1;
+  if (search_fpr (hd, KEYDB_SEARCH_MODE_SHORT_KID, fpr))
+    fail (0);
+  /* The index has been used and not been rebuilt.  */
+  if (hd->kb->index != idx || stat (idxfname, &st2)
+      || st2.st_ino != st.st_ino || st2.st_size != st.st_size)
+    fail (0);
+
+  /* Rewrite the keybox in place with the same size and a
+   * modification time in the same second.  */
+  if (stat (fname, &st))
+    fail (0);
+  write_keybox (fname, keys + 10, 10);
+  if (stat (fname, &st2) || st2.st_size != st.st_size)
+    fail (0);
+  touch_same_second (fname, &st);
+  for (i=0; i < 10; i++)
+    {
+      if (search_fpr (hd, KEYDB_SEARCH_MODE_FPR20, keys[i].fpr))
+        fail (i);
+      if (!search_fpr (hd, KEYDB_SEARCH_MODE_LONG_KID, keys[10+i].fpr))
+        fail (i);
+      check_found (hd, keys + 10 + i);
+    }
+  test_full_scan (hd, 10);
+
+  keybox_release (hd);
+  gnupg_remove (fname);
+  gnupg_remove (idxfname);
+}
+
+
+/* Delete and replace keys of a small keybox and check that the
+ * changes are done in place and are visible to the index.  */
+static void
+test_update (void)
+{
+  char fname[50], idxfname[50];
+  struct testkey_s keys[12];
+  void *token;
+  KEYBOX_HANDLE hd;
+  off_t off;
+  int i;
+
+  snprintf (fname, sizeof fname, "%s-update.kbx", PGM);
+  snprintf (idxfname, sizeof idxfname, "%s.idx", fname);
+  for (i=0; i < DIM (keys); i++)
+    make_testkey (keys + i);
+  write_keybox (fname, keys, 10);
+
+  if (keybox_register_file (fname, 0, &token))
+    fail (0);
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (0);
+  if (keybox_lock (hd, 1))
+    fail (0);
+
+  /* Delete the fourth key.  */
+  if (!search_grip (hd, keys[3].grip))
+    fail (0);
+  if (keybox_delete (hd))
+    fail (0);
+  if (search_grip (hd, keys[3].grip))
+    fail (0);
+  test_full_scan (hd, 9);
+
+  /* Append two new keys.  */
+  for (i=10; i < 12; i++)
+    if (keybox_insert_keyblock (hd, keys[i].packet, sizeof keys[i].packet))
+      fail (i);
+  for (i=0; i < 12; i++)
+    if (search_grip (hd, keys[i].grip) != (i != 3))
+      fail (i);
+  test_full_scan (hd, 11);
+
+  /* Replace the first key by the fourth one.  Both have the same
+   * size; thus the new one is written in place.  */
+  if (!search_grip (hd, keys[0].grip))
+    fail (0);
+  off = _keybox_get_blob_fileoffset (hd->found.blob);
+  if (keybox_update_keyblock (hd, keys[3].packet, sizeof keys[3].packet))
+    fail (0);
+  if (search_grip (hd, keys[0].grip))
+    fail (0);
+  if (!search_grip (hd, keys[3].grip))
+    fail (0);
+  check_found (hd, keys + 3);
+  if (_keybox_get_blob_fileoffset (hd->found.blob) != off)
+    fail (0);
+  test_full_scan (hd, 11);
+
+  /* Compressing must not lose any key.  */
+  if (keybox_compress (hd))
+    fail (0);
+  for (i=1; i < 12; i++)
+    if (!search_grip (hd, keys[i].grip))
+      fail (i);
+  test_full_scan (hd, 11);
+
+  keybox_lock (hd, 0);
+  keybox_release (hd);
+  gnupg_remove (fname);
+  gnupg_remove (idxfname);
+}
+
+
+/* Check that a cancelled transaction leaves the keybox unchanged
+ * and that a committed one applies all updates.  */
+static void
+test_transaction (void)
+{
+  char fname[50], idxfname[50];
+  struct testkey_s keys[8];
+  void *token;
+  KEYBOX_HANDLE hd;
+  struct stat st;
+  off_t size;
+  int i;
+
+  snprintf (fname, sizeof fname, "%s-txn.kbx", PGM);
+  snprintf (idxfname, sizeof idxfname, "%s.idx", fname);
+  for (i=0; i < DIM (keys); i++)
+    make_testkey (keys + i);
+  write_keybox (fname, keys, 4);
+
+  if (keybox_register_file (fname, 0, &token))
+    fail (0);
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (0);
+  if (keybox_lock (hd, 1))
+    fail (0);
+
+  /* Insert, replace and delete keys and then roll back.  */
+  if (keybox_begin_transaction (hd))
+    fail (0);
+  for (i=4; i < 6; i++)
+    if (keybox_insert_keyblock (hd, keys[i].packet, sizeof keys[i].packet))
+      fail (i);
+  if (!search_grip (hd, keys[0].grip))
+    fail (0);
+  if (keybox_update_keyblock (hd, keys[6].packet, sizeof keys[6].packet))
+    fail (0);
+  if (!search_grip (hd, keys[1].grip))
+    fail (0);
+  if (keybox_delete (hd))
+    fail (0);
+  for (i=0; i < 7; i++)
+    if (search_grip (hd, keys[i].grip) != (i > 1))
+      fail (i);
+  if (stat (fname, &st))
+    fail (0);
+  size = st.st_size;
+  if (keybox_end_transaction (hd, 1))
+    fail (0);
+  /* The rollback must not shrink the keybox.  */
+  if (stat (fname, &st) || st.st_size < size)
+    fail (0);
+  for (i=0; i < 8; i++)
+    if (search_grip (hd, keys[i].grip) != (i < 4))
+      fail (i);
+  test_full_scan (hd, 4);
+
+  /* Now the same but commit.  */
+  if (keybox_begin_transaction (hd))
+    fail (0);
+  for (i=4; i < 8; i++)
+    if (keybox_insert_keyblock (hd, keys[i].packet, sizeof keys[i].packet))
+      fail (i);
+  if (!search_grip (hd, keys[2].grip))
+    fail (0);
+  if (keybox_delete (hd))
+    fail (0);
+  if (keybox_end_transaction (hd, 0))
+    fail (0);
+  for (i=0; i < 8; i++)
+    if (search_grip (hd, keys[i].grip) != (i != 2))
+      fail (i);
+  test_full_scan (hd, 7);
+
+  keybox_lock (hd, 0);
+  keybox_release (hd);
+  gnupg_remove (fname);
+  gnupg_remove (idxfname);
+}
+
+
+/* Create the blob for KEY and return it.  */
+static KEYBOXBLOB
+make_blob (const struct testkey_s *key)
+{
+  struct _keybox_openpgp_info info;
+  KEYBOXBLOB blob;
+
+  if (_keybox_parse_openpgp (key->packet, sizeof key->packet, NULL, &info))
+    fail (0);
+  if (_keybox_create_openpgp_blob (&blob, &info, key->packet,
+                                   sizeof key->packet, 0))
+    fail (0);
+  _keybox_destroy_openpgp_info (&info);
+  return blob;
+}
+
+
+/* Write the journal JFNAME for an update with FLAGS of the blob
+ * IMAGE,IMAGELEN at NEWOFF which deletes the blob at DELOFF (see
+ * keybox-update.c).  With FLAGS 2 the image is also written.  */
+static void
+write_journal (const char *jfname, int flags, uint64_t newoff,
+               uint64_t deloff, const unsigned char *image, size_t imagelen)
+{
+  unsigned char journal[48];
+  FILE *fp;
+  int i;
+
+  memset (journal, 0, sizeof journal);
+  memcpy (journal, "KBXj", 4);
+  journal[4] = 1;
+  journal[5] = flags;
+  for (i=0; i < 8; i++)
+    {
+      journal[8+i] = newoff >> (56 - 8*i);
+      journal[16+i] = deloff >> (56 - 8*i);
+    }
+  journal[26] = imagelen >> 8;
+  journal[27] = imagelen;
+  gcry_md_hash_buffer (GCRY_MD_SHA1, journal + 28, image, imagelen);
+  fp = fopen (jfname, "wb");
+  if (!fp || fwrite (journal, sizeof journal, 1, fp) != 1
+      || (flags == 2 && fwrite (image, imagelen, 1, fp) != 1)
+      || fclose (fp))
+    fail (0);
+}
+
+
+/* Simulate crashes while appending a blob and while replacing a blob
+ * and check that the next update discards the partial blob without
+ * shrinking the keybox or completes the replacement.  */
+static void
+test_recover (void)
+{
+  char fname[50], idxfname[50], jfname[50];
+  struct testkey_s keys[6];
+  KEYBOXBLOB blob;
+  const unsigned char *image;
+  size_t imagelen;
+  void *token;
+  KEYBOX_HANDLE hd;
+  struct stat st;
+  off_t size, off;
+  FILE *fp;
+  int i;
+
+  snprintf (fname, sizeof fname, "%s-recover.kbx", PGM);
+  snprintf (idxfname, sizeof idxfname, "%s.idx", fname);
+  snprintf (jfname, sizeof jfname, "%s.jnl", fname);
+  for (i=0; i < DIM (keys); i++)
+    make_testkey (keys + i);
+  write_keybox (fname, keys, 2);
+
+  /* Append the first half of the blob of the third key together
+   * with the journal written before that.  */
+  blob = make_blob (keys + 2);
+  image = _keybox_get_blob_image (blob, &imagelen);
+  if (stat (fname, &st))
+    fail (0);
+  write_journal (jfname, 0, st.st_size, (uint64_t)-1, image, imagelen);
+  fp = fopen (fname, "ab");
+  if (!fp || fwrite (image, imagelen / 2, 1, fp) != 1 || fclose (fp))
+    fail (0);
+  _keybox_release_blob (blob);
+  size = st.st_size + imagelen / 2;
+
+  if (keybox_register_file (fname, 0, &token))
+    fail (0);
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (0);
+  if (keybox_lock (hd, 1))
+    fail (0);
+  if (keybox_insert_keyblock (hd, keys[3].packet, sizeof keys[3].packet))
+    fail (0);
+  if (!stat (jfname, &st))
+    fail (0);  /* The journal has not been removed.  */
+
+  /* The new key must have been appended after the partial blob.  */
+  if (!search_grip (hd, keys[3].grip))
+    fail (0);
+  if (_keybox_get_blob_fileoffset (hd->found.blob) < size)
+    fail (0);  /* The keybox has been truncated.  */
+
+  for (i=0; i < 4; i++)
+    if (search_grip (hd, keys[i].grip) != (i != 2))
+      fail (i);
+  test_full_scan (hd, 3);
+
+  /* Write the journal for replacing the first key by the fifth one
+   * but do not touch the keybox.  */
+  if (!search_grip (hd, keys[0].grip))
+    fail (0);
+  off = _keybox_get_blob_fileoffset (hd->found.blob);
+  blob = make_blob (keys + 4);
+  image = _keybox_get_blob_image (blob, &imagelen);
+  write_journal (jfname, 2, off, imagelen, image, imagelen);
+  _keybox_release_blob (blob);
+
+  if (keybox_insert_keyblock (hd, keys[5].packet, sizeof keys[5].packet))
+    fail (0);
+  if (!stat (jfname, &st))
+    fail (0);
+  if (search_grip (hd, keys[0].grip))
+    fail (0);
+  if (!search_grip (hd, keys[4].grip))
+    fail (0);
+  check_found (hd, keys + 4);
+  if (_keybox_get_blob_fileoffset (hd->found.blob) != off)
+    fail (0);
+  test_full_scan (hd, 4);
+
+  keybox_lock (hd, 0);
+  keybox_release (hd);
+  gnupg_remove (fname);
+  gnupg_remove (idxfname);
+}
+
+
+/* Return the index of the key of the NKEYS KEYS held by the blob
+ * found by the last search in HD or -1 if it holds none of them.  */
+static int
+found_key (KEYBOX_HANDLE hd, const struct testkey_s *keys, int nkeys)
+{
+  const unsigned char *buffer;
+  size_t length, image_off, image_len;
+  int i;
+
+  buffer = _keybox_get_blob_image (hd->found.blob, &length);
+  if (length < 40)
+    return -1;
+  image_off = buf32_to_size_t (buffer+8);
+  image_len = buf32_to_size_t (buffer+12);
+  if (image_off + image_len > length
+      || image_len != sizeof keys->packet)
+    return -1;
+  for (i=0; i < nkeys; i++)
+    if (!memcmp (buffer + image_off, keys[i].packet, image_len))
+      return i;
+  return -1;
+}
+
+
+/* Change a byte of the blob found by the last search in HD at offset
+ * POS within the blob.  */
+static void
+patch_found (KEYBOX_HANDLE hd, const char *fname, size_t pos)
+{
+  const unsigned char *buffer;
+  size_t length;
+  FILE *fp;
+
+  buffer = _keybox_get_blob_image (hd->found.blob, &length);
+  fp = fopen (fname, "r+b");
+  if (!fp
+      || fseeko (fp, _keybox_get_blob_fileoffset (hd->found.blob) + pos,
+                 SEEK_SET)
+      || putc (buffer[pos] ^ 1, fp) == EOF
+      || fclose (fp))
+    fail (0);
+}
+
+
+/* Check that readers which do not take the lock cope with updates by
+ * another process: A blob which is being appended is taken as the end
+ * of the keybox and a blob being replaced in place is not returned
+ * half written.  */
+static void
+test_readers (void)
+{
+  char fname[50], idxfname[50];
+  struct testkey_s keys[6];
+  KEYBOXBLOB blob;
+  const unsigned char *image, *buffer;
+  size_t imagelen, length, flag_pos, flag_size;
+  void *token;
+  KEYBOX_HANDLE hd;
+  FILE *fp;
+  int i;
+
+  snprintf (fname, sizeof fname, "%s-readers.kbx", PGM);
+  snprintf (idxfname, sizeof idxfname, "%s.idx", fname);
+  for (i=0; i < DIM (keys); i++)
+    make_testkey (keys + i);
+  write_keybox (fname, keys, 4);
+
+  if (keybox_register_file (fname, 0, &token))
+    fail (0);
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (0);
+  test_full_scan (hd, 4);
+
+  /* Append the blob of the fifth key in two steps.  */
+  blob = make_blob (keys + 4);
+  image = _keybox_get_blob_image (blob, &imagelen);
+  fp = fopen (fname, "ab");
+  if (!fp || fwrite (image, imagelen / 2, 1, fp) != 1 || fflush (fp))
+    fail (0);
+  for (i=0; i < 5; i++)
+    if (search_grip (hd, keys[i].grip) != (i < 4))
+      fail (i);
+  test_full_scan (hd, 4);
+  if (fwrite (image + imagelen / 2, imagelen - imagelen / 2, 1, fp) != 1
+      || fclose (fp))
+    fail (0);
+  _keybox_release_blob (blob);
+  for (i=0; i < 5; i++)
+    if (!search_grip (hd, keys[i].grip))
+      fail (i);
+  test_full_scan (hd, 5);
+
+  /* A blob with a wrong checksum is still found.  */
+  if (!search_grip (hd, keys[1].grip))
+    fail (0);
+  _keybox_get_blob_image (hd->found.blob, &length);
+  patch_found (hd, fname, length - 1);
+  if (!search_grip (hd, keys[1].grip))
+    fail (0);
+  check_found (hd, keys + 1);
+
+  /* Setting a flag keeps the checksum valid.  */
+  if (!search_grip (hd, keys[2].grip))
+    fail (0);
+  buffer = _keybox_get_blob_image (hd->found.blob, &length);
+  if (_keybox_get_flag_location (buffer, length, KEYBOX_FLAG_OWNERTRUST,
+                                 &flag_pos, &flag_size)
+      || flag_size != 1)
+    fail (0);
+  if (keybox_set_flags (hd, KEYBOX_FLAG_OWNERTRUST, 0, 5))
+    fail (0);
+  if (!search_grip (hd, keys[2].grip))
+    fail (0);
+  check_found (hd, keys + 2);
+  buffer = _keybox_get_blob_image (hd->found.blob, &length);
+  if (buffer[flag_pos] != 5 || !_keybox_blob_checksum_ok (buffer, length))
+    fail (0);
+
+#ifndef HAVE_W32_SYSTEM
+  {
+    KEYBOX_HANDLE hd2;
+    pid_t pid;
+    int status, n;
+
+    /* Let another process replace the first key back and forth by
+     * the sixth one while we scan the keybox.  */
+    fflush (stdout);
+    fflush (stderr);
+    pid = fork ();
+    if (pid == (pid_t)-1)
+      fail (0);
+    if (!pid)
+      {
+        /* The lock handle created by the parent is not ours.  */
+        hd->kb->lockhd = NULL;
+        hd2 = keybox_new_openpgp (token, 0);
+        if (!hd2 || keybox_lock (hd2, 1))
+          fail (0);
+        for (i=0; i < 100; i++)
+          {
+            if (!search_grip (hd2, keys[i % 2? 5 : 0].grip))
+              fail (i);
+            if (keybox_update_keyblock (hd2, keys[i % 2? 0 : 5].packet,
+                                        sizeof keys[0].packet))
+              fail (i);
+          }
+        keybox_lock (hd2, 0);
+        dotlock_destroy (hd2->kb->lockhd);
+        keybox_release (hd2);
+        _exit (0);
+      }
+
+    while (waitpid (pid, &status, WNOHANG) != pid)
+      {
+        KEYBOX_SEARCH_DESC desc;
+        unsigned long skipped;
+        gpg_error_t err;
+
+        if (keybox_search_reset (hd))
+          fail (0);
+        memset (&desc, 0, sizeof desc);
+        desc.mode = KEYDB_SEARCH_MODE_FIRST;
+        n = 0;
+        while (!(err = keybox_search (hd, &desc, 1, KEYBOX_BLOBTYPE_PGP,
+                                      NULL, &skipped)))
+          {
+            if (found_key (hd, keys, DIM (keys)) == -1)
+              fail (n);
+            n++;
+            desc.mode = KEYDB_SEARCH_MODE_NEXT;
+          }
+        if (err != -1 && gpg_err_code (err) != GPG_ERR_EOF)
+          fail (0);
+        /* The replaced key may be skipped while it is written.  */
+        if (n != 5 && n != 4)
+          fail (n);
+      }
+    if (!WIFEXITED (status) || WEXITSTATUS (status))
+      fail (0);
+  }
+  if (!search_grip (hd, keys[0].grip))
+    fail (0);
+  test_full_scan (hd, 5);
+#endif /*!HAVE_W32_SYSTEM*/
+
+  keybox_release (hd);
+  gnupg_remove (fname);
+  gnupg_remove (idxfname);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  static int sizes[] = { 10, 100, 1000, 10000 };
+  int i;
+
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  if (!gcry_check_version (NULL))
+    {
+      fprintf (stderr, PGM ": libgcrypt initialization failed\n");
+      exit (1);
+    }
+  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+  for (i=0; i < DIM (sizes); i++)
+    {
+      if (verbose)
+        printf ("keygrip lookups in a keybox with %d keys\n", sizes[i]);
+      test_grip_search (sizes[i]);
+    }
+
+  test_index_lookup ();
+  test_update ();
+  test_transaction ();
+  test_recover ();
+  test_readers ();
+
+  return !!errcount;
+}
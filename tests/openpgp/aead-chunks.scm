@@ -0,0 +1,60 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2020 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-legacy-environment)
+
+;; We use the smallest chunk size which is processed in parallel.
+(define chunksize 65536)
+(define enc-opts `(--yes --encrypt --recipient ,usrname2
+		   --rfc4880bis --force-aead --cipher-algo AES
+		   --compress-algo none --chunk-size 16 --aead-threads 2))
+(define dec-opts '(--yes --decrypt --aead-threads 2))
+
+;; The AEAD plaintext also contains the header of the literal data
+;; packet and, for partial lengths, the length headers.  Thus we check
+;; a range of data sizes around the chunk boundaries which is large
+;; enough to make the last chunk end 1 to 17 bytes before and after
+;; each boundary.
+(define (sizes-around k)
+  (let loop ((d -48) (acc '()))
+    (if (> d 17)
+	(reverse acc)
+	(loop (+ d 1) (cons (+ (* k chunksize) d) acc)))))
+
+(for-each-p
+ "Checking AEAD chunk boundaries"
+ (lambda (size)
+   (let ((source (string-append "data-aead-" (number->string size))))
+     (make-test-data source size)
+     ;; Reading from a file results in a definite length packet ...
+     (tr:do
+      (tr:open source)
+      (tr:gpg "" enc-opts)
+      (tr:gpg "" dec-opts)
+      (tr:assert-identity source))
+     ;; ... and reading from a pipe in partial length packets.
+     (tr:do
+      (tr:open source)
+      (tr:pipe-do
+       (pipe:gpg enc-opts)
+       (pipe:gpg dec-opts))
+      (tr:assert-identity source))
+     (unlink source)))
+ (append (sizes-around 1) (sizes-around 2)))
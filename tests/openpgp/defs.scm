@@ -119,7 +119,8 @@
 			   "agent/gpg-preset-passphrase")
     (gpgtar "GPGTAR" "tools/gpgtar")
     (gpg-zip "GPGZIP" "tools/gpg-zip")
-    (pinentry "PINENTRY" "tests/openpgp/fake-pinentry")))
+    (pinentry "PINENTRY" "tests/openpgp/fake-pinentry")
+    (mk-keydump "MK_KEYDUMP" "tests/openpgp/mk-keydump")))
 
 (define bin-prefix (getenv "BIN_PREFIX"))
 (define installed? (not (string=? "" bin-prefix)))
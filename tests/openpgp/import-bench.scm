@@ -0,0 +1,55 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2020 g10 code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Measure the time it takes to import a large number of keys into an
+;; empty keybox.  This is not part of the regular test suite; run it
+;; using
+;;
+;;   make -C tests/openpgp check TESTS=import-bench.scm
+;;
+;; The number of keys defaults to 100000 and can be changed using the
+;; environment variable IMPORT_BENCH_KEYS.  The import is done once
+;; with and once without the import option import-batch.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-environment)
+
+(define nkeys
+  (let ((n (getenv "IMPORT_BENCH_KEYS")))
+    (if (string=? n "") 100000 (string->number n))))
+
+(define keydump (path-join (getcwd) "import-bench.gpg"))
+(call-check `(,(tool 'mk-keydump) ,(number->string nkeys) ,keydump))
+
+(define (count-keys)
+  (length (filter (lambda (line) (string-prefix? line "pub:"))
+		  (string-split-newlines
+		   (call-check `(,@GPG --with-colons --list-keys))))))
+
+(define (bench-import option)
+  (with-ephemeral-home-directory setup-environment-no-atexit stop-agent
+    (let ((start (get-time)))
+      (call-check `(,@GPG --allow-non-selfsigned-uid
+			  --import-options ,option
+			  --import ,keydump))
+      (let ((elapsed (- (get-time) start)))
+	(assert (= nkeys (count-keys)))
+	(info "Imported" nkeys "keys with" option "in" elapsed "seconds")))))
+
+(for-each bench-import '("import-batch" "no-import-batch"))
@@ -0,0 +1,118 @@
+/* mk-keydump.c - Create a large dump of public keys for benchmarks.
+ *
+ * Copyright (C) 2020 g10 code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* This program writes NKEYS OpenPGP v4 RSA public keys, each with one
+ * user ID, to FILE.  The moduli are pseudo random numbers and the
+ * user IDs are not signed.  Thus the keys can only be imported with
+ * --allow-non-selfsigned-uid and are useless for anything but
+ * measuring the speed of the key database.  The output is the same
+ * for all runs.  */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PGM "mk-keydump"
+
+/* The size of the modulus in bytes.  */
+#define NBYTES 256
+
+
+static unsigned long long rngstate = 0x9e3779b97f4a7c15ULL;
+
+/* A simple xorshift generator; good enough for fake moduli.  */
+static unsigned char
+rng_byte (void)
+{
+  rngstate ^= rngstate << 13;
+  rngstate ^= rngstate >> 7;
+  rngstate ^= rngstate << 17;
+  return rngstate >> 32;
+}
+
+
+static void
+write_key (FILE *fp, unsigned long n)
+{
+  unsigned char packet[3 + 6 + 2 + NBYTES + 2 + 3];
+  unsigned char *p = packet;
+  size_t len = sizeof packet - 3;
+  unsigned long created = 1500000000 + n;
+  char uid[80];
+  int i;
+
+  *p++ = 0x99;  /* Public key packet with a 2 byte length.  */
+  *p++ = len >> 8;
+  *p++ = len;
+  *p++ = 4;     /* Version.  */
+  *p++ = created >> 24;
+  *p++ = created >> 16;
+  *p++ = created >> 8;
+  *p++ = created;
+  *p++ = 1;     /* RSA.  */
+  *p++ = (NBYTES * 8) >> 8;
+  *p++ = (NBYTES * 8) & 0xff;
+  for (i=0; i < NBYTES; i++)
+    p[i] = rng_byte ();
+  p[0] |= 0x80;
+  p[NBYTES-1] |= 1;
+  p += NBYTES;
+  *p++ = 0;     /* e = 65537.  */
+  *p++ = 17;
+  *p++ = 0x01;
+  *p++ = 0x00;
+  *p++ = 0x01;
+  fwrite (packet, sizeof packet, 1, fp);
+
+  snprintf (uid, sizeof uid, "Benchmark key %lu <key%lu@example.org>", n, n);
+  putc (0xb4, fp);  /* User ID packet with a 1 byte length.  */
+  putc (strlen (uid), fp);
+  fputs (uid, fp);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned long nkeys, n;
+  FILE *fp;
+
+  if (argc != 3)
+    {
+      fprintf (stderr, "usage: " PGM " NKEYS FILE\n");
+      return 1;
+    }
+  nkeys = strtoul (argv[1], NULL, 10);
+
+  fp = fopen (argv[2], "wb");
+  if (!fp)
+    {
+      perror (argv[2]);
+      return 1;
+    }
+  for (n=0; n < nkeys; n++)
+    write_key (fp, n);
+  if (ferror (fp) || fclose (fp))
+    {
+      perror (argv[2]);
+      return 1;
+    }
+  return 0;
+}